@@ -43,6 +43,7 @@ solution 'StormLib'
         defines { 'WIN64', '_WIN64' }
 
     filter 'system:linux'
+        links { 'pthread', }
         defines { '_7ZIP_ST', 'BZ_STRICT_ANSI' }
         removefiles {
             'src/lzma/C/LzFindMt.*',
@@ -23,6 +23,15 @@
 #pragma warning(disable: 4800)                  // 'BOOL' : forcing value to bool 'true' or 'false' (performance warning)
 #endif
 
+#ifdef STORMLIB_HTTP_SOCKETS
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <strings.h>
+#endif
+
 //-----------------------------------------------------------------------------
 // Local defines
 
@@ -30,6 +39,12 @@
 #define INVALID_HANDLE_VALUE ((HANDLE)-1)
 #endif
 
+#ifdef MSG_NOSIGNAL
+#define HTTP_SEND_FLAGS MSG_NOSIGNAL            // Don't raise SIGPIPE when the server has closed the connection
+#else
+#define HTTP_SEND_FLAGS 0                       // SO_NOSIGPIPE is set on the socket instead
+#endif
+
 //-----------------------------------------------------------------------------
 // Local functions - platform-specific functions
 
@@ -73,6 +88,41 @@ static void BaseNone_Init(TFileStream *)
 //-----------------------------------------------------------------------------
 // Local functions - base file support
 
+#ifdef STORMLIB_WINDOWS
+// On Windows, the access hints can only be given when the file is open
+static DWORD BaseFile_GetAccessFlags(DWORD dwStreamFlags)
+{
+    if(dwStreamFlags & STREAM_FLAG_SEQUENTIAL)
+        return FILE_FLAG_SEQUENTIAL_SCAN;
+    if(dwStreamFlags & STREAM_FLAG_RANDOM_ACCESS)
+        return FILE_FLAG_RANDOM_ACCESS;
+    return 0;
+}
+#endif
+
+// Tells the kernel how the file will be read, so it can tune the read-ahead
+static void BaseFile_SetAccessHint(TFileStream * pStream, DWORD dwStreamFlags)
+{
+#if defined(STORMLIB_LINUX) && defined(POSIX_FADV_SEQUENTIAL)
+    int nAdvice = POSIX_FADV_NORMAL;
+
+    if(dwStreamFlags & STREAM_FLAG_SEQUENTIAL)
+        nAdvice = POSIX_FADV_SEQUENTIAL;
+    else if(dwStreamFlags & STREAM_FLAG_RANDOM_ACCESS)
+        nAdvice = POSIX_FADV_RANDOM;
+    posix_fadvise((intptr_t)pStream->Base.File.hFile, 0, 0, nAdvice);
+#endif
+
+#if defined(STORMLIB_MAC) && defined(F_RDAHEAD)
+    // macOS has no posix_fadvise. Just turn the read-ahead off for random access
+    fcntl((intptr_t)pStream->Base.File.hFile, F_RDAHEAD, (dwStreamFlags & STREAM_FLAG_RANDOM_ACCESS) ? 0 : 1);
+#endif
+
+    // Windows: Hints are applied by BaseFile_GetAccessFlags when the file is open
+    STORMLIB_UNUSED(pStream);
+    STORMLIB_UNUSED(dwStreamFlags);
+}
+
 static bool BaseFile_Create(TFileStream * pStream)
 {
 #ifdef STORMLIB_WINDOWS
@@ -84,7 +134,7 @@ static bool BaseFile_Create(TFileStream * pStream)
                                               dwWriteShare | FILE_SHARE_READ,
                                               NULL,
                                               CREATE_ALWAYS,
-                                              0,
+                                              BaseFile_GetAccessFlags(pStream->dwFlags),
                                               NULL);
         if(pStream->Base.File.hFile == INVALID_HANDLE_VALUE)
             return false;
@@ -93,9 +143,20 @@ static bool BaseFile_Create(TFileStream * pStream)
 
 #if defined(STORMLIB_MAC) || defined(STORMLIB_LINUX)
     {
-        intptr_t handle;
+        intptr_t handle = -1;
+
+#if defined(STORMLIB_LINUX) && defined(O_DIRECT)
+        // Try to create the file for direct I/O. Not all file systems support it,
+        // (e.g. tmpfs), so if it fails, we create the file the normal way
+        if(pStream->dwFlags & STREAM_FLAG_DIRECT_IO)
+            handle = open(pStream->szFileName, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE | O_DIRECT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+#endif
+        if(handle == -1)
+        {
+            pStream->dwFlags &= ~STREAM_FLAG_DIRECT_IO;
+            handle = open(pStream->szFileName, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        }
 
-        handle = open(pStream->szFileName, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
         if(handle == -1)
         {
             pStream->Base.File.hFile = INVALID_HANDLE_VALUE;
@@ -104,6 +165,7 @@ static bool BaseFile_Create(TFileStream * pStream)
         }
 
         pStream->Base.File.hFile = (HANDLE)handle;
+        BaseFile_SetAccessHint(pStream, pStream->dwFlags);
     }
 #endif
 
@@ -127,7 +189,7 @@ static bool BaseFile_Open(TFileStream * pStream, LPCTSTR szFileName, DWORD dwStr
                                               FILE_SHARE_READ | dwWriteShare,
                                               NULL,
                                               OPEN_EXISTING,
-                                              0,
+                                              BaseFile_GetAccessFlags(dwStreamFlags),
                                               NULL);
         if(pStream->Base.File.hFile == INVALID_HANDLE_VALUE)
             return false;
@@ -171,6 +233,7 @@ static bool BaseFile_Open(TFileStream * pStream, LPCTSTR szFileName, DWORD dwStr
         pStream->Base.File.FileTime = 0x019DB1DED53E8000ULL + (10000000 * fileinfo.st_mtime);
         pStream->Base.File.FileSize = (ULONGLONG)fileinfo.st_size;
         pStream->Base.File.hFile = (HANDLE)handle;
+        BaseFile_SetAccessHint(pStream, dwStreamFlags);
     }
 #endif
 
@@ -216,18 +279,26 @@ static bool BaseFile_Read(
     {
         ssize_t bytes_read;
 
+#ifndef STORMLIB_HAS_PREAD
         // If the byte offset is different from the current file position,
-        // we have to update the file position   xxx
+        // we have to update the file position
         if(ByteOffset != pStream->Base.File.FilePos)
         {
             lseek64((intptr_t)pStream->Base.File.hFile, (off64_t)(ByteOffset), SEEK_SET);
             pStream->Base.File.FilePos = ByteOffset;
         }
+#endif
 
         // Perform the read operation
         if(dwBytesToRead != 0)
         {
+#ifdef STORMLIB_HAS_PREAD
+            // The positioned read doesn't move the file pointer of the descriptor,
+            // so multiple threads can read the same stream at different offsets
+            bytes_read = pread64((intptr_t)pStream->Base.File.hFile, pvBuffer, (size_t)dwBytesToRead, (off64_t)(ByteOffset));
+#else
             bytes_read = read((intptr_t)pStream->Base.File.hFile, pvBuffer, (size_t)dwBytesToRead);
+#endif
             if(bytes_read == -1)
             {
                 SErrSetLastError(errno);
@@ -241,12 +312,69 @@ static bool BaseFile_Read(
 
     // Increment the current file position by number of bytes read
     // If the number of bytes read doesn't match to required amount, return false
+    // Note: When the stream is read by multiple threads, the current position
+    // is only meaningful to a caller that reads with an explicit byte offset
     pStream->Base.File.FilePos = ByteOffset + dwBytesRead;
     if(dwBytesRead != dwBytesToRead)
         SErrSetLastError(ERROR_HANDLE_EOF);
     return (dwBytesRead == dwBytesToRead);
 }
 
+#ifdef STORMLIB_HAS_PREADV
+/**
+ * \a pStream Pointer to an open stream
+ * \a ByteOffset File byte offset of the first buffer
+ * \a Vectors Buffers to be filled with continuous data from the file
+ * \a dwVectorCount Number of buffers, at most STREAM_MAX_VECTORS
+ */
+
+static bool BaseFile_ReadV(TFileStream * pStream, ULONGLONG ByteOffset, TStreamVector * Vectors, DWORD dwVectorCount)
+{
+    struct iovec IoVec[STREAM_MAX_VECTORS];
+    ssize_t bytes_read;
+    size_t cbFilled = 0;                    // Bytes already read to Vectors[dwIndex]
+    DWORD dwIndex = 0;
+    DWORD dwCount;
+
+    assert(dwVectorCount <= STREAM_MAX_VECTORS);
+
+    while(dwIndex < dwVectorCount)
+    {
+        // Describe the buffers that are not filled yet
+        for(dwCount = 0; (dwIndex + dwCount) < dwVectorCount; dwCount++)
+        {
+            IoVec[dwCount].iov_base = (LPBYTE)Vectors[dwIndex + dwCount].pvBuffer;
+            IoVec[dwCount].iov_len = Vectors[dwIndex + dwCount].cbBuffer;
+        }
+        IoVec[0].iov_base = (LPBYTE)IoVec[0].iov_base + cbFilled;
+        IoVec[0].iov_len -= cbFilled;
+
+        // A read from a regular file is only shorter at the end of the file,
+        // but we handle the short reads anyway
+        bytes_read = preadv((intptr_t)pStream->Base.File.hFile, IoVec, (int)dwCount, (off_t)ByteOffset);
+        if(bytes_read == -1)
+        {
+            SErrSetLastError(errno);
+            return false;
+        }
+        if(bytes_read == 0)
+        {
+            SErrSetLastError(ERROR_HANDLE_EOF);
+            return false;
+        }
+
+        // Skip the buffers that have been filled
+        ByteOffset += (size_t)bytes_read;
+        cbFilled += (size_t)bytes_read;
+        while(dwIndex < dwVectorCount && cbFilled >= Vectors[dwIndex].cbBuffer)
+            cbFilled -= Vectors[dwIndex++].cbBuffer;
+    }
+
+    pStream->Base.File.FilePos = ByteOffset;
+    return true;
+}
+#endif
+
 /**
  * \a pStream Pointer to an open stream
  * \a pByteOffset Pointer to file byte offset. If NULL, writes to current position
@@ -287,6 +415,25 @@ static bool BaseFile_Write(TFileStream * pStream, ULONGLONG * pByteOffset, const
     {
         ssize_t bytes_written;
 
+#if defined(STORMLIB_LINUX) && defined(O_DIRECT)
+        // Direct I/O needs the buffer, the offset and the length aligned.
+        // If they are not (e.g. the last part of the file), turn the direct I/O off
+        if(pStream->dwFlags & STREAM_FLAG_DIRECT_IO)
+        {
+            if(((uintptr_t)pvBuffer | (uintptr_t)ByteOffset | dwBytesToWrite) & (STORM_DIRECT_IO_ALIGNMENT - 1))
+            {
+                int nFileFlags = fcntl((intptr_t)pStream->Base.File.hFile, F_GETFL);
+
+                fcntl((intptr_t)pStream->Base.File.hFile, F_SETFL, nFileFlags & ~O_DIRECT);
+                pStream->dwFlags &= ~STREAM_FLAG_DIRECT_IO;
+            }
+        }
+#endif
+
+#ifdef STORMLIB_HAS_PREAD
+        // Perform the positioned write operation
+        bytes_written = pwrite64((intptr_t)pStream->Base.File.hFile, pvBuffer, (size_t)dwBytesToWrite, (off64_t)(ByteOffset));
+#else
         // If the byte offset is different from the current file position,
         // we have to update the file position
         if(ByteOffset != pStream->Base.File.FilePos)
@@ -295,8 +442,9 @@ static bool BaseFile_Write(TFileStream * pStream, ULONGLONG * pByteOffset, const
             pStream->Base.File.FilePos = ByteOffset;
         }
 
-        // Perform the read operation
+        // Perform the write operation
         bytes_written = write((intptr_t)pStream->Base.File.hFile, pvBuffer, (size_t)dwBytesToWrite);
+#endif
         if(bytes_written == -1)
         {
             SErrSetLastError(errno);
@@ -434,6 +582,9 @@ static void BaseFile_Init(TFileStream * pStream)
     pStream->BaseGetSize = BaseFile_GetSize;
     pStream->BaseGetPos  = BaseFile_GetPos;
     pStream->BaseClose   = BaseFile_Close;
+#ifdef STORMLIB_HAS_PREADV
+    pStream->BaseReadV   = BaseFile_ReadV;
+#endif
 }
 
 //-----------------------------------------------------------------------------
@@ -564,6 +715,8 @@ static bool BaseMap_Open(TFileStream * pStream, LPCTSTR szFileName, DWORD dwStre
         if(fstat64(handle, &fileinfo) != -1)
         {
             pStream->Base.Map.pbFile = (LPBYTE)mmap(NULL, (size_t)fileinfo.st_size, PROT_READ, MAP_PRIVATE, handle, 0);
+            if(pStream->Base.Map.pbFile == (LPBYTE)MAP_FAILED)
+                pStream->Base.Map.pbFile = NULL;
             if(pStream->Base.Map.pbFile != NULL)
             {
                 // time_t is number of seconds since 1.1.1970, UTC.
@@ -610,8 +763,9 @@ static bool BaseMap_Read(
         memcpy(pvBuffer, pStream->Base.Map.pbFile + (size_t)ByteOffset, dwBytesToRead);
     }
 
-    // Move the current file position
-    pStream->Base.Map.FilePos += dwBytesToRead;
+    // Move the current file position. The mapped view itself is never modified,
+    // so concurrent reads from multiple threads are safe.
+    pStream->Base.Map.FilePos = ByteOffset + dwBytesToRead;
     return true;
 }
 
@@ -662,17 +816,28 @@ static bool BaseMpq_Read(TFileStream * pStream, ULONGLONG * pByteOffset, void *
     dwByteOffsetHi = (DWORD)(ByteOffset64 >> 0x20);
     dwByteOffsetLo = (DWORD)(ByteOffset64 & 0xFFFFFFFF);
 
+    // The MPQ file handle has its own file position, so we can't let
+    // more than one thread to seek-and-read at the same time
+    StormLock_Enter(&pStream->Lock);
+
     // Set the new file pointer
     if(SFileSetFilePointer(pStream->Base.Mpq.hFile, dwByteOffsetLo, (LONG *)(&dwByteOffsetHi), FILE_BEGIN) != dwByteOffsetLo)
+    {
+        StormLock_Leave(&pStream->Lock);
         return false;
+    }
     pStream->Base.File.FilePos = MAKE_OFFSET64(dwByteOffsetHi, dwByteOffsetLo);
 
     // Read the file data
     if(!SFileReadFile(pStream->Base.Mpq.hFile, pvBuffer, dwBytesToRead, &dwBytesRead, NULL))
+    {
+        StormLock_Leave(&pStream->Lock);
         return false;
+    }
 
     // Update the file position
     pStream->Base.File.FilePos += dwBytesRead;
+    StormLock_Leave(&pStream->Lock);
     return true;
 }
 
@@ -723,6 +888,280 @@ static LPCTSTR BaseHttp_ExtractServerName(LPCTSTR szFileName, TCHAR * szServerNa
     return szFileName;
 }
 
+#ifdef STORMLIB_HTTP_SOCKETS
+
+// Status line and headers of an HTTP response
+struct THttpResponse
+{
+    char szHeader[HTTP_MAX_HEADER_SIZE + 1];// Received header, followed by the first part of the body
+    DWORD cbReceived;                       // Number of bytes received to szHeader
+    DWORD cbHeader;                         // Offset of the body data that haven't been consumed yet
+    DWORD dwStatusCode;                     // HTTP status code
+    ULONGLONG ContentLength;                // Value of "Content-Length" (or -1 if not present)
+    bool bKeepAlive;                        // If false, the server closes the connection after the response
+};
+
+static void BaseHttp_Disconnect(TFileStream * pStream)
+{
+    if(pStream->Base.Http.hSocket != -1)
+        close(pStream->Base.Http.hSocket);
+    pStream->Base.Http.hSocket = -1;
+}
+
+static bool BaseHttp_Connect(TFileStream * pStream)
+{
+    struct addrinfo * pAddrList = NULL;
+    struct addrinfo * pAddr;
+    struct addrinfo Hints;
+    struct timeval Timeout;
+    const char * szService = HTTP_DEFAULT_PORT;
+    char szServerName[MAX_PATH];
+    char * szHostName;
+    char * szPort;
+    int hSocket = -1;
+    int nOption = 1;
+    int nError = ECONNREFUSED;
+
+    // Get the server name, e.g. "www.server.com:8080" or "[::1]:8080"
+    if((BaseHttp_ExtractServerName(pStream->szFileName, NULL) - pStream->szFileName) >= MAX_PATH)
+    {
+        SErrSetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+    BaseHttp_ExtractServerName(pStream->szFileName, szServerName);
+
+    // Split the server name to the host name and the port
+    if(szServerName[0] == '[')
+    {
+        szHostName = szServerName + 1;
+        if((szPort = strchr(szHostName, ']')) != NULL)
+            *szPort++ = 0;
+    }
+    else
+    {
+        szHostName = szServerName;
+        szPort = strchr(szHostName, ':');
+    }
+    if(szPort != NULL && szPort[0] == ':')
+    {
+        *szPort++ = 0;
+        szService = szPort;
+    }
+
+    // Resolve the server address
+    memset(&Hints, 0, sizeof(Hints));
+    Hints.ai_family = AF_UNSPEC;
+    Hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(szHostName, szService, &Hints, &pAddrList) != 0)
+    {
+        SErrSetLastError(ERROR_FILE_NOT_FOUND);
+        return false;
+    }
+
+    // Connect to the first address that accepts the connection
+    for(pAddr = pAddrList; pAddr != NULL; pAddr = pAddr->ai_next)
+    {
+        if((hSocket = socket(pAddr->ai_family, pAddr->ai_socktype, pAddr->ai_protocol)) != -1)
+        {
+            if(connect(hSocket, pAddr->ai_addr, pAddr->ai_addrlen) == 0)
+                break;
+            nError = errno;
+            close(hSocket);
+            hSocket = -1;
+        }
+    }
+    freeaddrinfo(pAddrList);
+
+    if(hSocket == -1)
+    {
+        SErrSetLastError(nError);
+        return false;
+    }
+
+    // The requests are small and we always wait for the response,
+    // so don't let the Nagle algorithm delay them
+    setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, &nOption, sizeof(nOption));
+#ifdef SO_NOSIGPIPE
+    setsockopt(hSocket, SOL_SOCKET, SO_NOSIGPIPE, &nOption, sizeof(nOption));
+#endif
+
+    // Don't hang forever if the server stops responding
+    Timeout.tv_sec = HTTP_TIMEOUT_SECONDS;
+    Timeout.tv_usec = 0;
+    setsockopt(hSocket, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+    setsockopt(hSocket, SOL_SOCKET, SO_SNDTIMEO, &Timeout, sizeof(Timeout));
+
+    pStream->Base.Http.hSocket = hSocket;
+    return true;
+}
+
+static bool BaseHttp_Send(int hSocket, const char * szRequest, size_t cbRequest)
+{
+    while(cbRequest != 0)
+    {
+        ssize_t nSent = send(hSocket, szRequest, cbRequest, HTTP_SEND_FLAGS);
+
+        if(nSent <= 0)
+        {
+            if(nSent == -1 && errno == EINTR)
+                continue;
+            SErrSetLastError((nSent == 0) ? ERROR_HANDLE_EOF : errno);
+            return false;
+        }
+
+        szRequest += nSent;
+        cbRequest -= nSent;
+    }
+
+    return true;
+}
+
+static bool BaseHttp_Receive(int hSocket, void * pvBuffer, size_t cbBuffer, DWORD * pcbReceived)
+{
+    ssize_t nReceived;
+
+    // Retry if interrupted by a signal
+    while((nReceived = recv(hSocket, pvBuffer, cbBuffer, 0)) == -1 && errno == EINTR);
+
+    // Zero means that the server closed the connection
+    if(nReceived <= 0)
+    {
+        SErrSetLastError((nReceived == 0) ? ERROR_HANDLE_EOF : errno);
+        return false;
+    }
+
+    *pcbReceived = (DWORD)nReceived;
+    return true;
+}
+
+static bool BaseHttp_ReceiveHeader(TFileStream * pStream, THttpResponse * pResponse)
+{
+    char * szHeaderEnd;
+    char * szLine;
+    DWORD cbReceived;
+
+    // Receive until we have the empty line that terminates the header.
+    // Whatever comes after it is the beginning of the body
+    pResponse->cbReceived = 0;
+    pResponse->szHeader[0] = 0;
+    while((szHeaderEnd = strstr(pResponse->szHeader, "\r\n\r\n")) == NULL)
+    {
+        if(pResponse->cbReceived >= HTTP_MAX_HEADER_SIZE)
+        {
+            SErrSetLastError(ERROR_BAD_FORMAT);
+            return false;
+        }
+
+        if(!BaseHttp_Receive(pStream->Base.Http.hSocket, pResponse->szHeader + pResponse->cbReceived, HTTP_MAX_HEADER_SIZE - pResponse->cbReceived, &cbReceived))
+            return false;
+        pResponse->cbReceived += cbReceived;
+        pResponse->szHeader[pResponse->cbReceived] = 0;
+    }
+    pResponse->cbHeader = (DWORD)(szHeaderEnd + 4 - pResponse->szHeader);
+    szHeaderEnd[2] = 0;
+
+    // Parse the status line, e.g. "HTTP/1.1 206 Partial Content"
+    if(strncmp(pResponse->szHeader, "HTTP/1.", 7) || pResponse->szHeader[8] != ' ')
+    {
+        SErrSetLastError(ERROR_BAD_FORMAT);
+        return false;
+    }
+    pResponse->dwStatusCode = StringToInt(pResponse->szHeader + 9);
+    pResponse->ContentLength = (ULONGLONG)(-1);
+    pResponse->bKeepAlive = (pResponse->szHeader[7] != '0');
+
+    // Parse the header fields that we are interested in
+    for(szLine = strstr(pResponse->szHeader, "\r\n"); szLine != NULL; szLine = strstr(szLine, "\r\n"))
+    {
+        szLine += 2;
+
+        if(!strncasecmp(szLine, "Content-Length:", 15))
+            pResponse->ContentLength = strtoull(szLine + 15, NULL, 10);
+
+        if(!strncasecmp(szLine, "Connection:", 11))
+        {
+            for(szLine += 11; szLine[0] == ' '; szLine++);
+            if(!strncasecmp(szLine, "close", 5))
+                pResponse->bKeepAlive = false;
+            if(!strncasecmp(szLine, "keep-alive", 10))
+                pResponse->bKeepAlive = true;
+        }
+    }
+
+    return true;
+}
+
+static bool BaseHttp_ReceiveBody(TFileStream * pStream, THttpResponse * pResponse, LPBYTE pbBuffer, DWORD cbBuffer)
+{
+    DWORD cbReceived = pResponse->cbReceived - pResponse->cbHeader;
+
+    // Use the part of the body that came together with the header
+    if(cbReceived > cbBuffer)
+        cbReceived = cbBuffer;
+    memcpy(pbBuffer, pResponse->szHeader + pResponse->cbHeader, cbReceived);
+    pResponse->cbHeader += cbReceived;
+
+    // Receive the rest directly to the buffer
+    while(cbReceived < cbBuffer)
+    {
+        DWORD cbTransferred = 0;
+
+        if(!BaseHttp_Receive(pStream->Base.Http.hSocket, pbBuffer + cbReceived, cbBuffer - cbReceived, &cbTransferred))
+            return false;
+        cbReceived += cbTransferred;
+    }
+
+    return true;
+}
+
+// Sends a request and receives the response header. If the request is sent over
+// a kept-alive connection that the server has closed meanwhile, reconnects and tries again.
+// If dwLength is nonzero, only the range of the file is requested
+static bool BaseHttp_SendRequest(TFileStream * pStream, const char * szMethod, ULONGLONG StartOffset, DWORD dwLength, THttpResponse * pResponse)
+{
+    LPCTSTR szFileName;
+    char szServerName[MAX_PATH];
+    char szRangeRequest[0x80] = "";
+    char szRequest[HTTP_MAX_HEADER_SIZE];
+    bool bReused = (pStream->Base.Http.hSocket != -1);
+    int nLength;
+
+    // The server name has been checked by BaseHttp_Connect
+    if(bReused == false && !BaseHttp_Connect(pStream))
+        return false;
+    szFileName = BaseHttp_ExtractServerName(pStream->szFileName, szServerName);
+
+    // Prepare the request
+    if(dwLength != 0)
+        snprintf(szRangeRequest, sizeof(szRangeRequest), "Range: bytes=%llu-%llu\r\n", (unsigned long long)StartOffset, (unsigned long long)(StartOffset + dwLength - 1));
+    nLength = snprintf(szRequest, sizeof(szRequest), "%s %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: StormLib HTTP MPQ reader\r\nConnection: keep-alive\r\n%s\r\n",
+                                                     szMethod,
+                                                     (szFileName[0] != 0) ? szFileName : "/",
+                                                     szServerName,
+                                                     szRangeRequest);
+    if(nLength < 0 || nLength >= (int)sizeof(szRequest))
+    {
+        SErrSetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Send the request and receive the response header
+    if(BaseHttp_Send(pStream->Base.Http.hSocket, szRequest, nLength) && BaseHttp_ReceiveHeader(pStream, pResponse))
+        return true;
+    BaseHttp_Disconnect(pStream);
+
+    // Retry once with a new connection
+    if(bReused && BaseHttp_Connect(pStream))
+    {
+        if(BaseHttp_Send(pStream->Base.Http.hSocket, szRequest, nLength) && BaseHttp_ReceiveHeader(pStream, pResponse))
+            return true;
+        BaseHttp_Disconnect(pStream);
+    }
+    return false;
+}
+
+#endif  // STORMLIB_HTTP_SOCKETS
+
 static bool BaseHttp_Open(TFileStream * pStream, LPCTSTR szFileName, DWORD dwStreamFlags)
 {
 #ifdef STORMLIB_WINDOWS
@@ -821,6 +1260,31 @@ static bool BaseHttp_Open(TFileStream * pStream, LPCTSTR szFileName, DWORD dwStr
     pStream->BaseClose(pStream);
     return false;
 
+#elif defined(STORMLIB_HTTP_SOCKETS)
+
+    THttpResponse Response;
+
+    // Keep compilers happy
+    STORMLIB_UNUSED(szFileName);
+    STORMLIB_UNUSED(dwStreamFlags);
+
+    // Query the file size. The connection is kept for the range requests
+    if(!BaseHttp_SendRequest(pStream, "HEAD", 0, 0, &Response))
+        return false;
+    if(!Response.bKeepAlive)
+        BaseHttp_Disconnect(pStream);
+
+    // The file must exist and we need to know its size
+    if(Response.dwStatusCode != 200 || Response.ContentLength == 0 || Response.ContentLength == (ULONGLONG)(-1))
+    {
+        SErrSetLastError(ERROR_FILE_NOT_FOUND);
+        return false;
+    }
+
+    pStream->Base.Http.FileSize = Response.ContentLength;
+    pStream->Base.Http.FilePos = 0;
+    return true;
+
 #else
 
     // Not supported
@@ -895,6 +1359,83 @@ static bool BaseHttp_Read(
         SErrSetLastError(ERROR_HANDLE_EOF);
     return (dwTotalBytesRead == dwBytesToRead);
 
+#elif defined(STORMLIB_HTTP_SOCKETS)
+    THttpResponse Response;
+    ULONGLONG ByteOffset = (pByteOffset != NULL) ? *pByteOffset : pStream->Base.Http.FilePos;
+    ULONGLONG CacheOffset;
+    ULONGLONG CacheEnd;
+    LPBYTE pbBuffer = (LPBYTE)pvBuffer;
+    DWORD dwTotalBytesRead = 0;
+    bool bResult = true;
+
+    // The connection and the read-ahead data are shared by all readers
+    StormLock_Enter(&pStream->Lock);
+    CacheOffset = pStream->Base.Http.CacheOffset;
+    CacheEnd = CacheOffset + pStream->Base.Http.cbCache;
+
+    // Take as much as possible from the data that have been read ahead
+    if(CacheOffset <= ByteOffset && ByteOffset < CacheEnd)
+    {
+        dwTotalBytesRead = (DWORD)STORMLIB_MIN(CacheEnd - ByteOffset, dwBytesToRead);
+        memcpy(pbBuffer, pStream->Base.Http.pbCache + (size_t)(ByteOffset - CacheOffset), dwTotalBytesRead);
+    }
+
+    // Request the rest from the server
+    if(dwTotalBytesRead < dwBytesToRead && (ByteOffset + dwTotalBytesRead) < pStream->Base.Http.FileSize)
+    {
+        ULONGLONG RangeOffset = ByteOffset + dwTotalBytesRead;
+        DWORD dwBytesNeeded = dwBytesToRead - dwTotalBytesRead;
+        DWORD dwRangeLength = dwBytesNeeded;
+
+        // Make the request at least as big as the read-ahead,
+        // but don't ask for anything beyond the end of the file
+        if(pStream->Base.Http.pbCache == NULL && pStream->Base.Http.cbReadAhead != 0)
+            pStream->Base.Http.pbCache = STORM_ALLOC(BYTE, pStream->Base.Http.cbReadAhead);
+        if(pStream->Base.Http.pbCache != NULL && dwRangeLength < pStream->Base.Http.cbReadAhead)
+            dwRangeLength = pStream->Base.Http.cbReadAhead;
+        if(dwRangeLength > (pStream->Base.Http.FileSize - RangeOffset))
+            dwRangeLength = (DWORD)(pStream->Base.Http.FileSize - RangeOffset);
+        if(dwBytesNeeded > dwRangeLength)
+            dwBytesNeeded = dwRangeLength;
+
+        // The server must return exactly the requested range
+        bResult = BaseHttp_SendRequest(pStream, "GET", RangeOffset, dwRangeLength, &Response);
+        if(bResult && (Response.dwStatusCode != 206 || Response.ContentLength != dwRangeLength))
+        {
+            SErrSetLastError((Response.dwStatusCode == 200) ? ERROR_NOT_SUPPORTED : ERROR_FILE_NOT_FOUND);
+            bResult = false;
+        }
+
+        // Receive the requested data to the caller's buffer and the rest to the read-ahead buffer
+        if(bResult)
+            bResult = BaseHttp_ReceiveBody(pStream, &Response, pbBuffer + dwTotalBytesRead, dwBytesNeeded);
+        if(bResult && dwRangeLength > dwBytesNeeded)
+        {
+            pStream->Base.Http.cbCache = 0;
+            bResult = BaseHttp_ReceiveBody(pStream, &Response, pStream->Base.Http.pbCache, dwRangeLength - dwBytesNeeded);
+            if(bResult)
+            {
+                pStream->Base.Http.CacheOffset = RangeOffset + dwBytesNeeded;
+                pStream->Base.Http.cbCache = dwRangeLength - dwBytesNeeded;
+            }
+        }
+        if(bResult)
+            dwTotalBytesRead += dwBytesNeeded;
+
+        // The connection can't be used anymore if the response hasn't been received completely
+        if(bResult == false || Response.bKeepAlive == false)
+            BaseHttp_Disconnect(pStream);
+    }
+
+    // Increment the current file position by number of bytes read
+    pStream->Base.Http.FilePos = ByteOffset + dwTotalBytesRead;
+    StormLock_Leave(&pStream->Lock);
+
+    // If the number of bytes read doesn't match the required amount, return false
+    if(bResult && dwTotalBytesRead != dwBytesToRead)
+        SErrSetLastError(ERROR_HANDLE_EOF);
+    return (dwTotalBytesRead == dwBytesToRead);
+
 #else
 
     // Not supported
@@ -918,6 +1459,13 @@ static void BaseHttp_Close(TFileStream * pStream)
     if(pStream->Base.Http.hInternet != NULL)
         InternetCloseHandle(pStream->Base.Http.hInternet);
     pStream->Base.Http.hInternet = NULL;
+#elif defined(STORMLIB_HTTP_SOCKETS)
+    BaseHttp_Disconnect(pStream);
+
+    if(pStream->Base.Http.pbCache != NULL)
+        STORM_FREE(pStream->Base.Http.pbCache);
+    pStream->Base.Http.pbCache = NULL;
+    pStream->Base.Http.cbCache = 0;
 #else
     pStream = pStream;
 #endif
@@ -933,6 +1481,12 @@ static void BaseHttp_Init(TFileStream * pStream)
     pStream->BaseGetPos  = BaseFile_GetPos;     // Reuse BaseFile function
     pStream->BaseClose   = BaseHttp_Close;
 
+#ifdef STORMLIB_HTTP_SOCKETS
+    // Not connected yet
+    pStream->Base.Http.hSocket = -1;
+    pStream->Base.Http.cbReadAhead = HTTP_DEFAULT_READ_AHEAD;
+#endif
+
     // HTTP files are read-only
     pStream->dwFlags |= STREAM_FLAG_READ_ONLY;
 }
@@ -940,10 +1494,54 @@ static void BaseHttp_Init(TFileStream * pStream)
 //-----------------------------------------------------------------------------
 // Local functions - base block-based support
 
+// Returns a buffer for reading the given amount of whole blocks.
+// The buffer is kept in the stream and only grows when needed
+static LPBYTE BlockStream_GetTransferBuffer(TBlockStream * pStream, DWORD cbTransfer)
+{
+    if(cbTransfer > pStream->TransferSize)
+    {
+        if(pStream->TransferBuffer != NULL)
+            STORM_FREE(pStream->TransferBuffer);
+        pStream->TransferSize = 0;
+
+        if((pStream->TransferBuffer = STORM_ALLOC(BYTE, cbTransfer)) == NULL)
+            return NULL;
+        pStream->TransferSize = cbTransfer;
+    }
+
+    return pStream->TransferBuffer;
+}
+
+// Loads blocks from the master stream. The master is also read by the prefetch worker,
+// which doesn't hold the lock of the mirror stream, so the master reads are serialized by its own lock
+static bool BlockStream_ReadMaster(TBlockStream * pStream, ULONGLONG StartOffset, LPBYTE BlockBuffer, DWORD BytesToRead)
+{
+    TFileStream * pMaster = pStream->pMaster;
+    bool bResult;
+
+    StormLock_Enter(&pMaster->Lock);
+    bResult = FileStream_Read(pMaster, &StartOffset, BlockBuffer, BytesToRead);
+    StormLock_Leave(&pMaster->Lock);
+    return bResult;
+}
+
+// After a demand miss, the reader is likely to continue beyond the loaded blocks.
+// The prefetch worker loads that area before the queued ranges
+static void BlockStream_SetDemandRange(TBlockStream * pStream, ULONGLONG ByteOffset)
+{
+    TStreamPrefetch * pPrefetch = pStream->pPrefetch;
+
+    if(pPrefetch != NULL && pPrefetch->bRunning)
+    {
+        pPrefetch->Demand.StartOffset = ByteOffset;
+        pPrefetch->Demand.EndOffset = STORMLIB_MIN(ByteOffset + PREFETCH_DEMAND_SIZE, pStream->StreamSize);
+    }
+}
+
 // Generic function that loads blocks from the file
 // The function groups the block with the same availability,
 // so the called BlockRead can finish the request in a single system call
-static bool BlockStream_Read(
+static bool BlockStream_ReadBlocks(
     TBlockStream * pStream,                 // Pointer to an open stream
     ULONGLONG * pByteOffset,                // Pointer to file byte offset. If NULL, it reads from the current position
     void * pvBuffer,                        // Pointer to data to be read
@@ -959,7 +1557,6 @@ static bool BlockStream_Read(
     DWORD BytesNeeded;                      // Number of bytes that really need to be read
     DWORD BlockSize = pStream->BlockSize;
     DWORD BlockCount;
-    bool bPrevBlockAvailable;
     bool bCallbackCalled = false;
     bool bBlockAvailable;
     bool bResult = true;
@@ -989,69 +1586,61 @@ static bool BlockStream_Read(
     assert((BlockSize & (BlockSize - 1)) == 0);
     BlockBufferOffset = (DWORD)(ByteOffset & (BlockSize - 1));
 
-    // Allocate buffer for reading blocks
-    TransferBuffer = BlockBuffer = STORM_ALLOC(BYTE, (BlockCount * BlockSize));
-    if(TransferBuffer == NULL)
+    // If the read begins and ends at a block boundary, the blocks are read directly
+    // to the caller's buffer. Otherwise, we need the transfer buffer of the stream
+    if(BlockBufferOffset == 0 && (EndOffset & (BlockSize - 1)) == 0 && STORMLIB_DWORD_ALIGNED(pvBuffer))
     {
-        SErrSetLastError(ERROR_NOT_ENOUGH_MEMORY);
-        return false;
+        TransferBuffer = BlockBuffer = (LPBYTE)pvBuffer;
+    }
+    else
+    {
+        TransferBuffer = BlockBuffer = BlockStream_GetTransferBuffer(pStream, BlockCount * BlockSize);
+        if(TransferBuffer == NULL)
+        {
+            SErrSetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return false;
+        }
     }
 
     // If all blocks are available, just read all blocks at once
     if(pStream->IsComplete == 0)
     {
-        // Now parse the blocks and send the block read request
-        // to all blocks with the same availability
-        assert(pStream->BlockCheck != NULL);
-        bPrevBlockAvailable = pStream->BlockCheck(pStream, BlockOffset);
+        DWORD BlockIndex = (DWORD)(BlockOffset / BlockSize);
+        DWORD BlockEnd = BlockIndex + BlockCount;
+        DWORD RunEnd;
 
-        // Loop as long as we have something to read
-        while(BlockOffset < EndOffset)
+        // Send the block read request to each run of blocks with the same availability
+        assert(pStream->BlockScan != NULL);
+        while(BlockIndex < BlockEnd)
         {
-            // Determine availability of the next block
-            bBlockAvailable = pStream->BlockCheck(pStream, BlockOffset);
-
-            // If the availability has changed, read all blocks up to this one
-            if(bBlockAvailable != bPrevBlockAvailable)
-            {
-                // Call the file stream callback, if the block is not available
-                if(pStream->pMaster && pStream->pfnCallback && bPrevBlockAvailable == false)
-                {
-                    pStream->pfnCallback(pStream->UserData, BlockOffset0, (DWORD)(BlockOffset - BlockOffset0));
-                    bCallbackCalled = true;
-                }
-
-                // Load the continuous blocks with the same availability
-                assert(BlockOffset > BlockOffset0);
-                bResult = pStream->BlockRead(pStream, BlockOffset0, BlockOffset, BlockBuffer, BytesNeeded, bPrevBlockAvailable);
-                if(!bResult)
-                    break;
-
-                // Move the block offset
-                BlockBuffer += (DWORD)(BlockOffset - BlockOffset0);
-                BytesNeeded -= (DWORD)(BlockOffset - BlockOffset0);
-                bPrevBlockAvailable = bBlockAvailable;
-                BlockOffset0 = BlockOffset;
-            }
-
-            // Move to the block offset in the stream
-            BlockOffset += BlockSize;
-        }
-
-        // If there is a block(s) remaining to be read, do it
-        if(BlockOffset > BlockOffset0)
-        {
-            // Call the file stream callback, if the block is not available
-            if(pStream->pMaster && pStream->pfnCallback && bPrevBlockAvailable == false)
+            // Find the end of the run of blocks
+            RunEnd = pStream->BlockScan(pStream, BlockIndex, BlockEnd, &bBlockAvailable);
+            BlockOffset0 = (ULONGLONG)BlockIndex * BlockSize;
+            BlockOffset = (ULONGLONG)RunEnd * BlockSize;
+            assert(RunEnd > BlockIndex);
+
+            // Call the file stream callback, if the blocks are not available
+            if(pStream->pMaster && pStream->pfnCallback && bBlockAvailable == false)
             {
                 pStream->pfnCallback(pStream->UserData, BlockOffset0, (DWORD)(BlockOffset - BlockOffset0));
                 bCallbackCalled = true;
             }
 
-            // Read the complete blocks from the file
+            // Load the continuous blocks with the same availability
             if(BlockOffset > pStream->StreamSize)
                 BlockOffset = pStream->StreamSize;
-            bResult = pStream->BlockRead(pStream, BlockOffset0, BlockOffset, BlockBuffer, BytesNeeded, bPrevBlockAvailable);
+            bResult = pStream->BlockRead(pStream, BlockOffset0, BlockOffset, BlockBuffer, BytesNeeded, bBlockAvailable);
+            if(!bResult)
+                break;
+
+            // Blocks loaded on demand jump the queue of the prefetch, if any
+            if(bBlockAvailable == false)
+                BlockStream_SetDemandRange(pStream, BlockOffset);
+
+            // Move to the next run
+            BlockBuffer += (DWORD)(BlockOffset - BlockOffset0);
+            BytesNeeded -= STORMLIB_MIN(BytesNeeded, (DWORD)(BlockOffset - BlockOffset0));
+            BlockIndex = RunEnd;
         }
     }
     else
@@ -1065,21 +1654,71 @@ static bool BlockStream_Read(
     // Now copy the data to the user buffer
     if(bResult)
     {
-        memcpy(pvBuffer, TransferBuffer + BlockBufferOffset, dwBytesToRead);
+        if(TransferBuffer != pvBuffer)
+            memcpy(pvBuffer, TransferBuffer + BlockBufferOffset, dwBytesToRead);
         pStream->StreamPos = ByteOffset + dwBytesToRead;
     }
     else
     {
-        // If the block read failed, set the last error
-        SErrSetLastError(ERROR_FILE_INCOMPLETE);
+        // If the block read failed, set the last error. Blocks that failed
+        // the verification keep their error code
+        if(SErrGetLastError() != ERROR_FILE_CORRUPT)
+            SErrSetLastError(ERROR_FILE_INCOMPLETE);
     }
 
     // Call the callback to indicate we are done
     if(bCallbackCalled)
         pStream->pfnCallback(pStream->UserData, 0, 0);
+    return bResult;
+}
+
+static bool BlockStream_Read(
+    TBlockStream * pStream,                 // Pointer to an open stream
+    ULONGLONG * pByteOffset,                // Pointer to file byte offset. If NULL, it reads from the current position
+    void * pvBuffer,                        // Pointer to data to be read
+    DWORD dwBytesToRead)                    // Number of bytes to read from the file
+{
+    ULONGLONG ByteOffset;
+    LPBYTE pbBuffer = (LPBYTE)pvBuffer;
+    DWORD BlockMask = pStream->BlockSize - 1;
+    DWORD MaxTransfer = STORMLIB_MAX(MAX_TRANSFER_SIZE, pStream->BlockSize);
+    DWORD dwBlockOffset;
+    DWORD dwLength;
+    bool bResult = true;
+
+    // Block streams update their bitmaps and mirror files during reading.
+    // Concurrent reads from multiple threads must be serialized.
+    StormLock_Enter(&pStream->Lock);
+    ByteOffset = (pByteOffset != NULL) ? pByteOffset[0] : pStream->StreamPos;
+
+    // Big reads are split to pieces that end at block boundaries. Whole blocks are read
+    // directly to the caller's buffer, if possible. The partial blocks and reads to unaligned
+    // buffers go through the transfer buffer, which is never bigger than MaxTransfer.
+    if(dwBytesToRead > MAX_TRANSFER_SIZE && (ByteOffset + dwBytesToRead) <= pStream->StreamSize)
+    {
+        while(bResult && dwBytesToRead != 0)
+        {
+            dwBlockOffset = (DWORD)(ByteOffset & BlockMask);
 
-    // Free the block buffer and return
-    STORM_FREE(TransferBuffer);
+            if(dwBlockOffset == 0 && STORMLIB_DWORD_ALIGNED(pbBuffer) && dwBytesToRead > BlockMask)
+                dwLength = dwBytesToRead & ~BlockMask;
+            else if(STORMLIB_DWORD_ALIGNED(pbBuffer + pStream->BlockSize - dwBlockOffset))
+                dwLength = STORMLIB_MIN(dwBytesToRead, pStream->BlockSize - dwBlockOffset);
+            else
+                dwLength = STORMLIB_MIN(dwBytesToRead, MaxTransfer - dwBlockOffset);
+
+            bResult = BlockStream_ReadBlocks(pStream, &ByteOffset, pbBuffer, dwLength);
+            ByteOffset += dwLength;
+            pbBuffer += dwLength;
+            dwBytesToRead -= dwLength;
+        }
+    }
+    else
+    {
+        bResult = BlockStream_ReadBlocks(pStream, &ByteOffset, pvBuffer, dwBytesToRead);
+    }
+
+    StormLock_Leave(&pStream->Lock);
     return bResult;
 }
 
@@ -1102,10 +1741,187 @@ static void BlockStream_Close(TBlockStream * pStream)
         STORM_FREE(pStream->FileBitmap);
     pStream->FileBitmap = NULL;
 
+    // Free the transfer buffer
+    if(pStream->TransferBuffer != NULL)
+        STORM_FREE(pStream->TransferBuffer);
+    pStream->TransferBuffer = NULL;
+
     // Call the base class for closing the stream
     pStream->BaseClose(pStream);
 }
 
+//-----------------------------------------------------------------------------
+// Local functions - background prefetch of mirror streams
+
+// Finds the next run of missing blocks to be prefetched, at most PREFETCH_CHUNK_SIZE long.
+// The area after the last demand miss goes first, then the queued ranges in their order.
+// Must be called with the stream lock held
+static bool BlockStream_GetPrefetchRun(TBlockStream * pStream, ULONGLONG * pStartOffset, ULONGLONG * pEndOffset)
+{
+    TStreamPrefetch * pPrefetch = pStream->pPrefetch;
+    TPrefetchRange * pRange;
+    DWORD BlockSize = pStream->BlockSize;
+    DWORD MaxBlocks = STORMLIB_MAX(PREFETCH_CHUNK_SIZE / BlockSize, 1);
+    DWORD BlockIndex;
+    DWORD BlockEnd;
+    DWORD RunEnd;
+    bool bAvailable;
+
+    while(pStream->IsComplete == 0)
+    {
+        // Pick the range with the highest priority
+        if(pPrefetch->Demand.StartOffset < pPrefetch->Demand.EndOffset)
+            pRange = &pPrefetch->Demand;
+        else if(pPrefetch->RangeIndex < pPrefetch->RangeCount)
+            pRange = pPrefetch->Ranges + pPrefetch->RangeIndex;
+        else
+            break;
+
+        // Find the run of blocks with the same availability
+        BlockIndex = (DWORD)(pRange->StartOffset / BlockSize);
+        BlockEnd = (DWORD)((pRange->EndOffset + BlockSize - 1) / BlockSize);
+        RunEnd = pStream->BlockScan(pStream, BlockIndex, BlockEnd, &bAvailable);
+        if(bAvailable == false && (RunEnd - BlockIndex) > MaxBlocks)
+            RunEnd = BlockIndex + MaxBlocks;
+
+        // Move the range beyond the run
+        pRange->StartOffset = (ULONGLONG)RunEnd * BlockSize;
+        if(pRange->StartOffset >= pRange->EndOffset)
+        {
+            pRange->StartOffset = pRange->EndOffset;
+            if(pRange != &pPrefetch->Demand)
+                pPrefetch->RangeIndex++;
+        }
+
+        // Give the run of missing blocks
+        if(bAvailable == false)
+        {
+            pStartOffset[0] = (ULONGLONG)BlockIndex * BlockSize;
+            pEndOffset[0] = STORMLIB_MIN((ULONGLONG)RunEnd * BlockSize, pStream->StreamSize);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Stores the prefetched blocks to the mirror. A reader may have loaded some of them
+// while the worker was loading them from the master, so only the missing blocks are stored.
+// Must be called with the stream lock held
+static void BlockStream_StorePrefetched(TBlockStream * pStream, ULONGLONG StartOffset, ULONGLONG EndOffset, LPBYTE BlockBuffer)
+{
+    ULONGLONG RunStart;
+    ULONGLONG RunEnd;
+    DWORD BlockSize = pStream->BlockSize;
+    DWORD BlockIndex = (DWORD)(StartOffset / BlockSize);
+    DWORD BlockEnd = (DWORD)((EndOffset + BlockSize - 1) / BlockSize);
+    DWORD RunEndIndex;
+    bool bAvailable;
+
+    while(BlockIndex < BlockEnd)
+    {
+        RunEndIndex = pStream->BlockScan(pStream, BlockIndex, BlockEnd, &bAvailable);
+
+        if(bAvailable == false)
+        {
+            RunStart = (ULONGLONG)BlockIndex * BlockSize;
+            RunEnd = STORMLIB_MIN((ULONGLONG)RunEndIndex * BlockSize, EndOffset);
+            pStream->BlockStore(pStream, RunStart, RunEnd, BlockBuffer + (size_t)(RunStart - StartOffset));
+        }
+
+        BlockIndex = RunEndIndex;
+    }
+}
+
+static void BlockStream_PrefetchWorker(void * pvParam)
+{
+    TStreamPrefetch * pPrefetch;
+    TBlockStream * pStream = (TBlockStream *)pvParam;
+    ULONGLONG StartOffset;
+    ULONGLONG EndOffset;
+    LPBYTE BlockBuffer;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // The worker has its own buffer, because it doesn't hold the stream lock while loading
+    BlockBuffer = STORM_ALLOC(BYTE, STORMLIB_MAX(PREFETCH_CHUNK_SIZE, pStream->BlockSize));
+    if(BlockBuffer == NULL)
+        dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+
+    StormLock_Enter(&pStream->Lock);
+    pPrefetch = pStream->pPrefetch;
+
+    while(dwErrCode == ERROR_SUCCESS && pPrefetch->bCancel == false)
+    {
+        // Get the next run of missing blocks. Stop if there is none
+        if(!BlockStream_GetPrefetchRun(pStream, &StartOffset, &EndOffset))
+            break;
+
+        // Load the blocks from the master. The readers can use the stream meanwhile
+        StormLock_Leave(&pStream->Lock);
+        if(!BlockStream_ReadMaster(pStream, StartOffset, BlockBuffer, (DWORD)(EndOffset - StartOffset)))
+            dwErrCode = ERROR_FILE_INCOMPLETE;
+        StormLock_Enter(&pStream->Lock);
+
+        // Store the blocks to the mirror
+        if(dwErrCode == ERROR_SUCCESS)
+            BlockStream_StorePrefetched(pStream, StartOffset, EndOffset, BlockBuffer);
+    }
+
+    // Remember the result and drop the rest of the queue
+    if(dwErrCode == ERROR_SUCCESS && pPrefetch->bCancel)
+        dwErrCode = ERROR_CAN_NOT_COMPLETE;
+    pPrefetch->Demand.StartOffset = pPrefetch->Demand.EndOffset = 0;
+    pPrefetch->RangeIndex = pPrefetch->RangeCount = 0;
+    pPrefetch->dwErrCode = dwErrCode;
+    pPrefetch->bRunning = false;
+    StormCond_WakeAll(&pPrefetch->Cond);
+    StormLock_Leave(&pStream->Lock);
+
+    if(BlockBuffer != NULL)
+        STORM_FREE(BlockBuffer);
+}
+
+// Stops the prefetch worker and waits until it ends
+static void BlockStream_CancelPrefetch(TBlockStream * pStream)
+{
+    TStreamPrefetch * pPrefetch;
+    STORM_THREAD Thread;
+    bool bWaitForThread = false;
+
+    StormLock_Enter(&pStream->Lock);
+    if((pPrefetch = pStream->pPrefetch) != NULL)
+    {
+        if(pPrefetch->bRunning)
+            pPrefetch->bCancel = true;
+        if(pPrefetch->bThreadValid)
+        {
+            Thread = pPrefetch->Thread;
+            pPrefetch->bThreadValid = false;
+            bWaitForThread = true;
+        }
+    }
+    StormLock_Leave(&pStream->Lock);
+
+    if(bWaitForThread)
+        StormThread_Wait(Thread);
+}
+
+static void BlockStream_FreePrefetch(TBlockStream * pStream)
+{
+    TStreamPrefetch * pPrefetch;
+
+    BlockStream_CancelPrefetch(pStream);
+
+    if((pPrefetch = pStream->pPrefetch) != NULL)
+    {
+        if(pPrefetch->Ranges != NULL)
+            STORM_FREE(pPrefetch->Ranges);
+        StormCond_Free(&pPrefetch->Cond);
+        STORM_FREE(pPrefetch);
+    }
+    pStream->pPrefetch = NULL;
+}
+
 //-----------------------------------------------------------------------------
 // File stream allocation function
 
@@ -1163,6 +1979,7 @@ static TFileStream * AllocateFileStream(
     {
         // Zero the entire structure
         memset(pStream, 0, StreamSize);
+        StormLock_Init(&pStream->Lock);
         pStream->pMaster = pMaster;
         pStream->dwFlags = dwStreamFlags;
 
@@ -1327,6 +2144,86 @@ static bool FlatStream_BlockCheck(
     return (FileBitmap[BlockIndex / 0x08] & BitMask) ? true : false;
 }
 
+// Returns the index of the lowest set bit. The value must not be zero
+static inline DWORD FindLowestSetBit(ULONGLONG Value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (DWORD)__builtin_ctzll(Value);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long Index;
+    _BitScanForward64(&Index, Value);
+    return (DWORD)Index;
+#else
+    DWORD Index = 0;
+
+    while((Value & 1) == 0)
+    {
+        Value >>= 1;
+        Index++;
+    }
+    return Index;
+#endif
+}
+
+// Loads one 64-bit word of the file bitmap. Bits beyond the end of the bitmap are zero
+static ULONGLONG FlatStream_LoadBitmapWord(TBlockStream * pStream, DWORD WordIndex)
+{
+    ULONGLONG Word = 0;
+    DWORD ByteIndex = WordIndex * sizeof(ULONGLONG);
+
+    if(ByteIndex < pStream->BitmapSize)
+        memcpy(&Word, (LPBYTE)pStream->FileBitmap + ByteIndex, STORMLIB_MIN(pStream->BitmapSize - ByteIndex, sizeof(ULONGLONG)));
+    return BSWAP_INT64_UNSIGNED(Word);
+}
+
+// Finds the first block whose availability differs from the first one.
+// The bitmap is scanned 64 blocks at a time.
+static DWORD FlatStream_BlockScan(
+    TBlockStream * pStream,                // Pointer to an open stream
+    DWORD BlockIndex,
+    DWORD BlockEnd,
+    bool * pbAvailable)
+{
+    ULONGLONG Word;
+    ULONGLONG Invert;
+    DWORD WordIndex = BlockIndex / 64;
+
+    // Sanity checks
+    assert(pStream->FileBitmap != NULL);
+    assert(BlockIndex < BlockEnd);
+
+    // Determine the availability of the first block. Then we look for the first
+    // bit that differs from it: a zero bit for available blocks, a one bit for missing ones.
+    Word = FlatStream_LoadBitmapWord(pStream, WordIndex);
+    pbAvailable[0] = (Word >> (BlockIndex & 63)) & 1 ? true : false;
+    Invert = pbAvailable[0] ? ~(ULONGLONG)0 : 0;
+
+    // Ignore the bits below the first block
+    Word = (Word ^ Invert) & (~(ULONGLONG)0 << (BlockIndex & 63));
+
+    // Skip the words where all blocks have the same availability
+    while(Word == 0)
+    {
+        if((++WordIndex * 64) >= BlockEnd)
+            return BlockEnd;
+        Word = FlatStream_LoadBitmapWord(pStream, WordIndex) ^ Invert;
+    }
+
+    return STORMLIB_MIN(BlockEnd, WordIndex * 64 + FindLowestSetBit(Word));
+}
+
+static void FlatStream_BlockStore(
+    TBlockStream * pStream,                // Pointer to an open stream
+    ULONGLONG StartOffset,
+    ULONGLONG EndOffset,
+    LPBYTE BlockBuffer)
+{
+    // Store the loaded blocks to the mirror file.
+    // Note that this operation is not required to succeed
+    if(pStream->BaseWrite(pStream, &StartOffset, BlockBuffer, (DWORD)(EndOffset - StartOffset)))
+        FlatStream_UpdateBitmap(pStream, StartOffset, EndOffset);
+}
+
 static bool FlatStream_BlockRead(
     TBlockStream * pStream,                // Pointer to an open stream
     ULONGLONG StartOffset,
@@ -1353,14 +2250,10 @@ static bool FlatStream_BlockRead(
         // Load the blocks from the master stream
         // Note that we always have to read complete blocks
         // so they get properly stored to the mirror stream
-        if(!FileStream_Read(pStream->pMaster, &StartOffset, BlockBuffer, BytesToRead))
+        if(!BlockStream_ReadMaster(pStream, StartOffset, BlockBuffer, BytesToRead))
             return false;
 
-        // Store the loaded blocks to the mirror file.
-        // Note that this operation is not required to succeed
-        if(pStream->BaseWrite(pStream, &StartOffset, BlockBuffer, BytesToRead))
-            FlatStream_UpdateBitmap(pStream, StartOffset, EndOffset);
-
+        FlatStream_BlockStore(pStream, StartOffset, EndOffset, BlockBuffer);
         return true;
     }
     else
@@ -1522,7 +2415,9 @@ static TFileStream * FlatStream_Open(LPCTSTR szFileName, DWORD dwStreamFlags)
 
         // Supply the block functions
         pStream->BlockCheck    = (BLOCK_CHECK)FlatStream_BlockCheck;
+        pStream->BlockScan     = (BLOCK_SCAN)FlatStream_BlockScan;
         pStream->BlockRead     = (BLOCK_READ)FlatStream_BlockRead;
+        pStream->BlockStore    = (BLOCK_STORE)FlatStream_BlockStore;
     }
     else
     {
@@ -1707,6 +2602,57 @@ static bool PartStream_BlockCheck(
     return (FileBitmap->Flags & 0x03) ? true : false;
 }
 
+// Finds the first block whose availability differs from the first one
+static DWORD PartStream_BlockScan(
+    TBlockStream * pStream,                // Pointer to an open stream
+    DWORD BlockIndex,
+    DWORD BlockEnd,
+    bool * pbAvailable)
+{
+    PPART_FILE_MAP_ENTRY FileBitmap = (PPART_FILE_MAP_ENTRY)pStream->FileBitmap;
+    DWORD Flags;
+
+    // Sanity checks
+    assert(pStream->FileBitmap != NULL);
+    assert(BlockIndex < BlockEnd && BlockEnd <= pStream->BlockCount);
+
+    // Get the availability of the first block
+    Flags = FileBitmap[BlockIndex].Flags & 0x03;
+    pbAvailable[0] = (Flags != 0);
+
+    // Find the first block with different availability
+    if(Flags != 0)
+    {
+        while(++BlockIndex < BlockEnd && (FileBitmap[BlockIndex].Flags & 0x03) != 0);
+    }
+    else
+    {
+        while(++BlockIndex < BlockEnd && (FileBitmap[BlockIndex].Flags & 0x03) == 0);
+    }
+
+    return BlockIndex;
+}
+
+static void PartStream_BlockStore(
+    TBlockStream * pStream,
+    ULONGLONG StartOffset,
+    ULONGLONG EndOffset,
+    LPBYTE BlockBuffer)
+{
+    ULONGLONG ByteOffset;
+
+    // The loaded blocks are going to be stored to the end of the file
+    // Note that this operation is not required to succeed
+    if(pStream->BaseGetSize(pStream, &ByteOffset))
+    {
+        // Store the loaded blocks to the mirror file.
+        if(pStream->BaseWrite(pStream, &ByteOffset, BlockBuffer, (DWORD)(EndOffset - StartOffset)))
+        {
+            PartStream_UpdateBitmap(pStream, StartOffset, EndOffset, ByteOffset);
+        }
+    }
+}
+
 static bool PartStream_BlockRead(
     TBlockStream * pStream,
     ULONGLONG StartOffset,
@@ -1737,19 +2683,10 @@ static bool PartStream_BlockRead(
         // Note that we always have to read complete blocks
         // so they get properly stored to the mirror stream
         BytesToRead = (DWORD)(EndOffset - StartOffset);
-        if(!FileStream_Read(pStream->pMaster, &StartOffset, BlockBuffer, BytesToRead))
+        if(!BlockStream_ReadMaster(pStream, StartOffset, BlockBuffer, BytesToRead))
             return false;
 
-        // The loaded blocks are going to be stored to the end of the file
-        // Note that this operation is not required to succeed
-        if(pStream->BaseGetSize(pStream, &ByteOffset))
-        {
-            // Store the loaded blocks to the mirror file.
-            if(pStream->BaseWrite(pStream, &ByteOffset, BlockBuffer, BytesToRead))
-            {
-                PartStream_UpdateBitmap(pStream, StartOffset, EndOffset, ByteOffset);
-            }
-        }
+        PartStream_BlockStore(pStream, StartOffset, EndOffset, BlockBuffer);
     }
     else
     {
@@ -1943,7 +2880,9 @@ static TFileStream * PartStream_Open(LPCTSTR szFileName, DWORD dwStreamFlags)
 
     // Supply the block functions
     pStream->BlockCheck    = (BLOCK_CHECK)PartStream_BlockCheck;
+    pStream->BlockScan     = (BLOCK_SCAN)PartStream_BlockScan;
     pStream->BlockRead     = (BLOCK_READ)PartStream_BlockRead;
+    pStream->BlockStore    = (BLOCK_STORE)PartStream_BlockStore;
     return pStream;
 }
 
@@ -2236,7 +3175,7 @@ static TFileStream * MpqeStream_Open(LPCTSTR szFileName, DWORD dwStreamFlags)
         pStream->StreamRead    = (STREAM_READ)BlockStream_Read;
         pStream->StreamGetPos  = BlockStream_GetPos;
         pStream->StreamGetSize = BlockStream_GetSize;
-        pStream->StreamClose   = pStream->BaseClose;
+        pStream->StreamClose   = (STREAM_CLOSE)BlockStream_Close;
 
         // Supply the block functions
         pStream->BlockRead     = (BLOCK_READ)MpqeStream_BlockRead;
@@ -2256,6 +3195,84 @@ static TFileStream * MpqeStream_Open(LPCTSTR szFileName, DWORD dwStreamFlags)
 #define BLOCK4_HASH_SIZE    0x20            // Size of MD5 hash that is after each block
 #define BLOCK4_MAX_BLOCKS   0x00002000      // Maximum amount of blocks per file
 #define BLOCK4_MAX_FSIZE    0x08040000      // Max size of one file
+#define BLOCK4_MAX_RUN      (STREAM_MAX_VECTORS / 2)   // Maximum amount of blocks per one vectored read
+
+// Verifies the blocks against the text MD5s that follow them in the file.
+// The MD5s of all blocks are calculated at once, by the multi-buffer code if possible
+static bool Block4Stream_VerifyBlocks(LPBYTE BlockBuffer, DWORD cbBlocks, LPBYTE BlockHashes)
+{
+    BYTE md5_array[BLOCK4_MAX_RUN * MD5_DIGEST_SIZE];
+    char szMd5[MD5_DIGEST_SIZE * 2 + 1];
+    DWORD dwBlockCount = (cbBlocks + BLOCK4_BLOCK_SIZE - 1) / BLOCK4_BLOCK_SIZE;
+
+    assert(dwBlockCount <= BLOCK4_MAX_RUN);
+    CalculateDataBlockHashes(BlockBuffer, cbBlocks, BLOCK4_BLOCK_SIZE, md5_array);
+
+    for(DWORD i = 0; i < dwBlockCount; i++)
+    {
+        LPBYTE pbTextHash = BlockHashes + i * BLOCK4_HASH_SIZE;
+
+        SMemBinToStr(szMd5, _countof(szMd5), md5_array + i * MD5_DIGEST_SIZE, MD5_DIGEST_SIZE);
+        for(DWORD j = 0; j < BLOCK4_HASH_SIZE; j++)
+        {
+            if(tolower(pbTextHash[j]) != szMd5[j])
+            {
+                SErrSetLastError(ERROR_FILE_CORRUPT);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Reads a run of blocks from one segment file. The blocks and their hashes
+// are continuous in the file, so they are read at once and the hashes are
+// scattered to a separate array. If the base provider can't read to multiple
+// buffers, the blocks are read one by one and the hashes only when needed.
+// The hash of the last block is only read if the blocks are verified
+static bool Block4Stream_ReadRun(TBlockStream * pStream, ULONGLONG ByteOffset, LPBYTE BlockBuffer, DWORD cbBlocks, LPBYTE BlockHashes)
+{
+    TStreamVector Vectors[BLOCK4_MAX_RUN * 2];
+    DWORD dwVectorCount = 0;
+    DWORD cbBlock;
+    bool bVerify = (pStream->dwFlags & STREAM_FLAG_VERIFY_BLOCKS) ? true : false;
+
+    for(DWORD cbOffset = 0; cbOffset < cbBlocks; cbOffset += cbBlock)
+    {
+        cbBlock = STORMLIB_MIN(cbBlocks - cbOffset, BLOCK4_BLOCK_SIZE);
+
+        if(pStream->BaseReadV != NULL)
+        {
+            Vectors[dwVectorCount].pvBuffer = BlockBuffer + cbOffset;
+            Vectors[dwVectorCount++].cbBuffer = cbBlock;
+            if(bVerify || (cbOffset + cbBlock) < cbBlocks)
+            {
+                Vectors[dwVectorCount].pvBuffer = BlockHashes;
+                Vectors[dwVectorCount++].cbBuffer = BLOCK4_HASH_SIZE;
+            }
+        }
+        else
+        {
+            if(!pStream->BaseRead(pStream, &ByteOffset, BlockBuffer + cbOffset, cbBlock))
+                return false;
+            ByteOffset += cbBlock;
+
+            if(bVerify)
+            {
+                if(!pStream->BaseRead(pStream, &ByteOffset, BlockHashes, BLOCK4_HASH_SIZE))
+                    return false;
+            }
+            ByteOffset += BLOCK4_HASH_SIZE;
+        }
+
+        BlockHashes += BLOCK4_HASH_SIZE;
+    }
+
+    if(dwVectorCount != 0)
+        return pStream->BaseReadV(pStream, ByteOffset, Vectors, dwVectorCount);
+    return true;
+}
 
 static bool Block4Stream_BlockRead(
     TBlockStream * pStream,                // Pointer to an open stream
@@ -2266,11 +3283,14 @@ static bool Block4Stream_BlockRead(
     bool bAvailable)
 {
     TBaseProviderData * BaseArray = (TBaseProviderData *)pStream->FileBitmap;
+    BYTE BlockHashes[BLOCK4_MAX_RUN * BLOCK4_HASH_SIZE];
     ULONGLONG ByteOffset;
+    DWORD BaseIndex = 0xFFFFFFFF;           // Index of the segment file that is in pStream->Base
     DWORD BytesToRead;
     DWORD StreamIndex;
     DWORD BlockIndex;
-    bool bResult;
+    DWORD BlockCount;
+    bool bResult = true;
 
     // The starting offset must be aligned to size of the block
     assert(pStream->FileBitmap != NULL);
@@ -2280,39 +3300,61 @@ static bool Block4Stream_BlockRead(
 
     // Keep compilers happy
     STORMLIB_UNUSED(bAvailable);
-    STORMLIB_UNUSED(EndOffset);
 
-    while(BytesNeeded != 0)
+    // Verified blocks are read whole, up to the block boundary or the end of the stream,
+    // so that the hash of each block follows its data in the file. The block buffer
+    // is always big enough for whole blocks. Otherwise, only the needed bytes are read
+    if(pStream->dwFlags & STREAM_FLAG_VERIFY_BLOCKS)
+    {
+        EndOffset = (EndOffset + BLOCK4_BLOCK_SIZE - 1) & ~(ULONGLONG)(BLOCK4_BLOCK_SIZE - 1);
+        EndOffset = STORMLIB_MIN(EndOffset, pStream->StreamSize);
+    }
+    else
+    {
+        EndOffset = STORMLIB_MIN(EndOffset, StartOffset + BytesNeeded);
+    }
+
+    while(bResult && StartOffset < EndOffset)
     {
         // Calculate the block index and the file index
         StreamIndex = (DWORD)((StartOffset / pStream->BlockSize) / BLOCK4_MAX_BLOCKS);
         BlockIndex  = (DWORD)((StartOffset / pStream->BlockSize) % BLOCK4_MAX_BLOCKS);
-        if(StreamIndex > pStream->BitmapSize)
-            return false;
+        if(StreamIndex >= pStream->BitmapSize)
+        {
+            bResult = false;
+            break;
+        }
 
-        // Calculate the block offset
+        // Take the blocks up to the end of the segment file
+        BlockCount = STORMLIB_MIN(BLOCK4_MAX_BLOCKS - BlockIndex, BLOCK4_MAX_RUN);
+        BytesToRead = (DWORD)STORMLIB_MIN(EndOffset - StartOffset, (ULONGLONG)BlockCount * BLOCK4_BLOCK_SIZE);
         ByteOffset = ((ULONGLONG)BlockIndex * (BLOCK4_BLOCK_SIZE + BLOCK4_HASH_SIZE));
-        BytesToRead = STORMLIB_MIN(BytesNeeded, BLOCK4_BLOCK_SIZE);
 
-        // Read from the base stream
-        pStream->Base = BaseArray[StreamIndex];
-        bResult = pStream->BaseRead(pStream, &ByteOffset, BlockBuffer, BytesToRead);
-        BaseArray[StreamIndex] = pStream->Base;
+        // Switch the base stream only when the read moves to another segment file
+        if(StreamIndex != BaseIndex)
+        {
+            if(BaseIndex != 0xFFFFFFFF)
+                BaseArray[BaseIndex] = pStream->Base;
+            pStream->Base = BaseArray[StreamIndex];
+            BaseIndex = StreamIndex;
+        }
 
-        // Did the result succeed?
-        if(bResult == false)
-            return false;
+        // Read from the base stream and verify the blocks, if needed
+        bResult = Block4Stream_ReadRun(pStream, ByteOffset, BlockBuffer, BytesToRead, BlockHashes);
+        if(bResult && (pStream->dwFlags & STREAM_FLAG_VERIFY_BLOCKS))
+            bResult = Block4Stream_VerifyBlocks(BlockBuffer, BytesToRead, BlockHashes);
 
         // Move pointers
         StartOffset += BytesToRead;
         BlockBuffer += BytesToRead;
-        BytesNeeded -= BytesToRead;
     }
 
-    return true;
+    // Store the state of the last used base stream
+    if(BaseIndex != 0xFFFFFFFF)
+        BaseArray[BaseIndex] = pStream->Base;
+    return bResult;
 }
 
-
 static void Block4Stream_Close(TBlockStream * pStream)
 {
     TBaseProviderData * BaseArray = (TBaseProviderData *)pStream->FileBitmap;
@@ -2334,6 +3376,11 @@ static void Block4Stream_Close(TBlockStream * pStream)
         STORM_FREE(pStream->FileBitmap);
     pStream->FileBitmap = NULL;
 
+    // Free the transfer buffer
+    if(pStream->TransferBuffer != NULL)
+        STORM_FREE(pStream->TransferBuffer);
+    pStream->TransferBuffer = NULL;
+
     // Do not call the BaseClose function,
     // we closed all handles already
     return;
@@ -2504,6 +3551,7 @@ TFileStream * FileStream_CreateFile(
         }
 
         // File create failed, delete the stream
+        StormLock_Free(&pStream->Lock);
         STORM_FREE(pStream);
         pStream = NULL;
     }
@@ -2607,6 +3655,7 @@ TFileStream * FileStream_OpenFileArchive(HANDLE hParentMpq, LPCSTR szFileName)
         }
 
         // Free the memory structure
+        StormLock_Free(&pStream->Lock);
         STORM_FREE(pStream);
         pStream = NULL;
     }
@@ -2772,8 +3821,11 @@ bool FileStream_GetBitmap(TFileStream * pStream, void * pvBitmap, DWORD cbBitmap
         pcbLengthNeeded[0] = sizeof(TStreamBitmap) + BitmapSize;
 
     // If the length of the buffer is not enough
+    // The prefetch worker may be updating the bitmap meanwhile
     if(pvBitmap != NULL && cbBitmap != 0)
     {
+        StormLock_Enter(&pStream->Lock);
+
         // Give the STREAM_BLOCK_MAP structure
         if(cbBitmap >= sizeof(TStreamBitmap))
         {
@@ -2814,6 +3866,8 @@ bool FileStream_GetBitmap(TFileStream * pStream, void * pvBitmap, DWORD cbBitmap
                 memset(Bitmap, 0xFF, BitmapSize);
             }
         }
+
+        StormLock_Leave(&pStream->Lock);
     }
 
     // Set last error value and return
@@ -2822,6 +3876,246 @@ bool FileStream_GetBitmap(TFileStream * pStream, void * pvBitmap, DWORD cbBitmap
     return bResult;
 }
 
+/**
+ * This function gives the statistics of the block map (number of available blocks
+ * and bytes, runs of missing blocks) without copying the block map.
+ * The block map is scanned by runs of blocks with the same availability.
+ *
+ * \a pStream Pointer to an open stream
+ * \a pStats Pointer to structure that receives the statistics
+ */
+
+bool FileStream_GetBlockStats(TFileStream * pStream, TStreamBlockStats * pStats)
+{
+    TBlockStream * pBlockStream = (TBlockStream *)pStream;
+    ULONGLONG RunStart;
+    ULONGLONG RunEnd;
+    DWORD BlockIndex = 0;
+    DWORD BlockEnd;
+    bool bAvailable;
+
+    if(pStats == NULL)
+    {
+        SErrSetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Streams without block map are always complete
+    // The prefetch worker may be updating the block map meanwhile
+    StormLock_Enter(&pStream->Lock);
+    memset(pStats, 0, sizeof(TStreamBlockStats));
+    pStats->StreamSize = pStream->StreamSize;
+    if(pStream->BlockScan != NULL)
+    {
+        pStats->BlockCount = pBlockStream->BlockCount;
+        pStats->BlockSize  = pBlockStream->BlockSize;
+        pStats->IsComplete = pBlockStream->IsComplete;
+    }
+    else
+    {
+        pStats->BlockCount = (DWORD)((pStream->StreamSize + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE);
+        pStats->BlockSize  = DEFAULT_BLOCK_SIZE;
+        pStats->IsComplete = 1;
+    }
+
+    // Complete streams have all blocks available
+    pStats->FirstMissingBlock = pStats->BlockCount;
+    if(pStats->IsComplete)
+    {
+        pStats->BlocksAvailable = pStats->BlockCount;
+        pStats->BytesAvailable = pStream->StreamSize;
+        StormLock_Leave(&pStream->Lock);
+        return true;
+    }
+
+    // Go through all runs of blocks
+    BlockEnd = (DWORD)((pStream->StreamSize + pStats->BlockSize - 1) / pStats->BlockSize);
+    while(BlockIndex < BlockEnd)
+    {
+        DWORD RunEndIndex = pStream->BlockScan(pStream, BlockIndex, BlockEnd, &bAvailable);
+
+        if(bAvailable)
+        {
+            RunStart = (ULONGLONG)BlockIndex * pStats->BlockSize;
+            RunEnd = STORMLIB_MIN((ULONGLONG)RunEndIndex * pStats->BlockSize, pStream->StreamSize);
+            pStats->BlocksAvailable += (RunEndIndex - BlockIndex);
+            pStats->BytesAvailable += (RunEnd - RunStart);
+        }
+        else
+        {
+            if(pStats->MissingRuns == 0)
+                pStats->FirstMissingBlock = BlockIndex;
+            pStats->MissingRuns++;
+        }
+
+        BlockIndex = RunEndIndex;
+    }
+
+    StormLock_Leave(&pStream->Lock);
+    return true;
+}
+
+/**
+ * Queues a range of a mirror stream to be loaded from the master stream by a background
+ * thread. The queued ranges are loaded in the order they have been queued; when a read
+ * has to load missing blocks itself, the area after them is loaded before the queued ranges.
+ * The progress can be watched by FileStream_GetBitmap or FileStream_GetBlockStats.
+ *
+ * \a pStream Pointer to an open mirror stream (flat or partial, with a master stream)
+ * \a ByteOffset Offset of the range
+ * \a Length Length of the range, in bytes
+ */
+bool FileStream_Prefetch(TFileStream * pStream, ULONGLONG ByteOffset, ULONGLONG Length)
+{
+    TStreamPrefetch * pPrefetch;
+    TPrefetchRange * pRange;
+    TBlockStream * pBlockStream = (TBlockStream *)pStream;
+    ULONGLONG EndOffset;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Only mirror streams can be prefetched
+    if(pStream->BlockStore == NULL || pStream->pMaster == NULL)
+    {
+        SErrSetLastError(ERROR_NOT_SUPPORTED);
+        return false;
+    }
+
+    // Cut the range at the end of the stream
+    if(ByteOffset >= pStream->StreamSize || Length == 0)
+        return true;
+    EndOffset = (Length < (pStream->StreamSize - ByteOffset)) ? (ByteOffset + Length) : pStream->StreamSize;
+
+    StormLock_Enter(&pStream->Lock);
+
+    // Allocate the prefetch state on the first use
+    if((pPrefetch = pBlockStream->pPrefetch) == NULL)
+    {
+        if((pPrefetch = STORM_ALLOC(TStreamPrefetch, 1)) != NULL)
+        {
+            memset(pPrefetch, 0, sizeof(TStreamPrefetch));
+            StormCond_Init(&pPrefetch->Cond);
+            pBlockStream->pPrefetch = pPrefetch;
+        }
+        else
+        {
+            dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+        }
+    }
+
+    // Extend the last queued range or append a new one
+    if(dwErrCode == ERROR_SUCCESS && pBlockStream->IsComplete == 0)
+    {
+        pRange = (pPrefetch->RangeCount > pPrefetch->RangeIndex) ? (pPrefetch->Ranges + pPrefetch->RangeCount - 1) : NULL;
+        if(pRange != NULL && pRange->StartOffset <= ByteOffset && ByteOffset <= pRange->EndOffset)
+        {
+            pRange->EndOffset = STORMLIB_MAX(pRange->EndOffset, EndOffset);
+        }
+        else
+        {
+            if(pPrefetch->RangeCount >= pPrefetch->RangeMax)
+            {
+                DWORD RangeMax = STORMLIB_MAX(pPrefetch->RangeMax * 2, 0x40);
+
+                if((pRange = STORM_REALLOC(TPrefetchRange, pPrefetch->Ranges, RangeMax)) != NULL)
+                {
+                    pPrefetch->Ranges = pRange;
+                    pPrefetch->RangeMax = RangeMax;
+                }
+                else
+                {
+                    dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+                }
+            }
+
+            if(dwErrCode == ERROR_SUCCESS)
+            {
+                pRange = pPrefetch->Ranges + pPrefetch->RangeCount++;
+                pRange->StartOffset = ByteOffset;
+                pRange->EndOffset = EndOffset;
+            }
+        }
+
+        // Start the worker, if not running. The previous worker has already
+        // left the stream lock for the last time, so it can be waited for here
+        if(dwErrCode == ERROR_SUCCESS && pPrefetch->bRunning == false)
+        {
+            if(pPrefetch->bThreadValid)
+                StormThread_Wait(pPrefetch->Thread);
+            pPrefetch->bThreadValid = false;
+            pPrefetch->bCancel = false;
+            pPrefetch->dwErrCode = ERROR_SUCCESS;
+            pPrefetch->bRunning = true;
+
+            if(StormThread_Create(&pPrefetch->Thread, BlockStream_PrefetchWorker, pStream))
+            {
+                pPrefetch->bThreadValid = true;
+            }
+            else
+            {
+                pPrefetch->RangeIndex = pPrefetch->RangeCount = 0;
+                pPrefetch->bRunning = false;
+                dwErrCode = ERROR_NOT_SUPPORTED;
+            }
+        }
+    }
+
+    StormLock_Leave(&pStream->Lock);
+
+    if(dwErrCode != ERROR_SUCCESS)
+        SErrSetLastError(dwErrCode);
+    return (dwErrCode == ERROR_SUCCESS);
+}
+
+/**
+ * Waits until the background prefetch of the stream loads all queued ranges.
+ * Returns false if the blocks could not be loaded or the prefetch has been cancelled.
+ *
+ * \a pStream Pointer to an open mirror stream
+ */
+bool FileStream_WaitPrefetch(TFileStream * pStream)
+{
+    TStreamPrefetch * pPrefetch;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    if(pStream->BlockStore == NULL || pStream->pMaster == NULL)
+    {
+        SErrSetLastError(ERROR_NOT_SUPPORTED);
+        return false;
+    }
+
+    StormLock_Enter(&pStream->Lock);
+    if((pPrefetch = ((TBlockStream *)pStream)->pPrefetch) != NULL)
+    {
+        while(pPrefetch->bRunning)
+            StormCond_Wait(&pPrefetch->Cond, &pStream->Lock);
+        dwErrCode = pPrefetch->dwErrCode;
+    }
+    StormLock_Leave(&pStream->Lock);
+
+    if(dwErrCode != ERROR_SUCCESS)
+        SErrSetLastError(dwErrCode);
+    return (dwErrCode == ERROR_SUCCESS);
+}
+
+/**
+ * Cancels the background prefetch of the stream. The function returns after the worker
+ * thread has stored the blocks that it was loading. The blocks that have been loaded
+ * so far stay in the mirror.
+ *
+ * \a pStream Pointer to an open mirror stream
+ */
+bool FileStream_CancelPrefetch(TFileStream * pStream)
+{
+    if(pStream->BlockStore == NULL)
+    {
+        SErrSetLastError(ERROR_NOT_SUPPORTED);
+        return false;
+    }
+
+    BlockStream_CancelPrefetch((TBlockStream *)pStream);
+    return true;
+}
+
 /**
  * Reads data from the stream
  *
@@ -2937,6 +4231,225 @@ bool FileStream_GetFlags(TFileStream * pStream, LPDWORD pdwStreamFlags)
     return true;
 }
 
+/**
+ * Changes the access hint of the stream. The hint tells the operating system
+ * whether the file will be read sequentially (STREAM_FLAG_SEQUENTIAL),
+ * at random offsets (STREAM_FLAG_RANDOM_ACCESS) or neither (zero).
+ * On Windows, the hint is only used when the file is open.
+ *
+ * \a pStream Pointer to an open stream
+ * \a dwAccessHint New access hint
+ */
+bool FileStream_SetAccessHint(TFileStream * pStream, DWORD dwAccessHint)
+{
+    // Only one of the hints can be given
+    if((dwAccessHint & ~STREAM_ACCESS_HINT_MASK) || dwAccessHint == STREAM_ACCESS_HINT_MASK)
+    {
+        SErrSetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Remember the hint, so it's also used when the file is reopen
+    pStream->dwFlags = (pStream->dwFlags & ~STREAM_ACCESS_HINT_MASK) | dwAccessHint;
+
+    // Apply the hint to the local file (if any)
+    if(pStream->BaseRead == BaseFile_Read)
+        BaseFile_SetAccessHint(pStream, pStream->dwFlags);
+    return true;
+}
+
+/**
+ * Sets the minimum size of the range requests sent to an HTTP server.
+ * Data received beyond the requested range are kept and used by the next reads.
+ * The setting is applied to the stream and to all its HTTP master streams.
+ * Only supported on Linux and macOS; other platforms return ERROR_NOT_SUPPORTED.
+ *
+ * \a pStream Pointer to an open stream
+ * \a cbReadAhead Minimum size of a range request. Zero turns the read-ahead off
+ */
+bool FileStream_SetReadAhead(TFileStream * pStream, DWORD cbReadAhead)
+{
+#ifdef STORMLIB_HTTP_SOCKETS
+    bool bResult = false;
+
+    for(; pStream != NULL; pStream = pStream->pMaster)
+    {
+        if(pStream->BaseRead == BaseHttp_Read)
+        {
+            // Drop the data read ahead, the buffer is reallocated with the new size
+            StormLock_Enter(&pStream->Lock);
+            if(pStream->Base.Http.pbCache != NULL)
+                STORM_FREE(pStream->Base.Http.pbCache);
+            pStream->Base.Http.pbCache = NULL;
+            pStream->Base.Http.cbCache = 0;
+            pStream->Base.Http.cbReadAhead = cbReadAhead;
+            StormLock_Leave(&pStream->Lock);
+            bResult = true;
+        }
+    }
+
+    if(bResult == false)
+        SErrSetLastError(ERROR_NOT_SUPPORTED);
+    return bResult;
+#else
+    STORMLIB_UNUSED(pStream);
+    STORMLIB_UNUSED(cbReadAhead);
+    SErrSetLastError(ERROR_NOT_SUPPORTED);
+    return false;
+#endif
+}
+
+/**
+ * Reserves the disk space for a local file that is about to be written,
+ * so the file system can allocate it in one piece. The file size doesn't change.
+ * Only supported on Linux; other platforms return ERROR_NOT_SUPPORTED.
+ *
+ * \a pStream Pointer to an open stream
+ * \a FileSize Expected size of the file
+ */
+bool FileStream_Preallocate(TFileStream * pStream, ULONGLONG FileSize)
+{
+    // Only local files can be preallocated
+    if(pStream->BaseWrite != BaseFile_Write || (pStream->dwFlags & STREAM_FLAG_READ_ONLY))
+    {
+        SErrSetLastError(ERROR_NOT_SUPPORTED);
+        return false;
+    }
+
+#if defined(STORMLIB_LINUX) && defined(FALLOC_FL_KEEP_SIZE)
+    if(FileSize != 0 && fallocate((intptr_t)pStream->Base.File.hFile, FALLOC_FL_KEEP_SIZE, 0, (off64_t)FileSize) == -1)
+    {
+        SErrSetLastError(errno);
+        return false;
+    }
+    return true;
+#else
+    STORMLIB_UNUSED(FileSize);
+    SErrSetLastError(ERROR_NOT_SUPPORTED);
+    return false;
+#endif
+}
+
+/**
+ * Copies data from one stream to another without passing them through user space.
+ * Both streams must be local files; the source and target may be the same file
+ * if the ranges don't overlap. Only supported on Linux. If the copy is not supported,
+ * the function fails with ERROR_NOT_SUPPORTED without copying anything,
+ * and the caller has to read and write the data itself.
+ *
+ * \a pStream Pointer to the target stream
+ * \a pByteOffset Pointer to target byte offset. If NULL, writes to current position
+ * \a pSrcStream Pointer to the source stream
+ * \a SrcByteOffset Offset of the data in the source stream
+ * \a dwBytesToCopy Number of bytes to copy
+ */
+bool FileStream_Copy(TFileStream * pStream, ULONGLONG * pByteOffset, TFileStream * pSrcStream, ULONGLONG SrcByteOffset, DWORD dwBytesToCopy)
+{
+    // Both streams must be local files that are read and written directly
+    if(pSrcStream->StreamRead != BaseFile_Read || pStream->StreamWrite != BaseFile_Write || (pStream->dwFlags & STREAM_FLAG_READ_ONLY))
+    {
+        SErrSetLastError(ERROR_NOT_SUPPORTED);
+        return false;
+    }
+
+#if defined(STORMLIB_HAS_COPY_FILE_RANGE) || defined(STORMLIB_HAS_SENDFILE)
+    {
+        ULONGLONG ByteOffset = (pByteOffset != NULL) ? *pByteOffset : pStream->Base.File.FilePos;
+        off64_t src_pos = (off64_t)SrcByteOffset;
+        off64_t trg_pos = (off64_t)ByteOffset;
+        int src_fd = (int)(intptr_t)pSrcStream->Base.File.hFile;
+        int trg_fd = (int)(intptr_t)pStream->Base.File.hFile;
+        DWORD dwBytesCopied = 0;
+        bool bUseSendFile = false;
+
+        while(dwBytesCopied < dwBytesToCopy)
+        {
+            size_t nBytesToCopy = (size_t)(dwBytesToCopy - dwBytesCopied);
+            ssize_t nBytesCopied = -1;
+
+#ifdef STORMLIB_HAS_COPY_FILE_RANGE
+            // Both positions are given explicitly and advanced by the kernel.
+            // If the file system can't do that, try sendfile
+            if(bUseSendFile == false)
+            {
+                nBytesCopied = copy_file_range(src_fd, &src_pos, trg_fd, &trg_pos, nBytesToCopy, 0);
+                if(nBytesCopied == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+                {
+                    bUseSendFile = true;
+                    continue;
+                }
+            }
+#else
+            bUseSendFile = true;
+#endif
+
+#ifdef STORMLIB_HAS_SENDFILE
+            // The sendfile function writes to the current position of the target file
+            if(bUseSendFile)
+            {
+                if(lseek64(trg_fd, trg_pos, SEEK_SET) != -1)
+                    nBytesCopied = sendfile64(trg_fd, src_fd, &src_pos, nBytesToCopy);
+                if(nBytesCopied == -1 && (errno == EINVAL || errno == ENOSYS) && dwBytesCopied == 0)
+                {
+                    SErrSetLastError(ERROR_NOT_SUPPORTED);
+                    return false;
+                }
+                if(nBytesCopied > 0)
+                    trg_pos += nBytesCopied;
+            }
+#endif
+
+            // Stop on error or at the end of the source file
+            if(nBytesCopied == -1)
+            {
+                SErrSetLastError(errno);
+                return false;
+            }
+            if(nBytesCopied == 0)
+                break;
+            dwBytesCopied += (DWORD)nBytesCopied;
+        }
+
+        // Update the file position and size, like BaseFile_Write does
+        pStream->Base.File.FilePos = ByteOffset + dwBytesCopied;
+        if(pStream->Base.File.FilePos > pStream->Base.File.FileSize)
+            pStream->Base.File.FileSize = pStream->Base.File.FilePos;
+
+        if(dwBytesCopied != dwBytesToCopy)
+            SErrSetLastError(ERROR_HANDLE_EOF);
+        return (dwBytesCopied == dwBytesToCopy);
+    }
+#else
+    STORMLIB_UNUSED(pByteOffset);
+    STORMLIB_UNUSED(SrcByteOffset);
+    STORMLIB_UNUSED(dwBytesToCopy);
+    SErrSetLastError(ERROR_NOT_SUPPORTED);
+    return false;
+#endif
+}
+
+/**
+ * Returns a pointer to the data of the stream, if the stream is a flat,
+ * memory-mapped file. Returns NULL for any other stream type, or if the range
+ * is not within the file. The pointer is valid until the stream is closed.
+ *
+ * \a pStream Pointer to an open stream
+ * \a ByteOffset Offset of the data in the stream
+ * \a dwBytesToRead Length of the data
+ */
+const void * FileStream_GetMappedData(TFileStream * pStream, ULONGLONG ByteOffset, DWORD dwBytesToRead)
+{
+    // The stream must be read directly from the mapped view
+    if(pStream->StreamRead != BaseMap_Read || pStream->Base.Map.pbFile == NULL)
+        return NULL;
+
+    // Check the range
+    if(ByteOffset > pStream->Base.Map.FileSize || dwBytesToRead > (pStream->Base.Map.FileSize - ByteOffset))
+        return NULL;
+
+    return pStream->Base.Map.pbFile + (size_t)ByteOffset;
+}
+
 /**
  * Switches a stream with another. Used for final phase of archive compacting.
  * Performs these steps:
@@ -2972,7 +4485,9 @@ bool FileStream_Replace(TFileStream * pStream, TFileStream * pNewStream)
     if(!BaseFile_Replace(pStream, pNewStream))
         return false;
 
-    // Now open the base file again
+    // Now open the base file again. Drop the access hint of the old file,
+    // because on Windows it would stick to the new handle until it is closed
+    pStream->dwFlags &= ~STREAM_ACCESS_HINT_MASK;
     if(!BaseFile_Open(pStream, pStream->szFileName, pStream->dwFlags))
         return false;
 
@@ -2994,6 +4509,10 @@ void FileStream_Close(TFileStream * pStream)
     // Check if the stream structure is allocated at all
     if(pStream != NULL)
     {
+        // Stop the prefetch, it uses the master stream
+        if(pStream->BlockStore != NULL)
+            BlockStream_FreePrefetch((TBlockStream *)pStream);
+
         // Free the master stream, if any
         if(pStream->pMaster != NULL)
             FileStream_Close(pStream->pMaster);
@@ -3008,6 +4527,7 @@ void FileStream_Close(TFileStream * pStream)
             pStream->BaseClose(pStream);
 
         // Free the stream itself
+        StormLock_Free(&pStream->Lock);
         STORM_FREE(pStream);
     }
 }
@@ -35,6 +35,13 @@ typedef bool (*STREAM_READ)(
     DWORD dwBytesToRead                 // Number of bytes to read from the file
     );
 
+typedef bool (*STREAM_READV)(
+    struct TFileStream * pStream,       // Pointer to an open stream
+    ULONGLONG ByteOffset,               // File byte offset of the first buffer
+    struct TStreamVector * Vectors,     // Buffers to be filled with continuous data, in order
+    DWORD dwVectorCount                 // Number of buffers, at most STREAM_MAX_VECTORS
+    );
+
 typedef bool (*STREAM_WRITE)(
     struct TFileStream * pStream,       // Pointer to an open stream
     ULONGLONG * pByteOffset,            // Pointer to file byte offset. If NULL, it writes to the current position
@@ -75,6 +82,20 @@ typedef bool (*BLOCK_CHECK)(
     ULONGLONG BlockOffset               // Offset of the file to check
     );
 
+typedef DWORD (*BLOCK_SCAN)(
+    struct TFileStream * pStream,       // Pointer to a block-oriented stream
+    DWORD BlockIndex,                   // Index of the first block of the run
+    DWORD BlockEnd,                     // Index of the block where the scan stops
+    bool * pbAvailable                  // Receives availability of the first block
+    );
+
+typedef void (*BLOCK_STORE)(
+    struct TFileStream * pStream,       // Pointer to a block-oriented stream
+    ULONGLONG StartOffset,              // Byte offset of start of the block array
+    ULONGLONG EndOffset,                // End offset (either end of the block or end of the file)
+    LPBYTE BlockBuffer                  // Blocks loaded from the master stream
+    );
+
 typedef void (*BLOCK_SAVEMAP)(
     struct TFileStream * pStream        // Pointer to a block-oriented stream
     );
@@ -84,8 +105,21 @@ typedef void (*BLOCK_SAVEMAP)(
 
 #define ID_FILE_BITMAP_FOOTER   0x33767470  // Signature of the file bitmap footer ('ptv3')
 #define DEFAULT_BLOCK_SIZE      0x00004000  // Default size of the stream block
+#define MAX_TRANSFER_SIZE       0x00040000  // Bigger reads are split to pieces, see BlockStream_Read
 #define DEFAULT_BUILD_NUMBER         10958  // Build number for newly created partial MPQs
 
+//-----------------------------------------------------------------------------
+// HTTP base provider. Windows uses WinInet, Linux and macOS use plain sockets
+
+#if defined(STORMLIB_LINUX) || (defined(STORMLIB_MAC) && defined(__APPLE__))
+#define STORMLIB_HTTP_SOCKETS
+#endif
+
+#define HTTP_DEFAULT_PORT       "80"        // Port used if the URL doesn't contain one
+#define HTTP_DEFAULT_READ_AHEAD 0x00010000  // Minimum size of a range request, see FileStream_SetReadAhead
+#define HTTP_MAX_HEADER_SIZE    0x00001000  // Maximum size of the HTTP response header
+#define HTTP_TIMEOUT_SECONDS    30          // Send/receive timeout of the HTTP connection
+
 typedef struct _PART_FILE_HEADER
 {
     DWORD PartialVersion;                   // Always set to 2
@@ -153,11 +187,28 @@ union TBaseProviderData
         ULONGLONG FileSize;                 // Size of the file
         ULONGLONG FilePos;                  // Current file position
         ULONGLONG FileTime;                 // Last write time
+#ifdef STORMLIB_HTTP_SOCKETS
+        int hSocket;                        // Keep-alive connection to the server (-1 if not connected)
+        LPBYTE pbCache;                     // Read-ahead data received beyond the last read
+        ULONGLONG CacheOffset;              // File offset of the read-ahead data
+        DWORD cbCache;                      // Number of valid bytes in the read-ahead buffer
+        DWORD cbReadAhead;                  // Minimum size of a range request
+#else
         HANDLE hInternet;                   // Internet handle
         HANDLE hConnect;                    // Connection to the internet server
+#endif
     } Http;
 };
 
+// Buffers for vectored reads from the base provider
+#define STREAM_MAX_VECTORS      0x00000080  // Maximum number of buffers for one vectored read
+
+struct TStreamVector
+{
+    void * pvBuffer;                        // Pointer to the buffer
+    DWORD cbBuffer;                         // Length of the buffer, in bytes
+};
+
 struct TFileStream
 {
     // Stream provider functions
@@ -171,11 +222,14 @@ struct TFileStream
     // Block-oriented functions
     BLOCK_READ     BlockRead;               // Pointer to function reading one or more blocks
     BLOCK_CHECK    BlockCheck;              // Pointer to function checking whether the block is present
+    BLOCK_SCAN     BlockScan;               // Pointer to function finding the first block with different availability
+    BLOCK_STORE    BlockStore;              // Pointer to function storing blocks loaded from the master to the mirror
 
     // Base provider functions
     STREAM_CREATE  BaseCreate;              // Pointer to base create function
     STREAM_OPEN    BaseOpen;                // Pointer to base open function
     STREAM_READ    BaseRead;                // Read from the stream
+    STREAM_READV   BaseReadV;               // Read from the stream to multiple buffers (NULL if not supported)
     STREAM_WRITE   BaseWrite;               // Write to the stream
     STREAM_RESIZE  BaseResize;              // Pointer to function changing file size
     STREAM_GETSIZE BaseGetSize;             // Pointer to function returning file size
@@ -191,12 +245,40 @@ struct TFileStream
 
     ULONGLONG StreamSize;                   // Stream size (can be less than file size)
     ULONGLONG StreamPos;                    // Stream position
+    STORM_LOCK Lock;                        // Serializes reads on providers that keep a shared state
     DWORD BuildNumber;                      // Game build number
     DWORD dwFlags;                          // Stream flags
 
     // Followed by stream provider data, with variable length
 };
 
+//-----------------------------------------------------------------------------
+// Structures for background prefetching of mirror streams
+
+#define PREFETCH_CHUNK_SIZE     0x00040000  // Maximum amount of data loaded from the master at once
+#define PREFETCH_DEMAND_SIZE    0x00100000  // Size of the area after a demand miss that is loaded first
+
+struct TPrefetchRange
+{
+    ULONGLONG StartOffset;                  // Next offset to be loaded
+    ULONGLONG EndOffset;                    // End of the range
+};
+
+struct TStreamPrefetch
+{
+    TPrefetchRange * Ranges;                // Queue of ranges to be loaded, in order of priority
+    TPrefetchRange Demand;                  // Area after the last demand miss. Loaded before the queued ranges
+    DWORD RangeIndex;                       // Index of the range being loaded
+    DWORD RangeCount;                       // Number of ranges in the queue
+    DWORD RangeMax;                         // Capacity of the queue
+    DWORD dwErrCode;                        // Result of the prefetch
+    STORM_THREAD Thread;                    // The worker thread
+    STORM_COND Cond;                        // Signaled when the worker ends. Used with the stream lock
+    bool bThreadValid;                      // If true, the worker thread must be waited for
+    bool bRunning;                          // If true, the worker loads the queued ranges
+    bool bCancel;                           // If true, the worker stops as soon as possible
+};
+
 //-----------------------------------------------------------------------------
 // Structures for block-oriented stream
 
@@ -210,6 +292,9 @@ struct TBlockStream : public TFileStream
     DWORD BlockCount;                       // Number of data blocks in the file
     DWORD IsComplete;                       // If nonzero, no blocks are missing
     DWORD IsModified;                       // nonzero if the bitmap has been modified
+    LPBYTE TransferBuffer;                  // Buffer for reading partial blocks. Reused by all reads
+    DWORD TransferSize;                     // Size of the transfer buffer, in bytes
+    TStreamPrefetch * pPrefetch;            // Background prefetch of a mirror stream. Guarded by the stream lock
 };
 
 //-----------------------------------------------------------------------------
@@ -207,7 +207,6 @@ void StringCat(TCHAR * szTarget, size_t cchTargetMax, const char * szSource)
 // Storm hashing functions
 
 #define STORM_BUFFER_SIZE       0x500
-#define HASH_INDEX_MASK(ha) (ha->pHeader->dwHashTableSize ? (ha->pHeader->dwHashTableSize - 1) : 0)
 
 static DWORD StormBuffer[STORM_BUFFER_SIZE];    // Buffer for the decryption engine
 static bool  bMpqCryptographyInitialized = false;
@@ -327,6 +326,86 @@ DWORD HashStringLower(const char * szFileName, DWORD dwHashType)
     return dwSeed1;
 }
 
+// Calculates MPQ_HASH_TABLE_INDEX, MPQ_HASH_NAME_A and MPQ_HASH_NAME_B
+// (and optionally the Jenkins hash for HET table) in one pass over the name.
+// Each character is normalized only once and then fed into all hashes.
+static void HashStringFused(const char * szFileName, const unsigned char * NormTable, TFileNameHash & NameHash, bool bJenkinsHash)
+{
+    LPBYTE pbKey   = (BYTE *)szFileName;
+    DWORD  dwSeed1A = 0x7FED7FED, dwSeed2A = 0xEEEEEEEE;
+    DWORD  dwSeed1B = 0x7FED7FED, dwSeed2B = 0xEEEEEEEE;
+    DWORD  dwSeed1C = 0x7FED7FED, dwSeed2C = 0xEEEEEEEE;
+    DWORD  ch;
+
+    if(bJenkinsHash)
+    {
+        char szNameBuff[0x108];
+        char * szNamePtr = szNameBuff;
+        char * szNameEnd = szNamePtr + sizeof(szNameBuff);
+        unsigned int primary_hash = 1;
+        unsigned int secondary_hash = 2;
+
+        while(*pbKey != 0)
+        {
+            // The Jenkins hash uses lowercase name. Same as in HashStringJenkins,
+            // only the first 0x108 characters are taken into account
+            if(szNamePtr < szNameEnd)
+                *szNamePtr++ = (char)AsciiToLowerTable[*pbKey];
+            ch = NormTable[*pbKey++];
+
+            dwSeed1A = StormBuffer[MPQ_HASH_TABLE_INDEX + ch] ^ (dwSeed1A + dwSeed2A);
+            dwSeed2A = ch + dwSeed1A + dwSeed2A + (dwSeed2A << 5) + 3;
+            dwSeed1B = StormBuffer[MPQ_HASH_NAME_A + ch] ^ (dwSeed1B + dwSeed2B);
+            dwSeed2B = ch + dwSeed1B + dwSeed2B + (dwSeed2B << 5) + 3;
+            dwSeed1C = StormBuffer[MPQ_HASH_NAME_B + ch] ^ (dwSeed1C + dwSeed2C);
+            dwSeed2C = ch + dwSeed1C + dwSeed2C + (dwSeed2C << 5) + 3;
+        }
+
+        hashlittle2(szNameBuff, szNamePtr - szNameBuff, &secondary_hash, &primary_hash);
+        NameHash.JenkinsHash = ((ULONGLONG)primary_hash << 0x20) | (ULONGLONG)secondary_hash;
+    }
+    else
+    {
+        while(*pbKey != 0)
+        {
+            ch = NormTable[*pbKey++];
+
+            dwSeed1A = StormBuffer[MPQ_HASH_TABLE_INDEX + ch] ^ (dwSeed1A + dwSeed2A);
+            dwSeed2A = ch + dwSeed1A + dwSeed2A + (dwSeed2A << 5) + 3;
+            dwSeed1B = StormBuffer[MPQ_HASH_NAME_A + ch] ^ (dwSeed1B + dwSeed2B);
+            dwSeed2B = ch + dwSeed1B + dwSeed2B + (dwSeed2B << 5) + 3;
+            dwSeed1C = StormBuffer[MPQ_HASH_NAME_B + ch] ^ (dwSeed1C + dwSeed2C);
+            dwSeed2C = ch + dwSeed1C + dwSeed2C + (dwSeed2C << 5) + 3;
+        }
+
+        NameHash.JenkinsHash = 0;
+    }
+
+    NameHash.dwHashIndex  = dwSeed1A;
+    NameHash.dwHashCheck1 = dwSeed1B;
+    NameHash.dwHashCheck2 = dwSeed1C;
+}
+
+// Calculates all name hashes that are needed to find the file in the archive.
+// Uses the same name normalization as the archive's pfnHashString
+void HashFileName(TMPQArchive * ha, const char * szFileName, TFileNameHash & NameHash, bool bJenkinsHash)
+{
+    if(ha->pfnHashString == HashString)
+        HashStringFused(szFileName, AsciiToUpperTable, NameHash, bJenkinsHash);
+    else if(ha->pfnHashString == HashStringSlash)
+        HashStringFused(szFileName, AsciiToUpperTable_Slash, NameHash, bJenkinsHash);
+    else if(ha->pfnHashString == HashStringLower)
+        HashStringFused(szFileName, AsciiToLowerTable, NameHash, bJenkinsHash);
+    else
+    {
+        // Unknown hashing function - fall back to separate passes
+        NameHash.dwHashIndex  = ha->pfnHashString(szFileName, MPQ_HASH_TABLE_INDEX);
+        NameHash.dwHashCheck1 = ha->pfnHashString(szFileName, MPQ_HASH_NAME_A);
+        NameHash.dwHashCheck2 = ha->pfnHashString(szFileName, MPQ_HASH_NAME_B);
+        NameHash.JenkinsHash  = bJenkinsHash ? HashStringJenkins(szFileName) : 0;
+    }
+}
+
 //-----------------------------------------------------------------------------
 // Calculates the hash table size for a given amount of files
 
@@ -408,123 +487,238 @@ DWORD GetDefaultSpecialFileFlags(DWORD dwFileSize, USHORT wFormatVersion)
 
 //-----------------------------------------------------------------------------
 // Encrypting/Decrypting MPQ data block
+//
+// Each DWORD is processed as:
+//
+//   dwKey2 += StormBuffer[MPQ_HASH_KEY2_MIX + (dwKey1 & 0xFF)];
+//   Data[i] ^= (dwKey1 + dwKey2);
+//   dwKey1 = ((~dwKey1 << 0x15) + 0x11111111) | (dwKey1 >> 0x0B);
+//   dwKey2 = Plain[i] + dwKey2 + (dwKey2 << 5) + 3;
+//
+// The sequence of dwKey1 does not depend on the data. For any initial value,
+// it becomes periodic with the period of 6 after the first 5 steps
+// (verified exhaustively for all 2^32 keys). This means that there are only
+// 11 distinct values of dwKey1 (and of the StormBuffer lookup) per block,
+// which we calculate in advance, so that the loop only does the dwKey2 chain.
+//
+// With the schedule precomputed, encryption can go further: dwKey2 only
+// depends on the plain text, which is known in advance, so the chain
+// is a linear recurrence (dwKey2 * 33 + known value) and can be evaluated
+// by a parallel prefix scan in SIMD registers. Decryption can't do that,
+// because dwKey2 depends on the decrypted value of the previous DWORD.
+
+#define MPQ_KEY1_HEAD       5                   // Number of steps before dwKey1 becomes periodic
+#define MPQ_KEY1_PERIOD     6                   // Period of dwKey1 after that
+#define MPQ_KEY1_STEPS      (MPQ_KEY1_HEAD + MPQ_KEY1_PERIOD)
+
+struct TMpqKeySchedule
+{
+    DWORD Key1[MPQ_KEY1_STEPS];                 // dwKey1 for steps 0-10. Step i >= 11 is the same as step 5 + (i - 5) % 6
+    DWORD Key2Add[MPQ_KEY1_STEPS];              // Value added to dwKey2 after step i (StormBuffer for the next dwKey1, plus 3)
+    DWORD dwKey2;                               // dwKey2 for step 0
+};
+
+static void PrepareKeySchedule(TMpqKeySchedule & Schedule, DWORD dwKey1)
+{
+    DWORD Key2Mix[MPQ_KEY1_STEPS + 1];
+
+    for(DWORD i = 0; i < MPQ_KEY1_STEPS + 1; i++)
+    {
+        if(i < MPQ_KEY1_STEPS)
+            Schedule.Key1[i] = dwKey1;
+        Key2Mix[i] = StormBuffer[MPQ_HASH_KEY2_MIX + (dwKey1 & 0xFF)];
+        dwKey1 = ((~dwKey1 << 0x15) + 0x11111111) | (dwKey1 >> 0x0B);
+    }
+
+    for(DWORD i = 0; i < MPQ_KEY1_STEPS; i++)
+        Schedule.Key2Add[i] = Key2Mix[i + 1] + 3;
+    Schedule.dwKey2 = 0xEEEEEEEE + Key2Mix[0];
+}
 
-static DWORD EncryptUInt32Unaligned(LPDWORD DataPointer, DWORD i, DWORD dwXorKey)
+// The data block doesn't need to be aligned
+static inline DWORD LoadUInt32(LPBYTE pbData)
 {
-    LPBYTE pbDataPointer = (LPBYTE)(DataPointer + i);
-    LPBYTE pbXorKey = (LPBYTE)(&dwXorKey);
     DWORD dwValue32;
 
-    // Retrieve the value
-    dwValue32 = ((DWORD)pbDataPointer[0] << 0x00) |
-                ((DWORD)pbDataPointer[1] << 0x08) |
-                ((DWORD)pbDataPointer[2] << 0x10) |
-                ((DWORD)pbDataPointer[3] << 0x18);
-
-    // Perform unaligned XOR
-    pbDataPointer[0] = (pbDataPointer[0] ^ pbXorKey[0]);
-    pbDataPointer[1] = (pbDataPointer[1] ^ pbXorKey[1]);
-    pbDataPointer[2] = (pbDataPointer[2] ^ pbXorKey[2]);
-    pbDataPointer[3] = (pbDataPointer[3] ^ pbXorKey[3]);
+    memcpy(&dwValue32, pbData, sizeof(DWORD));
     return dwValue32;
 }
 
-void EncryptMpqBlock(void * pvDataBlock, DWORD dwLength, DWORD dwKey1)
+static inline void StoreUInt32(LPBYTE pbData, DWORD dwValue32)
 {
-    LPDWORD DataPointer = (LPDWORD)pvDataBlock;
-    DWORD dwValue32;
-    DWORD dwKey2 = 0xEEEEEEEE;
+    memcpy(pbData, &dwValue32, sizeof(DWORD));
+}
 
-    // Round to DWORDs
-    dwLength >>= 2;
+#define ENCRYPT_STEP(pbData, dwKey1, dwKey2Add)                         \
+    {                                                                   \
+        DWORD dwValue32 = LoadUInt32(pbData);                           \
+        StoreUInt32(pbData, dwValue32 ^ (dwKey1 + dwKey2));             \
+        dwKey2 = dwValue32 + dwKey2 + (dwKey2 << 5) + dwKey2Add;        \
+    }
 
-    // We need different approach on non-aligned buffers
-    if(STORMLIB_DWORD_ALIGNED(DataPointer))
-    {
-        for(DWORD i = 0; i < dwLength; i++)
-        {
-            // Modify the second key
-            dwKey2 += StormBuffer[MPQ_HASH_KEY2_MIX + (dwKey1 & 0xFF)];
+#define DECRYPT_STEP(pbData, dwKey1, dwKey2Add)                         \
+    {                                                                   \
+        DWORD dwValue32 = LoadUInt32(pbData) ^ (dwKey1 + dwKey2);       \
+        StoreUInt32(pbData, dwValue32);                                 \
+        dwKey2 = dwValue32 + dwKey2 + (dwKey2 << 5) + dwKey2Add;        \
+    }
 
-            // We can use 32-bit approach, when the buffer is aligned
-            DataPointer[i] = (dwValue32 = DataPointer[i]) ^ (dwKey1 + dwKey2);
+// Encrypts the periodic part of the block (steps 5+), one period per loop
+static void EncryptPeriodic(TMpqKeySchedule & Schedule, LPBYTE pbData, DWORD dwLength, DWORD dwKey2)
+{
+    DWORD * Key1 = Schedule.Key1 + MPQ_KEY1_HEAD;
+    DWORD * Key2Add = Schedule.Key2Add + MPQ_KEY1_HEAD;
+    DWORD i;
 
-            dwKey1 = ((~dwKey1 << 0x15) + 0x11111111) | (dwKey1 >> 0x0B);
-            dwKey2 = dwValue32 + dwKey2 + (dwKey2 << 5) + 3;
-        }
+    for(i = 0; (i + MPQ_KEY1_PERIOD) <= dwLength; i += MPQ_KEY1_PERIOD, pbData += MPQ_KEY1_PERIOD * sizeof(DWORD))
+    {
+        ENCRYPT_STEP(pbData + 0x00, Key1[0], Key2Add[0]);
+        ENCRYPT_STEP(pbData + 0x04, Key1[1], Key2Add[1]);
+        ENCRYPT_STEP(pbData + 0x08, Key1[2], Key2Add[2]);
+        ENCRYPT_STEP(pbData + 0x0C, Key1[3], Key2Add[3]);
+        ENCRYPT_STEP(pbData + 0x10, Key1[4], Key2Add[4]);
+        ENCRYPT_STEP(pbData + 0x14, Key1[5], Key2Add[5]);
     }
-    else
+
+    for(DWORD j = 0; i < dwLength; i++, j++, pbData += sizeof(DWORD))
+        ENCRYPT_STEP(pbData, Key1[j], Key2Add[j]);
+}
+
+#ifdef STORMLIB_X86_AVX2
+
+// The encryption as a linear recurrence. For the DWORD n of a vector:
+//
+//   dwKey2[n] = dwKey2[0] * 33^n + E[n]
+//   E[n]      = E[n-1] * 33 + Plain[n-1] + Key2Add[n-1]    (E[0] = 0)
+//
+// E is calculated from the plain text by a prefix scan, the powers of 33 are constants.
+// There is no SSE2 variant, with 4 DWORDs per vector it is not faster than the plain C code.
+
+STORMLIB_TARGET_AVX2 static void EncryptPeriodic_AVX2(TMpqKeySchedule & Schedule, LPBYTE pbData, DWORD dwLength, DWORD dwKey2)
+{
+    DWORD Key1[MPQ_KEY1_PERIOD + 8];
+    DWORD Key2Add[MPQ_KEY1_PERIOD + 8];
+    DWORD dwPhase = 0;
+    DWORD i;
+
+    // Unroll the period so that any 8 consecutive steps can be loaded at once.
+    // Key2Add is shifted by one step: lane n needs the value added after step n-1.
+    for(i = 0; i < MPQ_KEY1_PERIOD + 8; i++)
     {
-        for(DWORD i = 0; i < dwLength; i++)
-        {
-            // Modify the second key
-            dwKey2 += StormBuffer[MPQ_HASH_KEY2_MIX + (dwKey1 & 0xFF)];
+        Key1[i] = Schedule.Key1[MPQ_KEY1_HEAD + (i % MPQ_KEY1_PERIOD)];
+        Key2Add[i] = Schedule.Key2Add[MPQ_KEY1_HEAD + ((i + MPQ_KEY1_PERIOD - 1) % MPQ_KEY1_PERIOD)];
+    }
 
-            // The data are unaligned. Make sure we don't cause data misalignment error
-            dwValue32 = EncryptUInt32Unaligned(DataPointer, i, (dwKey1 + dwKey2));
+    // Powers of 33 (33^0 - 33^7), and the multipliers carrying the lower half of the scan to the upper one
+    const __m256i Powers = _mm256_setr_epi32(1, 33, 1089, 35937, 1185921, 39135393, 1291467969, (int)3963737313U);
+    const __m256i Carry = _mm256_setr_epi32(0, 0, 0, 0, 33, 1089, 35937, 1185921);
+    const __m256i Rotate = _mm256_setr_epi32(7, 0, 1, 2, 3, 4, 5, 6);
+    const __m256i Lane3 = _mm256_set1_epi32(3);
+    const __m256i Mask0 = _mm256_setr_epi32(0, -1, -1, -1, -1, -1, -1, -1);
+    const DWORD dwPower8 = (DWORD)(3963737313U * 33);
 
-            dwKey1 = ((~dwKey1 << 0x15) + 0x11111111) | (dwKey1 >> 0x0B);
-            dwKey2 = dwValue32 + dwKey2 + (dwKey2 << 5) + 3;
-        }
+    for(i = 0; (i + 8) <= dwLength; i += 8, pbData += 8 * sizeof(DWORD))
+    {
+        __m256i PlainText = _mm256_loadu_si256((const __m256i *)pbData);
+        __m256i E;
+        __m256i A;
+        DWORD dwPlainLast = LoadUInt32(pbData + 0x1C);
+        DWORD dwE7;
+
+        // E[n] = Plain[n-1] + Key2Add[n-1], then the prefix scan in both 128-bit halves
+        E = _mm256_add_epi32(_mm256_permutevar8x32_epi32(PlainText, Rotate), _mm256_loadu_si256((const __m256i *)(Key2Add + dwPhase)));
+        E = _mm256_and_si256(E, Mask0);
+        A = _mm256_slli_si256(E, 4);
+        E = _mm256_add_epi32(E, _mm256_add_epi32(A, _mm256_slli_epi32(A, 5)));
+        A = _mm256_slli_si256(E, 8);
+        E = _mm256_add_epi32(E, _mm256_add_epi32(_mm256_add_epi32(A, _mm256_slli_epi32(A, 6)), _mm256_slli_epi32(A, 10)));
+        E = _mm256_add_epi32(E, _mm256_mullo_epi32(_mm256_permutevar8x32_epi32(E, Lane3), Carry));
+
+        // Add the contribution of the incoming dwKey2 and encrypt
+        A = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_set1_epi32((int)dwKey2), Powers), E);
+        A = _mm256_add_epi32(A, _mm256_loadu_si256((const __m256i *)(Key1 + dwPhase)));
+        _mm256_storeu_si256((__m256i *)pbData, _mm256_xor_si256(PlainText, A));
+
+        // Calculate dwKey2 for the next vector
+        dwE7 = (DWORD)_mm256_extract_epi32(E, 7);
+        dwKey2 = dwKey2 * dwPower8 + dwE7 * 33 + dwPlainLast + Key2Add[dwPhase + 8];
+        dwPhase = (dwPhase + 8) % MPQ_KEY1_PERIOD;
     }
+
+    // Finish the rest by the scalar code
+    for(DWORD j = dwPhase; i < dwLength; i++, j++, pbData += sizeof(DWORD))
+        ENCRYPT_STEP(pbData, Key1[j], Key2Add[j + 1]);
 }
+#endif  // STORMLIB_X86_AVX2
 
-static DWORD DecryptUInt32Unaligned(LPDWORD DataPointer, DWORD i, DWORD dwXorKey)
+void EncryptMpqBlock(void * pvDataBlock, DWORD dwLength, DWORD dwKey1)
 {
-    LPBYTE pbDataPointer = (LPBYTE)(DataPointer + i);
-    LPBYTE pbXorKey = (LPBYTE)(&dwXorKey);
+    TMpqKeySchedule Schedule;
+    LPBYTE pbData = (LPBYTE)pvDataBlock;
+    DWORD dwKey2;
+    DWORD i;
 
-    // Perform unaligned XOR
-    pbDataPointer[0] = (pbDataPointer[0] ^ pbXorKey[0]);
-    pbDataPointer[1] = (pbDataPointer[1] ^ pbXorKey[1]);
-    pbDataPointer[2] = (pbDataPointer[2] ^ pbXorKey[2]);
-    pbDataPointer[3] = (pbDataPointer[3] ^ pbXorKey[3]);
+    // Round to DWORDs
+    dwLength >>= 2;
+    if(dwLength == 0)
+        return;
 
-    // Retrieve the value
-    return ((DWORD)pbDataPointer[0] << 0x00) |
-           ((DWORD)pbDataPointer[1] << 0x08) |
-           ((DWORD)pbDataPointer[2] << 0x10) |
-           ((DWORD)pbDataPointer[3] << 0x18);
+    // Calculate the values of dwKey1 in advance
+    PrepareKeySchedule(Schedule, dwKey1);
+    dwKey2 = Schedule.dwKey2;
+
+    // The first steps, before dwKey1 becomes periodic
+    for(i = 0; i < dwLength && i < MPQ_KEY1_HEAD; i++, pbData += sizeof(DWORD))
+        ENCRYPT_STEP(pbData, Schedule.Key1[i], Schedule.Key2Add[i]);
+    dwLength -= i;
+
+    // The periodic part
+#ifdef STORMLIB_X86_AVX2
+    if(StormCpu_GetFeatures() & STORM_CPU_FEATURE_AVX2)
+    {
+        EncryptPeriodic_AVX2(Schedule, pbData, dwLength, dwKey2);
+        return;
+    }
+#endif
+    EncryptPeriodic(Schedule, pbData, dwLength, dwKey2);
 }
 
 void DecryptMpqBlock(void * pvDataBlock, DWORD dwLength, DWORD dwKey1)
 {
-    LPDWORD DataPointer = (LPDWORD)pvDataBlock;
-    DWORD dwValue32;
-    DWORD dwKey2 = 0xEEEEEEEE;
+    TMpqKeySchedule Schedule;
+    LPBYTE pbData = (LPBYTE)pvDataBlock;
+    DWORD * Key1 = Schedule.Key1 + MPQ_KEY1_HEAD;
+    DWORD * Key2Add = Schedule.Key2Add + MPQ_KEY1_HEAD;
+    DWORD dwKey2;
+    DWORD i;
 
     // Round to DWORDs
     dwLength >>= 2;
+    if(dwLength == 0)
+        return;
 
-    // We need different approach on non-aligned buffers
-    if(STORMLIB_DWORD_ALIGNED(DataPointer))
-    {
-        for(DWORD i = 0; i < dwLength; i++)
-        {
-            // Modify the second key
-            dwKey2 += StormBuffer[MPQ_HASH_KEY2_MIX + (dwKey1 & 0xFF)];
+    // Calculate the values of dwKey1 in advance
+    PrepareKeySchedule(Schedule, dwKey1);
+    dwKey2 = Schedule.dwKey2;
 
-            // We can use 32-bit approach, when the buffer is aligned
-            DataPointer[i] = dwValue32 = DataPointer[i] ^ (dwKey1 + dwKey2);
+    // The first steps, before dwKey1 becomes periodic
+    for(i = 0; i < dwLength && i < MPQ_KEY1_HEAD; i++, pbData += sizeof(DWORD))
+        DECRYPT_STEP(pbData, Schedule.Key1[i], Schedule.Key2Add[i]);
+    dwLength -= i;
 
-            dwKey1 = ((~dwKey1 << 0x15) + 0x11111111) | (dwKey1 >> 0x0B);
-            dwKey2 = dwValue32 + dwKey2 + (dwKey2 << 5) + 3;
-        }
-    }
-    else
+    // The periodic part, one period per loop
+    for(i = 0; (i + MPQ_KEY1_PERIOD) <= dwLength; i += MPQ_KEY1_PERIOD, pbData += MPQ_KEY1_PERIOD * sizeof(DWORD))
     {
-        for(DWORD i = 0; i < dwLength; i++)
-        {
-            // Modify the second key
-            dwKey2 += StormBuffer[MPQ_HASH_KEY2_MIX + (dwKey1 & 0xFF)];
-
-            // The data are unaligned. Make sure we don't cause data misalignment error
-            dwValue32 = DecryptUInt32Unaligned(DataPointer, i, (dwKey1 + dwKey2));
-
-            dwKey1 = ((~dwKey1 << 0x15) + 0x11111111) | (dwKey1 >> 0x0B);
-            dwKey2 = dwValue32 + dwKey2 + (dwKey2 << 5) + 3;
-        }
+        DECRYPT_STEP(pbData + 0x00, Key1[0], Key2Add[0]);
+        DECRYPT_STEP(pbData + 0x04, Key1[1], Key2Add[1]);
+        DECRYPT_STEP(pbData + 0x08, Key1[2], Key2Add[2]);
+        DECRYPT_STEP(pbData + 0x0C, Key1[3], Key2Add[3]);
+        DECRYPT_STEP(pbData + 0x10, Key1[4], Key2Add[4]);
+        DECRYPT_STEP(pbData + 0x14, Key1[5], Key2Add[5]);
     }
+
+    for(DWORD j = 0; i < dwLength; i++, j++, pbData += sizeof(DWORD))
+        DECRYPT_STEP(pbData, Key1[j], Key2Add[j]);
 }
 
 /**
@@ -699,6 +893,480 @@ DWORD DecryptFileKey(
     return dwFileKey;
 }
 
+//-----------------------------------------------------------------------------
+// Synchronization and thread functions
+//
+// Note: An archive handle can be shared by multiple threads, as long as
+// they only read from it. Each thread must open its own file handles.
+// The archive lock only guards data that are lazily updated during reading.
+
+void StormLock_Init(STORM_LOCK * pLock)
+{
+#if defined(STORMLIB_WINDOWS)
+    InitializeCriticalSection(pLock);
+#elif defined(STORMLIB_HAS_PTHREADS)
+    pthread_mutexattr_t MutexAttr;
+
+    // Make the lock recursive, the same way like critical sections on Windows
+    pthread_mutexattr_init(&MutexAttr);
+    pthread_mutexattr_settype(&MutexAttr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(pLock, &MutexAttr);
+    pthread_mutexattr_destroy(&MutexAttr);
+#else
+    pLock[0] = 0;
+#endif
+}
+
+void StormLock_Enter(STORM_LOCK * pLock)
+{
+#if defined(STORMLIB_WINDOWS)
+    EnterCriticalSection(pLock);
+#elif defined(STORMLIB_HAS_PTHREADS)
+    pthread_mutex_lock(pLock);
+#else
+    STORMLIB_UNUSED(pLock);
+#endif
+}
+
+void StormLock_Leave(STORM_LOCK * pLock)
+{
+#if defined(STORMLIB_WINDOWS)
+    LeaveCriticalSection(pLock);
+#elif defined(STORMLIB_HAS_PTHREADS)
+    pthread_mutex_unlock(pLock);
+#else
+    STORMLIB_UNUSED(pLock);
+#endif
+}
+
+void StormLock_Free(STORM_LOCK * pLock)
+{
+#if defined(STORMLIB_WINDOWS)
+    DeleteCriticalSection(pLock);
+#elif defined(STORMLIB_HAS_PTHREADS)
+    pthread_mutex_destroy(pLock);
+#else
+    STORMLIB_UNUSED(pLock);
+#endif
+}
+
+void StormCond_Init(STORM_COND * pCond)
+{
+#if defined(STORMLIB_WINDOWS)
+    InitializeConditionVariable(pCond);
+#elif defined(STORMLIB_HAS_PTHREADS)
+    pthread_cond_init(pCond, NULL);
+#else
+    pCond[0] = 0;
+#endif
+}
+
+// Note: The lock must be entered exactly once by the calling thread
+void StormCond_Wait(STORM_COND * pCond, STORM_LOCK * pLock)
+{
+#if defined(STORMLIB_WINDOWS)
+    SleepConditionVariableCS(pCond, pLock, INFINITE);
+#elif defined(STORMLIB_HAS_PTHREADS)
+    pthread_cond_wait(pCond, pLock);
+#else
+    STORMLIB_UNUSED(pCond);
+    STORMLIB_UNUSED(pLock);
+#endif
+}
+
+void StormCond_WakeAll(STORM_COND * pCond)
+{
+#if defined(STORMLIB_WINDOWS)
+    WakeAllConditionVariable(pCond);
+#elif defined(STORMLIB_HAS_PTHREADS)
+    pthread_cond_broadcast(pCond);
+#else
+    STORMLIB_UNUSED(pCond);
+#endif
+}
+
+void StormCond_Free(STORM_COND * pCond)
+{
+#if defined(STORMLIB_WINDOWS)
+    STORMLIB_UNUSED(pCond);
+#elif defined(STORMLIB_HAS_PTHREADS)
+    pthread_cond_destroy(pCond);
+#else
+    STORMLIB_UNUSED(pCond);
+#endif
+}
+
+// Parameters passed to the newly created thread
+struct TStormThreadStart
+{
+    STORM_THREAD_ROUTINE PfnThreadRoutine;
+    void * pvParam;
+};
+
+#if defined(STORMLIB_WINDOWS)
+static DWORD WINAPI StormThread_Entry(LPVOID lpParameter)
+#elif defined(STORMLIB_HAS_PTHREADS)
+static void * StormThread_Entry(void * lpParameter)
+#endif
+#if defined(STORMLIB_WINDOWS) || defined(STORMLIB_HAS_PTHREADS)
+{
+    TStormThreadStart * pStart = (TStormThreadStart *)lpParameter;
+    STORM_THREAD_ROUTINE PfnThreadRoutine = pStart->PfnThreadRoutine;
+    void * pvParam = pStart->pvParam;
+
+    // Free the start structure before running the routine
+    STORM_FREE(pStart);
+    PfnThreadRoutine(pvParam);
+    return 0;
+}
+#endif
+
+// Creates a new thread. Returns false if threads are not supported on the platform
+bool StormThread_Create(STORM_THREAD * pThread, STORM_THREAD_ROUTINE PfnThreadRoutine, void * pvParam)
+{
+#if defined(STORMLIB_WINDOWS) || defined(STORMLIB_HAS_PTHREADS)
+    TStormThreadStart * pStart;
+
+    // Allocate the start structure. The thread will free it
+    if((pStart = STORM_ALLOC(TStormThreadStart, 1)) == NULL)
+    {
+        SErrSetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+
+    pStart->PfnThreadRoutine = PfnThreadRoutine;
+    pStart->pvParam = pvParam;
+
+#if defined(STORMLIB_WINDOWS)
+    pThread[0] = CreateThread(NULL, 0, StormThread_Entry, pStart, 0, NULL);
+    if(pThread[0] != NULL)
+        return true;
+#else
+    int nError = pthread_create(pThread, NULL, StormThread_Entry, pStart);
+    if(nError == 0)
+        return true;
+    SErrSetLastError(nError);
+#endif
+
+    STORM_FREE(pStart);
+    return false;
+#else
+    STORMLIB_UNUSED(pThread);
+    STORMLIB_UNUSED(PfnThreadRoutine);
+    STORMLIB_UNUSED(pvParam);
+    SErrSetLastError(ERROR_NOT_SUPPORTED);
+    return false;
+#endif
+}
+
+// Waits until the thread terminates and frees the thread handle
+void StormThread_Wait(STORM_THREAD Thread)
+{
+#if defined(STORMLIB_WINDOWS)
+    WaitForSingleObject(Thread, INFINITE);
+    CloseHandle(Thread);
+#elif defined(STORMLIB_HAS_PTHREADS)
+    pthread_join(Thread, NULL);
+#else
+    STORMLIB_UNUSED(Thread);
+#endif
+}
+
+// Returns number of logical processors available
+DWORD StormThread_GetCpuCount()
+{
+#if defined(STORMLIB_WINDOWS)
+    SYSTEM_INFO SystemInfo;
+
+    GetSystemInfo(&SystemInfo);
+    return (SystemInfo.dwNumberOfProcessors != 0) ? SystemInfo.dwNumberOfProcessors : 1;
+#elif defined(STORMLIB_HAS_PTHREADS) && defined(_SC_NPROCESSORS_ONLN)
+    long nCpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (nCpuCount > 0) ? (DWORD)nCpuCount : 1;
+#else
+    return 1;
+#endif
+}
+
+// Returns the number of milliseconds elapsed since an unspecified point in time.
+// Used to measure the throughput of long operations
+ULONGLONG StormGetTickCount()
+{
+#if defined(STORMLIB_WINDOWS)
+    return GetTickCount64();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((ULONGLONG)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// CPU features
+//
+// The features are detected once. The mask allows to turn the SIMD code paths
+// off (e.g. to compare their results or speed with the plain C code).
+
+static DWORD g_dwCpuFeatureMask = 0xFFFFFFFF;   // All features allowed
+
+static DWORD StormCpu_DetectFeatures()
+{
+    DWORD dwFeatures = 0;
+
+#if defined(STORMLIB_X86_SIMD) && defined(_MSC_VER)
+    int CpuInfo[4];
+    int nMaxLeaf;
+
+    __cpuid(CpuInfo, 0);
+    nMaxLeaf = CpuInfo[0];
+
+    __cpuid(CpuInfo, 1);
+    if(CpuInfo[3] & (1 << 26))
+        dwFeatures |= STORM_CPU_FEATURE_SSE2;
+
+    // AVX2 also needs the OS to save the YMM registers (OSXSAVE and XCR0)
+#ifdef STORMLIB_X86_AVX2
+    if(nMaxLeaf >= 7 && (CpuInfo[2] & (1 << 27)) && (CpuInfo[2] & (1 << 28)) && (_xgetbv(0) & 0x06) == 0x06)
+    {
+        __cpuidex(CpuInfo, 7, 0);
+        if(CpuInfo[1] & (1 << 5))
+            dwFeatures |= STORM_CPU_FEATURE_AVX2;
+    }
+#else
+    STORMLIB_UNUSED(nMaxLeaf);
+#endif
+#elif defined(STORMLIB_X86_SIMD)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2"))
+        dwFeatures |= STORM_CPU_FEATURE_SSE2;
+    if(__builtin_cpu_supports("avx2"))
+        dwFeatures |= STORM_CPU_FEATURE_AVX2;
+#endif
+
+    return dwFeatures;
+}
+
+// The features are detected when the library is loaded, before any thread can use them.
+// A lazily initialized local static variable would not be thread-safe with compilers
+// older than C++11 (e.g. Visual Studio 2008). Calls made before the detection get no features
+static DWORD g_dwCpuFeatures = StormCpu_DetectFeatures();
+
+// Returns the CPU features that the SIMD code paths may use
+DWORD StormCpu_GetFeatures()
+{
+    return (g_dwCpuFeatures & g_dwCpuFeatureMask);
+}
+
+// Limits the CPU features that the SIMD code paths may use. 0xFFFFFFFF allows all of them
+void StormCpu_SetFeatureMask(DWORD dwFeatureMask)
+{
+    g_dwCpuFeatureMask = dwFeatureMask;
+}
+
+//-----------------------------------------------------------------------------
+// Worker pool
+//
+// The pool runs independent work items (e.g. file sectors) on multiple threads.
+// The thread that submits the work also processes the items, so the work
+// is always finished, even if the pool has no worker threads at all.
+
+struct TStormWork
+{
+    TStormWork * pNext;                     // Next work in the queue
+    STORM_WORK_ROUTINE PfnWorkRoutine;      // Routine that processes one item
+    void * pvParam;                         // Parameter for the work routine
+    DWORD dwItemCount;                      // Total number of items
+    DWORD dwNextItem;                       // Index of the next item to be taken
+    DWORD dwItemsDone;                      // Number of items already processed
+};
+
+struct TStormWorkPool
+{
+    STORM_LOCK Lock;                        // Guards the work queue
+    STORM_COND WorkReady;                   // Signalled when a new work is queued or on shutdown
+    STORM_COND WorkDone;                    // Signalled when all items of a work are processed
+    TStormWork * pFirstWork;                // Queue of works that have items to be taken
+    TStormWork * pLastWork;
+    STORM_THREAD * pThreads;                // Array of the worker threads
+    DWORD dwThreadCount;                    // Number of worker threads
+    bool bShutdown;                         // If true, the worker threads shall exit
+};
+
+static TStormWorkPool * g_pWorkPool = NULL;
+
+// Takes one item from the first queued work. The pool lock must be held
+static TStormWork * StormWorkPool_TakeItem(TStormWorkPool * pPool, DWORD * PtrItemIndex)
+{
+    TStormWork * pWork = pPool->pFirstWork;
+
+    if(pWork != NULL)
+    {
+        PtrItemIndex[0] = pWork->dwNextItem++;
+
+        // If this was the last item, remove the work from the queue
+        if(pWork->dwNextItem >= pWork->dwItemCount)
+        {
+            pPool->pFirstWork = pWork->pNext;
+            if(pPool->pFirstWork == NULL)
+                pPool->pLastWork = NULL;
+        }
+    }
+    return pWork;
+}
+
+// Processes one item and marks it as done. Must be called with the pool lock held
+static void StormWorkPool_ProcessItem(TStormWorkPool * pPool, TStormWork * pWork, DWORD dwItemIndex)
+{
+    StormLock_Leave(&pPool->Lock);
+    pWork->PfnWorkRoutine(pWork->pvParam, dwItemIndex);
+    StormLock_Enter(&pPool->Lock);
+
+    // Wake up the submitting thread once the last item is done
+    if(++pWork->dwItemsDone >= pWork->dwItemCount)
+        StormCond_WakeAll(&pPool->WorkDone);
+}
+
+static void StormWorkPool_Worker(void * pvParam)
+{
+    TStormWorkPool * pPool = (TStormWorkPool *)pvParam;
+    TStormWork * pWork;
+    DWORD dwItemIndex = 0;
+
+    StormLock_Enter(&pPool->Lock);
+    while(pPool->bShutdown == false)
+    {
+        if((pWork = StormWorkPool_TakeItem(pPool, &dwItemIndex)) != NULL)
+            StormWorkPool_ProcessItem(pPool, pWork, dwItemIndex);
+        else
+            StormCond_Wait(&pPool->WorkReady, &pPool->Lock);
+    }
+    StormLock_Leave(&pPool->Lock);
+}
+
+// Stops all worker threads and frees the pool.
+// Must not be called while other threads submit work to the pool.
+void StormWorkPool_Free()
+{
+    TStormWorkPool * pPool = g_pWorkPool;
+
+    if(pPool != NULL)
+    {
+        g_pWorkPool = NULL;
+
+        // Tell the threads to exit
+        StormLock_Enter(&pPool->Lock);
+        pPool->bShutdown = true;
+        StormCond_WakeAll(&pPool->WorkReady);
+        StormLock_Leave(&pPool->Lock);
+
+        // Wait for all of them
+        for(DWORD i = 0; i < pPool->dwThreadCount; i++)
+            StormThread_Wait(pPool->pThreads[i]);
+
+        StormCond_Free(&pPool->WorkDone);
+        StormCond_Free(&pPool->WorkReady);
+        StormLock_Free(&pPool->Lock);
+        STORM_FREE(pPool->pThreads);
+        STORM_FREE(pPool);
+    }
+}
+
+// Creates the worker pool with given total number of threads, including the calling one.
+// Any previous pool is destroyed. Thread count of 1 means that no pool is used.
+DWORD StormWorkPool_Create(DWORD dwThreadCount)
+{
+    TStormWorkPool * pPool;
+
+    // Destroy the previous pool, if any
+    StormWorkPool_Free();
+    if(dwThreadCount <= 1)
+        return ERROR_SUCCESS;
+
+#if defined(STORMLIB_WINDOWS) || defined(STORMLIB_HAS_PTHREADS)
+    // Allocate the pool structure
+    if((pPool = STORM_ALLOC(TStormWorkPool, 1)) == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    memset(pPool, 0, sizeof(TStormWorkPool));
+
+    // The calling thread also works, so we need one thread less
+    if((pPool->pThreads = STORM_ALLOC(STORM_THREAD, dwThreadCount - 1)) == NULL)
+    {
+        STORM_FREE(pPool);
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    StormLock_Init(&pPool->Lock);
+    StormCond_Init(&pPool->WorkReady);
+    StormCond_Init(&pPool->WorkDone);
+    g_pWorkPool = pPool;
+
+    // Start the worker threads. If this fails, we use as many as we have
+    while(pPool->dwThreadCount < (dwThreadCount - 1))
+    {
+        if(!StormThread_Create(&pPool->pThreads[pPool->dwThreadCount], StormWorkPool_Worker, pPool))
+            break;
+        pPool->dwThreadCount++;
+    }
+    return ERROR_SUCCESS;
+#else
+    STORMLIB_UNUSED(pPool);
+    return ERROR_NOT_SUPPORTED;
+#endif
+}
+
+// Returns total number of threads that process the work, including the calling one
+DWORD StormWorkPool_GetThreadCount()
+{
+    return (g_pWorkPool != NULL) ? (g_pWorkPool->dwThreadCount + 1) : 1;
+}
+
+// Processes all items of the work and returns when all of them are done.
+// Multiple threads may submit their work at the same time.
+void StormWorkPool_Run(DWORD dwItemCount, STORM_WORK_ROUTINE PfnWorkRoutine, void * pvParam)
+{
+    TStormWorkPool * pPool = g_pWorkPool;
+    TStormWork * pWork;
+    TStormWork Work;
+    DWORD dwItemIndex = 0;
+
+    // Without the pool or with just one item, do the work on the calling thread
+    if(pPool == NULL || pPool->dwThreadCount == 0 || dwItemCount <= 1)
+    {
+        for(DWORD i = 0; i < dwItemCount; i++)
+            PfnWorkRoutine(pvParam, i);
+        return;
+    }
+
+    // Prepare the work structure
+    Work.pNext = NULL;
+    Work.PfnWorkRoutine = PfnWorkRoutine;
+    Work.pvParam = pvParam;
+    Work.dwItemCount = dwItemCount;
+    Work.dwNextItem = 0;
+    Work.dwItemsDone = 0;
+
+    // Insert the work to the queue and wake up the workers
+    StormLock_Enter(&pPool->Lock);
+    if(pPool->pLastWork != NULL)
+        pPool->pLastWork->pNext = &Work;
+    else
+        pPool->pFirstWork = &Work;
+    pPool->pLastWork = &Work;
+    StormCond_WakeAll(&pPool->WorkReady);
+
+    // Help processing the queue until all our items are taken.
+    // Works queued before ours are processed first.
+    while(Work.dwNextItem < Work.dwItemCount && (pWork = StormWorkPool_TakeItem(pPool, &dwItemIndex)) != NULL)
+        StormWorkPool_ProcessItem(pPool, pWork, dwItemIndex);
+
+    // Wait until all items are processed
+    while(Work.dwItemsDone < Work.dwItemCount)
+        StormCond_Wait(&pPool->WorkDone, &pPool->Lock);
+    StormLock_Leave(&pPool->Lock);
+}
+
 //-----------------------------------------------------------------------------
 // Handle validation functions
 
@@ -781,11 +1449,19 @@ TMPQHash * FindFreeHashEntry(TMPQArchive * ha, DWORD dwStartIndex, DWORD dwHashC
 // Retrieves the first hash entry for the given file.
 // Every locale version of a file has its own hash entry
 TMPQHash * GetFirstHashEntry(TMPQArchive * ha, const char * szFileName)
+{
+    TFileNameHash NameHash;
+
+    HashFileName(ha, szFileName, NameHash);
+    return GetFirstHashEntry(ha, NameHash);
+}
+
+TMPQHash * GetFirstHashEntry(TMPQArchive * ha, const TFileNameHash & NameHash)
 {
     DWORD dwHashIndexMask = HASH_INDEX_MASK(ha);
-    DWORD dwStartIndex = ha->pfnHashString(szFileName, MPQ_HASH_TABLE_INDEX);
-    DWORD dwHashCheck1 = ha->pfnHashString(szFileName, MPQ_HASH_NAME_A);
-    DWORD dwHashCheck2 = ha->pfnHashString(szFileName, MPQ_HASH_NAME_B);
+    DWORD dwStartIndex = NameHash.dwHashIndex;
+    DWORD dwHashCheck1 = NameHash.dwHashCheck1;
+    DWORD dwHashCheck2 = NameHash.dwHashCheck2;
     DWORD dwIndex;
 
     // Set the initial index
@@ -847,18 +1523,19 @@ TMPQHash * AllocateHashEntry(
     TFileEntry * pFileEntry,
     LCID lcFileLocale)
 {
+    TFileNameHash NameHash;
     TMPQHash * pHash;
-    DWORD dwStartIndex = ha->pfnHashString(pFileEntry->szFileName, MPQ_HASH_TABLE_INDEX);
-    DWORD dwHashCheck1 = ha->pfnHashString(pFileEntry->szFileName, MPQ_HASH_NAME_A);
-    DWORD dwHashCheck2 = ha->pfnHashString(pFileEntry->szFileName, MPQ_HASH_NAME_B);
+
+    // Calculate all three hashes of the name in one pass
+    HashFileName(ha, pFileEntry->szFileName, NameHash);
 
     // Attempt to find a free hash entry
-    pHash = FindFreeHashEntry(ha, dwStartIndex, dwHashCheck1, dwHashCheck2, lcFileLocale);
+    pHash = FindFreeHashEntry(ha, NameHash.dwHashIndex, NameHash.dwHashCheck1, NameHash.dwHashCheck2, lcFileLocale);
     if(pHash != NULL)
     {
         // Fill the free hash entry
-        pHash->dwHashCheck1 = dwHashCheck1;
-        pHash->dwHashCheck2 = dwHashCheck2;
+        pHash->dwHashCheck1 = NameHash.dwHashCheck1;
+        pHash->dwHashCheck2 = NameHash.dwHashCheck2;
         pHash->Locale       = SFILE_LOCALE(lcFileLocale);
         pHash->Platform     = SFILE_PLATFORM(lcFileLocale);
         pHash->Flags        = 0;
@@ -868,17 +1545,28 @@ TMPQHash * AllocateHashEntry(
     return pHash;
 }
 
+// Returns the end of the file data, including the MD5 chunks
+ULONGLONG GetFileEntryDataEnd(TMPQArchive * ha, TFileEntry * pFileEntry)
+{
+    ULONGLONG EndOffset = pFileEntry->ByteOffset + pFileEntry->dwCmpSize;
+    DWORD dwRawChunkSize = ha->pHeader->dwRawChunkSize;
+
+    // Add the MD5 chunks, if present
+    if(dwRawChunkSize != 0 && pFileEntry->dwCmpSize != 0)
+        EndOffset += (((pFileEntry->dwCmpSize - 1) / dwRawChunkSize) + 1) * MD5_DIGEST_SIZE;
+    return EndOffset;
+}
+
 // Finds a free space in the MPQ where to store next data
 // The free space begins beyond the file that is stored at the fuhrtest
 // position in the MPQ. (listfile), (attributes) and (signature) are ignored,
 // unless the MPQ is being flushed.
-ULONGLONG FindFreeMpqSpace(TMPQArchive * ha)
+static ULONGLONG ScanFreeMpqSpace(TMPQArchive * ha)
 {
-    TMPQHeader * pHeader = ha->pHeader;
     TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
     TFileEntry * pFileEntry;
     ULONGLONG FreeSpacePos = ha->pHeader->dwHeaderSize;
-    DWORD dwChunkCount;
+    ULONGLONG EndOffset;
 
     // Parse the entire block table
     for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
@@ -891,18 +1579,9 @@ ULONGLONG FindFreeMpqSpace(TMPQArchive * ha)
                 continue;
 
             // If the end of the file is bigger than current MPQ table pos, update it
-            if((pFileEntry->ByteOffset + pFileEntry->dwCmpSize) > FreeSpacePos)
-            {
-                // Get the end of the file data
-                FreeSpacePos = pFileEntry->ByteOffset + pFileEntry->dwCmpSize;
-
-                // Add the MD5 chunks, if present
-                if(pHeader->dwRawChunkSize != 0 && pFileEntry->dwCmpSize != 0)
-                {
-                    dwChunkCount = ((pFileEntry->dwCmpSize - 1) / pHeader->dwRawChunkSize) + 1;
-                    FreeSpacePos += dwChunkCount * MD5_DIGEST_SIZE;
-                }
-            }
+            EndOffset = GetFileEntryDataEnd(ha, pFileEntry);
+            if(EndOffset > FreeSpacePos)
+                FreeSpacePos = EndOffset;
         }
     }
 
@@ -910,6 +1589,168 @@ ULONGLONG FindFreeMpqSpace(TMPQArchive * ha)
     return FreeSpacePos;
 }
 
+// Returns the end of the file data. The block table is only scanned once,
+// then the position is kept up to date as files are added and removed.
+ULONGLONG FindFreeMpqSpace(TMPQArchive * ha)
+{
+    // When saving the MPQ tables, the internal files must be included too
+    if(ha->dwFlags & MPQ_FLAG_SAVING_TABLES)
+    {
+        ULONGLONG FreeSpacePos = ScanFreeMpqSpace(ha);
+        return STORMLIB_MAX(FreeSpacePos, ha->EndOfData);
+    }
+
+    if(ha->EndOfData == 0)
+        ha->EndOfData = ScanFreeMpqSpace(ha);
+    return ha->EndOfData;
+}
+
+// Reserves the space for a new file with the given size. Holes that are big enough
+// to hold the file in the worst case (no compression, sector offsets, sector checksums,
+// patch info and MD5 chunks) are reused, otherwise the space is taken from the end of data.
+// The unused part of the reserved space is given back by ReleaseMpqSpace.
+ULONGLONG AllocateMpqSpace(TMPQArchive * ha, DWORD dwFileSize, ULONGLONG * PtrReservedEnd)
+{
+    TMPQExtent * pExtent;
+    ULONGLONG ByteOffset;
+    ULONGLONG MaxDataSize;
+    ULONGLONG SectorCount = ((ULONGLONG)dwFileSize + ha->dwSectorSize - 1) / ha->dwSectorSize;
+
+    // Calculate the largest size that the file data can take
+    MaxDataSize = dwFileSize + (SectorCount + 2) * sizeof(DWORD) + SectorCount * sizeof(DWORD) + sizeof(TPatchInfo);
+    if(ha->pHeader->dwRawChunkSize != 0)
+        MaxDataSize += (((MaxDataSize - 1) / ha->pHeader->dwRawChunkSize) + 1) * MD5_DIGEST_SIZE;
+
+    // Make sure that the end of data is known
+    FindFreeMpqSpace(ha);
+
+    // Take the first hole where the file fits
+    for(DWORD i = 0; i < ha->dwFreeSpaceCount; i++)
+    {
+        pExtent = ha->pFreeSpace + i;
+        if((pExtent->EndOffset - pExtent->ByteOffset) >= MaxDataSize)
+        {
+            ByteOffset = pExtent->ByteOffset;
+            pExtent->ByteOffset += MaxDataSize;
+
+            // Remove the hole if it has been used entirely
+            if(pExtent->ByteOffset == pExtent->EndOffset)
+            {
+                memmove(pExtent, pExtent + 1, (ha->dwFreeSpaceCount - i - 1) * sizeof(TMPQExtent));
+                ha->dwFreeSpaceCount--;
+            }
+
+            PtrReservedEnd[0] = ByteOffset + MaxDataSize;
+            return ByteOffset;
+        }
+    }
+
+    // Append the file to the end of data
+    ByteOffset = ha->EndOfData;
+    ha->EndOfData += MaxDataSize;
+    PtrReservedEnd[0] = ha->EndOfData;
+    return ByteOffset;
+}
+
+// Gives a range of the MPQ back to the free space. If the range is at the end
+// of data, the end of data moves back. Otherwise the range is merged with the neighbor holes.
+void ReleaseMpqSpace(TMPQArchive * ha, ULONGLONG ByteOffset, ULONGLONG EndOffset)
+{
+    TMPQExtent * pExtent;
+    DWORD dwIndex;
+
+    // Nothing to do if the range is empty or beyond the end of data
+    if(ByteOffset >= EndOffset || ha->EndOfData == 0 || ByteOffset >= ha->EndOfData)
+        return;
+
+    // Find the index where the hole will be inserted
+    for(dwIndex = 0; dwIndex < ha->dwFreeSpaceCount; dwIndex++)
+    {
+        if(ha->pFreeSpace[dwIndex].ByteOffset > ByteOffset)
+            break;
+    }
+
+    // Merge with the previous hole
+    if(dwIndex > 0 && ha->pFreeSpace[dwIndex - 1].EndOffset == ByteOffset)
+    {
+        ByteOffset = ha->pFreeSpace[--dwIndex].ByteOffset;
+        memmove(ha->pFreeSpace + dwIndex, ha->pFreeSpace + dwIndex + 1, (ha->dwFreeSpaceCount - dwIndex - 1) * sizeof(TMPQExtent));
+        ha->dwFreeSpaceCount--;
+    }
+
+    // Merge with the next hole
+    if(dwIndex < ha->dwFreeSpaceCount && ha->pFreeSpace[dwIndex].ByteOffset == EndOffset)
+    {
+        EndOffset = ha->pFreeSpace[dwIndex].EndOffset;
+        memmove(ha->pFreeSpace + dwIndex, ha->pFreeSpace + dwIndex + 1, (ha->dwFreeSpaceCount - dwIndex - 1) * sizeof(TMPQExtent));
+        ha->dwFreeSpaceCount--;
+    }
+
+    // If the hole is at the end of data, just move the end of data back
+    if(EndOffset >= ha->EndOfData)
+    {
+        ha->EndOfData = ByteOffset;
+        return;
+    }
+
+    // Make sure there is space for one more hole. If we cannot allocate it,
+    // the space is just lost until the archive is compacted
+    if(ha->dwFreeSpaceCount >= ha->dwFreeSpaceMax)
+    {
+        DWORD dwNewMax = (ha->dwFreeSpaceMax != 0) ? (ha->dwFreeSpaceMax * 2) : 0x10;
+
+        if((pExtent = STORM_REALLOC(TMPQExtent, ha->pFreeSpace, dwNewMax)) == NULL)
+            return;
+        ha->pFreeSpace = pExtent;
+        ha->dwFreeSpaceMax = dwNewMax;
+    }
+
+    // Insert the hole
+    memmove(ha->pFreeSpace + dwIndex + 1, ha->pFreeSpace + dwIndex, (ha->dwFreeSpaceCount - dwIndex) * sizeof(TMPQExtent));
+    ha->pFreeSpace[dwIndex].ByteOffset = ByteOffset;
+    ha->pFreeSpace[dwIndex].EndOffset = EndOffset;
+    ha->dwFreeSpaceCount++;
+}
+
+// Gives the space of a file that has been deleted or replaced back to the free space.
+// Internal files are ignored, same like in FindFreeMpqSpace. If the data are also used
+// by another file entry (some protected MPQs do that), the space is not given back.
+void ReleaseFileEntrySpace(TMPQArchive * ha, TFileEntry * pFileEntry, ULONGLONG ByteOffset, ULONGLONG EndOffset)
+{
+    TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TFileEntry * pTestEntry;
+
+    // Ignore empty ranges and internal files
+    if(ByteOffset >= EndOffset || IsInternalMpqFileName(pFileEntry->szFileName))
+        return;
+
+    // Make sure that the end of data is known
+    FindFreeMpqSpace(ha);
+
+    // Check all other files whether they use the space
+    for(pTestEntry = ha->pFileTable; pTestEntry < pFileTableEnd; pTestEntry++)
+    {
+        if(pTestEntry != pFileEntry && (pTestEntry->dwFlags & MPQ_FILE_EXISTS) && pTestEntry->dwCmpSize != 0)
+        {
+            if(pTestEntry->ByteOffset < EndOffset && GetFileEntryDataEnd(ha, pTestEntry) > ByteOffset)
+                return;
+        }
+    }
+
+    ReleaseMpqSpace(ha, ByteOffset, EndOffset);
+}
+
+// Forgets the end of data and all holes. Called when the file data have been moved
+void ResetMpqSpace(TMPQArchive * ha)
+{
+    if(ha->pFreeSpace != NULL)
+        STORM_FREE(ha->pFreeSpace);
+    ha->pFreeSpace = NULL;
+    ha->dwFreeSpaceCount = 0;
+    ha->dwFreeSpaceMax = 0;
+    ha->EndOfData = 0;
+}
+
 //-----------------------------------------------------------------------------
 // Common functions - MPQ File
 
@@ -931,7 +1772,9 @@ TMPQFile * CreateFileHandle(TMPQArchive * ha, TFileEntry * pFileEntry)
         if(ha != NULL)
         {
             // Increment number of open files in the archive handle
+            StormLock_Enter(&ha->Lock);
             ha->dwFileCount++;
+            StormLock_Leave(&ha->Lock);
 
             // Add the file entry to the handle
             if(pFileEntry != NULL)
@@ -953,11 +1796,19 @@ TMPQFile * CreateFileHandle(TMPQArchive * ha, TFileEntry * pFileEntry)
 TMPQFile * CreateWritableHandle(TMPQArchive * ha, DWORD dwFileSize)
 {
     ULONGLONG FreeMpqSpace;
+    ULONGLONG ReservedEnd = 0;
     ULONGLONG TempPos;
     TMPQFile * hf;
 
-    // We need to find the position in the MPQ where we save the file data
-    FreeMpqSpace = FindFreeMpqSpace(ha);
+    // We need to find the position in the MPQ where we save the file data.
+    // During SFileCommitBulkAdd, the files are stored one after another.
+    // Internal files are stored beyond all other files when the MPQ tables are saved.
+    if(ha->BulkAddPos != 0)
+        FreeMpqSpace = ha->BulkAddPos;
+    else if(ha->dwFlags & MPQ_FLAG_SAVING_TABLES)
+        FreeMpqSpace = FindFreeMpqSpace(ha);
+    else
+        FreeMpqSpace = AllocateMpqSpace(ha, dwFileSize, &ReservedEnd);
 
     // When format V1, the size of the archive cannot exceed 4 GB
     if(ha->pHeader->wFormatVersion == MPQ_FORMAT_VERSION_1)
@@ -968,6 +1819,7 @@ TMPQFile * CreateWritableHandle(TMPQArchive * ha, DWORD dwFileSize)
                   (ha->dwFileTableSize * sizeof(TMPQBlock));
         if((TempPos >> 32) != 0)
         {
+            ReleaseMpqSpace(ha, FreeMpqSpace, ReservedEnd);
             SErrSetLastError(ERROR_DISK_FULL);
             return NULL;
         }
@@ -977,12 +1829,14 @@ TMPQFile * CreateWritableHandle(TMPQArchive * ha, DWORD dwFileSize)
     hf = CreateFileHandle(ha, NULL);
     if(hf == NULL)
     {
+        ReleaseMpqSpace(ha, FreeMpqSpace, ReservedEnd);
         SErrSetLastError(ERROR_NOT_ENOUGH_MEMORY);
         return NULL;
     }
 
     // We need to find the position in the MPQ where we save the file data
     hf->MpqFilePos = FreeMpqSpace;
+    hf->ReservedEnd = ReservedEnd;
     hf->bIsWriteHandle = true;
     return hf;
 }
@@ -1591,31 +2445,16 @@ DWORD WriteMemDataMD5(
     LPDWORD pcbTotalSize)
 {
     unsigned char * md5_array;
-    unsigned char * md5;
-    LPBYTE pbRawData = (LPBYTE)pvRawData;
-    DWORD dwBytesRemaining = dwRawDataSize;
     DWORD dwMd5ArraySize = 0;
     DWORD dwErrCode = ERROR_SUCCESS;
 
     // Allocate buffer for array of MD5
-    md5_array = md5 = AllocateMd5Buffer(dwRawDataSize, dwChunkSize, &dwMd5ArraySize);
+    md5_array = AllocateMd5Buffer(dwRawDataSize, dwChunkSize, &dwMd5ArraySize);
     if(md5_array == NULL)
         return ERROR_NOT_ENOUGH_MEMORY;
 
     // For every file chunk, calculate MD5
-    while(dwBytesRemaining != 0)
-    {
-        // Get the remaining number of bytes to read
-        dwChunkSize = STORMLIB_MIN(dwBytesRemaining, dwChunkSize);
-
-        // Calculate MD5
-        CalculateDataBlockHash(pbRawData, dwChunkSize, md5);
-        md5 += MD5_DIGEST_SIZE;
-
-        // Move offset and size
-        dwBytesRemaining -= dwChunkSize;
-        pbRawData += dwChunkSize;
-    }
+    CalculateDataBlockHashes(pvRawData, dwRawDataSize, dwChunkSize, md5_array);
 
     // Write the array od MD5's to the file
     RawDataOffs += dwRawDataSize;
@@ -1632,6 +2471,8 @@ DWORD WriteMemDataMD5(
 }
 
 
+#define MD5_CHUNKS_BUFFER_SIZE  0x100000    // Size of the buffer for reading raw data chunks to be hashed
+
 // Writes the MD5 for each chunk of the raw file data
 DWORD WriteMpqDataMD5(
     TFileStream * pStream,
@@ -1643,6 +2484,7 @@ DWORD WriteMpqDataMD5(
     unsigned char * md5;
     LPBYTE pbFileChunk;
     DWORD dwMd5ArraySize = 0;
+    DWORD dwChunksPerRead;
     DWORD dwToRead = dwRawDataSize;
     DWORD dwErrCode = ERROR_SUCCESS;
 
@@ -1651,8 +2493,12 @@ DWORD WriteMpqDataMD5(
     if(md5_array == NULL)
         return ERROR_NOT_ENOUGH_MEMORY;
 
-    // Allocate space for file chunk
-    pbFileChunk = STORM_ALLOC(BYTE, dwChunkSize);
+    // Read as many chunks at once as fit into the buffer, so they can be hashed together
+    dwChunksPerRead = (dwChunkSize < MD5_CHUNKS_BUFFER_SIZE) ? (MD5_CHUNKS_BUFFER_SIZE / dwChunkSize) : 1;
+    dwChunksPerRead = STORMLIB_MIN(dwChunksPerRead, dwMd5ArraySize / MD5_DIGEST_SIZE);
+
+    // Allocate space for file chunks
+    pbFileChunk = STORM_ALLOC(BYTE, dwChunksPerRead * dwChunkSize);
     if(pbFileChunk == NULL)
     {
         STORM_FREE(md5_array);
@@ -1663,9 +2509,9 @@ DWORD WriteMpqDataMD5(
     while(dwRawDataSize != 0)
     {
         // Get the remaining number of bytes to read
-        dwToRead = STORMLIB_MIN(dwRawDataSize, dwChunkSize);
+        dwToRead = STORMLIB_MIN(dwRawDataSize, dwChunksPerRead * dwChunkSize);
 
-        // Read the chunk
+        // Read the chunks
         if(!FileStream_Read(pStream, &RawDataOffs, pbFileChunk, dwToRead))
         {
             dwErrCode = SErrGetLastError();
@@ -1673,8 +2519,8 @@ DWORD WriteMpqDataMD5(
         }
 
         // Calculate MD5
-        CalculateDataBlockHash(pbFileChunk, dwToRead, md5);
-        md5 += MD5_DIGEST_SIZE;
+        CalculateDataBlockHashes(pbFileChunk, dwToRead, dwChunkSize, md5);
+        md5 += ((dwToRead - 1) / dwChunkSize + 1) * MD5_DIGEST_SIZE;
 
         // Move offset and size
         RawDataOffs += dwToRead;
@@ -1793,6 +2639,332 @@ void CalculateDataBlockHash(void * pvDataBlock, DWORD cbDataBlock, LPBYTE md5_ha
     md5_done(&md5_ctx, md5_hash);
 }
 
+//-----------------------------------------------------------------------------
+// Multi-buffer MD5
+//
+// The MD5 of one block of data can't be vectorized, because each step depends
+// on the previous one. But the raw data of MPQ v4 archives are split to chunks
+// that are hashed independently, so each lane of a vector register can process
+// its own chunk. SSE2 hashes 4 chunks at once, AVX2 hashes 8 chunks at once.
+// All chunks of a group have the same length, so their last blocks (with
+// the padding and the bit length) are the same for all lanes.
+
+#ifdef STORMLIB_X86_SIMD
+
+#define MD5_BLOCK_SIZE      64
+
+static const DWORD Md5Constants[64] =
+{
+    0xD76AA478, 0xE8C7B756, 0x242070DB, 0xC1BDCEEE, 0xF57C0FAF, 0x4787C62A, 0xA8304613, 0xFD469501,
+    0x698098D8, 0x8B44F7AF, 0xFFFF5BB1, 0x895CD7BE, 0x6B901122, 0xFD987193, 0xA679438E, 0x49B40821,
+    0xF61E2562, 0xC040B340, 0x265E5A51, 0xE9B6C7AA, 0xD62F105D, 0x02441453, 0xD8A1E681, 0xE7D3FBC8,
+    0x21E1CDE6, 0xC33707D6, 0xF4D50D87, 0x455A14ED, 0xA9E3E905, 0xFCEFA3F8, 0x676F02D9, 0x8D2A4C8A,
+    0xFFFA3942, 0x8771F681, 0x6D9D6122, 0xFDE5380C, 0xA4BEEA44, 0x4BDECFA9, 0xF6BB4B60, 0xBEBFBC70,
+    0x289B7EC6, 0xEAA127FA, 0xD4EF3085, 0x04881D05, 0xD9D4D039, 0xE6DB99E5, 0x1FA27CF8, 0xC4AC5665,
+    0xF4292244, 0x432AFF97, 0xAB9423A7, 0xFC93A039, 0x655B59C3, 0x8F0CCC92, 0xFFEFF47D, 0x85845DD1,
+    0x6FA87E4F, 0xFE2CE6E0, 0xA3014314, 0x4E0811A1, 0xF7537E82, 0xBD3AF235, 0x2AD7D2BB, 0xEB86D391
+};
+
+// Creates the last one or two blocks of a chunk: the rest of the data, 0x80, zeros and the bit length.
+// Returns the number of the blocks
+static DWORD Md5PrepareTail(LPBYTE pbTail, const BYTE * pbChunk, DWORD cbChunk)
+{
+    DWORD cbRest = cbChunk % MD5_BLOCK_SIZE;
+    DWORD cbTail = (cbRest < (MD5_BLOCK_SIZE - 8)) ? MD5_BLOCK_SIZE : (2 * MD5_BLOCK_SIZE);
+    ULONGLONG BitLength = (ULONGLONG)cbChunk * 8;
+
+    memcpy(pbTail, pbChunk + cbChunk - cbRest, cbRest);
+    memset(pbTail + cbRest, 0, cbTail - cbRest);
+    pbTail[cbRest] = 0x80;
+    for(DWORD i = 0; i < 8; i++)
+        pbTail[cbTail - 8 + i] = (BYTE)(BitLength >> (i * 8));
+    return cbTail / MD5_BLOCK_SIZE;
+}
+
+// The MD5 steps, written with the vector operations MD5_ADD, MD5_XOR, MD5_AND, MD5_OR,
+// MD5_ROTL and MD5_SET1 that are defined for each instruction set
+#define MD5_F(b, c, d)  MD5_XOR(d, MD5_AND(b, MD5_XOR(c, d)))
+#define MD5_G(b, c, d)  MD5_XOR(c, MD5_AND(d, MD5_XOR(b, c)))
+#define MD5_H(b, c, d)  MD5_XOR(MD5_XOR(b, c), d)
+#define MD5_I(b, c, d)  MD5_XOR(c, MD5_OR(b, MD5_XOR(d, Ones)))
+
+#define MD5_STEP(F, a, b, c, d, i, k, s) \
+    a = MD5_ADD(b, MD5_ROTL(MD5_ADD(MD5_ADD(a, F(b, c, d)), MD5_ADD(W[k], MD5_SET1(Md5Constants[i]))), s))
+
+#define MD5_COMPRESS()                                                          \
+    {                                                                           \
+        a = A; b = B; c = C; d = D;                                             \
+        MD5_STEP(MD5_F, a, b, c, d,  0,  0,  7);  MD5_STEP(MD5_F, d, a, b, c,  1,  1, 12); \
+        MD5_STEP(MD5_F, c, d, a, b,  2,  2, 17);  MD5_STEP(MD5_F, b, c, d, a,  3,  3, 22); \
+        MD5_STEP(MD5_F, a, b, c, d,  4,  4,  7);  MD5_STEP(MD5_F, d, a, b, c,  5,  5, 12); \
+        MD5_STEP(MD5_F, c, d, a, b,  6,  6, 17);  MD5_STEP(MD5_F, b, c, d, a,  7,  7, 22); \
+        MD5_STEP(MD5_F, a, b, c, d,  8,  8,  7);  MD5_STEP(MD5_F, d, a, b, c,  9,  9, 12); \
+        MD5_STEP(MD5_F, c, d, a, b, 10, 10, 17);  MD5_STEP(MD5_F, b, c, d, a, 11, 11, 22); \
+        MD5_STEP(MD5_F, a, b, c, d, 12, 12,  7);  MD5_STEP(MD5_F, d, a, b, c, 13, 13, 12); \
+        MD5_STEP(MD5_F, c, d, a, b, 14, 14, 17);  MD5_STEP(MD5_F, b, c, d, a, 15, 15, 22); \
+        MD5_STEP(MD5_G, a, b, c, d, 16,  1,  5);  MD5_STEP(MD5_G, d, a, b, c, 17,  6,  9); \
+        MD5_STEP(MD5_G, c, d, a, b, 18, 11, 14);  MD5_STEP(MD5_G, b, c, d, a, 19,  0, 20); \
+        MD5_STEP(MD5_G, a, b, c, d, 20,  5,  5);  MD5_STEP(MD5_G, d, a, b, c, 21, 10,  9); \
+        MD5_STEP(MD5_G, c, d, a, b, 22, 15, 14);  MD5_STEP(MD5_G, b, c, d, a, 23,  4, 20); \
+        MD5_STEP(MD5_G, a, b, c, d, 24,  9,  5);  MD5_STEP(MD5_G, d, a, b, c, 25, 14,  9); \
+        MD5_STEP(MD5_G, c, d, a, b, 26,  3, 14);  MD5_STEP(MD5_G, b, c, d, a, 27,  8, 20); \
+        MD5_STEP(MD5_G, a, b, c, d, 28, 13,  5);  MD5_STEP(MD5_G, d, a, b, c, 29,  2,  9); \
+        MD5_STEP(MD5_G, c, d, a, b, 30,  7, 14);  MD5_STEP(MD5_G, b, c, d, a, 31, 12, 20); \
+        MD5_STEP(MD5_H, a, b, c, d, 32,  5,  4);  MD5_STEP(MD5_H, d, a, b, c, 33,  8, 11); \
+        MD5_STEP(MD5_H, c, d, a, b, 34, 11, 16);  MD5_STEP(MD5_H, b, c, d, a, 35, 14, 23); \
+        MD5_STEP(MD5_H, a, b, c, d, 36,  1,  4);  MD5_STEP(MD5_H, d, a, b, c, 37,  4, 11); \
+        MD5_STEP(MD5_H, c, d, a, b, 38,  7, 16);  MD5_STEP(MD5_H, b, c, d, a, 39, 10, 23); \
+        MD5_STEP(MD5_H, a, b, c, d, 40, 13,  4);  MD5_STEP(MD5_H, d, a, b, c, 41,  0, 11); \
+        MD5_STEP(MD5_H, c, d, a, b, 42,  3, 16);  MD5_STEP(MD5_H, b, c, d, a, 43,  6, 23); \
+        MD5_STEP(MD5_H, a, b, c, d, 44,  9,  4);  MD5_STEP(MD5_H, d, a, b, c, 45, 12, 11); \
+        MD5_STEP(MD5_H, c, d, a, b, 46, 15, 16);  MD5_STEP(MD5_H, b, c, d, a, 47,  2, 23); \
+        MD5_STEP(MD5_I, a, b, c, d, 48,  0,  6);  MD5_STEP(MD5_I, d, a, b, c, 49,  7, 10); \
+        MD5_STEP(MD5_I, c, d, a, b, 50, 14, 15);  MD5_STEP(MD5_I, b, c, d, a, 51,  5, 21); \
+        MD5_STEP(MD5_I, a, b, c, d, 52, 12,  6);  MD5_STEP(MD5_I, d, a, b, c, 53,  3, 10); \
+        MD5_STEP(MD5_I, c, d, a, b, 54, 10, 15);  MD5_STEP(MD5_I, b, c, d, a, 55,  1, 21); \
+        MD5_STEP(MD5_I, a, b, c, d, 56,  8,  6);  MD5_STEP(MD5_I, d, a, b, c, 57, 15, 10); \
+        MD5_STEP(MD5_I, c, d, a, b, 58,  6, 15);  MD5_STEP(MD5_I, b, c, d, a, 59, 13, 21); \
+        MD5_STEP(MD5_I, a, b, c, d, 60,  4,  6);  MD5_STEP(MD5_I, d, a, b, c, 61, 11, 10); \
+        MD5_STEP(MD5_I, c, d, a, b, 62,  2, 15);  MD5_STEP(MD5_I, b, c, d, a, 63,  9, 21); \
+        A = MD5_ADD(A, a); B = MD5_ADD(B, b); C = MD5_ADD(C, c); D = MD5_ADD(D, d); \
+    }
+
+#define MD5_ADD(x, y)   _mm_add_epi32(x, y)
+#define MD5_XOR(x, y)   _mm_xor_si128(x, y)
+#define MD5_AND(x, y)   _mm_and_si128(x, y)
+#define MD5_OR(x, y)    _mm_or_si128(x, y)
+#define MD5_ROTL(x, s)  _mm_or_si128(_mm_slli_epi32(x, s), _mm_srli_epi32(x, 32 - s))
+#define MD5_SET1(k)     _mm_set1_epi32((int)(k))
+
+// Loads 4 DWORDs from each of the 4 lanes and transposes them, so each vector holds one DWORD of all lanes
+#define MD5_LOAD_4X4(W, p0, p1, p2, p3)                                         \
+    {                                                                           \
+        __m128i T0 = _mm_loadu_si128((const __m128i *)(p0));                    \
+        __m128i T1 = _mm_loadu_si128((const __m128i *)(p1));                    \
+        __m128i T2 = _mm_loadu_si128((const __m128i *)(p2));                    \
+        __m128i T3 = _mm_loadu_si128((const __m128i *)(p3));                    \
+        __m128i U0 = _mm_unpacklo_epi32(T0, T1);                                \
+        __m128i U1 = _mm_unpackhi_epi32(T0, T1);                                \
+        __m128i U2 = _mm_unpacklo_epi32(T2, T3);                                \
+        __m128i U3 = _mm_unpackhi_epi32(T2, T3);                                \
+        W[0] = _mm_unpacklo_epi64(U0, U2);                                      \
+        W[1] = _mm_unpackhi_epi64(U0, U2);                                      \
+        W[2] = _mm_unpacklo_epi64(U1, U3);                                      \
+        W[3] = _mm_unpackhi_epi64(U1, U3);                                      \
+    }
+
+STORMLIB_TARGET_SSE2 static void Md5Blocks_SSE2(__m128i * State, const BYTE ** Lanes, DWORD dwBlocks)
+{
+    const __m128i Ones = _mm_set1_epi32(-1);
+    __m128i A = State[0], B = State[1], C = State[2], D = State[3];
+    __m128i a, b, c, d;
+    __m128i W[16];
+
+    for(DWORD i = 0; i < dwBlocks; i++)
+    {
+        DWORD dwOffset = i * MD5_BLOCK_SIZE;
+
+        for(DWORD j = 0; j < 16; j += 4)
+            MD5_LOAD_4X4((W + j), Lanes[0] + dwOffset + j * 4, Lanes[1] + dwOffset + j * 4, Lanes[2] + dwOffset + j * 4, Lanes[3] + dwOffset + j * 4);
+        MD5_COMPRESS();
+    }
+
+    State[0] = A; State[1] = B; State[2] = C; State[3] = D;
+}
+
+// Hashes 4 chunks of the same length
+STORMLIB_TARGET_SSE2 static void CalculateDataBlockHashes_SSE2(const BYTE ** Chunks, DWORD cbChunk, LPBYTE md5_array)
+{
+    __m128i State[4];
+    const BYTE * Lanes[4];
+    BYTE Tails[4][2 * MD5_BLOCK_SIZE];
+    DWORD Digests[4][4];
+    DWORD dwTailBlocks = 0;
+
+    State[0] = _mm_set1_epi32(0x67452301);
+    State[1] = _mm_set1_epi32((int)0xEFCDAB89);
+    State[2] = _mm_set1_epi32((int)0x98BADCFE);
+    State[3] = _mm_set1_epi32(0x10325476);
+
+    // All full blocks directly from the chunks, then the tail blocks
+    Md5Blocks_SSE2(State, Chunks, cbChunk / MD5_BLOCK_SIZE);
+    for(DWORD i = 0; i < 4; i++)
+    {
+        dwTailBlocks = Md5PrepareTail(Tails[i], Chunks[i], cbChunk);
+        Lanes[i] = Tails[i];
+    }
+    Md5Blocks_SSE2(State, Lanes, dwTailBlocks);
+
+    // The digest is the state stored in little endian
+    for(DWORD i = 0; i < 4; i++)
+        _mm_storeu_si128((__m128i *)Digests[i], State[i]);
+    for(DWORD i = 0; i < 4; i++, md5_array += MD5_DIGEST_SIZE)
+    {
+        for(DWORD j = 0; j < 4; j++)
+            StoreUInt32(md5_array + j * sizeof(DWORD), Digests[j][i]);
+    }
+}
+
+#undef MD5_ADD
+#undef MD5_XOR
+#undef MD5_AND
+#undef MD5_OR
+#undef MD5_ROTL
+#undef MD5_SET1
+
+#ifdef STORMLIB_X86_AVX2
+
+#define MD5_ADD(x, y)   _mm256_add_epi32(x, y)
+#define MD5_XOR(x, y)   _mm256_xor_si256(x, y)
+#define MD5_AND(x, y)   _mm256_and_si256(x, y)
+#define MD5_OR(x, y)    _mm256_or_si256(x, y)
+#define MD5_ROTL(x, s)  _mm256_or_si256(_mm256_slli_epi32(x, s), _mm256_srli_epi32(x, 32 - s))
+#define MD5_SET1(k)     _mm256_set1_epi32((int)(k))
+
+STORMLIB_TARGET_AVX2 static void Md5Blocks_AVX2(__m256i * State, const BYTE ** Lanes, DWORD dwBlocks)
+{
+    const __m256i Ones = _mm256_set1_epi32(-1);
+    __m256i A = State[0], B = State[1], C = State[2], D = State[3];
+    __m256i a, b, c, d;
+    __m256i W[16];
+
+    for(DWORD i = 0; i < dwBlocks; i++)
+    {
+        DWORD dwOffset = i * MD5_BLOCK_SIZE;
+
+        // Load 8 DWORDs from each lane and transpose the 8x8 matrix, for both halves of the block
+        for(DWORD j = 0; j < 16; j += 8)
+        {
+            __m256i T0 = _mm256_loadu_si256((const __m256i *)(Lanes[0] + dwOffset + j * 4));
+            __m256i T1 = _mm256_loadu_si256((const __m256i *)(Lanes[1] + dwOffset + j * 4));
+            __m256i T2 = _mm256_loadu_si256((const __m256i *)(Lanes[2] + dwOffset + j * 4));
+            __m256i T3 = _mm256_loadu_si256((const __m256i *)(Lanes[3] + dwOffset + j * 4));
+            __m256i T4 = _mm256_loadu_si256((const __m256i *)(Lanes[4] + dwOffset + j * 4));
+            __m256i T5 = _mm256_loadu_si256((const __m256i *)(Lanes[5] + dwOffset + j * 4));
+            __m256i T6 = _mm256_loadu_si256((const __m256i *)(Lanes[6] + dwOffset + j * 4));
+            __m256i T7 = _mm256_loadu_si256((const __m256i *)(Lanes[7] + dwOffset + j * 4));
+            __m256i U0 = _mm256_unpacklo_epi32(T0, T1);
+            __m256i U1 = _mm256_unpackhi_epi32(T0, T1);
+            __m256i U2 = _mm256_unpacklo_epi32(T2, T3);
+            __m256i U3 = _mm256_unpackhi_epi32(T2, T3);
+            __m256i U4 = _mm256_unpacklo_epi32(T4, T5);
+            __m256i U5 = _mm256_unpackhi_epi32(T4, T5);
+            __m256i U6 = _mm256_unpacklo_epi32(T6, T7);
+            __m256i U7 = _mm256_unpackhi_epi32(T6, T7);
+
+            T0 = _mm256_unpacklo_epi64(U0, U2);
+            T1 = _mm256_unpackhi_epi64(U0, U2);
+            T2 = _mm256_unpacklo_epi64(U1, U3);
+            T3 = _mm256_unpackhi_epi64(U1, U3);
+            T4 = _mm256_unpacklo_epi64(U4, U6);
+            T5 = _mm256_unpackhi_epi64(U4, U6);
+            T6 = _mm256_unpacklo_epi64(U5, U7);
+            T7 = _mm256_unpackhi_epi64(U5, U7);
+
+            W[j + 0] = _mm256_permute2x128_si256(T0, T4, 0x20);
+            W[j + 1] = _mm256_permute2x128_si256(T1, T5, 0x20);
+            W[j + 2] = _mm256_permute2x128_si256(T2, T6, 0x20);
+            W[j + 3] = _mm256_permute2x128_si256(T3, T7, 0x20);
+            W[j + 4] = _mm256_permute2x128_si256(T0, T4, 0x31);
+            W[j + 5] = _mm256_permute2x128_si256(T1, T5, 0x31);
+            W[j + 6] = _mm256_permute2x128_si256(T2, T6, 0x31);
+            W[j + 7] = _mm256_permute2x128_si256(T3, T7, 0x31);
+        }
+        MD5_COMPRESS();
+    }
+
+    State[0] = A; State[1] = B; State[2] = C; State[3] = D;
+}
+
+// Hashes 8 chunks of the same length
+STORMLIB_TARGET_AVX2 static void CalculateDataBlockHashes_AVX2(const BYTE ** Chunks, DWORD cbChunk, LPBYTE md5_array)
+{
+    __m256i State[4];
+    const BYTE * Lanes[8];
+    BYTE Tails[8][2 * MD5_BLOCK_SIZE];
+    DWORD Digests[4][8];
+    DWORD dwTailBlocks = 0;
+
+    State[0] = _mm256_set1_epi32(0x67452301);
+    State[1] = _mm256_set1_epi32((int)0xEFCDAB89);
+    State[2] = _mm256_set1_epi32((int)0x98BADCFE);
+    State[3] = _mm256_set1_epi32(0x10325476);
+
+    // All full blocks directly from the chunks, then the tail blocks
+    Md5Blocks_AVX2(State, Chunks, cbChunk / MD5_BLOCK_SIZE);
+    for(DWORD i = 0; i < 8; i++)
+    {
+        dwTailBlocks = Md5PrepareTail(Tails[i], Chunks[i], cbChunk);
+        Lanes[i] = Tails[i];
+    }
+    Md5Blocks_AVX2(State, Lanes, dwTailBlocks);
+
+    // The digest is the state stored in little endian
+    for(DWORD i = 0; i < 4; i++)
+        _mm256_storeu_si256((__m256i *)Digests[i], State[i]);
+    for(DWORD i = 0; i < 8; i++, md5_array += MD5_DIGEST_SIZE)
+    {
+        for(DWORD j = 0; j < 4; j++)
+            StoreUInt32(md5_array + j * sizeof(DWORD), Digests[j][i]);
+    }
+}
+
+#endif  // STORMLIB_X86_AVX2
+
+#undef MD5_ADD
+#undef MD5_XOR
+#undef MD5_AND
+#undef MD5_OR
+#undef MD5_ROTL
+#undef MD5_SET1
+#endif  // STORMLIB_X86_SIMD
+
+// Calculates MD5 of each chunk of the data block. The last chunk may be shorter.
+// Groups of chunks with the same length are hashed by the multi-buffer code, if the CPU supports it
+void CalculateDataBlockHashes(void * pvDataBlock, DWORD cbDataBlock, DWORD dwChunkSize, LPBYTE md5_array)
+{
+    const BYTE * pbDataBlock = (const BYTE *)pvDataBlock;
+    DWORD dwFullChunks = cbDataBlock / dwChunkSize;
+    DWORD i = 0;
+
+#ifdef STORMLIB_X86_SIMD
+    {
+        DWORD dwFeatures = StormCpu_GetFeatures();
+        const BYTE * Chunks[8];
+
+#ifdef STORMLIB_X86_AVX2
+        if(dwFeatures & STORM_CPU_FEATURE_AVX2)
+        {
+            for(; (i + 8) <= dwFullChunks; i += 8)
+            {
+                for(DWORD j = 0; j < 8; j++)
+                    Chunks[j] = pbDataBlock + (i + j) * dwChunkSize;
+                CalculateDataBlockHashes_AVX2(Chunks, dwChunkSize, md5_array + i * MD5_DIGEST_SIZE);
+            }
+        }
+#endif
+
+        if(dwFeatures & STORM_CPU_FEATURE_SSE2)
+        {
+            for(; (i + 4) <= dwFullChunks; i += 4)
+            {
+                for(DWORD j = 0; j < 4; j++)
+                    Chunks[j] = pbDataBlock + (i + j) * dwChunkSize;
+                CalculateDataBlockHashes_SSE2(Chunks, dwChunkSize, md5_array + i * MD5_DIGEST_SIZE);
+            }
+        }
+    }
+#endif
+
+    // The remaining chunks one by one
+    for(; (i * dwChunkSize) < cbDataBlock; i++)
+    {
+        DWORD cbChunk = STORMLIB_MIN(dwChunkSize, cbDataBlock - i * dwChunkSize);
+
+        CalculateDataBlockHash((LPBYTE)pbDataBlock + i * dwChunkSize, cbChunk, md5_array + i * MD5_DIGEST_SIZE);
+    }
+}
+
 //-----------------------------------------------------------------------------
 // Free the handle structures
 
@@ -1841,11 +3013,24 @@ static void DeleteArchiveHandle(TMPQArchive * ha)
         STORM_FREE(ha->pHashTable);
     if(ha->pHetTable != NULL)
         FreeHetTable(ha->pHetTable);
+    // Free the pseudo names that were replaced while the archive was open
+    if(ha->pRetiredNames != NULL)
+    {
+        for(DWORD i = 0; i < ha->dwRetiredNames; i++)
+            STORM_FREE(ha->pRetiredNames[i]);
+        STORM_FREE(ha->pRetiredNames);
+    }
+
+    SectorCache_Free(ha);
+    PatchCache_Free(ha);
+    ResetMpqSpace(ha);
+    StormLock_Free(&ha->Lock);
     STORM_FREE(ha);
 }
 
 void FreeFileHandle(TMPQFile *& hf)
 {
+    TFileEntry * pFileEntry;
     TMPQArchive * ha;
 
     if(hf != NULL)
@@ -1865,11 +3050,28 @@ void FreeFileHandle(TMPQFile *& hf)
             STORM_FREE(hf->SectorChksums);
         if(hf->hctx != NULL)
             STORM_FREE(hf->hctx);
+        if(hf->pWriteBatch != NULL)
+            STORM_FREE(hf->pWriteBatch);
         if(hf->pbFileSector != NULL)
             STORM_FREE(hf->pbFileSector);
         if(hf->pStream != NULL)
             FileStream_Close(hf->pStream);
 
+        // Give back the part of the reserved space that the file data didn't take.
+        // If the file has not been added, the entire reserved space is given back.
+        // Also give back the space of the file that has been replaced, if any
+        if((ha = hf->ha) != NULL && hf->bIsWriteHandle)
+        {
+            pFileEntry = hf->pFileEntry;
+            if(pFileEntry != NULL && (pFileEntry->dwFlags & MPQ_FILE_EXISTS) && pFileEntry->ByteOffset == hf->MpqFilePos)
+                ReleaseMpqSpace(ha, GetFileEntryDataEnd(ha, pFileEntry), hf->ReservedEnd);
+            else
+                ReleaseMpqSpace(ha, hf->MpqFilePos, hf->ReservedEnd);
+
+            if(pFileEntry != NULL)
+                ReleaseFileEntrySpace(ha, pFileEntry, hf->Replaced.ByteOffset, hf->Replaced.EndOffset);
+        }
+
         // Dereference file count in the archive handle
         if((ha = hf->ha) != NULL)
             DereferenceArchiveFiles(ha);
@@ -1882,15 +3084,25 @@ void FreeFileHandle(TMPQFile *& hf)
 
 bool DereferenceArchiveFiles(TMPQArchive * ha)
 {
-    // There must be at least one reference
-    if(ha == NULL || ha->dwFileCount == 0)
+    bool bDeleteArchive;
+
+    // There must be a valid archive
+    if(ha == NULL)
         return false;
 
-    // Decrement the file count
+    // Decrement the file count. Files may be closed from multiple threads
+    StormLock_Enter(&ha->Lock);
+    if(ha->dwFileCount == 0)
+    {
+        StormLock_Leave(&ha->Lock);
+        return false;
+    }
     ha->dwFileCount--;
+    bDeleteArchive = (ha->dwRefCount == 0 && ha->dwFileCount == 0);
+    StormLock_Leave(&ha->Lock);
 
     // If we reached zero, free the archive
-    if(ha->dwRefCount == 0 && ha->dwFileCount == 0)
+    if(bDeleteArchive)
         DeleteArchiveHandle(ha);
     return true;
 }
@@ -2069,4 +3281,4 @@ void SFileLog(const char * format, ...)
     }
 }
 #endif
-*/
\ No newline at end of file
+*/
\ No newline at end of file
@@ -824,9 +824,9 @@ static bool IsValidHashEntry1(TMPQArchive * ha, TMPQHash * pHash, TMPQBlock * pB
 // 2) A hash table entry with the neutral|matching locale and neutral|matching platform
 // 3) NULL
 // Storm_2016.dll: 15020940
-static TMPQHash * GetHashEntryLocale(TMPQArchive * ha, const char * szFileName, LCID lcFileLocale)
+static TMPQHash * GetHashEntryLocale(TMPQArchive * ha, const TFileNameHash & NameHash, LCID lcFileLocale)
 {
-    TMPQHash * pFirstHash = GetFirstHashEntry(ha, szFileName);
+    TMPQHash * pFirstHash = GetFirstHashEntry(ha, NameHash);
     TMPQHash * pBestEntry = NULL;
     TMPQHash * pHash = pFirstHash;
     USHORT Locale = SFILE_LOCALE(lcFileLocale);
@@ -866,9 +866,9 @@ static TMPQHash * GetHashEntryLocale(TMPQArchive * ha, const char * szFileName,
 // 2) NULL
 // In case there are multiple items with the same locale&platform,
 // we need to return the last one. This is because it must correspond to SFileOpenFileEx
-static TMPQHash * GetHashEntryExact(TMPQArchive * ha, const char * szFileName, LCID lcFileLocale)
+static TMPQHash * GetHashEntryExact(TMPQArchive * ha, const TFileNameHash & NameHash, LCID lcFileLocale)
 {
-    TMPQHash * pFirstHash = GetFirstHashEntry(ha, szFileName);
+    TMPQHash * pFirstHash = GetFirstHashEntry(ha, NameHash);
     TMPQHash * pBestHash = NULL;
     TMPQHash * pHash = pFirstHash;
     USHORT Locale = SFILE_LOCALE(lcFileLocale);
@@ -889,6 +889,17 @@ static TMPQHash * GetHashEntryExact(TMPQArchive * ha, const char * szFileName, L
     return pBestHash;
 }
 
+// Only used by the assert in AllocateFileEntry. The condition matches the one of assert
+#ifndef NDEBUG
+static TMPQHash * GetHashEntryExact(TMPQArchive * ha, const char * szFileName, LCID lcFileLocale)
+{
+    TFileNameHash NameHash;
+
+    HashFileName(ha, szFileName, NameHash);
+    return GetHashEntryExact(ha, NameHash, lcFileLocale);
+}
+#endif
+
 // Defragment the file table so it does not contain any gaps
 // Note: As long as all values of all TMPQHash::dwBlockIndex
 // are not HASH_ENTRY_FREE, the startup search index does not matter.
@@ -1616,7 +1627,7 @@ static TMPQExtHeader * TranslateHetTable(TMPQHetTable * pHetTable, ULONGLONG * p
     return (TMPQExtHeader *)pbLinearTable;
 }
 
-static DWORD GetFileIndex_Het(TMPQArchive * ha, const char * szFileName)
+static DWORD GetFileIndex_Het(TMPQArchive * ha, ULONGLONG JenkinsHash)
 {
     TMPQHetTable * pHetTable = ha->pHetTable;
     ULONGLONG FileNameHash;
@@ -1631,8 +1642,8 @@ static DWORD GetFileIndex_Het(TMPQArchive * ha, const char * szFileName)
     // Do nothing if the MPQ has no HET table
     assert(ha->pHetTable != NULL);
 
-    // Calculate 64-bit hash of the file name
-    FileNameHash = (HashStringJenkins(szFileName) & pHetTable->AndMask64) | pHetTable->OrMask64;
+    // Mask the 64-bit hash of the file name
+    FileNameHash = (JenkinsHash & pHetTable->AndMask64) | pHetTable->OrMask64;
 
     // Split the file name hash into two parts:
     // NameHash1: The highest 8 bits of the name hash
@@ -2047,7 +2058,31 @@ void FreeBetTable(TMPQBetTable * pBetTable)
 //-----------------------------------------------------------------------------
 // Support for file table
 
+// Calculates the name hashes for the tables that the archive has.
+// Storm hashes are only needed for the hash table, Jenkins hash only for HET table
+void CalculateNameHashes(TMPQArchive * ha, const char * szFileName, TFileNameHash & NameHash)
+{
+    if(ha->pHashTable != NULL)
+    {
+        HashFileName(ha, szFileName, NameHash, (ha->pHetTable != NULL));
+    }
+    else
+    {
+        NameHash.dwHashIndex = NameHash.dwHashCheck1 = NameHash.dwHashCheck2 = 0;
+        NameHash.JenkinsHash = (ha->pHetTable != NULL) ? HashStringJenkins(szFileName) : 0;
+    }
+}
+
 TFileEntry * GetFileEntryLocale(TMPQArchive * ha, const char * szFileName, LCID lcFileLocale, LPDWORD PtrHashIndex)
+{
+    TFileNameHash NameHash;
+
+    // Calculate all hashes that we might need in one pass over the name
+    CalculateNameHashes(ha, szFileName, NameHash);
+    return GetFileEntryLocale(ha, NameHash, lcFileLocale, PtrHashIndex);
+}
+
+TFileEntry * GetFileEntryLocale(TMPQArchive * ha, const TFileNameHash & NameHash, LCID lcFileLocale, LPDWORD PtrHashIndex)
 {
     TMPQHash * pHash;
     DWORD dwFileIndex;
@@ -2057,7 +2092,7 @@ TFileEntry * GetFileEntryLocale(TMPQArchive * ha, const char * szFileName, LCID
     // we will need the pointer to hash table entry
     if(ha->pHashTable != NULL)
     {
-        pHash = GetHashEntryLocale(ha, szFileName, lcFileLocale);
+        pHash = GetHashEntryLocale(ha, NameHash, lcFileLocale);
         if(pHash != NULL && MPQ_BLOCK_INDEX(pHash) < ha->dwFileTableSize)
         {
             if(PtrHashIndex != NULL)
@@ -2069,7 +2104,7 @@ TFileEntry * GetFileEntryLocale(TMPQArchive * ha, const char * szFileName, LCID
     // If we have HET table in the MPQ, try to find the file in HET table
     if(ha->pHetTable != NULL)
     {
-        dwFileIndex = GetFileIndex_Het(ha, szFileName);
+        dwFileIndex = GetFileIndex_Het(ha, NameHash.JenkinsHash);
         if(dwFileIndex != HASH_ENTRY_FREE)
             return ha->pFileTable + dwFileIndex;
     }
@@ -2080,13 +2115,17 @@ TFileEntry * GetFileEntryLocale(TMPQArchive * ha, const char * szFileName, LCID
 
 TFileEntry * GetFileEntryExact(TMPQArchive * ha, const char * szFileName, LCID lcFileLocale, LPDWORD PtrHashIndex)
 {
+    TFileNameHash NameHash;
     TMPQHash * pHash;
     DWORD dwFileIndex;
 
+    // Calculate all hashes that we might need in one pass over the name
+    CalculateNameHashes(ha, szFileName, NameHash);
+
     // If the hash table is present, find the entry from hash table
     if(ha->pHashTable != NULL)
     {
-        pHash = GetHashEntryExact(ha, szFileName, lcFileLocale);
+        pHash = GetHashEntryExact(ha, NameHash, lcFileLocale);
         if(pHash != NULL && MPQ_BLOCK_INDEX(pHash) < ha->dwFileTableSize)
         {
             if(PtrHashIndex != NULL)
@@ -2098,7 +2137,7 @@ TFileEntry * GetFileEntryExact(TMPQArchive * ha, const char * szFileName, LCID l
     // If we have HET table in the MPQ, try to find the file in HET table
     if(ha->pHetTable != NULL)
     {
-        dwFileIndex = GetFileIndex_Het(ha, szFileName);
+        dwFileIndex = GetFileIndex_Het(ha, NameHash.JenkinsHash);
         if(dwFileIndex != HASH_ENTRY_FREE)
         {
             if(PtrHashIndex != NULL)
@@ -2111,25 +2150,55 @@ TFileEntry * GetFileEntryExact(TMPQArchive * ha, const char * szFileName, LCID l
     return NULL;
 }
 
+// Keeps a replaced file name until the archive is closed. Other threads
+// may read the file name without the lock, so it cannot be freed yet.
+// Must be called with ha->Lock held
+static void RetireFileName(TMPQArchive * ha, char * szFileName)
+{
+    char ** pRetiredNames;
+
+    // Make sure there is space for one more name. If we cannot allocate it,
+    // the name is lost until the process ends, which is still safe
+    if(ha->dwRetiredNames >= ha->dwRetiredNamesMax)
+    {
+        DWORD dwNewMax = (ha->dwRetiredNamesMax != 0) ? (ha->dwRetiredNamesMax * 2) : 0x10;
+
+        if((pRetiredNames = STORM_REALLOC(char *, ha->pRetiredNames, dwNewMax)) == NULL)
+            return;
+        ha->pRetiredNames = pRetiredNames;
+        ha->dwRetiredNamesMax = dwNewMax;
+    }
+
+    ha->pRetiredNames[ha->dwRetiredNames++] = szFileName;
+}
+
 void AllocateFileName(TMPQArchive * ha, TFileEntry * pFileEntry, const char * szFileName)
 {
+    char * szOldName;
+    char * szNewName;
+
     // Sanity check
     assert(pFileEntry != NULL);
 
-    // If the file name is pseudo file name, free it at this point
-    if(IsPseudoFileName(pFileEntry->szFileName, NULL))
-    {
-        if(pFileEntry->szFileName != NULL)
-            STORM_FREE(pFileEntry->szFileName);
-        pFileEntry->szFileName = NULL;
-    }
+    // The file entry is shared by all file handles, which may be opened
+    // by multiple threads. Make sure that only one of them updates the name
+    StormLock_Enter(&ha->Lock);
+    szOldName = pFileEntry->szFileName;
 
-    // Only allocate new file name if it's not there yet
-    if(pFileEntry->szFileName == NULL)
+    // Only allocate new file name if it's not there yet or if it's a pseudo file name
+    if(szOldName == NULL || IsPseudoFileName(szOldName, NULL))
     {
-        pFileEntry->szFileName = STORM_ALLOC(char, strlen(szFileName) + 1);
-        if(pFileEntry->szFileName != NULL)
-            strcpy(pFileEntry->szFileName, szFileName);
+        // Copy the whole name before it's stored to the file entry,
+        // so that the readers never see a partially copied name.
+        // The old pseudo name may still be in use by them, so we don't free it
+        if((szNewName = STORM_ALLOC(char, strlen(szFileName) + 1)) != NULL)
+        {
+            strcpy(szNewName, szFileName);
+            pFileEntry->szFileName = szNewName;
+
+            if(szOldName != NULL)
+                RetireFileName(ha, szOldName);
+        }
     }
 
     // We also need to create the file name hash
@@ -2140,6 +2209,8 @@ void AllocateFileName(TMPQArchive * ha, TFileEntry * pFileEntry, const char * sz
 
         pFileEntry->FileNameHash = (HashStringJenkins(szFileName) & AndMask64) | OrMask64;
     }
+
+    StormLock_Leave(&ha->Lock);
 }
 
 TFileEntry * AllocateFileEntry(TMPQArchive * ha, const char * szFileName, LCID lcFileLocale, LPDWORD PtrHashIndex)
@@ -2159,8 +2230,10 @@ TFileEntry * AllocateFileEntry(TMPQArchive * ha, const char * szFileName, LCID l
 
     // Now find a free entry in the file table.
     // Note that in the case when free entries are in the middle,
-    // we need to use these
-    for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
+    // we need to use these. During SFileCommitBulkAdd, we skip the entries
+    // that have been found used before
+    pFileEntry = ha->pFileTable + ((ha->BulkAddPos != 0) ? ha->dwBulkAddFileIndex : 0);
+    for(; pFileEntry < pFileTableEnd; pFileEntry++)
     {
         if((pFileEntry->dwFlags & MPQ_FILE_EXISTS) == 0)
         {
@@ -2181,6 +2254,10 @@ TFileEntry * AllocateFileEntry(TMPQArchive * ha, const char * szFileName, LCID l
     if(pFreeEntry == NULL || dwFreeCount <= dwReservedFiles)
         return NULL;
 
+    // The entries before this one are used
+    if(ha->BulkAddPos != 0)
+        ha->dwBulkAddFileIndex = (DWORD)(pFreeEntry - ha->pFileTable) + 1;
+
     // Initialize the file entry and set its file name
     memset(pFreeEntry, 0, sizeof(TFileEntry));
     AllocateFileName(ha, pFreeEntry, szFileName);
@@ -2205,7 +2282,7 @@ TFileEntry * AllocateFileEntry(TMPQArchive * ha, const char * szFileName, LCID l
     // Note: Don't bother modifying the HET table. It will be rebuilt from scratch after, anyway
     if(ha->pHetTable != NULL)
     {
-        assert(GetFileIndex_Het(ha, szFileName) == HASH_ENTRY_FREE);
+        assert(GetFileIndex_Het(ha, HashStringJenkins(szFileName)) == HASH_ENTRY_FREE);
     }
 
     // Return the free table entry
@@ -2282,6 +2359,11 @@ DWORD DeleteFileEntry(TMPQArchive * ha, TMPQFile * hf)
         pHashEntry->dwBlockIndex = HASH_ENTRY_DELETED;
     }
 
+    // Give the file data back to the free space. Files being written
+    // give back their reserved space when the handle is freed
+    if(hf->bIsWriteHandle == false)
+        ReleaseFileEntrySpace(ha, pFileEntry, pFileEntry->ByteOffset, GetFileEntryDataEnd(ha, pFileEntry));
+
     // Free the file name, and set the file entry as deleted
     if(pFileEntry->szFileName != NULL)
         STORM_FREE(pFileEntry->szFileName);
@@ -2338,6 +2420,9 @@ DWORD InvalidateInternalFile(TMPQArchive * ha, const char * szFileName, DWORD dw
 
 void InvalidateInternalFiles(TMPQArchive * ha)
 {
+    // The content of the archive is going to change
+    SectorCache_Flush(ha);
+
     // Do nothing if we are in the middle of saving internal files
     if(!(ha->dwFlags & MPQ_FLAG_SAVING_TABLES))
     {
@@ -2856,6 +2941,9 @@ DWORD DefragmentFileTable(TMPQArchive * ha)
     DWORD dwSrcIndex;
     DWORD dwTrgIndex;
 
+    // The file indexes are going to change, so the cached sectors would not match
+    SectorCache_Flush(ha);
+
     // Allocate brand new file table
     DefragmentTable = STORM_ALLOC(DWORD, ha->dwFileTableSize);
     if(DefragmentTable != NULL)
@@ -3155,16 +3243,9 @@ DWORD SaveMPQTables(TMPQArchive * ha)
         TablePos += HiBlockTableSize64;
     }
 
-    // Cut the MPQ
-    if(dwErrCode == ERROR_SUCCESS)
-    {
-        ULONGLONG FileSize = ha->MpqPos + TablePos;
-
-        if(!FileStream_SetSize(ha->pStream, FileSize))
-            dwErrCode = SErrGetLastError();
-    }
-
-    // Write the MPQ header
+    // Write the MPQ header. This must be done before the MPQ is cut,
+    // because the data beyond the new end may be the tables that
+    // the old header refers to
     if(dwErrCode == ERROR_SUCCESS)
     {
         TMPQHeader SaveMpqHeader;
@@ -3187,6 +3268,15 @@ DWORD SaveMPQTables(TMPQArchive * ha)
             dwErrCode = SErrGetLastError();
     }
 
+    // Cut the MPQ
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        ULONGLONG FileSize = ha->MpqPos + TablePos;
+
+        if(!FileStream_SetSize(ha->pStream, FileSize))
+            dwErrCode = SErrGetLastError();
+    }
+
     // Clear the changed flag
     if(dwErrCode == ERROR_SUCCESS)
         ha->dwFlags &= ~MPQ_FLAG_CHANGED;
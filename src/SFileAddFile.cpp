@@ -80,6 +80,53 @@ static bool IsWaveFile_16BitsPerAdpcmSample(
     return false;
 }
 
+// Deals with various combination of compressions given to SFileAddFileEx.
+// Returns true if the compression of next sectors must be chosen
+// by the WAVE header of the file (see GetWaveCompressionNext)
+static bool PrepareAddFileCompression(LPDWORD PtrCompression, LPDWORD PtrCompressionNext)
+{
+    // When the compression for next blocks is set to default,
+    // we will copy the compression for the first sector
+    if(PtrCompressionNext[0] == MPQ_COMPRESSION_NEXT_SAME)
+        PtrCompressionNext[0] = PtrCompression[0];
+
+    // If the caller wants ADPCM compression, we make sure
+    // that the first sector is not compressed with lossy compression
+    if(PtrCompressionNext[0] & (MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO))
+    {
+        // The compression of the first file sector must not be ADPCM
+        // in order not to corrupt the headers
+        if(PtrCompression[0] & (MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO))
+            PtrCompression[0] = MPQ_COMPRESSION_PKWARE;
+
+        // Remove both flag mono and stereo flags.
+        // They will be re-added according to WAVE type
+        PtrCompressionNext[0] &= ~(MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO);
+        return true;
+    }
+
+    return false;
+}
+
+// Returns the compression of next sectors, chosen by the WAVE header of the file
+static DWORD GetWaveCompressionNext(LPBYTE pbFileData, DWORD cbFileData, DWORD dwCompression, DWORD dwCompressionNext)
+{
+    DWORD dwChannels = 0;
+
+    // The file must really be a WAVE file with at least 16 bits per sample,
+    // otherwise the ADPCM compression will corrupt it
+    if(IsWaveFile_16BitsPerAdpcmSample(pbFileData, cbFileData, &dwChannels))
+    {
+        // Setup the compression of next sectors according to number of channels
+        return dwCompressionNext | ((dwChannels == 1) ? MPQ_COMPRESSION_ADPCM_MONO : MPQ_COMPRESSION_ADPCM_STEREO);
+    }
+    else
+    {
+        // Setup the compression of next sectors to a lossless compression
+        return (dwCompression & MPQ_LOSSY_COMPRESSION_MASK) ? MPQ_COMPRESSION_PKWARE : dwCompression;
+    }
+}
+
 static DWORD FillWritableHandle(
     TMPQArchive * ha,
     TMPQFile * hf,
@@ -121,6 +168,80 @@ static DWORD FillWritableHandle(
 //-----------------------------------------------------------------------------
 // MPQ write data functions
 
+// Compresses one file sector by the compression given by the file flags.
+// pbCompressed must have at least (cbSector + 0x100) bytes.
+// Returns the size of the compressed data.
+static DWORD CompressFileSector(
+    DWORD dwFlags,
+    LPBYTE pbSector,
+    DWORD cbSector,
+    LPBYTE pbCompressed,
+    DWORD dwCompression)
+{
+    int nOutBuffer = (int)cbSector;
+    int nInBuffer = (int)cbSector;
+    int nCompressionLevel;                  // ADPCM compression level (only used for wave files)
+
+    //
+    // Note that both SCompImplode and SCompCompress copy data as-is,
+    // if they are unable to compress the data.
+    //
+
+    if(dwFlags & MPQ_FILE_IMPLODE)
+    {
+        SCompImplode(pbCompressed, &nOutBuffer, pbSector, nInBuffer);
+    }
+
+    if(dwFlags & MPQ_FILE_COMPRESS)
+    {
+        // If the caller wants ADPCM compression, we will set wave compression level to 4,
+        // which corresponds to medium quality
+        nCompressionLevel = (dwCompression & MPQ_LOSSY_COMPRESSION_MASK) ? 4 : -1;
+        SCompCompress(pbCompressed, &nOutBuffer, pbSector, nInBuffer, (unsigned)dwCompression, 0, nCompressionLevel);
+    }
+
+    return (DWORD)nOutBuffer;
+}
+
+// Compresses (if needed), calculates the checksum and encrypts (if needed) one file sector.
+// pbCompressed must have at least (dwSectorSize + 0x100) bytes. The sector data are destroyed
+// if the file is encrypted and not compressed. Returns the number of bytes to be written.
+// This function may be called for multiple sectors of the same file at the same time.
+static DWORD PrepareFileSector(
+    TMPQFile * hf,
+    DWORD dwSectorIndex,
+    LPBYTE pbSector,
+    DWORD dwBytesInSector,
+    LPBYTE pbCompressed,
+    DWORD dwCompression,
+    LPBYTE * PtrToWrite)
+{
+    TFileEntry * pFileEntry = hf->pFileEntry;
+    LPBYTE pbToWrite = pbSector;
+
+    // Compress the file sector, if needed
+    if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK)
+    {
+        pbToWrite = pbCompressed;
+        dwBytesInSector = CompressFileSector(pFileEntry->dwFlags, pbSector, dwBytesInSector, pbCompressed, dwCompression);
+
+        // We have to calculate sector CRC, if enabled
+        if(hf->SectorChksums != NULL)
+            hf->SectorChksums[dwSectorIndex] = adler32(0, pbCompressed, dwBytesInSector);
+    }
+
+    // Encrypt the sector, if necessary
+    if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
+    {
+        BSWAP_ARRAY32_UNSIGNED(pbToWrite, dwBytesInSector);
+        EncryptMpqBlock(pbToWrite, dwBytesInSector, hf->dwFileKey + dwSectorIndex);
+        BSWAP_ARRAY32_UNSIGNED(pbToWrite, dwBytesInSector);
+    }
+
+    PtrToWrite[0] = pbToWrite;
+    return dwBytesInSector;
+}
+
 static DWORD WriteDataToMpqFile(
     TMPQArchive * ha,
     TMPQFile * hf,
@@ -131,9 +252,8 @@ static DWORD WriteDataToMpqFile(
     TFileEntry * pFileEntry = hf->pFileEntry;
     ULONGLONG ByteOffset;
     LPBYTE pbCompressed = NULL;             // Compressed (target) data
-    LPBYTE pbToWrite = hf->pbFileSector;    // Data to write to the file
+    LPBYTE pbToWrite = NULL;                // Data to write to the file
     DWORD dwErrCode = ERROR_SUCCESS;
-    int nCompressionLevel;                  // ADPCM compression level (only used for wave files)
 
     // Make sure that the caller won't overrun the previously initiated file size
     assert(hf->dwFilePos + dwDataSize <= pFileEntry->dwFileSize);
@@ -179,72 +299,37 @@ static DWORD WriteDataToMpqFile(
                     md5_process((hash_state *)hf->hctx, hf->pbFileSector, dwBytesInSector);
                 hf->dwCrc32 = crc32(hf->dwCrc32, hf->pbFileSector, dwBytesInSector);
 
-                // Compress the file sector, if needed
-                if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK)
+                // If the file is compressed, allocate buffer for the compressed data.
+                // Note that we allocate buffer that is a bit longer than sector size,
+                // for case if the compression method performs a buffer overrun
+                if(pbCompressed == NULL && (pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK))
                 {
-                    int nOutBuffer = (int)dwBytesInSector;
-                    int nInBuffer = (int)dwBytesInSector;
-
-                    // If the file is compressed, allocate buffer for the compressed data.
-                    // Note that we allocate buffer that is a bit longer than sector size,
-                    // for case if the compression method performs a buffer overrun
+                    pbCompressed = STORM_ALLOC(BYTE, hf->dwSectorSize + 0x100);
                     if(pbCompressed == NULL)
                     {
-                        pbToWrite = pbCompressed = STORM_ALLOC(BYTE, hf->dwSectorSize + 0x100);
-                        if(pbCompressed == NULL)
-                        {
-                            dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
-                            break;
-                        }
+                        dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+                        break;
                     }
-
-                    //
-                    // Note that both SCompImplode and SCompCompress copy data as-is,
-                    // if they are unable to compress the data.
-                    //
-
-                    if(pFileEntry->dwFlags & MPQ_FILE_IMPLODE)
-                    {
-                        SCompImplode(pbCompressed, &nOutBuffer, hf->pbFileSector, nInBuffer);
-                    }
-
-                    if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS)
-                    {
-                        // If this is the first sector, we need to override the given compression
-                        // by the first sector compression. This is because the entire sector must
-                        // be compressed by the same compression.
-                        //
-                        // Test case:
-                        //
-                        // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_PKWARE)       // Write 0x10 bytes (sector 0)
-                        // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
-                        // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
-                        // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
-                        dwCompression = (dwSectorIndex == 0) ? hf->dwCompression0 : dwCompression;
-
-                        // If the caller wants ADPCM compression, we will set wave compression level to 4,
-                        // which corresponds to medium quality
-                        nCompressionLevel = (dwCompression & MPQ_LOSSY_COMPRESSION_MASK) ? 4 : -1;
-                        SCompCompress(pbCompressed, &nOutBuffer, hf->pbFileSector, nInBuffer, (unsigned)dwCompression, 0, nCompressionLevel);
-                    }
-
-                    // Update sector positions
-                    dwBytesInSector = nOutBuffer;
-                    if(hf->SectorOffsets != NULL)
-                        hf->SectorOffsets[dwSectorIndex+1] = hf->SectorOffsets[dwSectorIndex] + dwBytesInSector;
-
-                    // We have to calculate sector CRC, if enabled
-                    if(hf->SectorChksums != NULL)
-                        hf->SectorChksums[dwSectorIndex] = adler32(0, pbCompressed, nOutBuffer);
                 }
 
-                // Encrypt the sector, if necessary
-                if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
-                {
-                    BSWAP_ARRAY32_UNSIGNED(pbToWrite, dwBytesInSector);
-                    EncryptMpqBlock(pbToWrite, dwBytesInSector, hf->dwFileKey + dwSectorIndex);
-                    BSWAP_ARRAY32_UNSIGNED(pbToWrite, dwBytesInSector);
-                }
+                // If this is the first sector, we need to override the given compression
+                // by the first sector compression. This is because the entire sector must
+                // be compressed by the same compression.
+                //
+                // Test case:
+                //
+                // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_PKWARE)       // Write 0x10 bytes (sector 0)
+                // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
+                // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
+                // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
+                dwCompression = (dwSectorIndex == 0) ? hf->dwCompression0 : dwCompression;
+
+                // Compress and encrypt the sector
+                dwBytesInSector = PrepareFileSector(hf, dwSectorIndex, hf->pbFileSector, dwBytesInSector, pbCompressed, dwCompression, &pbToWrite);
+
+                // Update sector positions
+                if(hf->SectorOffsets != NULL)
+                    hf->SectorOffsets[dwSectorIndex+1] = hf->SectorOffsets[dwSectorIndex] + dwBytesInSector;
 
                 // Do not allow Warcraft III maps to go over 2GB. 
                 // https://github.com/ladislav-zezula/StormLib/issues/306
@@ -279,6 +364,257 @@ static DWORD WriteDataToMpqFile(
     return dwErrCode;
 }
 
+//-----------------------------------------------------------------------------
+// Pipelined writing of compressed files
+//
+// If the worker pool is active (see SFileSetThreadCount), sectors of compressed
+// files are collected to batches. All sectors of a batch are compressed in parallel
+// by the worker pool. At the same time, one worker calculates MD5 and CRC32
+// of the batch and another one writes the previous batch to the archive.
+// The sectors are compressed and written in the same order and by the same
+// compression as by WriteDataToMpqFile, so the resulting archive is identical.
+
+#define WRITE_BATCH_SECTORS_PER_THREAD  4           // Minimum number of sectors in a batch, per thread
+#define WRITE_BATCH_MIN_SIZE            0x100000    // Minimum size of plain data in a batch
+#define WRITE_BATCH_ALIGN(size)         (((size) + 0x0F) & ~(size_t)0x0F)
+#define WRITE_BATCH_OUT_SECTOR(pBatch, i) (pBatch->pbOutData[pBatch->dwOutIndex] + (size_t)(i) * (pBatch->hf->dwSectorSize + 0x100))
+
+struct TWriteBatchSector
+{
+    DWORD dwCompression;                    // Compression of the sector
+    DWORD cbPlainData;                      // Size of the plain sector data
+    DWORD cbOutData;                        // Size of the compressed and encrypted sector data
+    LPBYTE pbOutData;                       // Pointer to the compressed and encrypted sector data
+};
+
+struct TWriteBatch
+{
+    TMPQFile * hf;                          // The file being written
+    TWriteBatchSector * Sectors;            // Sectors of the current batch
+    LPBYTE pbPlainData;                     // Plain data of the current batch
+    LPBYTE pbOutData[2];                    // Output buffers. One is being filled, the other one is being written
+    DWORD dwOutIndex;                       // Index of the output buffer for the current batch
+    DWORD dwMaxSectors;                     // Maximum number of sectors in a batch
+    DWORD dwFirstSector;                    // Index of the first sector of the current batch
+    DWORD dwSectorCount;                    // Number of complete sectors in the current batch
+
+    ULONGLONG PendingOffset;                // Position of the previous batch in the archive
+    LPBYTE pbPendingData;                   // Data of the previous batch, not written yet
+    DWORD cbPendingData;                    // Size of the previous batch
+    DWORD dwPendingFilePos;                 // File position after the previous batch
+    DWORD dwWriteError;                     // Result of writing the previous batch
+};
+
+// Allocates the batch for the file, if the pipelined writing makes sense.
+// The batch is one memory block, so FreeFileHandle only needs to free it.
+static DWORD AllocateWriteBatch(TMPQFile * hf)
+{
+    TWriteBatch * pBatch;
+    TFileEntry * pFileEntry = hf->pFileEntry;
+    size_t cbSectors;
+    size_t cbPlainData;
+    size_t cbOutData;
+    LPBYTE pbBatch;
+    DWORD dwThreadCount = StormWorkPool_GetThreadCount();
+    DWORD dwFileSectors;
+    DWORD dwMaxSectors;
+
+    // Only compressed files with multiple sectors, and only if there are threads to do the work
+    if(dwThreadCount <= 1 || hf->dwSectorSize == 0 || !(pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK) || (pFileEntry->dwFlags & MPQ_FILE_SINGLE_UNIT))
+        return ERROR_SUCCESS;
+    dwFileSectors = (pFileEntry->dwFileSize + hf->dwSectorSize - 1) / hf->dwSectorSize;
+    if(dwFileSectors <= 1)
+        return ERROR_SUCCESS;
+
+    // Determine the size of the batch
+    dwMaxSectors = STORMLIB_MAX(dwThreadCount * WRITE_BATCH_SECTORS_PER_THREAD, WRITE_BATCH_MIN_SIZE / hf->dwSectorSize);
+    dwMaxSectors = STORMLIB_MIN(dwMaxSectors, dwFileSectors);
+
+    // Allocate the batch with all its buffers
+    cbSectors = WRITE_BATCH_ALIGN(sizeof(TWriteBatchSector) * dwMaxSectors);
+    cbPlainData = WRITE_BATCH_ALIGN((size_t)hf->dwSectorSize * dwMaxSectors);
+    cbOutData = (size_t)(hf->dwSectorSize + 0x100) * dwMaxSectors;
+    if((pbBatch = STORM_ALLOC(BYTE, WRITE_BATCH_ALIGN(sizeof(TWriteBatch)) + cbSectors + cbPlainData + cbOutData * 2)) == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    pBatch = (TWriteBatch *)pbBatch;
+    memset(pBatch, 0, sizeof(TWriteBatch));
+    pbBatch += WRITE_BATCH_ALIGN(sizeof(TWriteBatch));
+    pBatch->hf = hf;
+    pBatch->Sectors = (TWriteBatchSector *)pbBatch;
+    pBatch->pbPlainData = pbBatch + cbSectors;
+    pBatch->pbOutData[0] = pBatch->pbPlainData + cbPlainData;
+    pBatch->pbOutData[1] = pBatch->pbOutData[0] + cbOutData;
+    pBatch->dwMaxSectors = dwMaxSectors;
+    hf->pWriteBatch = pBatch;
+    return ERROR_SUCCESS;
+}
+
+static void WriteBatchWorker(void * pvParam, DWORD dwItemIndex)
+{
+    TWriteBatch * pBatch = (TWriteBatch *)pvParam;
+    TWriteBatchSector * pSector;
+    TMPQFile * hf = pBatch->hf;
+
+    switch(dwItemIndex)
+    {
+        // Write the previous batch to the archive
+        case 0:
+            if(pBatch->cbPendingData != 0)
+            {
+                if(!FileStream_Write(hf->ha->pStream, &pBatch->PendingOffset, pBatch->pbPendingData, pBatch->cbPendingData))
+                    pBatch->dwWriteError = SErrGetLastError();
+            }
+            break;
+
+        // Update MD5 and CRC32 of the file
+        case 1:
+            for(DWORD i = 0; i < pBatch->dwSectorCount; i++)
+            {
+                LPBYTE pbPlainData = pBatch->pbPlainData + (size_t)i * hf->dwSectorSize;
+
+                if(hf->hctx != NULL)
+                    md5_process((hash_state *)hf->hctx, pbPlainData, pBatch->Sectors[i].cbPlainData);
+                hf->dwCrc32 = crc32(hf->dwCrc32, pbPlainData, pBatch->Sectors[i].cbPlainData);
+            }
+            break;
+
+        // Compress and encrypt one sector
+        default:
+            pSector = pBatch->Sectors + (dwItemIndex - 2);
+            pSector->cbOutData = PrepareFileSector(hf,
+                                                   pBatch->dwFirstSector + (dwItemIndex - 2),
+                                                   pBatch->pbPlainData + (size_t)(dwItemIndex - 2) * hf->dwSectorSize,
+                                                   pSector->cbPlainData,
+                                                   WRITE_BATCH_OUT_SECTOR(pBatch, dwItemIndex - 2),
+                                                   pSector->dwCompression,
+                                                   &pSector->pbOutData);
+            break;
+    }
+}
+
+// Processes the complete sectors of the batch. The previous batch is written to the archive
+// while this one is being compressed. The batch itself is written by the next call,
+// or immediately if this is the last batch of the file.
+static DWORD FlushWriteBatch(TMPQArchive * ha, TMPQFile * hf, TWriteBatch * pBatch, bool bLastBatch)
+{
+    TFileEntry * pFileEntry = hf->pFileEntry;
+    ULONGLONG ByteOffset;
+    LPBYTE pbBatchData = WRITE_BATCH_OUT_SECTOR(pBatch, 0);
+    DWORD cbBatchData = 0;
+
+    // Compress the sectors, calculate hashes and write the previous batch
+    StormWorkPool_Run(pBatch->dwSectorCount + 2, WriteBatchWorker, pBatch);
+
+    // Check the result of writing the previous batch
+    if(pBatch->dwWriteError != ERROR_SUCCESS)
+        return pBatch->dwWriteError;
+    if(pBatch->cbPendingData != 0)
+    {
+        // Update the compressed file size
+        pFileEntry->dwCmpSize += pBatch->cbPendingData;
+        pBatch->cbPendingData = 0;
+
+        // Call the add-file callback, if any
+        if(ha->pfnAddFileCB != NULL)
+            ha->pfnAddFileCB(ha->pvAddFileUserData, pBatch->dwPendingFilePos, hf->dwDataSize, false);
+    }
+
+    // Put the sectors one after another and update the sector offsets
+    for(DWORD i = 0; i < pBatch->dwSectorCount; i++)
+    {
+        TWriteBatchSector * pSector = pBatch->Sectors + i;
+        DWORD dwSectorIndex = pBatch->dwFirstSector + i;
+
+        memmove(pbBatchData + cbBatchData, pSector->pbOutData, pSector->cbOutData);
+        if(hf->SectorOffsets != NULL)
+            hf->SectorOffsets[dwSectorIndex+1] = hf->SectorOffsets[dwSectorIndex] + pSector->cbOutData;
+        cbBatchData += pSector->cbOutData;
+    }
+
+    // Do not allow Warcraft III maps to go over 2GB.
+    // https://github.com/ladislav-zezula/StormLib/issues/306
+    ByteOffset = hf->RawFilePos + pFileEntry->dwCmpSize;
+    if((ha->dwFlags & MPQ_FLAG_WAR3_MAP) && (ByteOffset + cbBatchData) > 0x7FFFFFFF)
+        return ERROR_DISK_FULL;
+
+    // The batch will be written during processing of the next one
+    pBatch->PendingOffset = ByteOffset;
+    pBatch->pbPendingData = pbBatchData;
+    pBatch->cbPendingData = cbBatchData;
+    pBatch->dwPendingFilePos = hf->dwFilePos;
+    pBatch->dwFirstSector += pBatch->dwSectorCount;
+    pBatch->dwSectorCount = 0;
+    pBatch->dwOutIndex ^= 1;
+
+    // The last batch is written immediately
+    if(bLastBatch)
+    {
+        WriteBatchWorker(pBatch, 0);
+        if(pBatch->dwWriteError != ERROR_SUCCESS)
+            return pBatch->dwWriteError;
+
+        pFileEntry->dwCmpSize += pBatch->cbPendingData;
+        pBatch->cbPendingData = 0;
+
+        if(ha->pfnAddFileCB != NULL)
+            ha->pfnAddFileCB(ha->pvAddFileUserData, pBatch->dwPendingFilePos, hf->dwDataSize, false);
+    }
+    return ERROR_SUCCESS;
+}
+
+// Pipelined variant of WriteDataToMpqFile
+static DWORD WriteDataToMpqFile_Batch(
+    TMPQArchive * ha,
+    TMPQFile * hf,
+    LPBYTE pbFileData,
+    DWORD dwDataSize,
+    DWORD dwCompression)
+{
+    TWriteBatch * pBatch = (TWriteBatch *)hf->pWriteBatch;
+    TFileEntry * pFileEntry = hf->pFileEntry;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Make sure that the caller won't overrun the previously initiated file size
+    assert(hf->dwFilePos + dwDataSize <= pFileEntry->dwFileSize);
+    if((hf->dwFilePos + dwDataSize) > pFileEntry->dwFileSize)
+        return ERROR_DISK_FULL;
+
+    // Process all data
+    while(dwDataSize != 0 && dwErrCode == ERROR_SUCCESS)
+    {
+        DWORD dwBytesInSector = hf->dwFilePos % hf->dwSectorSize;
+        DWORD dwSectorIndex = hf->dwFilePos / hf->dwSectorSize;
+        DWORD dwBytesToCopy = STORMLIB_MIN(dwDataSize, hf->dwSectorSize - dwBytesInSector);
+        LPBYTE pbPlainData = pBatch->pbPlainData + (size_t)(dwSectorIndex - pBatch->dwFirstSector) * hf->dwSectorSize;
+
+        // Copy the data to the sector in the batch
+        memcpy(pbPlainData + dwBytesInSector, pbFileData, dwBytesToCopy);
+        dwBytesInSector += dwBytesToCopy;
+        pbFileData += dwBytesToCopy;
+        dwDataSize -= dwBytesToCopy;
+        hf->dwFilePos += dwBytesToCopy;
+
+        // If the sector is complete, add it to the batch. The first sector is always
+        // compressed by the first sector compression (see WriteDataToMpqFile)
+        if(dwBytesInSector >= hf->dwSectorSize || hf->dwFilePos >= pFileEntry->dwFileSize)
+        {
+            TWriteBatchSector * pSector = pBatch->Sectors + pBatch->dwSectorCount++;
+
+            pSector->dwCompression = (dwSectorIndex == 0) ? hf->dwCompression0 : dwCompression;
+            pSector->cbPlainData = dwBytesInSector;
+
+            // Process the batch if it's full or if this was the last sector
+            if(pBatch->dwSectorCount >= pBatch->dwMaxSectors || hf->dwFilePos >= pFileEntry->dwFileSize)
+            {
+                dwErrCode = FlushWriteBatch(ha, hf, pBatch, (hf->dwFilePos >= pFileEntry->dwFileSize));
+            }
+        }
+    }
+
+    return dwErrCode;
+}
+
 //-----------------------------------------------------------------------------
 // Recrypts file data for file renaming
 
@@ -495,6 +831,13 @@ DWORD SFileAddFile_Init(
         assert(pFileEntry->szFileName != NULL);
         assert(_stricmp(pFileEntry->szFileName, szFileName) == 0);
 
+        // If we are replacing a file, its space is given back when the handle is freed
+        if(pFileEntry->dwFlags & MPQ_FILE_EXISTS)
+        {
+            hf->Replaced.ByteOffset = pFileEntry->ByteOffset;
+            hf->Replaced.EndOffset = GetFileEntryDataEnd(ha, pFileEntry);
+        }
+
         dwErrCode = FillWritableHandle(ha, hf, FileTime, dwFileSize, dwFlags);
     }
 
@@ -574,6 +917,120 @@ DWORD SFileAddFile_Init(
     return dwErrCode;
 }
 
+// Allocates the buffers needed for writing the file and reserves space
+// for the patch info and the sector offset table in the archive
+static DWORD AllocateWriteBuffers(TMPQFile * hf, const void * pvData, DWORD dwSize)
+{
+    ULONGLONG RawFilePos = hf->RawFilePos;
+    TMPQArchive * ha = hf->ha;
+    TFileEntry * pFileEntry = hf->pFileEntry;
+    DWORD dwErrCode;
+
+    // Allocate buffer for file sector
+    dwErrCode = AllocateSectorBuffer(hf);
+    if(dwErrCode != ERROR_SUCCESS)
+        return dwErrCode;
+
+    // Allocate patch info, if the data is patch
+    if(hf->pPatchInfo == NULL && IsIncrementalPatchFile(pvData, dwSize, &hf->dwPatchedFileSize))
+    {
+        // Set the MPQ_FILE_PATCH_FILE flag
+        pFileEntry->dwFlags |= MPQ_FILE_PATCH_FILE;
+
+        // Allocate the patch info
+        dwErrCode = AllocatePatchInfo(hf, false);
+        if(dwErrCode != ERROR_SUCCESS)
+            return dwErrCode;
+    }
+
+    // Allocate sector offsets
+    if(hf->SectorOffsets == NULL)
+    {
+        dwErrCode = AllocateSectorOffsets(hf, false);
+        if(dwErrCode != ERROR_SUCCESS)
+            return dwErrCode;
+    }
+
+    // Create array of sector checksums
+    if(hf->SectorChksums == NULL && (pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC))
+    {
+        dwErrCode = AllocateSectorChecksums(hf, false);
+        if(dwErrCode != ERROR_SUCCESS)
+            return dwErrCode;
+    }
+
+    // Pre-save the patch info, if any
+    if(hf->pPatchInfo != NULL)
+    {
+        if(!FileStream_Write(ha->pStream, &RawFilePos, hf->pPatchInfo, hf->pPatchInfo->dwLength))
+            dwErrCode = SErrGetLastError();
+
+        pFileEntry->dwCmpSize += hf->pPatchInfo->dwLength;
+        RawFilePos += hf->pPatchInfo->dwLength;
+    }
+
+    // Pre-save the sector offset table, just to reserve space in the file.
+    // Note that we dont need to swap the sector positions, nor encrypt the table
+    // at the moment, as it will be written again after writing all file sectors.
+    if(hf->SectorOffsets != NULL)
+    {
+        if(!FileStream_Write(ha->pStream, &RawFilePos, hf->SectorOffsets, hf->SectorOffsets[0]))
+            dwErrCode = SErrGetLastError();
+
+        pFileEntry->dwCmpSize += hf->SectorOffsets[0];
+        RawFilePos += hf->SectorOffsets[0];
+    }
+
+    return dwErrCode;
+}
+
+// Called after all file data have been written. Finishes the hashes
+// and writes the sector checksums, patch info, sector offsets and MD5 chunks
+static DWORD CompleteFileWrite(TMPQArchive * ha, TMPQFile * hf)
+{
+    TFileEntry * pFileEntry = hf->pFileEntry;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Finish calculating CRC32
+    pFileEntry->dwCrc32 = hf->dwCrc32;
+
+    // Finish calculating MD5
+    if(hf->hctx != NULL)
+        md5_done((hash_state *)hf->hctx, pFileEntry->md5);
+
+    // If we also have sector checksums, write them to the file
+    if(hf->SectorChksums != NULL)
+    {
+        dwErrCode = WriteSectorChecksums(hf);
+    }
+
+    // Now write patch info
+    if(hf->pPatchInfo != NULL)
+    {
+        memcpy(hf->pPatchInfo->md5, pFileEntry->md5, MD5_DIGEST_SIZE);
+        hf->pPatchInfo->dwDataSize  = pFileEntry->dwFileSize;
+        pFileEntry->dwFileSize = hf->dwPatchedFileSize;
+        dwErrCode = WritePatchInfo(hf);
+    }
+
+    // Now write sector offsets to the file
+    if(hf->SectorOffsets != NULL)
+    {
+        dwErrCode = WriteSectorOffsets(hf);
+    }
+
+    // Write the MD5 hashes of each file chunk, if required
+    if(ha->pHeader->dwRawChunkSize != 0)
+    {
+        dwErrCode = WriteMpqDataMD5(ha->pStream,
+                                    ha->MpqPos + pFileEntry->ByteOffset,
+                                    hf->pFileEntry->dwCmpSize,
+                                    ha->pHeader->dwRawChunkSize);
+    }
+
+    return dwErrCode;
+}
+
 DWORD SFileAddFile_Write(TMPQFile * hf, const void * pvData, DWORD dwSize, DWORD dwCompression)
 {
     TMPQArchive * ha;
@@ -591,62 +1048,15 @@ DWORD SFileAddFile_Write(TMPQFile * hf, const void * pvData, DWORD dwSize, DWORD
     // Allocate file buffers
     if(hf->pbFileSector == NULL)
     {
-        ULONGLONG RawFilePos = hf->RawFilePos;
-
-        // Allocate buffer for file sector
-        hf->dwAddFileError = dwErrCode = AllocateSectorBuffer(hf);
+        // Allocate the sector buffer, sector offsets and checksums
+        hf->dwAddFileError = dwErrCode = AllocateWriteBuffers(hf, pvData, dwSize);
         if(dwErrCode != ERROR_SUCCESS)
             return dwErrCode;
 
-        // Allocate patch info, if the data is patch
-        if(hf->pPatchInfo == NULL && IsIncrementalPatchFile(pvData, dwSize, &hf->dwPatchedFileSize))
-        {
-            // Set the MPQ_FILE_PATCH_FILE flag
-            pFileEntry->dwFlags |= MPQ_FILE_PATCH_FILE;
-
-            // Allocate the patch info
-            hf->dwAddFileError = dwErrCode = AllocatePatchInfo(hf, false);
-            if(dwErrCode != ERROR_SUCCESS)
-                return dwErrCode;
-        }
-
-        // Allocate sector offsets
-        if(hf->SectorOffsets == NULL)
-        {
-            hf->dwAddFileError = dwErrCode = AllocateSectorOffsets(hf, false);
-            if(dwErrCode != ERROR_SUCCESS)
-                return dwErrCode;
-        }
-
-        // Create array of sector checksums
-        if(hf->SectorChksums == NULL && (pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC))
-        {
-            hf->dwAddFileError = dwErrCode = AllocateSectorChecksums(hf, false);
-            if(dwErrCode != ERROR_SUCCESS)
-                return dwErrCode;
-        }
-
-        // Pre-save the patch info, if any
-        if(hf->pPatchInfo != NULL)
-        {
-            if(!FileStream_Write(ha->pStream, &RawFilePos, hf->pPatchInfo, hf->pPatchInfo->dwLength))
-                dwErrCode = SErrGetLastError();
-
-            pFileEntry->dwCmpSize += hf->pPatchInfo->dwLength;
-            RawFilePos += hf->pPatchInfo->dwLength;
-        }
-
-        // Pre-save the sector offset table, just to reserve space in the file.
-        // Note that we dont need to swap the sector positions, nor encrypt the table
-        // at the moment, as it will be written again after writing all file sectors.
-        if(hf->SectorOffsets != NULL)
-        {
-            if(!FileStream_Write(ha->pStream, &RawFilePos, hf->SectorOffsets, hf->SectorOffsets[0]))
-                dwErrCode = SErrGetLastError();
-
-            pFileEntry->dwCmpSize += hf->SectorOffsets[0];
-            RawFilePos += hf->SectorOffsets[0];
-        }
+        // Allocate the batch for pipelined compression, if the worker pool is active
+        hf->dwAddFileError = dwErrCode = AllocateWriteBatch(hf);
+        if(dwErrCode != ERROR_SUCCESS)
+            return dwErrCode;
     }
 
     // Write the MPQ data to the file
@@ -659,7 +1069,10 @@ DWORD SFileAddFile_Write(TMPQFile * hf, const void * pvData, DWORD dwSize, DWORD
             hf->dwCompression0 = dwCompression;
 
         // Write the data to the MPQ
-        dwErrCode = WriteDataToMpqFile(ha, hf, (LPBYTE)pvData, dwSize, dwCompression);
+        if(hf->pWriteBatch != NULL)
+            dwErrCode = WriteDataToMpqFile_Batch(ha, hf, (LPBYTE)pvData, dwSize, dwCompression);
+        else
+            dwErrCode = WriteDataToMpqFile(ha, hf, (LPBYTE)pvData, dwSize, dwCompression);
     }
 
     // If it succeeded and we wrote all the file data,
@@ -668,42 +1081,7 @@ DWORD SFileAddFile_Write(TMPQFile * hf, const void * pvData, DWORD dwSize, DWORD
     {
         if(hf->dwFilePos >= pFileEntry->dwFileSize)
         {
-            // Finish calculating CRC32
-            pFileEntry->dwCrc32 = hf->dwCrc32;
-
-            // Finish calculating MD5
-            if(hf->hctx != NULL)
-                md5_done((hash_state *)hf->hctx, pFileEntry->md5);
-
-            // If we also have sector checksums, write them to the file
-            if(hf->SectorChksums != NULL)
-            {
-                dwErrCode = WriteSectorChecksums(hf);
-            }
-
-            // Now write patch info
-            if(hf->pPatchInfo != NULL)
-            {
-                memcpy(hf->pPatchInfo->md5, pFileEntry->md5, MD5_DIGEST_SIZE);
-                hf->pPatchInfo->dwDataSize  = pFileEntry->dwFileSize;
-                pFileEntry->dwFileSize = hf->dwPatchedFileSize;
-                dwErrCode = WritePatchInfo(hf);
-            }
-
-            // Now write sector offsets to the file
-            if(hf->SectorOffsets != NULL)
-            {
-                dwErrCode = WriteSectorOffsets(hf);
-            }
-
-            // Write the MD5 hashes of each file chunk, if required
-            if(ha->pHeader->dwRawChunkSize != 0)
-            {
-                dwErrCode = WriteMpqDataMD5(ha->pStream,
-                                            ha->MpqPos + pFileEntry->ByteOffset,
-                                            hf->pFileEntry->dwCmpSize,
-                                            ha->pHeader->dwRawChunkSize);
-            }
+            dwErrCode = CompleteFileWrite(ha, hf);
         }
     }
 
@@ -739,8 +1117,9 @@ DWORD SFileAddFile_Finish(TMPQFile * hf)
         }
     }
 
-    // Now we need to recreate the HET table, if exists
-    if(dwErrCode == ERROR_SUCCESS && ha->pHetTable != NULL)
+    // Now we need to recreate the HET table, if exists. During SFileCommitBulkAdd,
+    // the files are found by the hash table and the HET table is rebuilt once at the end
+    if(dwErrCode == ERROR_SUCCESS && ha->pHetTable != NULL && (ha->BulkAddPos == 0 || ha->pHashTable == NULL))
     {
         dwErrCode = RebuildHetTable(ha);
     }
@@ -910,7 +1289,6 @@ bool WINAPI SFileAddFileEx(
     DWORD dwBytesRemaining = 0;
     DWORD dwBytesToRead;
     DWORD dwSectorSize = 0x1000;
-    DWORD dwChannels = 0;
     bool bIsAdpcmCompression = false;
     bool bIsFirstSector = true;
     DWORD dwErrCode = ERROR_SUCCESS;
@@ -952,25 +1330,7 @@ bool WINAPI SFileAddFileEx(
     // Deal with various combination of compressions
     if(dwErrCode == ERROR_SUCCESS)
     {
-        // When the compression for next blocks is set to default,
-        // we will copy the compression for the first sector
-        if(dwCompressionNext == MPQ_COMPRESSION_NEXT_SAME)
-            dwCompressionNext = dwCompression;
-
-        // If the caller wants ADPCM compression, we make sure
-        // that the first sector is not compressed with lossy compression
-        if(dwCompressionNext & (MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO))
-        {
-            // The compression of the first file sector must not be ADPCM
-            // in order not to corrupt the headers
-            if(dwCompression & (MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO))
-                dwCompression = MPQ_COMPRESSION_PKWARE;
-
-            // Remove both flag mono and stereo flags.
-            // They will be re-added according to WAVE type
-            dwCompressionNext &= ~(MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO);
-            bIsAdpcmCompression = true;
-        }
+        bIsAdpcmCompression = PrepareAddFileCompression(&dwCompression, &dwCompressionNext);
 
         // Initiate adding file to the MPQ
         if(!SFileCreateFile(hMpq, szArchivedName, FileTime, (DWORD)FileSize, g_lcFileLocale, dwFlags, &hMpqFile))
@@ -995,19 +1355,7 @@ bool WINAPI SFileAddFileEx(
         // If the file being added is a WAVE file, we check number of channels
         if(bIsFirstSector && bIsAdpcmCompression)
         {
-            // The file must really be a WAVE file with at least 16 bits per sample,
-            // otherwise the ADPCM compression will corrupt it
-            if(IsWaveFile_16BitsPerAdpcmSample(pbFileData, dwBytesToRead, &dwChannels))
-            {
-                // Setup the compression of next sectors according to number of channels
-                dwCompressionNext |= (dwChannels == 1) ? MPQ_COMPRESSION_ADPCM_MONO : MPQ_COMPRESSION_ADPCM_STEREO;
-            }
-            else
-            {
-                // Setup the compression of next sectors to a lossless compression
-                dwCompressionNext = (dwCompression & MPQ_LOSSY_COMPRESSION_MASK) ? MPQ_COMPRESSION_PKWARE : dwCompression;
-            }
-
+            dwCompressionNext = GetWaveCompressionNext(pbFileData, dwBytesToRead, dwCompression, dwCompressionNext);
             bIsFirstSector = false;
         }
 
@@ -1095,6 +1443,662 @@ bool WINAPI SFileAddWave(HANDLE hMpq, const TCHAR * szFileName, const char * szA
                           dwCompression);           // Next sectors should be compressed as WAVE
 }
 
+//-----------------------------------------------------------------------------
+// Adding many files at once
+//
+// The files are queued by SFileBulkAddFile and SFileBulkAddData and added
+// to the archive by SFileCommitBulkAdd. The hash table is enlarged only once,
+// the file data are stored one after another behind the existing data,
+// and the HET table, (listfile), (attributes) and the MPQ tables are saved
+// only once at the end. Small files are loaded, compressed and hashed
+// by the worker pool, one file per worker; only writing them is serial.
+// Bigger files are written in chunks, using the pipelined sector compression.
+
+#define BULK_ADD_GROUP_SIZE         64          // Number of files prepared by the worker pool at once
+#define BULK_ADD_MAX_LOAD_SIZE      0x40000     // Bigger files are not loaded to memory as a whole
+#define BULK_ADD_CHUNK_SIZE         0x100000    // Size of the chunks in which bigger files are written
+#define BULK_ADD_FIRST_CHUNK_SIZE   0x1000      // Size of the first chunk, same like in SFileAddFileEx
+
+struct TBulkAddFile
+{
+    TCHAR * szFileName;                     // Name of the local file. NULL if the file data are in memory
+    char * szArchivedName;                  // Name of the file in the archive
+    const void * pvData;                    // File data in memory, or the loaded local file
+    ULONGLONG FileTime;                     // File time
+    LCID lcFileLocale;                      // File locale
+    DWORD dwFileSize;                       // File size
+    DWORD dwFlags;                          // MPQ_FILE_XXX
+    DWORD dwCompression;                    // Compression of the first sector
+    DWORD dwCompressionNext;                // Compression of the next sectors
+    bool bIsAdpcmCompression;               // If true, the compression of the next sectors depends on the WAVE header
+
+    // Prepared by the worker pool
+    TFileStream * pStream;                  // Local file that is too big to be loaded
+    LPBYTE pbFileData;                      // Data loaded from the local file
+    LPDWORD SectorSizes;                    // Sizes of the prepared sectors. Followed by checksums and the sector data
+    LPDWORD SectorChksums;                  // ADLER32 of the compressed sectors
+    LPBYTE pbSectors;                       // Compressed (or copied) sectors, one after another
+    DWORD dwSectorCount;                    // Number of prepared sectors
+    DWORD cbSectors;                        // Total size of the prepared sectors
+    hash_state Md5State;                    // MD5 of the file data
+    DWORD dwCrc32;                          // CRC32 of the file data
+    DWORD dwErrCode;                        // Result of the preparation
+};
+
+struct TMPQBulkAdd
+{
+    DWORD dwMagic;                          // ID_MPQ_BULK_ADD
+    TMPQArchive * ha;                       // The archive where the files are added
+    TMPQBulkAdd * pNext;                    // Next bulk add handle of the same archive
+    TBulkAddFile * pFiles;                  // Queued files, in the order of adding
+    TBulkAddFile * pGroup;                  // The first file of the group being prepared
+    LPBYTE pbChunk;                         // Buffer for reading chunks of big local files
+    DWORD dwFileCount;                      // Number of queued files
+    DWORD dwMaxFiles;                       // Capacity of the pFiles array
+};
+
+static TMPQBulkAdd * IsValidBulkAddHandle(HANDLE hBulkAdd)
+{
+    TMPQBulkAdd * pBulk = (TMPQBulkAdd *)hBulkAdd;
+
+    if(pBulk != NULL && pBulk->dwMagic == ID_MPQ_BULK_ADD && IsValidMpqHandle(pBulk->ha))
+        return pBulk;
+    return NULL;
+}
+
+static void FreeBulkAddFileData(TBulkAddFile * pFile)
+{
+    if(pFile->pStream != NULL)
+        FileStream_Close(pFile->pStream);
+    pFile->pStream = NULL;
+
+    if(pFile->pbFileData != NULL)
+        STORM_FREE(pFile->pbFileData);
+    pFile->pbFileData = NULL;
+
+    if(pFile->SectorSizes != NULL)
+        STORM_FREE(pFile->SectorSizes);
+    pFile->SectorSizes = NULL;
+}
+
+static void FreeBulkAdd(TMPQBulkAdd * pBulk)
+{
+    TMPQBulkAdd ** ppBulk;
+
+    // Unlink the handle from the archive
+    for(ppBulk = &pBulk->ha->pFirstBulkAdd; ppBulk[0] != NULL; ppBulk = &ppBulk[0]->pNext)
+    {
+        if(ppBulk[0] == pBulk)
+        {
+            ppBulk[0] = pBulk->pNext;
+            break;
+        }
+    }
+
+    for(DWORD i = 0; i < pBulk->dwFileCount; i++)
+    {
+        TBulkAddFile * pFile = pBulk->pFiles + i;
+
+        FreeBulkAddFileData(pFile);
+        if(pFile->szFileName != NULL)
+            STORM_FREE(pFile->szFileName);
+        if(pFile->szArchivedName != NULL)
+            STORM_FREE(pFile->szArchivedName);
+    }
+
+    if(pBulk->pFiles != NULL)
+        STORM_FREE(pBulk->pFiles);
+    if(pBulk->pbChunk != NULL)
+        STORM_FREE(pBulk->pbChunk);
+    pBulk->dwMagic = 0;
+    STORM_FREE(pBulk);
+}
+
+// Performs the same checks like SFileCreateFile and SFileAddFileEx and puts the file to the queue
+static DWORD QueueBulkAddFile(
+    TMPQBulkAdd * pBulk,
+    const TCHAR * szFileName,
+    const void * pvData,
+    DWORD cbData,
+    const char * szArchivedName,
+    ULONGLONG FileTime,
+    DWORD dwFlags,
+    DWORD dwCompression,
+    DWORD dwCompressionNext)
+{
+    TBulkAddFile * pFile;
+    TMPQArchive * ha = pBulk->ha;
+    size_t nLength;
+
+    // Don't allow to add a file under pseudo-file name or any of the internal files
+    if(szArchivedName == NULL || *szArchivedName == 0 || IsPseudoFileName(szArchivedName, NULL))
+        return ERROR_INVALID_PARAMETER;
+    if(IsInternalMpqFileName(szArchivedName))
+        return ERROR_INTERNAL_FILE;
+
+    // Mask all unsupported flags out and check for valid flag combinations
+    dwFlags &= ha->dwValidFileFlags;
+    if((dwFlags & (MPQ_FILE_IMPLODE | MPQ_FILE_COMPRESS)) == (MPQ_FILE_IMPLODE | MPQ_FILE_COMPRESS))
+        return ERROR_INVALID_PARAMETER;
+
+    // LZMA compression can only be present in MPQ version 2 or higher
+    if(dwCompression == MPQ_COMPRESSION_LZMA && ha->pHeader->wFormatVersion == MPQ_FORMAT_VERSION_1)
+        return ERROR_INVALID_PARAMETER;
+
+    // Lossy compression is not allowed on single unit files
+    if((dwFlags & MPQ_FILE_SINGLE_UNIT) && (dwCompression & MPQ_LOSSY_COMPRESSION_MASK))
+        return ERROR_INVALID_PARAMETER;
+
+    // Enlarge the queue, if needed
+    if(pBulk->dwFileCount >= pBulk->dwMaxFiles)
+    {
+        DWORD dwMaxFiles = (pBulk->dwMaxFiles != 0) ? (pBulk->dwMaxFiles * 2) : BULK_ADD_GROUP_SIZE;
+        TBulkAddFile * pFiles = STORM_REALLOC(TBulkAddFile, pBulk->pFiles, dwMaxFiles);
+
+        if(pFiles == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+        pBulk->pFiles = pFiles;
+        pBulk->dwMaxFiles = dwMaxFiles;
+    }
+
+    // Fill the queued file
+    pFile = pBulk->pFiles + pBulk->dwFileCount;
+    memset(pFile, 0, sizeof(TBulkAddFile));
+    pFile->pvData = pvData;
+    pFile->FileTime = FileTime;
+    pFile->lcFileLocale = g_lcFileLocale;
+    pFile->dwFileSize = cbData;
+    pFile->dwFlags = dwFlags;
+    pFile->dwCompression = dwCompression;
+    pFile->dwCompressionNext = dwCompressionNext;
+    pFile->bIsAdpcmCompression = PrepareAddFileCompression(&pFile->dwCompression, &pFile->dwCompressionNext);
+
+    // Copy the names
+    nLength = strlen(szArchivedName);
+    if((pFile->szArchivedName = STORM_ALLOC(char, nLength + 1)) == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    memcpy(pFile->szArchivedName, szArchivedName, nLength + 1);
+
+    if(szFileName != NULL)
+    {
+        nLength = _tcslen(szFileName);
+        if((pFile->szFileName = STORM_ALLOC(TCHAR, nLength + 1)) == NULL)
+        {
+            STORM_FREE(pFile->szArchivedName);
+            return ERROR_NOT_ENOUGH_MEMORY;
+        }
+        memcpy(pFile->szFileName, szFileName, (nLength + 1) * sizeof(TCHAR));
+    }
+
+    pBulk->dwFileCount++;
+    return ERROR_SUCCESS;
+}
+
+// Opens the local file. Files that are small enough are loaded to memory
+static DWORD LoadBulkAddFile(TBulkAddFile * pFile)
+{
+    ULONGLONG FileSize = 0;
+
+    // Open the local file
+    pFile->pStream = FileStream_OpenFile(pFile->szFileName, STREAM_FLAG_READ_ONLY | STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE);
+    if(pFile->pStream == NULL)
+        return SErrGetLastError();
+
+    // Files bigger than 4GB cannot be added to MPQ
+    FileStream_GetTime(pFile->pStream, &pFile->FileTime);
+    FileStream_GetSize(pFile->pStream, &FileSize);
+    if(FileSize >> 32)
+        return ERROR_DISK_FULL;
+    pFile->dwFileSize = (DWORD)FileSize;
+
+    // Bigger files are read while being written
+    if(pFile->dwFileSize == 0 || pFile->dwFileSize > BULK_ADD_MAX_LOAD_SIZE)
+        return ERROR_SUCCESS;
+
+    // Load the entire file
+    if((pFile->pbFileData = STORM_ALLOC(BYTE, pFile->dwFileSize)) == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    if(!FileStream_Read(pFile->pStream, NULL, pFile->pbFileData, pFile->dwFileSize))
+        return SErrGetLastError();
+    pFile->pvData = pFile->pbFileData;
+
+    // We don't need the local file anymore
+    FileStream_Close(pFile->pStream);
+    pFile->pStream = NULL;
+    return ERROR_SUCCESS;
+}
+
+// Compresses all sectors of a file and calculates MD5 and CRC32 of its data.
+// The sectors are put one after another, so they can be written at once.
+// The sectors are compressed by the same compressions like in SFileAddFileEx.
+static DWORD CompressBulkAddFile(TMPQArchive * ha, TBulkAddFile * pFile)
+{
+    LPBYTE pbFileData = (LPBYTE)pFile->pvData;
+    DWORD dwSectorSize = (pFile->dwFlags & MPQ_FILE_SINGLE_UNIT) ? pFile->dwFileSize : ha->dwSectorSize;
+    DWORD dwSectorCount = (pFile->dwFileSize + dwSectorSize - 1) / dwSectorSize;
+    DWORD cbSectors = 0;
+
+    // Choose the compression of the next sectors by the WAVE header
+    if(pFile->bIsAdpcmCompression)
+    {
+        pFile->dwCompressionNext = GetWaveCompressionNext(pbFileData,
+                                                          STORMLIB_MIN(pFile->dwFileSize, BULK_ADD_FIRST_CHUNK_SIZE),
+                                                          pFile->dwCompression,
+                                                          pFile->dwCompressionNext);
+    }
+
+    // Calculate MD5 and CRC32 of the file data
+    md5_init(&pFile->Md5State);
+    md5_process(&pFile->Md5State, pbFileData, pFile->dwFileSize);
+    pFile->dwCrc32 = crc32(crc32(0, Z_NULL, 0), pbFileData, pFile->dwFileSize);
+
+    // Allocate one buffer for sector sizes, checksums and the sector data.
+    // Give the compression a bit more space, for case it performs a buffer overrun
+    pFile->SectorSizes = STORM_ALLOC(DWORD, dwSectorCount * 2 + (pFile->dwFileSize + 0x100) / sizeof(DWORD) + 1);
+    if(pFile->SectorSizes == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    pFile->SectorChksums = pFile->SectorSizes + dwSectorCount;
+    pFile->pbSectors = (LPBYTE)(pFile->SectorChksums + dwSectorCount);
+    pFile->dwSectorCount = dwSectorCount;
+
+    // Prepare all sectors
+    for(DWORD i = 0; i < dwSectorCount; i++)
+    {
+        LPBYTE pbSector = pbFileData + (size_t)i * dwSectorSize;
+        LPBYTE pbTarget = pFile->pbSectors + cbSectors;
+        DWORD cbSector = STORMLIB_MIN(dwSectorSize, pFile->dwFileSize - i * dwSectorSize);
+        DWORD dwCompression = pFile->dwCompressionNext;
+
+        // SFileAddFileEx writes the first chunk by the first sector compression.
+        // Sectors that are complete after the first chunk are compressed by it
+        if(i == 0 || (i * dwSectorSize + cbSector) <= BULK_ADD_FIRST_CHUNK_SIZE)
+            dwCompression = pFile->dwCompression;
+
+        if(pFile->dwFlags & MPQ_FILE_COMPRESS_MASK)
+        {
+            cbSector = CompressFileSector(pFile->dwFlags, pbSector, cbSector, pbTarget, dwCompression);
+            pFile->SectorChksums[i] = adler32(0, pbTarget, cbSector);
+        }
+        else
+        {
+            memcpy(pbTarget, pbSector, cbSector);
+        }
+
+        pFile->SectorSizes[i] = cbSector;
+        cbSectors += cbSector;
+    }
+
+    pFile->cbSectors = cbSectors;
+    return ERROR_SUCCESS;
+}
+
+static void PrepareBulkAddFile(void * pvParam, DWORD dwItemIndex)
+{
+    TMPQBulkAdd * pBulk = (TMPQBulkAdd *)pvParam;
+    TBulkAddFile * pFile = pBulk->pGroup + dwItemIndex;
+
+    // Open or load the local file
+    if(pFile->szFileName != NULL)
+        pFile->dwErrCode = LoadBulkAddFile(pFile);
+
+    // Compress small files as a whole
+    if(pFile->dwErrCode == ERROR_SUCCESS && pFile->pStream == NULL && pFile->dwFileSize != 0 && pFile->dwFileSize <= BULK_ADD_MAX_LOAD_SIZE)
+        pFile->dwErrCode = CompressBulkAddFile(pBulk->ha, pFile);
+}
+
+// Writes the sectors prepared by CompressBulkAddFile to the archive
+static DWORD WriteBulkAddSectors(TMPQArchive * ha, TMPQFile * hf, TBulkAddFile * pFile)
+{
+    TFileEntry * pFileEntry = hf->pFileEntry;
+    ULONGLONG ByteOffset;
+    LPBYTE pbSector = pFile->pbSectors;
+    DWORD dwErrCode;
+
+    // Allocate sector offsets and checksums, reserve space for the sector offset table
+    dwErrCode = AllocateWriteBuffers(hf, pFile->pvData, pFile->dwFileSize);
+    if(dwErrCode != ERROR_SUCCESS)
+        return dwErrCode;
+
+    // Fill the sector offsets and checksums. The file key is only known now,
+    // because it may depend on the position of the file in the archive
+    for(DWORD i = 0; i < pFile->dwSectorCount; i++)
+    {
+        DWORD cbSector = pFile->SectorSizes[i];
+
+        if(hf->SectorOffsets != NULL)
+            hf->SectorOffsets[i+1] = hf->SectorOffsets[i] + cbSector;
+        if(hf->SectorChksums != NULL)
+            hf->SectorChksums[i] = pFile->SectorChksums[i];
+
+        if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
+        {
+            BSWAP_ARRAY32_UNSIGNED(pbSector, cbSector);
+            EncryptMpqBlock(pbSector, cbSector, hf->dwFileKey + i);
+            BSWAP_ARRAY32_UNSIGNED(pbSector, cbSector);
+        }
+        pbSector += cbSector;
+    }
+
+    // Do not allow Warcraft III maps to go over 2GB.
+    // https://github.com/ladislav-zezula/StormLib/issues/306
+    ByteOffset = hf->RawFilePos + pFileEntry->dwCmpSize;
+    if((ha->dwFlags & MPQ_FLAG_WAR3_MAP) && (ByteOffset + pFile->cbSectors) > 0x7FFFFFFF)
+        return ERROR_DISK_FULL;
+
+    // Write all sectors at once
+    if(!FileStream_Write(ha->pStream, &ByteOffset, pFile->pbSectors, pFile->cbSectors))
+        return SErrGetLastError();
+    pFileEntry->dwCmpSize += pFile->cbSectors;
+    hf->dwFilePos = pFile->dwFileSize;
+
+    // Call the add file callback, if any
+    if(ha->pfnAddFileCB != NULL)
+        ha->pfnAddFileCB(ha->pvAddFileUserData, hf->dwFilePos, hf->dwDataSize, false);
+
+    // The hashes have already been calculated
+    if(hf->hctx != NULL)
+        memcpy(hf->hctx, &pFile->Md5State, sizeof(hash_state));
+    hf->dwCrc32 = pFile->dwCrc32;
+    return CompleteFileWrite(ha, hf);
+}
+
+// Writes a file that has not been loaded in chunks, like SFileAddFileEx does
+static DWORD WriteBulkAddChunks(TMPQBulkAdd * pBulk, TMPQFile * hf, TBulkAddFile * pFile)
+{
+    LPBYTE pbChunk = (LPBYTE)pFile->pvData;
+    DWORD dwBytesRemaining = pFile->dwFileSize;
+    DWORD dwBytesToWrite = BULK_ADD_FIRST_CHUNK_SIZE;
+    DWORD dwCompression = pFile->dwCompression;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    while(dwErrCode == ERROR_SUCCESS && dwBytesRemaining != 0)
+    {
+        dwBytesToWrite = STORMLIB_MIN(dwBytesToWrite, dwBytesRemaining);
+
+        // Read the chunk from the local file
+        if(pFile->pStream != NULL)
+        {
+            if(pBulk->pbChunk == NULL && (pBulk->pbChunk = STORM_ALLOC(BYTE, BULK_ADD_CHUNK_SIZE)) == NULL)
+                return ERROR_NOT_ENOUGH_MEMORY;
+            if(!FileStream_Read(pFile->pStream, NULL, pBulk->pbChunk, dwBytesToWrite))
+                return SErrGetLastError();
+            pbChunk = pBulk->pbChunk;
+        }
+
+        // The first chunk decides about the compression of the next sectors
+        if(dwBytesRemaining == pFile->dwFileSize && pFile->bIsAdpcmCompression)
+            pFile->dwCompressionNext = GetWaveCompressionNext(pbChunk, dwBytesToWrite, dwCompression, pFile->dwCompressionNext);
+
+        dwErrCode = SFileAddFile_Write(hf, pbChunk, dwBytesToWrite, dwCompression);
+
+        // Move to the next chunk
+        if(pFile->pStream == NULL)
+            pbChunk += dwBytesToWrite;
+        dwBytesRemaining -= dwBytesToWrite;
+        dwBytesToWrite = BULK_ADD_CHUNK_SIZE;
+        dwCompression = pFile->dwCompressionNext;
+    }
+
+    return dwErrCode;
+}
+
+static DWORD WriteBulkAddFile(TMPQBulkAdd * pBulk, TBulkAddFile * pFile)
+{
+    TMPQArchive * ha = pBulk->ha;
+    TFileEntry * pFileEntry;
+    TMPQFile * hf = NULL;
+    DWORD dwErrCode = pFile->dwErrCode;
+
+    // Initiate adding the file. It will be stored at ha->BulkAddPos
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = SFileAddFile_Init(ha, pFile->szArchivedName, pFile->FileTime, pFile->dwFileSize, pFile->lcFileLocale, pFile->dwFlags, &hf);
+    if(dwErrCode != ERROR_SUCCESS)
+        return dwErrCode;
+    pFileEntry = hf->pFileEntry;
+
+    // Write the file data
+    if(pFile->pbSectors != NULL)
+    {
+        dwErrCode = WriteBulkAddSectors(ha, hf, pFile);
+
+        // Update the archive size
+        if((ha->MpqPos + pFileEntry->ByteOffset + pFileEntry->dwCmpSize) > ha->FileSize)
+            ha->FileSize = ha->MpqPos + pFileEntry->ByteOffset + pFileEntry->dwCmpSize;
+        hf->dwAddFileError = dwErrCode;
+    }
+    else if(pFile->dwFileSize != 0)
+    {
+        dwErrCode = WriteBulkAddChunks(pBulk, hf, pFile);
+        hf->dwAddFileError = dwErrCode;
+    }
+
+    // Finish the file. The next file goes right behind this one
+    dwErrCode = SFileAddFile_Finish(hf);
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        ha->BulkAddPos = pFileEntry->ByteOffset + pFileEntry->dwCmpSize;
+        if(ha->pHeader->dwRawChunkSize != 0 && pFileEntry->dwCmpSize != 0)
+            ha->BulkAddPos += (((pFileEntry->dwCmpSize - 1) / ha->pHeader->dwRawChunkSize) + 1) * MD5_DIGEST_SIZE;
+    }
+    return dwErrCode;
+}
+
+// Enlarges the hash table, so there is space for all queued files.
+// If this is not possible (e.g. some files are open), we keep the current size
+static void ReserveBulkAddFiles(TMPQArchive * ha, DWORD dwFileCount)
+{
+    TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TFileEntry * pFileEntry;
+    DWORD dwMaxFileCount = dwFileCount + ha->dwReservedFiles + 3;
+
+    // Count the existing files
+    for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
+    {
+        if(pFileEntry->dwFlags & MPQ_FILE_EXISTS)
+            dwMaxFileCount++;
+    }
+
+    if(dwMaxFileCount > ha->dwMaxFileCount)
+        SFileSetMaxFileCount((HANDLE)ha, dwMaxFileCount);
+}
+
+bool WINAPI SFileBeginBulkAdd(HANDLE hMpq, HANDLE * phBulkAdd)
+{
+    TMPQBulkAdd * pBulk;
+    TMPQArchive * ha;
+
+    // Check the parameters
+    if((ha = IsValidMpqHandle(hMpq)) == NULL)
+    {
+        SErrSetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    if(phBulkAdd == NULL)
+    {
+        SErrSetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Don't allow to add files if the MPQ is open for read only
+    if(ha->dwFlags & MPQ_FLAG_READ_ONLY)
+    {
+        SErrSetLastError(ERROR_ACCESS_DENIED);
+        return false;
+    }
+
+    // Create the bulk add handle
+    if((pBulk = STORM_ALLOC(TMPQBulkAdd, 1)) == NULL)
+    {
+        SErrSetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+
+    memset(pBulk, 0, sizeof(TMPQBulkAdd));
+    pBulk->dwMagic = ID_MPQ_BULK_ADD;
+    pBulk->ha = ha;
+
+    // Remember the handle in the archive, so it can be freed when the archive is closed
+    pBulk->pNext = ha->pFirstBulkAdd;
+    ha->pFirstBulkAdd = pBulk;
+    phBulkAdd[0] = (HANDLE)pBulk;
+    return true;
+}
+
+bool WINAPI SFileBulkAddFile(
+    HANDLE hBulkAdd,
+    const TCHAR * szFileName,
+    const char * szArchivedName,
+    DWORD dwFlags,
+    DWORD dwCompression,
+    DWORD dwCompressionNext)
+{
+    TMPQBulkAdd * pBulk;
+    DWORD dwErrCode;
+
+    // Check the parameters
+    if((pBulk = IsValidBulkAddHandle(hBulkAdd)) == NULL)
+    {
+        SErrSetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    if(szFileName == NULL || *szFileName == 0)
+    {
+        SErrSetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Put the file to the queue. It will be opened by SFileCommitBulkAdd
+    dwErrCode = QueueBulkAddFile(pBulk, szFileName, NULL, 0, szArchivedName, 0, dwFlags, dwCompression, dwCompressionNext);
+    if(dwErrCode != ERROR_SUCCESS)
+        SErrSetLastError(dwErrCode);
+    return (dwErrCode == ERROR_SUCCESS);
+}
+
+bool WINAPI SFileBulkAddData(
+    HANDLE hBulkAdd,
+    const void * pvData,
+    DWORD cbData,
+    const char * szArchivedName,
+    ULONGLONG FileTime,
+    DWORD dwFlags,
+    DWORD dwCompression,
+    DWORD dwCompressionNext)
+{
+    TMPQBulkAdd * pBulk;
+    DWORD dwErrCode;
+
+    // Check the parameters
+    if((pBulk = IsValidBulkAddHandle(hBulkAdd)) == NULL)
+    {
+        SErrSetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    if(pvData == NULL && cbData != 0)
+    {
+        SErrSetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Put the data to the queue. Note that the data are not copied
+    dwErrCode = QueueBulkAddFile(pBulk, NULL, pvData, cbData, szArchivedName, FileTime, dwFlags, dwCompression, dwCompressionNext);
+    if(dwErrCode != ERROR_SUCCESS)
+        SErrSetLastError(dwErrCode);
+    return (dwErrCode == ERROR_SUCCESS);
+}
+
+bool WINAPI SFileCommitBulkAdd(HANDLE hBulkAdd)
+{
+    TMPQBulkAdd * pBulk;
+    TMPQArchive * ha;
+    DWORD dwGroupSize;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Check the parameters
+    if((pBulk = IsValidBulkAddHandle(hBulkAdd)) == NULL)
+    {
+        SErrSetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+    ha = pBulk->ha;
+
+    // Add all files
+    if(pBulk->dwFileCount != 0)
+    {
+        // Make sure that all files fit into the hash table
+        ReserveBulkAddFiles(ha, pBulk->dwFileCount);
+
+        // The internal files are going to be saved again. This must be done
+        // before the position of the new files and free file entries are determined
+        InvalidateInternalFiles(ha);
+        ha->BulkAddPos = FindFreeMpqSpace(ha);
+        ha->dwBulkAddFileIndex = 0;
+
+        // Prepare a group of files on the worker pool, then write them in the order of adding
+        for(DWORD i = 0; i < pBulk->dwFileCount && dwErrCode == ERROR_SUCCESS; i += dwGroupSize)
+        {
+            dwGroupSize = STORMLIB_MIN(BULK_ADD_GROUP_SIZE, pBulk->dwFileCount - i);
+            pBulk->pGroup = pBulk->pFiles + i;
+            StormWorkPool_Run(dwGroupSize, PrepareBulkAddFile, pBulk);
+
+            for(DWORD j = 0; j < dwGroupSize; j++)
+            {
+                if(dwErrCode == ERROR_SUCCESS)
+                    dwErrCode = WriteBulkAddFile(pBulk, pBulk->pGroup + j);
+                FreeBulkAddFileData(pBulk->pGroup + j);
+            }
+        }
+
+        // The files have been stored from the end of data on
+        ha->EndOfData = ha->BulkAddPos;
+        ha->BulkAddPos = 0;
+        ha->dwBulkAddFileIndex = 0;
+
+        // The HET table has not been updated by SFileAddFile_Finish
+        if(ha->pHetTable != NULL && ha->pHashTable != NULL)
+        {
+            DWORD dwHetErrCode = RebuildHetTable(ha);
+
+            if(dwErrCode == ERROR_SUCCESS)
+                dwErrCode = dwHetErrCode;
+        }
+
+        // Save the (listfile), (attributes) and the MPQ tables
+        if(dwErrCode == ERROR_SUCCESS && !SFileFlushArchive((HANDLE)ha))
+            dwErrCode = SErrGetLastError();
+    }
+
+    // The bulk add handle is freed in any case
+    FreeBulkAdd(pBulk);
+    if(dwErrCode != ERROR_SUCCESS)
+        SErrSetLastError(dwErrCode);
+    return (dwErrCode == ERROR_SUCCESS);
+}
+
+bool WINAPI SFileAbortBulkAdd(HANDLE hBulkAdd)
+{
+    TMPQBulkAdd * pBulk;
+
+    // Check the parameters
+    if((pBulk = IsValidBulkAddHandle(hBulkAdd)) == NULL)
+    {
+        SErrSetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    // No file has been added yet, so we only free the queue
+    FreeBulkAdd(pBulk);
+    return true;
+}
+
+void AbortBulkAdds(TMPQArchive * ha)
+{
+    while(ha->pFirstBulkAdd != NULL)
+        FreeBulkAdd(ha->pFirstBulkAdd);
+}
+
 //-----------------------------------------------------------------------------
 // bool SFileRemoveFile(HANDLE hMpq, char * szFileName)
 //
@@ -14,6 +14,12 @@
 #include "StormLib.h"
 #include "StormCommon.h"
 
+/*****************************************************************************/
+/* Local defines                                                             */
+/*****************************************************************************/
+
+#define COMPACT_CHUNK_SIZE  0x00100000      // Size of the data copied in one step. Also the size of a data slot in the compact journal
+
 /*****************************************************************************/
 /* Local functions                                                           */
 /*****************************************************************************/
@@ -142,6 +148,89 @@ static DWORD CopyNonMpqData(
     return dwErrCode;
 }
 
+// Checks whether the file sectors and the sector checksums follow each other
+// without gaps or overlaps, so the raw file data can be copied as one block.
+static bool IsContiguousFileData(TMPQFile * hf, DWORD dwBytesToCopy)
+{
+    DWORD dwOffsetCount;
+
+    // Files without sector offset table are always stored in one piece
+    if(hf->SectorOffsets == NULL)
+        return true;
+
+    // Check the sector offsets, including the offset of the end of the sector checksums
+    dwOffsetCount = hf->dwSectorCount + ((hf->SectorChksums != NULL) ? 2 : 1);
+    for(DWORD i = 1; i < dwOffsetCount; i++)
+    {
+        if(hf->SectorOffsets[i] < hf->SectorOffsets[i - 1])
+            return false;
+    }
+
+    // The data must not go beyond the compressed size of the file
+    return ((hf->SectorOffsets[dwOffsetCount - 1] - hf->SectorOffsets[0]) <= dwBytesToCopy);
+}
+
+// Copies a block of raw data from the archive to the current position of the target stream.
+// Local files are copied by the operating system if possible, otherwise through a large buffer.
+static DWORD CopyMpqFileData(TMPQArchive * ha, TFileStream * pNewStream, ULONGLONG RawFilePos, DWORD dwBytesToCopy)
+{
+    LPBYTE pbBuffer = NULL;
+    DWORD dwToCopy;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    while(dwBytesToCopy != 0)
+    {
+        dwToCopy = STORMLIB_MIN(dwBytesToCopy, COMPACT_CHUNK_SIZE);
+
+        // Try to let the kernel copy the data. Once it fails, use the buffer for the rest
+        if(pbBuffer == NULL)
+        {
+            if(!FileStream_Copy(pNewStream, NULL, ha->pStream, RawFilePos, dwToCopy))
+            {
+                if((dwErrCode = SErrGetLastError()) != ERROR_NOT_SUPPORTED)
+                    break;
+
+                if((pbBuffer = STORM_ALLOC(BYTE, dwToCopy)) == NULL)
+                {
+                    dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+                    break;
+                }
+                dwErrCode = ERROR_SUCCESS;
+            }
+        }
+
+        // Copy the data through the buffer
+        if(pbBuffer != NULL)
+        {
+            if(!FileStream_Read(ha->pStream, &RawFilePos, pbBuffer, dwToCopy))
+            {
+                dwErrCode = SErrGetLastError();
+                break;
+            }
+
+            if(!FileStream_Write(pNewStream, NULL, pbBuffer, dwToCopy))
+            {
+                dwErrCode = SErrGetLastError();
+                break;
+            }
+        }
+
+        // Update compact progress
+        if(ha->pfnCompactCB != NULL)
+        {
+            ha->CompactBytesProcessed += dwToCopy;
+            ha->pfnCompactCB(ha->pvCompactUserData, CCB_COMPACTING_FILES, ha->CompactBytesProcessed, ha->CompactTotalBytes);
+        }
+
+        RawFilePos += dwToCopy;
+        dwBytesToCopy -= dwToCopy;
+    }
+
+    if(pbBuffer != NULL)
+        STORM_FREE(pbBuffer);
+    return dwErrCode;
+}
+
 // Copies all file sectors into another archive.
 static DWORD CopyMpqFileSectors(
     TMPQArchive * ha,
@@ -151,12 +240,17 @@ static DWORD CopyMpqFileSectors(
 {
     TFileEntry * pFileEntry = hf->pFileEntry;
     ULONGLONG RawFilePos;               // Used for calculating sector offset in the old MPQ archive
+    ULONGLONG NewRawFilePos = 0;        // Position of the file in the new stream
     DWORD dwBytesToCopy = pFileEntry->dwCmpSize;
     DWORD dwPatchSize = 0;              // Size of patch header
     DWORD dwFileKey1 = 0;               // File key used for decryption
     DWORD dwFileKey2 = 0;               // File key used for encryption
     DWORD dwCmpSize = 0;                // Compressed file size, including patch header
     DWORD dwErrCode = ERROR_SUCCESS;
+    bool bCopiedAsBlock = false;        // If true, the file data have been copied as one block
+
+    // Remember where the file begins in the target stream
+    FileStream_GetPos(pNewStream, &NewRawFilePos);
 
     // Resolve decryption keys. Note that the file key given
     // in the TMPQFile structure also includes the key adjustment
@@ -218,9 +312,23 @@ static DWORD CopyMpqFileSectors(
         STORM_FREE(SectorOffsetsCopy);
     }
 
+    // If the file doesn't need to be re-encrypted and the sectors follow each other,
+    // the sectors, the sector checksums and any extra data are copied as one block
+    if(dwErrCode == ERROR_SUCCESS && dwFileKey1 == dwFileKey2 && IsContiguousFileData(hf, dwBytesToCopy))
+    {
+        RawFilePos = CalculateRawSectorOffset(hf, (hf->SectorOffsets != NULL) ? hf->SectorOffsets[0] : 0);
+        if((ha->FileOffsetMask - RawFilePos) >= dwBytesToCopy)
+        {
+            dwErrCode = CopyMpqFileData(ha, pNewStream, RawFilePos, dwBytesToCopy);
+            dwCmpSize += dwBytesToCopy;
+            dwBytesToCopy = 0;
+            bCopiedAsBlock = true;
+        }
+    }
+
     // Now we have to copy all file sectors. We do it without
     // recompression, because recompression is not necessary in this case
-    if(dwErrCode == ERROR_SUCCESS)
+    if(dwErrCode == ERROR_SUCCESS && bCopiedAsBlock == false)
     {
         for(DWORD dwSector = 0; dwSector < hf->dwSectorCount; dwSector++)
         {
@@ -281,7 +389,7 @@ static DWORD CopyMpqFileSectors(
 
     // Copy the sector CRCs, if any
     // Sector CRCs are always compressed (not imploded) and unencrypted
-    if(dwErrCode == ERROR_SUCCESS && hf->SectorOffsets != NULL && hf->SectorChksums != NULL)
+    if(dwErrCode == ERROR_SUCCESS && bCopiedAsBlock == false && hf->SectorOffsets != NULL && hf->SectorChksums != NULL)
     {
         DWORD dwCrcLength;
 
@@ -338,7 +446,7 @@ static DWORD CopyMpqFileSectors(
     if(dwErrCode == ERROR_SUCCESS && ha->pHeader->dwRawChunkSize != 0)
     {
         dwErrCode = WriteMpqDataMD5(pNewStream,
-                                 ha->MpqPos + MpqFilePos,
+                                 NewRawFilePos,
                                  pFileEntry->dwCmpSize,
                                  ha->pHeader->dwRawChunkSize);
     }
@@ -370,11 +478,49 @@ static DWORD CopyMpqFileSectors(
     return dwErrCode;
 }
 
+// Copies one file into another stream, at the current position of the stream
+static DWORD CopyMpqFile(TMPQArchive * ha, TFileEntry * pFileEntry, DWORD dwFileKey, TFileStream * pNewStream, ULONGLONG MpqFilePos)
+{
+    TMPQFile * hf;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Allocate structure for the MPQ file
+    hf = CreateFileHandle(ha, pFileEntry);
+    if(hf == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    // Set the file decryption key
+    hf->dwFileKey = dwFileKey;
+
+    // If the file is a patch file, load the patch header
+    if(dwErrCode == ERROR_SUCCESS && (pFileEntry->dwFlags & MPQ_FILE_PATCH_FILE))
+        dwErrCode = AllocatePatchInfo(hf, true);
+
+    // Allocate buffers for file sector and sector offset table
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = AllocateSectorBuffer(hf);
+
+    // Also allocate sector offset table and sector checksum table
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = AllocateSectorOffsets(hf, true);
+
+    // Also load sector checksums, if any
+    if(dwErrCode == ERROR_SUCCESS && (pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC))
+        dwErrCode = AllocateSectorChecksums(hf, false);
+
+    // Copy all file sectors
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CopyMpqFileSectors(ha, hf, pNewStream, MpqFilePos);
+
+    // Free buffers
+    FreeFileHandle(hf);
+    return dwErrCode;
+}
+
 static DWORD CopyMpqFiles(TMPQArchive * ha, LPDWORD pFileKeys, TFileStream * pNewStream)
 {
     TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
     TFileEntry * pFileEntry;
-    TMPQFile * hf = NULL;
     ULONGLONG MpqFilePos;
     DWORD dwErrCode = ERROR_SUCCESS;
 
@@ -392,60 +538,509 @@ static DWORD CopyMpqFiles(TMPQArchive * ha, LPDWORD pFileKeys, TFileStream * pNe
             // Perform file copy ONLY if the file has nonzero size
             if(pFileEntry->dwFileSize != 0)
             {
-                // Allocate structure for the MPQ file
-                hf = CreateFileHandle(ha, pFileEntry);
-                if(hf == NULL)
-                    return ERROR_NOT_ENOUGH_MEMORY;
+                dwErrCode = CopyMpqFile(ha, pFileEntry, pFileKeys[pFileEntry - ha->pFileTable], pNewStream, MpqFilePos);
+                if(dwErrCode != ERROR_SUCCESS)
+                    break;
+            }
 
-                // Set the file decryption key
-                hf->dwFileKey = pFileKeys[pFileEntry - ha->pFileTable];
+            // Note: DO NOT update the compressed size in the file entry, no matter how bad it is.
+            pFileEntry->ByteOffset = MpqFilePos;
+        }
+    }
 
-                // If the file is a patch file, load the patch header
-                if(pFileEntry->dwFlags & MPQ_FILE_PATCH_FILE)
-                {
-                    dwErrCode = AllocatePatchInfo(hf, true);
-                    if(dwErrCode != ERROR_SUCCESS)
-                        break;
-                }
+    return dwErrCode;
+}
 
-                // Allocate buffers for file sector and sector offset table
-                dwErrCode = AllocateSectorBuffer(hf);
-                if(dwErrCode != ERROR_SUCCESS)
-                    break;
+//-----------------------------------------------------------------------------
+// In-place compacting
+//
+// The files are slid down into the free space, one by one, in the order of
+// their position in the MPQ. Before any data overwrite the archive, they are
+// saved to a journal file ("<archive>.compact"). If the process is interrupted,
+// the journal is used to finish the move the next time the archive is open
+// for write access. Opening such archive for read-only access fails.
+
+#define ID_MPQ_JOURNAL      0x4A51504D      // Signature of the compact journal ('MPQJ')
+
+// Header of the compact journal. Followed by the list of finished moves
+// (TCompactMove[dwMaxMoves]) and by two data slots of COMPACT_CHUNK_SIZE bytes
+typedef struct _TCompactJournal
+{
+    DWORD dwSignature;                      // ID_MPQ_JOURNAL
+    DWORD dwMaxMoves;                       // Number of entries in the file table
+    DWORD dwMoveCount;                      // Number of finished file moves
+    DWORD dwFileIndex;                      // Index of the file being moved. HASH_ENTRY_FREE if none
+    ULONGLONG OldByteOffset;                // Old position of the file being moved
+    ULONGLONG NewByteOffset;                // New position of the file being moved
+    ULONGLONG DataSize;                     // Size of the file data, including MD5s
+    ULONGLONG DataOffset;                   // Offset of the data saved in the journal, relative to the file begin
+    ULONGLONG DataLength;                   // Length of the data saved in the journal
+} TCompactJournal;
+
+// A finished file move
+typedef struct _TCompactMove
+{
+    DWORD dwFileIndex;                      // Index of the moved file
+    DWORD dwReserved;                       // Alignment
+    ULONGLONG NewByteOffset;                // New position of the file
+} TCompactMove;
 
-                // Also allocate sector offset table and sector checksum table
-                dwErrCode = AllocateSectorOffsets(hf, true);
-                if(dwErrCode != ERROR_SUCCESS)
-                    break;
+typedef struct _TCompactState
+{
+    TMPQArchive * ha;                       // The archive being compacted
+    TFileStream * pJournal;                 // The compact journal
+    TCompactJournal Journal;                // Current content of the journal header
+    ULONGLONG SlotsPos;                     // Position of the data slots in the journal
+    LPBYTE pbBuffer;                        // Buffer for one chunk of data
+    bool bMovePending;                      // If true, the journal on the disk refers to an unfinished move
+} TCompactState;
+
+static int CompareFileEntriesByOffset(const void * pvEntry1, const void * pvEntry2)
+{
+    TFileEntry * pFileEntry1 = *(TFileEntry **)pvEntry1;
+    TFileEntry * pFileEntry2 = *(TFileEntry **)pvEntry2;
+
+    if(pFileEntry1->ByteOffset < pFileEntry2->ByteOffset)
+        return -1;
+    if(pFileEntry1->ByteOffset > pFileEntry2->ByteOffset)
+        return +1;
+    return 0;
+}
 
-                // Also load sector checksums, if any
-                if(pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC)
-                {
-                    dwErrCode = AllocateSectorChecksums(hf, false);
-                    if(dwErrCode != ERROR_SUCCESS)
-                        break;
-                }
+// Retrieves the positions of the MPQ tables that are currently stored in the archive.
+// Sizes of compressed tables are not known here, so we take the uncompressed ones.
+static DWORD GetTableExtents(TMPQArchive * ha, TMPQExtent * pExtents)
+{
+    TMPQHeader * pHeader = ha->pHeader;
+    TMPQExtent Tables[5];
+    DWORD dwExtentCount = 0;
+
+    Tables[0].ByteOffset = pHeader->HetTablePos64;
+    Tables[0].EndOffset  = pHeader->HetTablePos64 + pHeader->HetTableSize64;
+    Tables[1].ByteOffset = pHeader->BetTablePos64;
+    Tables[1].EndOffset  = pHeader->BetTablePos64 + pHeader->BetTableSize64;
+    Tables[2].ByteOffset = MAKE_OFFSET64(pHeader->wHashTablePosHi, pHeader->dwHashTablePos);
+    Tables[2].EndOffset  = Tables[2].ByteOffset + (ULONGLONG)pHeader->dwHashTableSize * sizeof(TMPQHash);
+    Tables[3].ByteOffset = MAKE_OFFSET64(pHeader->wBlockTablePosHi, pHeader->dwBlockTablePos);
+    Tables[3].EndOffset  = Tables[3].ByteOffset + (ULONGLONG)pHeader->dwBlockTableSize * sizeof(TMPQBlock);
+    Tables[4].ByteOffset = pHeader->HiBlockTablePos64;
+    Tables[4].EndOffset  = pHeader->HiBlockTablePos64 + pHeader->HiBlockTableSize64;
+
+    // Only keep the tables that are present
+    for(size_t i = 0; i < _countof(Tables); i++)
+    {
+        if(Tables[i].ByteOffset != 0 && Tables[i].EndOffset > Tables[i].ByteOffset)
+            pExtents[dwExtentCount++] = Tables[i];
+    }
+    return dwExtentCount;
+}
 
-                // Copy all file sectors
-                dwErrCode = CopyMpqFileSectors(ha, hf, pNewStream, MpqFilePos);
-                if(dwErrCode != ERROR_SUCCESS)
-                    break;
+// Returns the first position at or beyond ByteOffset where the data can be stored
+// without overlapping any of the given extents
+static ULONGLONG SkipTableExtents(TMPQExtent * pExtents, DWORD dwExtentCount, ULONGLONG ByteOffset, ULONGLONG DataSize)
+{
+    bool bMoved;
 
-                // Free buffers. This also sets "hf" to NULL.
-                FreeFileHandle(hf);
+    do
+    {
+        bMoved = false;
+        for(DWORD i = 0; i < dwExtentCount; i++)
+        {
+            if(ByteOffset < pExtents[i].EndOffset && pExtents[i].ByteOffset < ByteOffset + DataSize)
+            {
+                ByteOffset = pExtents[i].EndOffset;
+                bMoved = true;
             }
+        }
+    }
+    while(bMoved);
 
-            // Note: DO NOT update the compressed size in the file entry, no matter how bad it is.
-            pFileEntry->ByteOffset = MpqFilePos;
+    return ByteOffset;
+}
+
+static void GetCompactJournalName(TMPQArchive * ha, TCHAR * szJournal, size_t cchJournal)
+{
+    StringCopy(szJournal, cchJournal, FileStream_GetFileName(ha->pStream));
+    StringCat(szJournal, cchJournal, _T(".compact"));
+}
+
+static DWORD WriteCompactJournal(TCompactState * pState)
+{
+    TCompactJournal Journal = pState->Journal;
+    ULONGLONG ByteOffset = 0;
+
+    // Once we start writing a header with a file move, the move is pending
+    if(Journal.dwFileIndex != HASH_ENTRY_FREE)
+        pState->bMovePending = true;
+
+    BSWAP_ARRAY32_UNSIGNED(&Journal, sizeof(DWORD) * 4);
+    BSWAP_ARRAY64_UNSIGNED(&Journal.OldByteOffset, sizeof(ULONGLONG) * 5);
+    if(!FileStream_Write(pState->pJournal, &ByteOffset, &Journal, sizeof(TCompactJournal)))
+        return SErrGetLastError();
+
+    if(Journal.dwFileIndex == HASH_ENTRY_FREE)
+        pState->bMovePending = false;
+    return ERROR_SUCCESS;
+}
+
+// The data slots alternate, so the previously saved chunk
+// stays valid until the journal header is updated
+static ULONGLONG GetJournalSlotPos(TCompactState * pState, ULONGLONG DataOffset)
+{
+    return pState->SlotsPos + ((DataOffset / COMPACT_CHUNK_SIZE) & 1) * COMPACT_CHUNK_SIZE;
+}
+
+// Copies the data saved in the journal to their new position in the archive
+static DWORD CopyJournalData(TCompactState * pState)
+{
+    TCompactJournal * pJournal = &pState->Journal;
+    TMPQArchive * ha = pState->ha;
+    ULONGLONG SlotPos = GetJournalSlotPos(pState, pJournal->DataOffset);
+    ULONGLONG ByteOffset;
+    ULONGLONG BytesCopied = 0;
+    DWORD dwToCopy;
+
+    while(BytesCopied < pJournal->DataLength)
+    {
+        dwToCopy = (DWORD)STORMLIB_MIN(pJournal->DataLength - BytesCopied, COMPACT_CHUNK_SIZE);
+
+        ByteOffset = SlotPos + BytesCopied;
+        if(!FileStream_Read(pState->pJournal, &ByteOffset, pState->pbBuffer, dwToCopy))
+            return SErrGetLastError();
+
+        ByteOffset = FileOffsetFromMpqOffset(ha, pJournal->NewByteOffset + pJournal->DataOffset + BytesCopied);
+        if(!FileStream_Write(ha->pStream, &ByteOffset, pState->pbBuffer, dwToCopy))
+            return SErrGetLastError();
+
+        BytesCopied += dwToCopy;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Moves the file data to the new position, chunk by chunk, starting at the given offset.
+// Every chunk is saved to the journal before it is written to the archive,
+// because it may overwrite the old data of the same file
+static DWORD MoveFileChunks(TCompactState * pState, ULONGLONG DataOffset)
+{
+    TCompactJournal * pJournal = &pState->Journal;
+    TMPQArchive * ha = pState->ha;
+    ULONGLONG ByteOffset;
+    ULONGLONG SrcOffset;
+    DWORD dwToCopy;
+    DWORD dwErrCode;
+    bool bSaveChunks = true;
+    bool bUseKernelCopy = true;
+
+    // If the new position doesn't overlap the old one, the old data stay
+    // intact during the move, and the journal only needs to know the move
+    if(pJournal->NewByteOffset + pJournal->DataSize <= pJournal->OldByteOffset)
+    {
+        pJournal->DataOffset = DataOffset;
+        pJournal->DataLength = 0;
+        dwErrCode = WriteCompactJournal(pState);
+        if(dwErrCode != ERROR_SUCCESS)
+            return dwErrCode;
+        bSaveChunks = false;
+    }
+
+    while(DataOffset < pJournal->DataSize)
+    {
+        dwToCopy = (DWORD)STORMLIB_MIN(pJournal->DataSize - DataOffset, COMPACT_CHUNK_SIZE);
+        SrcOffset = FileOffsetFromMpqOffset(ha, pJournal->OldByteOffset + DataOffset);
+
+        // If the chunk doesn't need to be saved, try to let the kernel copy it
+        if(bSaveChunks == false && bUseKernelCopy)
+        {
+            ByteOffset = FileOffsetFromMpqOffset(ha, pJournal->NewByteOffset + DataOffset);
+            if(FileStream_Copy(ha->pStream, &ByteOffset, ha->pStream, SrcOffset, dwToCopy) == false)
+            {
+                if(SErrGetLastError() != ERROR_NOT_SUPPORTED)
+                    return SErrGetLastError();
+                bUseKernelCopy = false;
+            }
+        }
+
+        // Read the chunk from the old position
+        if(bSaveChunks || bUseKernelCopy == false)
+        {
+            if(!FileStream_Read(ha->pStream, &SrcOffset, pState->pbBuffer, dwToCopy))
+                return SErrGetLastError();
+        }
+
+        // Save the chunk to the journal and let the journal header point to it
+        if(bSaveChunks)
+        {
+            ByteOffset = GetJournalSlotPos(pState, DataOffset);
+            if(!FileStream_Write(pState->pJournal, &ByteOffset, pState->pbBuffer, dwToCopy))
+                return SErrGetLastError();
+
+            pJournal->DataOffset = DataOffset;
+            pJournal->DataLength = dwToCopy;
+            dwErrCode = WriteCompactJournal(pState);
+            if(dwErrCode != ERROR_SUCCESS)
+                return dwErrCode;
+        }
+
+        // Now the chunk can be written to the new position
+        if(bSaveChunks || bUseKernelCopy == false)
+        {
+            ByteOffset = FileOffsetFromMpqOffset(ha, pJournal->NewByteOffset + DataOffset);
+            if(!FileStream_Write(ha->pStream, &ByteOffset, pState->pbBuffer, dwToCopy))
+                return SErrGetLastError();
+        }
+
+        // Update compact progress
+        if(ha->pfnCompactCB != NULL)
+        {
+            ha->CompactBytesProcessed += dwToCopy;
+            ha->pfnCompactCB(ha->pvCompactUserData, CCB_COMPACTING_FILES, ha->CompactBytesProcessed, ha->CompactTotalBytes);
+        }
+
+        DataOffset += dwToCopy;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Moves a file whose encryption key depends on its position (MPQ_FILE_KEY_V2).
+// The re-encrypted image of the file is built in the journal first.
+static DWORD MoveFileImage(TCompactState * pState, TFileEntry * pFileEntry, DWORD dwFileKey)
+{
+    TCompactJournal * pJournal = &pState->Journal;
+    TMPQArchive * ha = pState->ha;
+    ULONGLONG ByteOffset = pState->SlotsPos;
+    DWORD dwErrCode;
+
+    // Set the journal position to the begin of the data slots
+    if(!FileStream_Write(pState->pJournal, &ByteOffset, pState->pbBuffer, 0))
+        return SErrGetLastError();
+
+    // Write the file, re-encrypted for the new position
+    dwErrCode = CopyMpqFile(ha, pFileEntry, dwFileKey, pState->pJournal, pJournal->NewByteOffset);
+    if(dwErrCode != ERROR_SUCCESS)
+        return dwErrCode;
+
+    // If the size of the image doesn't match the file data
+    // (e.g. due to a bad compressed size), we leave the file where it is
+    FileStream_GetPos(pState->pJournal, &ByteOffset);
+    if((ByteOffset - pState->SlotsPos) != pJournal->DataSize)
+        return ERROR_CAN_NOT_COMPLETE;
+
+    // Let the journal header point to the image and copy it to the archive
+    pJournal->DataOffset = 0;
+    pJournal->DataLength = pJournal->DataSize;
+    dwErrCode = WriteCompactJournal(pState);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CopyJournalData(pState);
+    return dwErrCode;
+}
+
+// Records the finished move in the journal and in the file table
+static DWORD FinishFileMove(TCompactState * pState, TFileEntry * pFileEntry)
+{
+    TCompactJournal * pJournal = &pState->Journal;
+    TCompactMove Move;
+    ULONGLONG ByteOffset = sizeof(TCompactJournal) + (ULONGLONG)pJournal->dwMoveCount * sizeof(TCompactMove);
+    DWORD dwErrCode;
+
+    // Append the move to the list of finished moves
+    Move.dwFileIndex = pJournal->dwFileIndex;
+    Move.dwReserved = 0;
+    Move.NewByteOffset = pJournal->NewByteOffset;
+    BSWAP_ARRAY32_UNSIGNED(&Move, sizeof(DWORD) * 2);
+    BSWAP_ARRAY64_UNSIGNED(&Move.NewByteOffset, sizeof(ULONGLONG));
+    if(!FileStream_Write(pState->pJournal, &ByteOffset, &Move, sizeof(TCompactMove)))
+        return SErrGetLastError();
+
+    // Update the journal header
+    pJournal->dwMoveCount++;
+    pJournal->dwFileIndex = HASH_ENTRY_FREE;
+    pJournal->DataOffset = pJournal->DataLength = 0;
+    dwErrCode = WriteCompactJournal(pState);
+    if(dwErrCode != ERROR_SUCCESS)
+        return dwErrCode;
+
+    // Note: DO NOT update the compressed size in the file entry, no matter how bad it is.
+    pFileEntry->ByteOffset = pJournal->NewByteOffset;
+    return ERROR_SUCCESS;
+}
+
+// Loads the journal of an interrupted in-place compacting (if any),
+// applies the finished file moves and finishes the move that was in progress.
+// Called when the archive is being open for write access.
+DWORD LoadCompactJournal(TMPQArchive * ha)
+{
+    TCompactJournal * pJournal;
+    TCompactState State;
+    TCompactMove Move;
+    TFileEntry * pFileEntry;
+    ULONGLONG ByteOffset = 0;
+    ULONGLONG FileSize = 0;
+    TCHAR szJournal[MAX_PATH+1];
+    DWORD dwStreamFlags = STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Prepare the state of the compacting
+    memset(&State, 0, sizeof(TCompactState));
+    pJournal = &State.Journal;
+    State.ha = ha;
+
+    // If there is no journal, there is nothing to do
+    GetCompactJournalName(ha, szJournal, _countof(szJournal));
+    dwStreamFlags |= (ha->dwFlags & MPQ_FLAG_READ_ONLY) ? STREAM_FLAG_READ_ONLY : 0;
+    State.pJournal = FileStream_OpenFile(szJournal, dwStreamFlags);
+    if(State.pJournal == NULL)
+        return ERROR_SUCCESS;
+
+    // If the journal header has not been written yet, the compacting
+    // has been interrupted before anything in the archive was changed
+    FileStream_GetSize(State.pJournal, &FileSize);
+    if(FileSize < sizeof(TCompactJournal))
+    {
+        FileStream_Close(State.pJournal);
+        if((ha->dwFlags & MPQ_FLAG_READ_ONLY) == 0)
+            _tremove(szJournal);
+        return ERROR_SUCCESS;
+    }
+
+    // The file moves can only be finished with write access. Without it, the files
+    // that have already been moved would be read through the old tables
+    if(ha->dwFlags & MPQ_FLAG_READ_ONLY)
+    {
+        FileStream_Close(State.pJournal);
+        return ERROR_ACCESS_DENIED;
+    }
+
+    // Load and verify the journal header
+    if(!FileStream_Read(State.pJournal, &ByteOffset, pJournal, sizeof(TCompactJournal)))
+        dwErrCode = ERROR_FILE_CORRUPT;
+    BSWAP_ARRAY32_UNSIGNED(pJournal, sizeof(DWORD) * 4);
+    BSWAP_ARRAY64_UNSIGNED(&pJournal->OldByteOffset, sizeof(ULONGLONG) * 5);
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        if(pJournal->dwSignature != ID_MPQ_JOURNAL || pJournal->dwMoveCount > pJournal->dwMaxMoves)
+            dwErrCode = ERROR_FILE_CORRUPT;
+        State.SlotsPos = sizeof(TCompactJournal) + (ULONGLONG)pJournal->dwMaxMoves * sizeof(TCompactMove);
+    }
+
+    // Apply the finished moves to the file table
+    for(DWORD i = 0; dwErrCode == ERROR_SUCCESS && i < pJournal->dwMoveCount; i++)
+    {
+        if(!FileStream_Read(State.pJournal, NULL, &Move, sizeof(TCompactMove)))
+        {
+            dwErrCode = ERROR_FILE_CORRUPT;
+            break;
+        }
+
+        BSWAP_ARRAY32_UNSIGNED(&Move, sizeof(DWORD) * 2);
+        BSWAP_ARRAY64_UNSIGNED(&Move.NewByteOffset, sizeof(ULONGLONG));
+        if(Move.dwFileIndex >= ha->dwFileTableSize)
+        {
+            dwErrCode = ERROR_FILE_CORRUPT;
+            break;
         }
+
+        ha->pFileTable[Move.dwFileIndex].ByteOffset = Move.NewByteOffset;
     }
 
+    // Finish the move that was in progress
+    if(dwErrCode == ERROR_SUCCESS && pJournal->dwFileIndex != HASH_ENTRY_FREE)
+    {
+        // The file must still be at its old position
+        if(pJournal->dwFileIndex >= ha->dwFileTableSize)
+            dwErrCode = ERROR_FILE_CORRUPT;
+        pFileEntry = ha->pFileTable + pJournal->dwFileIndex;
+        if(dwErrCode == ERROR_SUCCESS && pFileEntry->ByteOffset != pJournal->OldByteOffset)
+            dwErrCode = ERROR_FILE_CORRUPT;
+
+        // Allocate the buffer for copying the data
+        if(dwErrCode == ERROR_SUCCESS)
+        {
+            State.pbBuffer = STORM_ALLOC(BYTE, COMPACT_CHUNK_SIZE);
+            if(State.pbBuffer == NULL)
+                dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+        }
+
+        // Write the data saved in the journal again, then move the rest of the file
+        if(dwErrCode == ERROR_SUCCESS)
+            dwErrCode = CopyJournalData(&State);
+        if(dwErrCode == ERROR_SUCCESS && (pJournal->DataOffset + pJournal->DataLength) < pJournal->DataSize)
+            dwErrCode = MoveFileChunks(&State, pJournal->DataOffset + pJournal->DataLength);
+        if(dwErrCode == ERROR_SUCCESS)
+            dwErrCode = FinishFileMove(&State, pFileEntry);
+    }
+
+    // The tables must be saved and the journal deleted once the archive is open
+    if(dwErrCode == ERROR_SUCCESS)
+        ha->dwFlags |= MPQ_FLAG_COMPACT_JOURNAL;
+
     // Cleanup and exit
-    if(hf != NULL)
-        FreeFileHandle(hf);
+    if(State.pbBuffer != NULL)
+        STORM_FREE(State.pbBuffer);
+    FileStream_Close(State.pJournal);
     return dwErrCode;
 }
 
+// Saves the MPQ tables at the given position (or right after the last file, if zero)
+static DWORD SaveTablesAt(TMPQArchive * ha, ULONGLONG TablePos)
+{
+    ha->EndOfData = TablePos;
+    ha->dwFlags |= MPQ_FLAG_CHANGED;
+    if(!SFileFlushArchive((HANDLE)ha))
+        return SErrGetLastError();
+    return ERROR_SUCCESS;
+}
+
+// Saves the MPQ tables after the files have been moved and deletes the journal.
+// The journal is kept until the last save is complete. If the process is interrupted
+// before that, the next open applies the moves again (they are already done) and
+// comes here once more. For that, the tables referenced by the MPQ header must stay
+// valid all the time, so new tables are never written over them.
+DWORD FinishCompactJournal(TMPQArchive * ha)
+{
+    ULONGLONG TablesPos;
+    ULONGLONG TablesEnd;
+    ULONGLONG FinalPos;
+    ULONGLONG FileSize = 0;
+    TCHAR szJournal[MAX_PATH+1];
+    DWORD dwErrCode;
+
+    // Save the tables beyond the current end of the archive. The MPQ header
+    // is written after the tables, so the old tables stay valid until then.
+    FileStream_GetSize(ha->pStream, &FileSize);
+    TablesPos = FileSize - ha->MpqPos;
+    if((dwErrCode = SaveTablesAt(ha, TablesPos)) != ERROR_SUCCESS)
+        return dwErrCode;
+    FileStream_GetSize(ha->pStream, &FileSize);
+    TablesEnd = FileSize - ha->MpqPos;
+
+    // Find out where the tables end up after the last file (internal files included)
+    ResetMpqSpace(ha);
+    ha->dwFlags |= MPQ_FLAG_SAVING_TABLES;
+    FinalPos = FindFreeMpqSpace(ha);
+    ha->dwFlags &= ~MPQ_FLAG_SAVING_TABLES;
+
+    // If they would overlap the tables we have just saved, save them once more
+    // beyond those. Otherwise, an interruption could leave no valid tables.
+    if((FinalPos + (TablesEnd - TablesPos)) > TablesPos)
+    {
+        if((dwErrCode = SaveTablesAt(ha, TablesEnd)) != ERROR_SUCCESS)
+            return dwErrCode;
+    }
+
+    // Save the tables right after the last file. This also cuts the archive
+    ResetMpqSpace(ha);
+    if((dwErrCode = SaveTablesAt(ha, 0)) != ERROR_SUCCESS)
+        return dwErrCode;
+
+    // The moves are now stored in the tables, so we no longer need the journal
+    GetCompactJournalName(ha, szJournal, _countof(szJournal));
+    _tremove(szJournal);
+    ha->dwFlags &= ~MPQ_FLAG_COMPACT_JOURNAL;
+    return ERROR_SUCCESS;
+}
+
 /*****************************************************************************/
 /* Public functions                                                          */
 /*****************************************************************************/
@@ -534,6 +1129,7 @@ bool WINAPI SFileCompactArchive(HANDLE hMpq, const TCHAR * szListFile, bool /* b
     ULONGLONG ByteCount;
     LPDWORD pFileKeys = NULL;
     TCHAR szTempFile[MAX_PATH+1] = _T("");
+    DWORD dwStreamFlags = 0;
     DWORD dwErrCode = ERROR_SUCCESS;
 
     // Test the valid parameters
@@ -579,9 +1175,13 @@ bool WINAPI SFileCompactArchive(HANDLE hMpq, const TCHAR * szListFile, bool /* b
         StringCat(szTempFile, _countof(szTempFile), _T(".tmp"));
 
         // Create temporary file
-        pTempStream = FileStream_CreateFile(szTempFile, STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE);
+        pTempStream = FileStream_CreateFile(szTempFile, STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE | STREAM_FLAG_SEQUENTIAL);
         if(pTempStream == NULL)
             dwErrCode = SErrGetLastError();
+
+        // The whole archive will be read through. Let the system read ahead
+        FileStream_GetFlags(ha->pStream, &dwStreamFlags);
+        FileStream_SetAccessHint(ha->pStream, STREAM_FLAG_SEQUENTIAL);
     }
 
     // Write the data before MPQ user data (if any)
@@ -628,9 +1228,12 @@ bool WINAPI SFileCompactArchive(HANDLE hMpq, const TCHAR * szListFile, bool /* b
         ha->CompactBytesProcessed += ha->pHeader->dwHeaderSize;
     }
 
-    // Now copy all files
+    // Now copy all files. The holes in the file data are gone
     if(dwErrCode == ERROR_SUCCESS)
+    {
         dwErrCode = CopyMpqFiles(ha, pFileKeys, pTempStream);
+        ResetMpqSpace(ha);
+    }
 
     // If succeeded, switch the streams
     if(dwErrCode == ERROR_SUCCESS)
@@ -650,6 +1253,10 @@ bool WINAPI SFileCompactArchive(HANDLE hMpq, const TCHAR * szListFile, bool /* b
         ha->pfnCompactCB(ha->pvCompactUserData, CCB_CLOSING_ARCHIVE, ha->CompactBytesProcessed, ha->CompactTotalBytes);
     }
 
+    // Restore the original access hint
+    if(szTempFile[0] != 0)
+        FileStream_SetAccessHint(ha->pStream, dwStreamFlags & STREAM_ACCESS_HINT_MASK);
+
     // Cleanup and return
     if(pTempStream != NULL)
         FileStream_Close(pTempStream);
@@ -659,3 +1266,227 @@ bool WINAPI SFileCompactArchive(HANDLE hMpq, const TCHAR * szListFile, bool /* b
         SErrSetLastError(dwErrCode);
     return (dwErrCode == ERROR_SUCCESS);
 }
+
+//-----------------------------------------------------------------------------
+// In-place archive compacting
+
+bool WINAPI SFileCompactArchiveInPlace(HANDLE hMpq, const TCHAR * szListFile, ULONGLONG BytesToReclaim)
+{
+    TCompactState State;
+    TMPQArchive * ha = IsValidMpqHandle(hMpq);
+    TFileEntry * pFileTableEnd;
+    TFileEntry * pFileEntry;
+    TFileEntry ** SortTable = NULL;
+    TMPQExtent Tables[5];
+    ULONGLONG FreeSpacePos = 0;         // End of the files that have already been processed
+    ULONGLONG FreeSpaceEnd = 0;         // Begin of the first file that has not been moved
+    ULONGLONG ByteOffset;
+    ULONGLONG DataSize;
+    TCHAR szJournal[MAX_PATH+1];
+    DWORD dwTableCount = 0;
+    DWORD dwFileCount = 0;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Prepare the state of the compacting
+    memset(&State, 0, sizeof(TCompactState));
+    State.ha = ha;
+
+    // Test the valid parameters
+    if(ha == NULL)
+        dwErrCode = ERROR_INVALID_HANDLE;
+    else if(ha->dwFlags & MPQ_FLAG_READ_ONLY)
+        dwErrCode = ERROR_ACCESS_DENIED;
+
+    // Are there some files open?
+    else if(ha->dwFileCount)
+        dwErrCode = ERROR_ACCESS_DENIED;
+
+    // Always save the archive. Besides saving the pending changes, this also removes
+    // the free entries from the file table, so the file indexes stored in the journal
+    // match the file table that will be loaded after an interruption.
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        ha->dwFlags |= MPQ_FLAG_CHANGED;
+        if(!SFileFlushArchive(hMpq))
+            dwErrCode = SErrGetLastError();
+    }
+
+    // Initialize the progress variables for compact callback
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        ha->CompactTotalBytes = 0;
+        ha->CompactBytesProcessed = 0;
+    }
+
+    // Files encrypted with MPQ_FILE_KEY_V2 need their names to be moved
+    if(dwErrCode == ERROR_SUCCESS && szListFile != NULL)
+    {
+        // Notify the user
+        if(ha->pfnCompactCB != NULL)
+            ha->pfnCompactCB(ha->pvCompactUserData, CCB_CHECKING_FILES, ha->CompactBytesProcessed, ha->CompactTotalBytes);
+
+        dwErrCode = SFileAddListFile(hMpq, szListFile);
+    }
+
+    // Sort the files by their position in the archive
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        SortTable = STORM_ALLOC(TFileEntry *, ha->dwFileTableSize);
+        if(SortTable != NULL)
+        {
+            pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+            for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
+            {
+                if((pFileEntry->dwFlags & MPQ_FILE_EXISTS) && pFileEntry->dwCmpSize != 0)
+                {
+                    ha->CompactTotalBytes += GetFileEntryDataEnd(ha, pFileEntry) - pFileEntry->ByteOffset;
+                    SortTable[dwFileCount++] = pFileEntry;
+                }
+            }
+
+            qsort(SortTable, dwFileCount, sizeof(TFileEntry *), CompareFileEntriesByOffset);
+            dwTableCount = GetTableExtents(ha, Tables);
+        }
+        else
+            dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    // Create the journal
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        State.pbBuffer = STORM_ALLOC(BYTE, COMPACT_CHUNK_SIZE);
+        if(State.pbBuffer == NULL)
+            dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        GetCompactJournalName(ha, szJournal, _countof(szJournal));
+        State.pJournal = FileStream_CreateFile(szJournal, STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE);
+        if(State.pJournal != NULL)
+        {
+            State.Journal.dwSignature = ID_MPQ_JOURNAL;
+            State.Journal.dwMaxMoves = ha->dwFileTableSize;
+            State.Journal.dwFileIndex = HASH_ENTRY_FREE;
+            State.SlotsPos = sizeof(TCompactJournal) + (ULONGLONG)ha->dwFileTableSize * sizeof(TCompactMove);
+            dwErrCode = WriteCompactJournal(&State);
+        }
+        else
+            dwErrCode = SErrGetLastError();
+    }
+
+    // Slide the files down, in the order of their position in the archive
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        FreeSpacePos = ha->pHeader->dwHeaderSize;
+        for(DWORD i = 0; i < dwFileCount; i++)
+        {
+            pFileEntry = SortTable[i];
+            ByteOffset = pFileEntry->ByteOffset;
+            DataSize = GetFileEntryDataEnd(ha, pFileEntry) - ByteOffset;
+
+            // If the file shares its data with the previous one, we leave the rest as-is
+            if(ByteOffset < FreeSpacePos)
+                break;
+            FreeSpaceEnd = ByteOffset;
+
+            // Find the new position of the file. The current MPQ tables must stay intact
+            State.Journal.NewByteOffset = SkipTableExtents(Tables, dwTableCount, FreeSpacePos, DataSize);
+            if(State.Journal.NewByteOffset < ByteOffset)
+            {
+                // Stop if we already reclaimed enough space
+                if(BytesToReclaim != 0 && (ByteOffset - FreeSpacePos) >= BytesToReclaim)
+                    break;
+
+                State.Journal.dwFileIndex = (DWORD)(pFileEntry - ha->pFileTable);
+                State.Journal.OldByteOffset = ByteOffset;
+                State.Journal.DataSize = DataSize;
+
+                // Files with the key depending on the position need to be re-encrypted
+                if((pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED) && (pFileEntry->dwFlags & MPQ_FILE_KEY_V2) && pFileEntry->dwFileSize != 0)
+                {
+                    // We don't know the encryption key of this file, so we cannot move it
+                    if(pFileEntry->szFileName == NULL || IsPseudoFileName(pFileEntry->szFileName, NULL))
+                    {
+                        dwErrCode = ERROR_UNKNOWN_FILE_NAMES;
+                        break;
+                    }
+
+                    dwErrCode = MoveFileImage(&State, pFileEntry, DecryptFileKey(pFileEntry->szFileName,
+                                                                                 pFileEntry->ByteOffset,
+                                                                                 pFileEntry->dwFileSize,
+                                                                                 pFileEntry->dwFlags));
+                }
+                else
+                {
+                    dwErrCode = MoveFileChunks(&State, 0);
+                }
+
+                // Record the finished move. If the file could not be copied
+                // and nothing has been written to the archive, leave it as-is
+                if(dwErrCode == ERROR_SUCCESS)
+                {
+                    dwErrCode = FinishFileMove(&State, pFileEntry);
+                    ByteOffset = pFileEntry->ByteOffset;
+                }
+                else if(dwErrCode == ERROR_CAN_NOT_COMPLETE && State.bMovePending == false)
+                {
+                    dwErrCode = ERROR_SUCCESS;
+                }
+
+                if(dwErrCode != ERROR_SUCCESS)
+                    break;
+            }
+            else if(ha->pfnCompactCB != NULL)
+            {
+                ha->CompactBytesProcessed += DataSize;
+                ha->pfnCompactCB(ha->pvCompactUserData, CCB_COMPACTING_FILES, ha->CompactBytesProcessed, ha->CompactTotalBytes);
+            }
+
+            FreeSpacePos = ByteOffset + DataSize;
+            FreeSpaceEnd = 0;
+        }
+    }
+
+    // If a move has been interrupted in the middle, the journal must stay as-is.
+    // The move will be finished when the archive is open for write access next time.
+    if(State.pJournal != NULL)
+    {
+        FileStream_Close(State.pJournal);
+        State.pJournal = NULL;
+
+        if(State.bMovePending == false)
+        {
+            DWORD dwFinishError;
+
+            // Notify the user
+            if(ha->pfnCompactCB != NULL)
+                ha->pfnCompactCB(ha->pvCompactUserData, CCB_CLOSING_ARCHIVE, ha->CompactBytesProcessed, ha->CompactTotalBytes);
+
+            // Save the tables and delete the journal
+            dwFinishError = FinishCompactJournal(ha);
+            if(dwErrCode == ERROR_SUCCESS)
+                dwErrCode = dwFinishError;
+
+            // If we stopped before the end, let the new files use the reclaimed space
+            if(dwFinishError == ERROR_SUCCESS && FreeSpaceEnd > FreeSpacePos)
+            {
+                FindFreeMpqSpace(ha);
+                ReleaseMpqSpace(ha, FreeSpacePos, FreeSpaceEnd);
+            }
+        }
+        else
+        {
+            ha->dwFlags |= MPQ_FLAG_READ_ONLY;
+        }
+    }
+
+    // Cleanup and return
+    if(State.pbBuffer != NULL)
+        STORM_FREE(State.pbBuffer);
+    if(SortTable != NULL)
+        STORM_FREE(SortTable);
+    if(dwErrCode != ERROR_SUCCESS)
+        SErrSetLastError(dwErrCode);
+    return (dwErrCode == ERROR_SUCCESS);
+}
@@ -209,6 +209,7 @@ bool WINAPI SFileCreateArchive2(const TCHAR * szMpqName, PSFILE_CREATE_MPQ pCrea
     if(dwErrCode == ERROR_SUCCESS)
     {
         memset(ha, 0, sizeof(TMPQArchive));
+        StormLock_Init(&ha->Lock);
         ha->pfnHashString    = HashStringSlash;
         ha->pStream          = pStream;
         ha->dwSectorSize     = pCreateInfo->dwSectorSize;
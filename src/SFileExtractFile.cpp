@@ -62,3 +62,486 @@ bool WINAPI SFileExtractFile(HANDLE hMpq, const char * szToExtract, const TCHAR
         SErrSetLastError(dwErrCode);
     return (dwErrCode == ERROR_SUCCESS);
 }
+
+//-----------------------------------------------------------------------------
+// Extracting multiple files
+//
+// The files are extracted in the order of their position in the archive,
+// so the archive is read (mostly) sequentially. Each thread of the worker pool
+// takes the next file from the list and extracts it using its own buffer.
+
+#define EXTRACT_BUFFER_SIZE     0x100000        // Size of the data buffer of one extracting thread
+
+#ifdef STORMLIB_WINDOWS
+#define EXTRACT_PATH_SEPARATOR  _T('\\')
+#else
+#define EXTRACT_PATH_SEPARATOR  '/'
+#endif
+
+struct TExtractFile
+{
+    const char * szFileName;                // Name of the file in the archive
+    size_t nNameOffset;                     // Offset of the name in the name buffer (while collecting files)
+    ULONGLONG ByteOffset;                   // Position of the file data in the archive
+    DWORD dwFileSize;                       // Size of the file
+    DWORD dwCompSize;                       // Compressed size of the file
+};
+
+struct TExtractWork
+{
+    HANDLE hMpq;                            // Archive handle
+    const TCHAR * szTargetDir;              // Target directory
+    TExtractFile * pFiles;                  // List of files to extract, sorted by file position
+    char * szNames;                         // Buffer with file names
+    DWORD dwFileCount;                      // Number of files to extract
+    DWORD dwNextFile;                       // Index of the next file to be extracted
+    DWORD dwFlags;                          // SFILE_EXTRACT_XXX
+    DWORD dwErrCode;                        // The first error that occurred
+    bool bStopped;                          // If true, no more files will be extracted
+    bool bSerialSectors;                    // If true, the sectors of each file are processed by its extracting thread
+
+    SFILE_EXTRACT_CALLBACK ExtractCB;       // Progress callback
+    void * pvUserData;                      // User data for the callback
+    SFILE_EXTRACT_INFO Info;                // Progress information
+    ULONGLONG StartTime;                    // Time when the extraction started, in milliseconds
+
+    STORM_LOCK Lock;                        // Lock for the file list and the progress information
+};
+
+static int CompareFilesByName(const void * pvFile1, const void * pvFile2)
+{
+    const TExtractFile * pFile1 = (const TExtractFile *)pvFile1;
+    const TExtractFile * pFile2 = (const TExtractFile *)pvFile2;
+
+    return _stricmp(pFile1->szFileName, pFile2->szFileName);
+}
+
+static int CompareFilesByOffset(const void * pvFile1, const void * pvFile2)
+{
+    const TExtractFile * pFile1 = (const TExtractFile *)pvFile1;
+    const TExtractFile * pFile2 = (const TExtractFile *)pvFile2;
+
+    if(pFile1->ByteOffset != pFile2->ByteOffset)
+        return (pFile1->ByteOffset < pFile2->ByteOffset) ? -1 : +1;
+    return 0;
+}
+
+// Finds all files that match the mask and sorts them by their position in the archive
+static DWORD CollectFilesToExtract(TMPQArchive * ha, const char * szMask, TExtractWork * pWork)
+{
+    SFILE_FIND_DATA sf;
+    HANDLE hFind;
+    size_t cbNames = 0;
+    size_t cbMaxNames = 0;
+    DWORD dwMaxFiles = 0;
+    DWORD dwFileCount = 0;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Find the first file. If there is none, there is nothing to extract
+    hFind = SFileFindFirstFile(pWork->hMpq, szMask, &sf, NULL);
+    if(hFind == NULL)
+    {
+        dwErrCode = SErrGetLastError();
+        return (dwErrCode == ERROR_NO_MORE_FILES) ? ERROR_SUCCESS : dwErrCode;
+    }
+
+    do
+    {
+        TExtractFile * pFile;
+        size_t nNameLength = strlen(sf.cFileName) + 1;
+
+        // Enlarge the file list, if needed
+        if(dwFileCount >= dwMaxFiles)
+        {
+            TExtractFile * pNewFiles;
+
+            dwMaxFiles = (dwMaxFiles != 0) ? (dwMaxFiles * 2) : 0x400;
+            if((pNewFiles = STORM_REALLOC(TExtractFile, pWork->pFiles, dwMaxFiles)) == NULL)
+            {
+                dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+                break;
+            }
+            pWork->pFiles = pNewFiles;
+        }
+
+        // Enlarge the name buffer, if needed
+        if((cbNames + nNameLength) > cbMaxNames)
+        {
+            char * szNewNames;
+
+            cbMaxNames = (cbMaxNames != 0) ? (cbMaxNames * 2) : 0x10000;
+            if((szNewNames = STORM_REALLOC(char, pWork->szNames, cbMaxNames)) == NULL)
+            {
+                dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+                break;
+            }
+            pWork->szNames = szNewNames;
+        }
+
+        // Insert the file to the list
+        pFile = pWork->pFiles + dwFileCount++;
+        pFile->szFileName = NULL;
+        pFile->nNameOffset = cbNames;
+        pFile->ByteOffset = (sf.dwBlockIndex < ha->dwFileTableSize) ? ha->pFileTable[sf.dwBlockIndex].ByteOffset : 0;
+        pFile->dwFileSize = sf.dwFileSize;
+        pFile->dwCompSize = sf.dwCompSize;
+        memcpy(pWork->szNames + cbNames, sf.cFileName, nNameLength);
+        cbNames += nNameLength;
+    }
+    while(SFileFindNextFile(hFind, &sf));
+    SFileFindClose(hFind);
+
+    // The name buffer doesn't move anymore, so we can set the name pointers
+    if(dwErrCode == ERROR_SUCCESS && dwFileCount != 0)
+    {
+        DWORD dwUniqueCount = 1;
+
+        for(DWORD i = 0; i < dwFileCount; i++)
+            pWork->pFiles[i].szFileName = pWork->szNames + pWork->pFiles[i].nNameOffset;
+
+        // The same name can be found multiple times (one for every locale),
+        // but SFileOpenFileEx only opens one of them. Keep just one entry for each name
+        qsort(pWork->pFiles, dwFileCount, sizeof(TExtractFile), CompareFilesByName);
+        for(DWORD i = 1; i < dwFileCount; i++)
+        {
+            if(_stricmp(pWork->pFiles[i].szFileName, pWork->pFiles[dwUniqueCount - 1].szFileName))
+                pWork->pFiles[dwUniqueCount++] = pWork->pFiles[i];
+        }
+        dwFileCount = dwUniqueCount;
+
+        // Sort the files by their position in the archive
+        qsort(pWork->pFiles, dwFileCount, sizeof(TExtractFile), CompareFilesByOffset);
+    }
+
+    // Calculate the total size of the data
+    for(DWORD i = 0; i < dwFileCount; i++)
+        pWork->Info.TotalBytes += pWork->pFiles[i].dwFileSize;
+    pWork->dwFileCount = dwFileCount;
+    return dwErrCode;
+}
+
+// Creates all directories on the path, starting at the given position.
+// Errors are ignored here; if a directory can't be created, creating the file will fail
+static void CreateDirectoriesOnPath(TCHAR * szPath, size_t nStartPos)
+{
+    for(size_t i = nStartPos; szPath[i] != 0; i++)
+    {
+        if(szPath[i] == EXTRACT_PATH_SEPARATOR && i > 0)
+        {
+            szPath[i] = 0;
+#ifdef STORMLIB_WINDOWS
+            CreateDirectory(szPath, NULL);
+#else
+            mkdir(szPath, 0755);
+#endif
+            szPath[i] = EXTRACT_PATH_SEPARATOR;
+        }
+    }
+}
+
+// Converts the name of the file in the archive to the local file name.
+// Returns the position of the file name part (after the last separator)
+static DWORD CreateLocalFileName(const TCHAR * szTargetDir, const char * szFileName, TCHAR * szBuffer, size_t ccBuffer, size_t * PtrNamePos)
+{
+    size_t nLength;
+    size_t nNamePos;
+
+    // Start with the target directory
+    StringCopy(szBuffer, ccBuffer, szTargetDir);
+    nLength = _tcslen(szBuffer);
+    if(nLength == 0 || szBuffer[nLength - 1] != EXTRACT_PATH_SEPARATOR)
+    {
+        if((nLength + 1) >= ccBuffer)
+            return ERROR_INSUFFICIENT_BUFFER;
+        szBuffer[nLength++] = EXTRACT_PATH_SEPARATOR;
+        szBuffer[nLength] = 0;
+    }
+
+    // Append all parts of the name. Both slashes and backslashes are path separators
+    for(;;)
+    {
+        const char * szPartEnd = szFileName;
+        size_t nPartLength = 0;
+
+        while(szPartEnd[0] != 0 && szPartEnd[0] != '\\' && szPartEnd[0] != '/')
+            szPartEnd++;
+
+        // Don't allow the file to be written outside of the target directory
+        if(szPartEnd == szFileName || !strncmp(szFileName, ".", szPartEnd - szFileName) || !strncmp(szFileName, "..", szPartEnd - szFileName))
+            return ERROR_INVALID_PARAMETER;
+
+        // Convert the part of the name to a file-name-safe string
+        nNamePos = nLength;
+        SMemUTF8ToFileName(szBuffer + nLength, ccBuffer - nLength, szFileName, szPartEnd, 0, &nPartLength);
+        if((nLength + nPartLength) > ccBuffer)
+            return ERROR_INSUFFICIENT_BUFFER;
+        nLength = nLength + nPartLength - 1;
+
+        // Was it the last part?
+        if(szPartEnd[0] == 0)
+            break;
+
+        // Append the path separator
+        if((nLength + 1) >= ccBuffer)
+            return ERROR_INSUFFICIENT_BUFFER;
+        szBuffer[nLength++] = EXTRACT_PATH_SEPARATOR;
+        szBuffer[nLength] = 0;
+        szFileName = szPartEnd + 1;
+    }
+
+    PtrNamePos[0] = nNamePos;
+    return ERROR_SUCCESS;
+}
+
+static DWORD ExtractSingleFile(TExtractWork * pWork, TExtractFile * pFile, LPBYTE pbBuffer, TCHAR * szLastDir, ULONGLONG * PtrBytesWritten)
+{
+    TFileStream * pLocalFile = NULL;
+    HANDLE hMpqFile = NULL;
+    TCHAR szLocalName[MAX_PATH];
+    size_t nNamePos = 0;
+    DWORD dwStreamFlags = STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE;
+    DWORD dwErrCode;
+
+    // Create the name of the local file
+    dwErrCode = CreateLocalFileName(pWork->szTargetDir, pFile->szFileName, szLocalName, _countof(szLocalName), &nNamePos);
+    if(dwErrCode != ERROR_SUCCESS)
+        return dwErrCode;
+
+    // Create the directories, unless they have been created for the previous file
+    szLocalName[nNamePos - 1] = 0;
+    if(_tcscmp(szLocalName, szLastDir))
+    {
+        szLocalName[nNamePos - 1] = EXTRACT_PATH_SEPARATOR;
+        CreateDirectoriesOnPath(szLocalName, _tcslen(pWork->szTargetDir));
+        szLocalName[nNamePos - 1] = 0;
+        StringCopy(szLastDir, MAX_PATH, szLocalName);
+    }
+    szLocalName[nNamePos - 1] = EXTRACT_PATH_SEPARATOR;
+
+    // Open the file in the archive
+    if(!SFileOpenFileEx(pWork->hMpq, pFile->szFileName, SFILE_OPEN_FROM_MPQ, &hMpqFile))
+        return SErrGetLastError();
+
+    // Don't let the file reads use more threads of the worker pool
+    if(pWork->bSerialSectors)
+    {
+        for(TMPQFile * hf = (TMPQFile *)hMpqFile; hf != NULL; hf = hf->hfPatch)
+            hf->bSerialSectors = true;
+    }
+
+    // Create the local file
+    if(pWork->dwFlags & SFILE_EXTRACT_DIRECT_IO)
+        dwStreamFlags |= STREAM_FLAG_DIRECT_IO;
+    pLocalFile = FileStream_CreateFile(szLocalName, dwStreamFlags);
+    if(pLocalFile == NULL)
+        dwErrCode = SErrGetLastError();
+
+    // Reserve the space for the file. This is just a hint, so we don't care about the result
+    if(dwErrCode == ERROR_SUCCESS && (pWork->dwFlags & SFILE_EXTRACT_PREALLOCATE))
+        FileStream_Preallocate(pLocalFile, SFileGetFileSize(hMpqFile, NULL));
+
+    // Copy the file's content
+    while(dwErrCode == ERROR_SUCCESS)
+    {
+        DWORD dwTransferred = 0;
+
+        // dwTransferred is only set to nonzero if something has been read.
+        // dwErrCode can be ERROR_SUCCESS or ERROR_HANDLE_EOF
+        if(!SFileReadFile(hMpqFile, pbBuffer, EXTRACT_BUFFER_SIZE, &dwTransferred, NULL))
+            dwErrCode = SErrGetLastError();
+        if(dwErrCode == ERROR_HANDLE_EOF)
+            dwErrCode = ERROR_SUCCESS;
+        if(dwTransferred == 0)
+            break;
+
+        // If something has been actually read, write it
+        if(!FileStream_Write(pLocalFile, NULL, pbBuffer, dwTransferred))
+            dwErrCode = SErrGetLastError();
+        PtrBytesWritten[0] += dwTransferred;
+    }
+
+    // Close the files
+    if(pLocalFile != NULL)
+        FileStream_Close(pLocalFile);
+    SFileCloseFile(hMpqFile);
+    return dwErrCode;
+}
+
+static void ExtractFilesWorker(void * pvParam, DWORD /* dwItemIndex */)
+{
+    TExtractWork * pWork = (TExtractWork *)pvParam;
+    TExtractFile * pFile;
+    LPBYTE pbAllocated;
+    LPBYTE pbBuffer;
+    TCHAR szLastDir[MAX_PATH];
+
+    // Allocate the data buffer, aligned for direct I/O
+    pbAllocated = STORM_ALLOC(BYTE, EXTRACT_BUFFER_SIZE + STORM_DIRECT_IO_ALIGNMENT);
+    if(pbAllocated == NULL)
+    {
+        StormLock_Enter(&pWork->Lock);
+        pWork->dwErrCode = (pWork->dwErrCode == ERROR_SUCCESS) ? ERROR_NOT_ENOUGH_MEMORY : pWork->dwErrCode;
+        StormLock_Leave(&pWork->Lock);
+        return;
+    }
+    pbBuffer = (LPBYTE)(((size_t)pbAllocated + STORM_DIRECT_IO_ALIGNMENT - 1) & ~(size_t)(STORM_DIRECT_IO_ALIGNMENT - 1));
+    szLastDir[0] = 0;
+
+    for(;;)
+    {
+        ULONGLONG BytesWritten = 0;
+        DWORD dwErrCode;
+
+        // Take the next file from the list
+        StormLock_Enter(&pWork->Lock);
+        pFile = (pWork->bStopped == false && pWork->dwNextFile < pWork->dwFileCount) ? &pWork->pFiles[pWork->dwNextFile++] : NULL;
+        StormLock_Leave(&pWork->Lock);
+        if(pFile == NULL)
+            break;
+
+        // Extract the file
+        dwErrCode = ExtractSingleFile(pWork, pFile, pbBuffer, szLastDir, &BytesWritten);
+
+        // Update the progress and report it. The callback is never called from two threads at once
+        StormLock_Enter(&pWork->Lock);
+        pWork->Info.szFileName = pFile->szFileName;
+        pWork->Info.dwErrCode = dwErrCode;
+        pWork->Info.dwFilesDone++;
+        pWork->Info.BytesWritten += BytesWritten;
+        pWork->Info.BytesRead += pFile->dwCompSize;
+        pWork->Info.ElapsedMs = StormGetTickCount() - pWork->StartTime;
+        pWork->Info.BytesPerSecond = (pWork->Info.ElapsedMs != 0) ? (pWork->Info.BytesWritten * 1000 / pWork->Info.ElapsedMs) : 0;
+        if(dwErrCode != ERROR_SUCCESS)
+        {
+            pWork->Info.dwFilesFailed++;
+            if(pWork->dwErrCode == ERROR_SUCCESS)
+                pWork->dwErrCode = dwErrCode;
+            if(pWork->dwFlags & SFILE_EXTRACT_STOP_ON_ERROR)
+                pWork->bStopped = true;
+        }
+        if(pWork->ExtractCB != NULL)
+            pWork->ExtractCB(pWork->pvUserData, &pWork->Info);
+        StormLock_Leave(&pWork->Lock);
+    }
+
+    STORM_FREE(pbAllocated);
+}
+
+//-----------------------------------------------------------------------------
+// SFileExtractFiles
+//
+//   hMpq          - Handle of opened MPQ archive
+//   szMask        - Mask of the files to extract (NULL = all files)
+//   szTargetDir   - Directory where to extract the files. Subdirectories are created as needed
+//   dwFlags       - Combination of SFILE_EXTRACT_XXX
+//   dwThreadCount - Maximum number of threads used by this call (0 = no limit).
+//                   The threads are taken from the worker pool (see SFileSetThreadCount).
+//                   With a limit below the pool size, each file is read and decompressed
+//                   by the thread that extracts it, so the call never uses more threads
+//   ExtractCB     - Optional callback, called after each file and once at the end (with NULL file name)
+//   pvUserData    - User data for the callback
+//
+// If some files fail to extract, the function returns false and the last error
+// is set to the error of the first failed file.
+
+bool WINAPI SFileExtractFiles(
+    HANDLE hMpq,
+    const char * szMask,
+    const TCHAR * szTargetDir,
+    DWORD dwFlags,
+    DWORD dwThreadCount,
+    SFILE_EXTRACT_CALLBACK ExtractCB,
+    void * pvUserData)
+{
+    TMPQArchive * ha = IsValidMpqHandle(hMpq);
+    TExtractWork Work;
+    TCHAR szTargetPath[MAX_PATH];
+    DWORD dwStreamFlags = 0;
+    DWORD dwWorkerCount;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Check the parameters
+    if(ha == NULL)
+    {
+        SErrSetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+    if(szTargetDir == NULL || szTargetDir[0] == 0)
+    {
+        SErrSetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Prepare the work
+    memset(&Work, 0, sizeof(TExtractWork));
+    StormLock_Init(&Work.Lock);
+    Work.hMpq = hMpq;
+    Work.szTargetDir = szTargetDir;
+    Work.dwFlags = dwFlags;
+    Work.ExtractCB = ExtractCB;
+    Work.pvUserData = pvUserData;
+    Work.StartTime = StormGetTickCount();
+
+    // Find the files and sort them by their position in the archive
+    dwErrCode = CollectFilesToExtract(ha, (szMask != NULL) ? szMask : "*", &Work);
+    Work.Info.dwFileCount = Work.dwFileCount;
+
+    // Create the target directory
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        size_t nLength;
+
+        StringCopy(szTargetPath, _countof(szTargetPath) - 1, szTargetDir);
+        nLength = _tcslen(szTargetPath);
+        if(szTargetPath[nLength - 1] != EXTRACT_PATH_SEPARATOR)
+        {
+            szTargetPath[nLength++] = EXTRACT_PATH_SEPARATOR;
+            szTargetPath[nLength] = 0;
+        }
+        CreateDirectoriesOnPath(szTargetPath, 0);
+    }
+
+    // Extract the files
+    if(dwErrCode == ERROR_SUCCESS && Work.dwFileCount != 0)
+    {
+        // Determine the number of threads that will extract files
+        dwWorkerCount = StormWorkPool_GetThreadCount();
+        if(dwThreadCount != 0 && dwThreadCount < dwWorkerCount)
+        {
+            Work.bSerialSectors = true;
+            dwWorkerCount = dwThreadCount;
+        }
+        if(dwWorkerCount > Work.dwFileCount)
+            dwWorkerCount = Work.dwFileCount;
+
+        // The archive is read in the order of file positions
+        FileStream_GetFlags(ha->pStream, &dwStreamFlags);
+        FileStream_SetAccessHint(ha->pStream, STREAM_FLAG_SEQUENTIAL);
+
+        StormWorkPool_Run(dwWorkerCount, ExtractFilesWorker, &Work);
+        dwErrCode = Work.dwErrCode;
+
+        FileStream_SetAccessHint(ha->pStream, dwStreamFlags & STREAM_ACCESS_HINT_MASK);
+    }
+
+    // Final call of the callback
+    if(ExtractCB != NULL)
+    {
+        Work.Info.szFileName = NULL;
+        Work.Info.dwErrCode = dwErrCode;
+        Work.Info.ElapsedMs = StormGetTickCount() - Work.StartTime;
+        Work.Info.BytesPerSecond = (Work.Info.ElapsedMs != 0) ? (Work.Info.BytesWritten * 1000 / Work.Info.ElapsedMs) : 0;
+        ExtractCB(pvUserData, &Work.Info);
+    }
+
+    // Free the work
+    if(Work.szNames != NULL)
+        STORM_FREE(Work.szNames);
+    if(Work.pFiles != NULL)
+        STORM_FREE(Work.pFiles);
+    StormLock_Free(&Work.Lock);
+
+    if(dwErrCode != ERROR_SUCCESS)
+        SErrSetLastError(dwErrCode);
+    return (dwErrCode == ERROR_SUCCESS);
+}
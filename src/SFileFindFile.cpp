@@ -20,6 +20,7 @@ struct TMPQSearch
 {
     TMPQArchive * ha;                   // Handle to MPQ, where the search runs
     TFileEntry ** pSearchTable;         // Table for files that have been already found
+    LPDWORD pSearchHashes;              // MPQ_HASH_NAME_B of the names in the search table
     DWORD  dwSearchTableItems;          // Number of items in the search table
     DWORD  dwNextIndex;                 // Next file index to be checked
     DWORD  dwFlagMask;                  // For checking flag mask
@@ -115,10 +116,10 @@ static bool FileWasFoundBefore(
     TMPQSearch * hs,
     TFileEntry * pFileEntry)
 {
+    TFileNameHash NameHash;
     TFileEntry * pEntry;
     char * szRealFileName = pFileEntry->szFileName;
     DWORD dwStartIndex;
-    DWORD dwNameHash;
     DWORD dwIndex;
 
     if(hs->pSearchTable != NULL && szRealFileName != NULL)
@@ -135,9 +136,10 @@ static bool FileWasFoundBefore(
             szRealFileName += ha->pPatchPrefix->nLength;
         }
 
-        // Calculate the hash to the table
-        dwNameHash = ha->pfnHashString(szRealFileName, MPQ_HASH_NAME_A);
-        dwStartIndex = dwIndex = (dwNameHash % hs->dwSearchTableItems);
+        // Calculate the name hashes in one pass. NAME_A is the index to the table,
+        // NAME_B is stored along with the entry so that we rarely need to compare names
+        HashFileName(ha, szRealFileName, NameHash);
+        dwStartIndex = dwIndex = (NameHash.dwHashCheck1 % hs->dwSearchTableItems);
 
         // The file might have been found before
         // only if this is not the first MPQ being searched
@@ -151,7 +153,8 @@ static bool FileWasFoundBefore(
                 if(pEntry == NULL)
                     break;
 
-                if(pEntry->szFileName != NULL)
+                // Only compare the names if the second name hash matches too
+                if(pEntry->szFileName != NULL && hs->pSearchHashes[dwIndex] == NameHash.dwHashCheck2)
                 {
                     // Does the name match?
                     if(!_stricmp(pEntry->szFileName, szRealFileName))
@@ -167,6 +170,7 @@ static bool FileWasFoundBefore(
 
         // Put the entry to the table for later use
         hs->pSearchTable[dwIndex] = pFileEntry;
+        hs->pSearchHashes[dwIndex] = NameHash.dwHashCheck2;
     }
     return false;
 }
@@ -175,10 +179,16 @@ static TFileEntry * FindPatchEntry(TMPQArchive * ha, TFileEntry * pFileEntry)
 {
     TFileEntry * pPatchEntry = pFileEntry;
     TFileEntry * pTempEntry;
+    char szEntryName[MAX_PATH+1];
     char szFileName[MAX_PATH+1];
 
+    // Copy the name of the file entry. Another thread may replace a pseudo name in the meantime
+    StormLock_Enter(&ha->Lock);
+    StringCopy(szEntryName, _countof(szEntryName), (pFileEntry->szFileName != NULL) ? pFileEntry->szFileName : "");
+    StormLock_Leave(&ha->Lock);
+
     // Can't find patch entry for a file that doesn't have name
-    if(pFileEntry->szFileName != NULL && pFileEntry->szFileName[0] != 0)
+    if(szEntryName[0] != 0)
     {
         // Go while there are patches
         while(ha->haPatch != NULL)
@@ -190,7 +200,7 @@ static TFileEntry * FindPatchEntry(TMPQArchive * ha, TFileEntry * pFileEntry)
             // Prepare the prefix for the file name
             if(ha->pPatchPrefix && ha->pPatchPrefix->nLength)
                 StringCopy(szFileName, _countof(szFileName), ha->pPatchPrefix->szPatchPrefix);
-            StringCat(szFileName, _countof(szFileName), pFileEntry->szFileName);
+            StringCat(szFileName, _countof(szFileName), szEntryName);
 
             // Try to find the file there
             pTempEntry = GetFileEntryExact(ha, szFileName, 0, NULL);
@@ -215,6 +225,7 @@ static bool DoMPQSearch_FileEntry(
     const char * szFileName;
     size_t nGlobalPrefixLength = (ha->pPatchPrefix != NULL) ? ha->pPatchPrefix->nLength : 0;
     DWORD dwBlockIndex;
+    bool bFoundBefore;
     char szNameBuff[MAX_PATH];
 
     // Is it a file but not a patch file?
@@ -224,8 +235,13 @@ static bool DoMPQSearch_FileEntry(
         if((pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK) == 0 && (pFileEntry->dwFileSize > ha->FileSize))
             return false;
 
-        // Now we have to check if this file was not enumerated before
-        if(!FileWasFoundBefore(ha, hs, pFileEntry))
+        // Now we have to check if this file was not enumerated before.
+        // The check uses the file name, which another thread may replace
+        StormLock_Enter(&ha->Lock);
+        bFoundBefore = FileWasFoundBefore(ha, hs, pFileEntry);
+        StormLock_Leave(&ha->Lock);
+
+        if(!bFoundBefore)
         {
             size_t nPrefixLength = nGlobalPrefixLength;
 
@@ -239,8 +255,18 @@ static bool DoMPQSearch_FileEntry(
             // Prepare the block index
             dwBlockIndex = (DWORD)(pFileEntry - ha->pFileTable);
 
-            // Get the file name. If it's not known, we will create pseudo-name
-            szFileName = pFileEntry->szFileName;
+            // Get the file name. Another thread may replace a pseudo name
+            // in the meantime, so we work with a copy of it
+            szFileName = NULL;
+            StormLock_Enter(&ha->Lock);
+            if(pFileEntry->szFileName != NULL)
+            {
+                StringCopy(szNameBuff, _countof(szNameBuff), pFileEntry->szFileName);
+                szFileName = szNameBuff;
+            }
+            StormLock_Leave(&ha->Lock);
+
+            // If the file name is not known, we will create pseudo-name
             if(szFileName == NULL)
             {
                 // Open the file by its pseudo-name.
@@ -377,6 +403,8 @@ static void FreeMPQSearch(TMPQSearch *& hs)
     {
         if(hs->pSearchTable != NULL)
             STORM_FREE(hs->pSearchTable);
+        if(hs->pSearchHashes != NULL)
+            STORM_FREE(hs->pSearchHashes);
         STORM_FREE(hs);
         hs = NULL;
     }
@@ -426,8 +454,9 @@ HANDLE WINAPI SFileFindFirstFile(HANDLE hMpq, const char * szMask, SFILE_FIND_DA
         {
             hs->dwSearchTableItems = GetSearchTableItems(ha);
             hs->pSearchTable = STORM_ALLOC(TFileEntry *, hs->dwSearchTableItems);
+            hs->pSearchHashes = STORM_ALLOC(DWORD, hs->dwSearchTableItems);
             hs->dwFlagMask = MPQ_FILE_EXISTS | MPQ_FILE_PATCH_FILE;
-            if(hs->pSearchTable != NULL)
+            if(hs->pSearchTable != NULL && hs->pSearchHashes != NULL)
                 memset(hs->pSearchTable, 0, hs->dwSearchTableItems * sizeof(TFileEntry *));
             else
                 dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
@@ -122,11 +122,15 @@ static bool GetInfo_ReadFromFile(void * pvFileInfo, DWORD cbFileInfo, TFileStrea
     return FileStream_Read(pStream, &ByteOffset, pvFileInfo, cbData);
 }
 
-static bool GetInfo_FileEntry(void * pvFileInfo, DWORD cbFileInfo, TFileEntry * pFileEntry, LPDWORD pcbLengthNeeded)
+static bool GetInfo_FileEntry(TMPQArchive * ha, void * pvFileInfo, DWORD cbFileInfo, TFileEntry * pFileEntry, LPDWORD pcbLengthNeeded)
 {
     LPBYTE pbFileInfo = (LPBYTE)pvFileInfo;
     DWORD cbSrcFileInfo = sizeof(TFileEntry);
     DWORD cbFileName = 1;
+    bool bResult = false;
+
+    // Another thread may replace a pseudo name in the file entry (see AllocateFileName)
+    StormLock_Enter(&ha->Lock);
 
     // The file name belongs to the file entry
     if(pFileEntry->szFileName)
@@ -134,18 +138,21 @@ static bool GetInfo_FileEntry(void * pvFileInfo, DWORD cbFileInfo, TFileEntry *
     cbSrcFileInfo += cbFileName;
 
     // Verify buffer pointer and buffer size
-    if(!GetInfo_BufferCheck(pvFileInfo, cbFileInfo, cbSrcFileInfo, pcbLengthNeeded))
-        return false;
+    if(GetInfo_BufferCheck(pvFileInfo, cbFileInfo, cbSrcFileInfo, pcbLengthNeeded))
+    {
+        // Copy the file entry
+        memcpy(pbFileInfo, pFileEntry, sizeof(TFileEntry));
+        pbFileInfo += sizeof(TFileEntry);
+        pbFileInfo[0] = 0;
 
-    // Copy the file entry
-    memcpy(pbFileInfo, pFileEntry, sizeof(TFileEntry));
-    pbFileInfo += sizeof(TFileEntry);
-    pbFileInfo[0] = 0;
+        // Copy the file name
+        if(pFileEntry->szFileName)
+            memcpy(pbFileInfo, pFileEntry->szFileName, cbFileName);
+        bResult = true;
+    }
 
-    // Copy the file name
-    if(pFileEntry->szFileName)
-        memcpy(pbFileInfo, pFileEntry->szFileName, cbFileName);
-    return true;
+    StormLock_Leave(&ha->Lock);
+    return bResult;
 }
 
 static bool GetInfo_PatchChain(TMPQFile * hf, void * pvFileInfo, DWORD cbFileInfo, LPDWORD pcbLengthNeeded)
@@ -213,8 +220,8 @@ bool WINAPI SFileGetFileInfo(
     DWORD cbSrcFileInfo = 0;
     DWORD dwInt32Value = 0;
 
-    // Validate archive/file handle
-    if((int)InfoClass <= (int)SFileMpqFlags)
+    // Validate archive/file handle. The archive classes that were added later follow the file classes
+    if((int)InfoClass <= (int)SFileMpqFlags || ((int)InfoClass >= (int)SFileMpqCacheHits && (int)InfoClass <= (int)SFileMpqPatchCacheMisses))
     {
         if((ha = IsValidMpqHandle(hMpqOrFile)) == NULL)
             return GetInfo_ReturnError(ERROR_INVALID_HANDLE);
@@ -394,13 +401,48 @@ bool WINAPI SFileGetFileInfo(
         case SFileMpqFlags:
             return GetInfo(pvFileInfo, cbFileInfo, &ha->dwFlags, sizeof(DWORD), pcbLengthNeeded);
 
+        case SFileMpqCacheHits:
+            if(ha->pSectorCache == NULL)
+                return GetInfo_ReturnError(ERROR_FILE_NOT_FOUND);
+            Int64Value = ha->pSectorCache->CacheHits;
+            return GetInfo(pvFileInfo, cbFileInfo, &Int64Value, sizeof(ULONGLONG), pcbLengthNeeded);
+
+        case SFileMpqCacheMisses:
+            if(ha->pSectorCache == NULL)
+                return GetInfo_ReturnError(ERROR_FILE_NOT_FOUND);
+            Int64Value = ha->pSectorCache->CacheMisses;
+            return GetInfo(pvFileInfo, cbFileInfo, &Int64Value, sizeof(ULONGLONG), pcbLengthNeeded);
+
+        case SFileMpqSignatureBytes:
+            if(ha->SignatureBytes == 0)
+                return GetInfo_ReturnError(ERROR_FILE_NOT_FOUND);
+            return GetInfo(pvFileInfo, cbFileInfo, &ha->SignatureBytes, sizeof(ULONGLONG), pcbLengthNeeded);
+
+        case SFileMpqSignatureSpeed:
+            if(ha->SignatureBytes == 0)
+                return GetInfo_ReturnError(ERROR_FILE_NOT_FOUND);
+            Int64Value = ha->SignatureBytes * 1000 / STORMLIB_MAX(ha->SignatureTime, 1);
+            return GetInfo(pvFileInfo, cbFileInfo, &Int64Value, sizeof(ULONGLONG), pcbLengthNeeded);
+
+        case SFileMpqPatchCacheHits:
+            if(ha->pPatchCache == NULL)
+                return GetInfo_ReturnError(ERROR_FILE_NOT_FOUND);
+            Int64Value = ha->pPatchCache->CacheHits;
+            return GetInfo(pvFileInfo, cbFileInfo, &Int64Value, sizeof(ULONGLONG), pcbLengthNeeded);
+
+        case SFileMpqPatchCacheMisses:
+            if(ha->pPatchCache == NULL)
+                return GetInfo_ReturnError(ERROR_FILE_NOT_FOUND);
+            Int64Value = ha->pPatchCache->CacheMisses;
+            return GetInfo(pvFileInfo, cbFileInfo, &Int64Value, sizeof(ULONGLONG), pcbLengthNeeded);
+
         case SFileInfoPatchChain:
             return GetInfo_PatchChain(hf, pvFileInfo, cbFileInfo, pcbLengthNeeded);
 
         case SFileInfoFileEntry:
             if(pFileEntry == NULL)
                 return GetInfo_ReturnError(ERROR_FILE_NOT_FOUND);
-            return GetInfo_FileEntry(pvFileInfo, cbFileInfo, pFileEntry, pcbLengthNeeded);
+            return GetInfo_FileEntry(hf->ha, pvFileInfo, cbFileInfo, pFileEntry, pcbLengthNeeded);
 
         case SFileInfoHashEntry:
             return GetInfo(pvFileInfo, cbFileInfo, hf->pHashEntry, sizeof(TMPQHash), pcbLengthNeeded);
@@ -595,6 +637,9 @@ bool WINAPI SFileGetFileName(HANDLE hFile, char * szFileName)
         {
             if(pFileEntry != NULL)
             {
+                // Another thread may replace a pseudo name in the meantime
+                StormLock_Enter(&hf->ha->Lock);
+
                 // If the file name is not there yet, create a pseudo name
                 if(pFileEntry->szFileName == NULL)
                     dwErrCode = CreatePseudoFileName(hFile, pFileEntry, szFileName);
@@ -605,6 +650,7 @@ bool WINAPI SFileGetFileName(HANDLE hFile, char * szFileName)
                     StringCopy(szFileName, MAX_PATH, pFileEntry->szFileName);
                     dwErrCode = ERROR_SUCCESS;
                 }
+                StormLock_Leave(&hf->ha->Lock);
             }
         }
 
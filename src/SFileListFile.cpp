@@ -37,6 +37,26 @@ struct TListFileCache
 //  char szListFile[listfile_length];   // Followed by the listfile (if any)
 };
 
+// Maps (NAME_A, NAME_B) to file indexes. Built from the hash table
+// once per listfile, so that each name is found without scanning the hash table
+struct TNameMapEntry
+{
+    DWORD dwHashCheck1;                 // MPQ_HASH_NAME_A of the hash entry
+    DWORD dwHashCheck2;                 // MPQ_HASH_NAME_B of the hash entry
+    DWORD dwFileIndex;                  // Index to the file table
+    DWORD dwNextEntry;                  // Next entry in the same bucket or HASH_ENTRY_FREE
+};
+
+struct TListFileNameMap
+{
+    TNameMapEntry * pEntries;           // Array of entries, in the order of the hash table
+    LPDWORD pBuckets;                   // Index of the first entry for each bucket
+    DWORD dwBucketMask;                 // Bucket count - 1
+
+//  TNameMapEntry Entries[entry_count]; // Followed by the entries
+//  DWORD Buckets[bucket_count];        // Followed by the buckets
+};
+
 typedef bool (*LOAD_LISTFILE)(TListFileHandle * pHandle, void * pvBuffer, DWORD cbBuffer, LPDWORD pdwBytesRead);
 
 //-----------------------------------------------------------------------------
@@ -403,16 +423,89 @@ static LPBYTE CreateListFile(TMPQArchive * ha, DWORD * pcbListFile)
 //-----------------------------------------------------------------------------
 // Local functions (listfile nodes)
 
+// Returns the end of the hash table entries that are worth checking
+static TMPQHash * GetHashTableEnd(TMPQArchive * ha)
+{
+    // Some protectors set very high hash table size (0x00400000 items or more)
+    // in order to make this process very slow. We will ignore items
+    // in the hash table that would be beyond the end of the file.
+    // Example MPQ: MPQ_2022_v1_Sniper.scx
+    if(ha->dwFlags & MPQ_FLAG_HASH_TABLE_CUT)
+        return ha->pHashTable + (ha->dwRealHashTableSize / sizeof(TMPQHash));
+    return ha->pHashTable + ha->pHeader->dwHashTableSize;
+}
+
+// Creates the map of name hashes for applying a listfile. Every hash entry
+// that points to a valid file is included, regardless of its position in the
+// hash table, so we find the same files as a full scan of the hash table would.
+static TListFileNameMap * CreateNameMap(TMPQArchive * ha)
+{
+    TListFileNameMap * pNameMap;
+    TNameMapEntry * pEntry;
+    TMPQHash * pHashEnd;
+    TMPQHash * pHash;
+    DWORD dwEntryCount = 0;
+    DWORD dwBucketCount;
+    DWORD dwBucket;
+
+    // Only needed for archives that are searched by the hash table
+    if(ha->pHashTable == NULL || ha->pHetTable != NULL)
+        return NULL;
+    pHashEnd = GetHashTableEnd(ha);
+
+    // Count the hash entries that refer to a file
+    for(pHash = ha->pHashTable; pHash < pHashEnd; pHash++)
+    {
+        if(MPQ_BLOCK_INDEX(pHash) < ha->dwFileTableSize)
+            dwEntryCount++;
+    }
+
+    // Keep the buckets at most half full
+    dwBucketCount = GetNearestPowerOfTwo(STORMLIB_MAX(dwEntryCount, 1) * 2);
+
+    // Allocate the map with all entries and buckets in one block
+    pNameMap = (TListFileNameMap *)STORM_ALLOC(BYTE, sizeof(TListFileNameMap) + dwEntryCount * sizeof(TNameMapEntry) + dwBucketCount * sizeof(DWORD));
+    if(pNameMap != NULL)
+    {
+        pNameMap->pEntries = (TNameMapEntry *)(pNameMap + 1);
+        pNameMap->pBuckets = (LPDWORD)(pNameMap->pEntries + dwEntryCount);
+        pNameMap->dwBucketMask = dwBucketCount - 1;
+        memset(pNameMap->pBuckets, 0xFF, dwBucketCount * sizeof(DWORD));
+
+        // Insert the entries backwards, so that each bucket chain
+        // keeps the order in which the entries are in the hash table
+        pEntry = pNameMap->pEntries + dwEntryCount;
+        for(pHash = pHashEnd; pHash > ha->pHashTable; )
+        {
+            pHash--;
+            if(MPQ_BLOCK_INDEX(pHash) < ha->dwFileTableSize)
+            {
+                pEntry--;
+                dwBucket = pHash->dwHashCheck1 & pNameMap->dwBucketMask;
+
+                pEntry->dwHashCheck1 = pHash->dwHashCheck1;
+                pEntry->dwHashCheck2 = pHash->dwHashCheck2;
+                pEntry->dwFileIndex  = MPQ_BLOCK_INDEX(pHash);
+                pEntry->dwNextEntry  = pNameMap->pBuckets[dwBucket];
+                pNameMap->pBuckets[dwBucket] = (DWORD)(pEntry - pNameMap->pEntries);
+            }
+        }
+    }
+
+    return pNameMap;
+}
+
 // Adds a name into the list of all names. For each locale in the MPQ,
 // one entry will be created
 // If the file name is already there, does nothing.
-static DWORD SListFileCreateNodeForAllLocales(TMPQArchive * ha, const char * szFileName)
+static DWORD SListFileCreateNodeForAllLocales(TMPQArchive * ha, const char * szFileName, TListFileNameMap * pNameMap = NULL)
 {
+    TFileNameHash NameHash;
+    TNameMapEntry * pEntry;
     TFileEntry * pFileEntry;
     TMPQHash * pHashEnd;
     TMPQHash * pHash;
-    DWORD dwHashCheck1;
-    DWORD dwHashCheck2;
+    DWORD dwIndex;
 
     // If we have HET table, use that one
     if(ha->pHetTable != NULL)
@@ -430,39 +523,37 @@ static DWORD SListFileCreateNodeForAllLocales(TMPQArchive * ha, const char * szF
     // If we have hash table, we use it
     if(ha->pHashTable != NULL)
     {
-        // Get the end of the hash table and both names
-        pHashEnd = ha->pHashTable + ha->pHeader->dwHashTableSize;
-        dwHashCheck1 = ha->pfnHashString(szFileName, MPQ_HASH_NAME_A);
-        dwHashCheck2 = ha->pfnHashString(szFileName, MPQ_HASH_NAME_B);
-
-        // Some protectors set very high hash table size (0x00400000 items or more)
-        // in order to make this process very slow. We will ignore items
-        // in the hash table that would be beyond the end of the file.
-        // Example MPQ: MPQ_2022_v1_Sniper.scx
-        if(ha->dwFlags & MPQ_FLAG_HASH_TABLE_CUT)
-            pHashEnd = ha->pHashTable + (ha->dwRealHashTableSize / sizeof(TMPQHash));
+        // Calculate both name hashes
+        HashFileName(ha, szFileName, NameHash);
+
+        // If we have the name map, only check the entries with the same bucket
+        if(pNameMap != NULL)
+        {
+            dwIndex = pNameMap->pBuckets[NameHash.dwHashCheck1 & pNameMap->dwBucketMask];
+            while(dwIndex != HASH_ENTRY_FREE)
+            {
+                pEntry = pNameMap->pEntries + dwIndex;
+                if(pEntry->dwHashCheck1 == NameHash.dwHashCheck1 && pEntry->dwHashCheck2 == NameHash.dwHashCheck2)
+                {
+                    // Allocate file name for the file entry
+                    AllocateFileName(ha, ha->pFileTable + pEntry->dwFileIndex, szFileName);
+                }
+                dwIndex = pEntry->dwNextEntry;
+            }
+            return ERROR_SUCCESS;
+        }
 
         // Go through the hash table and put the name in each item that has the same name pair
+        pHashEnd = GetHashTableEnd(ha);
         for(pHash = ha->pHashTable; pHash < pHashEnd; pHash++)
         {
-            if(pHash->dwHashCheck1 == dwHashCheck1 && pHash->dwHashCheck2 == dwHashCheck2 && MPQ_BLOCK_INDEX(pHash) < ha->dwFileTableSize)
+            if(pHash->dwHashCheck1 == NameHash.dwHashCheck1 && pHash->dwHashCheck2 == NameHash.dwHashCheck2 && MPQ_BLOCK_INDEX(pHash) < ha->dwFileTableSize)
             {
                 // Allocate file name for the file entry
                 AllocateFileName(ha, ha->pFileTable + MPQ_BLOCK_INDEX(pHash), szFileName);
             }
         }
 
-        // Go while we found something
-        //pFirstHash = pHash = GetFirstHashEntry(ha, szFileName);
-        //while(pHash != NULL)
-        //{
-        //    // Allocate file name for the file entry
-        //    AllocateFileName(ha, ha->pFileTable + MPQ_BLOCK_INDEX(pHash), szFileName);
-
-        //    // Now find the next language version of the file
-        //    pHash = GetNextHashEntry(ha, pFirstHash, pHash);
-        //}
-
         return ERROR_SUCCESS;
     }
 
@@ -534,6 +625,7 @@ static DWORD SFileAddArbitraryListFile(
     const TCHAR * szListFile,
     DWORD dwMaxSize)
 {
+    TListFileNameMap * pNameMap;
     TListFileCache * pCache = NULL;
 
     // Create the listfile cache for that file
@@ -543,15 +635,20 @@ static DWORD SFileAddArbitraryListFile(
         char * szFileName;
         size_t nLength = 0;
 
+        // Map the name hashes to files once for the whole listfile
+        pNameMap = CreateNameMap(ha);
+
         // Get the next line
         while((szFileName = ReadListFileLine(pCache, &nLength)) != NULL)
         {
             // Add the line to the MPQ
             if(nLength != 0)
-                SListFileCreateNodeForAllLocales(ha, szFileName);
+                SListFileCreateNodeForAllLocales(ha, szFileName, pNameMap);
         }
 
-        // Delete the cache
+        // Delete the name map and the cache
+        if(pNameMap != NULL)
+            STORM_FREE(pNameMap);
         FreeListFileCache(pCache);
     }
 
@@ -565,15 +662,21 @@ static DWORD SFileAddArbitraryListFile(
 {
     if(listFileEntries != NULL && dwEntryCount > 0)
     {
+        // Map the name hashes to files once for all entries
+        TListFileNameMap * pNameMap = CreateNameMap(ha);
+
         // Get the next line
         for(DWORD dwListFileNum = 0; dwListFileNum < dwEntryCount; dwListFileNum++)
         {
             const char * listFileEntry = listFileEntries[dwListFileNum];
             if(listFileEntry != NULL)
             {
-                SListFileCreateNodeForAllLocales(ha, listFileEntry);
+                SListFileCreateNodeForAllLocales(ha, listFileEntry, pNameMap);
             }
         }
+
+        if(pNameMap != NULL)
+            STORM_FREE(pNameMap);
     }
 
     return (listFileEntries != NULL && dwEntryCount > 0) ? ERROR_SUCCESS : ERROR_INVALID_PARAMETER;
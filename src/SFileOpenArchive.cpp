@@ -241,7 +241,10 @@ static bool OpenArchiveFromStream(TFileStream * pStream, HANDLE hParentMpq, DWOR
     if(dwErrCode == ERROR_SUCCESS)
     {
         if((ha = STORM_ALLOC(TMPQArchive, 1)) != NULL)
+        {
             memset(ha, 0, sizeof(TMPQArchive));
+            StormLock_Init(&ha->Lock);
+        }
         else
             dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
     }
@@ -513,6 +516,13 @@ static bool OpenArchiveFromStream(TFileStream * pStream, HANDLE hParentMpq, DWOR
         dwErrCode = BuildFileTable(ha);
     }
 
+    // If an in-place compacting has been interrupted, finish the file moves
+    // before anything is loaded from the files. Fails for read-only access
+    if(dwErrCode == ERROR_SUCCESS && (ha->dwFlags & MPQ_FLAG_MALFORMED) == 0)
+    {
+        dwErrCode = LoadCompactJournal(ha);
+    }
+
     // Load the internal listfile and include it to the file table
     if(dwErrCode == ERROR_SUCCESS && (dwFlags & MPQ_OPEN_NO_LISTFILE) == 0)
     {
@@ -555,6 +565,12 @@ static bool OpenArchiveFromStream(TFileStream * pStream, HANDLE hParentMpq, DWOR
         ha->dwFlags |= (ha->dwFlags & MPQ_FLAG_MALFORMED) ? MPQ_FLAG_READ_ONLY : 0;
     }
 
+    // Save the tables fixed by the compact journal
+    if(dwErrCode == ERROR_SUCCESS && (ha->dwFlags & MPQ_FLAG_COMPACT_JOURNAL))
+    {
+        dwErrCode = FinishCompactJournal(ha);
+    }
+
     // Finally, we need to reference the parent archive, if any
     if(dwErrCode == ERROR_SUCCESS && hParentMpq != NULL)
     {
@@ -635,6 +651,35 @@ LCID WINAPI SFileSetLocale(LCID lcFileLocale)
     return (g_lcFileLocale = lcFileLocale);
 }
 
+//-----------------------------------------------------------------------------
+// Number of threads used for processing file sectors
+//
+//   dwThreadCount - Total number of threads, including the calling thread.
+//                   1 turns the parallel processing off (default),
+//                   0 uses one thread per logical processor.
+//
+// Note: Don't call this while other threads read from an archive.
+
+DWORD WINAPI SFileGetThreadCount()
+{
+    return StormWorkPool_GetThreadCount();
+}
+
+bool WINAPI SFileSetThreadCount(DWORD dwThreadCount)
+{
+    DWORD dwErrCode;
+
+    // Zero means one thread per processor
+    if(dwThreadCount == 0)
+        dwThreadCount = StormThread_GetCpuCount();
+
+    // Re-create the worker pool
+    dwErrCode = StormWorkPool_Create(dwThreadCount);
+    if(dwErrCode != ERROR_SUCCESS)
+        SErrSetLastError(dwErrCode);
+    return (dwErrCode == ERROR_SUCCESS);
+}
+
 //-----------------------------------------------------------------------------
 // SFileOpenArchive
 //
@@ -722,6 +767,133 @@ bool WINAPI SFileSetDownloadCallback(HANDLE hMpq, SFILE_DOWNLOAD_CALLBACK Downlo
     return FileStream_SetCallback(ha->pStream, DownloadCB, pvUserData);
 }
 
+//-----------------------------------------------------------------------------
+// bool WINAPI SFilePrefetchArchive(HANDLE hMpq, DWORD dwFlags);
+// bool WINAPI SFileCancelPrefetch(HANDLE hMpq);
+//
+// Starts loading a mirrored MPQ from the master MPQ in the background.
+// The MPQ header and tables go first, then (listfile) and (attributes),
+// then the files in the order of their position and finally the rest
+// of the archive. Reading files while the prefetch runs is allowed;
+// the blocks that are missing are loaded by the reader itself and the area
+// that follows them moves to the front of the queue.
+//
+
+static int ComparePrefetchEntries(const void * pvEntry1, const void * pvEntry2)
+{
+    TFileEntry * pFileEntry1 = *(TFileEntry **)pvEntry1;
+    TFileEntry * pFileEntry2 = *(TFileEntry **)pvEntry2;
+
+    if(pFileEntry1->ByteOffset < pFileEntry2->ByteOffset)
+        return -1;
+    if(pFileEntry1->ByteOffset > pFileEntry2->ByteOffset)
+        return +1;
+    return 0;
+}
+
+static bool PrefetchMpqRange(TMPQArchive * ha, ULONGLONG MpqOffset, ULONGLONG Length)
+{
+    // Tables that are not present have zero position or size
+    if(MpqOffset == 0 || Length == 0)
+        return true;
+    return FileStream_Prefetch(ha->pStream, FileOffsetFromMpqOffset(ha, MpqOffset), Length);
+}
+
+static bool PrefetchFileEntry(TMPQArchive * ha, TFileEntry * pFileEntry)
+{
+    ULONGLONG ByteOffset;
+
+    if(pFileEntry == NULL || !(pFileEntry->dwFlags & MPQ_FILE_EXISTS) || pFileEntry->dwCmpSize == 0)
+        return true;
+    ByteOffset = FileOffsetFromMpqOffset(ha, pFileEntry->ByteOffset);
+    return FileStream_Prefetch(ha->pStream, ByteOffset, GetFileEntryDataEnd(ha, pFileEntry) - pFileEntry->ByteOffset);
+}
+
+bool WINAPI SFilePrefetchArchive(HANDLE hMpq, DWORD dwFlags)
+{
+    TMPQArchive * ha = (TMPQArchive *)hMpq;
+    TMPQHeader * pHeader;
+    TFileEntry * pFileTableEnd;
+    TFileEntry ** SortTable;
+    TFileEntry * pFileEntry;
+    ULONGLONG StreamSize = 0;
+    DWORD dwFileCount = 0;
+    bool bResult;
+
+    // Do nothing if 'hMpq' is bad parameter
+    if(!IsValidMpqHandle(hMpq))
+    {
+        SErrSetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+    pHeader = ha->pHeader;
+
+    // The MPQ header and the tables
+    bResult = FileStream_Prefetch(ha->pStream, ha->MpqPos, pHeader->dwHeaderSize);
+    if(bResult)
+        bResult = PrefetchMpqRange(ha, pHeader->HetTablePos64, pHeader->HetTableSize64);
+    if(bResult)
+        bResult = PrefetchMpqRange(ha, pHeader->BetTablePos64, pHeader->BetTableSize64);
+    if(bResult)
+        bResult = PrefetchMpqRange(ha, MAKE_OFFSET64(pHeader->wHashTablePosHi, pHeader->dwHashTablePos), pHeader->HashTableSize64);
+    if(bResult)
+        bResult = PrefetchMpqRange(ha, MAKE_OFFSET64(pHeader->wBlockTablePosHi, pHeader->dwBlockTablePos), pHeader->BlockTableSize64);
+    if(bResult)
+        bResult = PrefetchMpqRange(ha, pHeader->HiBlockTablePos64, pHeader->HiBlockTableSize64);
+
+    // The internal files, needed for searching the archive
+    if(bResult)
+        bResult = PrefetchFileEntry(ha, GetFileEntryLocale(ha, LISTFILE_NAME, 0));
+    if(bResult)
+        bResult = PrefetchFileEntry(ha, GetFileEntryLocale(ha, ATTRIBUTES_NAME, 0));
+
+    // The files, in the order of their position in the archive
+    if(bResult && ha->pFileTable != NULL)
+    {
+        SortTable = STORM_ALLOC(TFileEntry *, ha->dwFileTableSize + 1);
+        if(SortTable != NULL)
+        {
+            pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+            for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
+            {
+                if(pFileEntry->dwFlags & MPQ_FILE_EXISTS)
+                    SortTable[dwFileCount++] = pFileEntry;
+            }
+
+            qsort(SortTable, dwFileCount, sizeof(TFileEntry *), ComparePrefetchEntries);
+            for(DWORD i = 0; bResult && i < dwFileCount; i++)
+                bResult = PrefetchFileEntry(ha, SortTable[i]);
+            STORM_FREE(SortTable);
+        }
+    }
+
+    // The rest of the archive
+    if(bResult)
+    {
+        FileStream_GetSize(ha->pStream, &StreamSize);
+        bResult = FileStream_Prefetch(ha->pStream, 0, StreamSize);
+    }
+
+    // Wait for the prefetch to finish, if needed
+    if(bResult && (dwFlags & SFILE_PREFETCH_WAIT))
+        bResult = FileStream_WaitPrefetch(ha->pStream);
+    return bResult;
+}
+
+bool WINAPI SFileCancelPrefetch(HANDLE hMpq)
+{
+    TMPQArchive * ha = (TMPQArchive *)hMpq;
+
+    // Do nothing if 'hMpq' is bad parameter
+    if(!IsValidMpqHandle(hMpq))
+    {
+        SErrSetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    return FileStream_CancelPrefetch(ha->pStream);
+}
+
 //-----------------------------------------------------------------------------
 // bool SFileFlushArchive(HANDLE hMpq)
 //
@@ -835,6 +1007,9 @@ bool WINAPI SFileCloseArchive(HANDLE hMpq)
         return false;
     }
 
+    // Bulk adds that have not been committed are dropped. Their handles become invalid
+    AbortBulkAdds(ha);
+
     // Dereference the archive
     if(!DereferenceArchive(ha))
     {
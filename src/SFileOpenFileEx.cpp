@@ -176,6 +176,105 @@ bool OpenPatchedFile(HANDLE hMpq, const char * szFileName, HANDLE * PtrFile)
     return (hfBase != NULL);
 }
 
+// Checks the file entry that was found for the file name and creates the file handle.
+// If the entry was not found, the name can still be a pseudo-name ("File00000001.ext")
+static DWORD OpenFileEntry(
+    TMPQArchive * ha,
+    TFileEntry * pFileEntry,
+    DWORD dwHashIndex,
+    const char * szFileName,
+    bool bCheckExists,
+    TMPQFile ** PtrFile)
+{
+    TMPQFile * hf = NULL;
+    DWORD dwFileIndex = 0;
+    DWORD dwErrCode = ERROR_SUCCESS;
+    bool bOpenByIndex = false;
+
+    // If we didn't find the file, try to open it using pseudo file name ("File
+    if(pFileEntry == NULL || (pFileEntry->dwFlags & MPQ_FILE_EXISTS) == 0)
+    {
+        // Check the pseudo-file name ("File00000001.ext")
+        if((bOpenByIndex = IsPseudoFileName(szFileName, &dwFileIndex)) == true)
+        {
+            // Get the file entry for the file
+            if(dwFileIndex < ha->dwFileTableSize)
+            {
+                pFileEntry = ha->pFileTable + dwFileIndex;
+            }
+        }
+
+        // Still not found?
+        if(pFileEntry == NULL || (pFileEntry->dwFlags & MPQ_FILE_EXISTS) == 0)
+        {
+            dwErrCode = ERROR_FILE_NOT_FOUND;
+        }
+    }
+
+    // Perform some checks of invalid files
+    if(pFileEntry != NULL)
+    {
+        // MPQ protectors use insanely amount of fake files, often with very high size.
+        // We won't open any files whose compressed size is bigger than archive size
+        // If the file is not compressed, its size cannot be bigger than archive size
+        if((pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK) == 0 && (pFileEntry->dwFileSize > ha->FileSize))
+        {
+            dwErrCode = ERROR_FILE_CORRUPT;
+            pFileEntry = NULL;
+        }
+
+        // Ignore unknown loading flags (example: MPQ_2016_v1_WME4_4.w3x)
+//          if(pFileEntry->dwFlags & ~MPQ_FILE_VALID_FLAGS)
+//          {
+//              dwErrCode = ERROR_NOT_SUPPORTED;
+//              pFileEntry = NULL;
+//          }
+    }
+
+    // Did the caller just wanted to know if the file exists?
+    if(dwErrCode == ERROR_SUCCESS && bCheckExists == false)
+    {
+        // Allocate file handle
+        hf = CreateFileHandle(ha, pFileEntry);
+        if(hf != NULL)
+        {
+            // Get the hash index for the file
+            if(ha->pHashTable != NULL && dwHashIndex == HASH_ENTRY_FREE)
+                dwHashIndex = FindHashIndex(ha, dwFileIndex);
+            if(dwHashIndex != HASH_ENTRY_FREE)
+                hf->pHashEntry = ha->pHashTable + dwHashIndex;
+            hf->dwHashIndex = dwHashIndex;
+
+            // If the MPQ has sector CRC enabled, enable if for the file
+            if(ha->dwFlags & MPQ_FLAG_CHECK_SECTOR_CRC)
+                hf->bCheckSectorCRCs = true;
+
+            // If we know the real file name, copy it to the file entry
+            if(bOpenByIndex == false)
+            {
+                // If there is no file name yet, allocate it
+                AllocateFileName(ha, pFileEntry, szFileName);
+
+                // If the file is encrypted, we should detect the file key
+                if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
+                {
+                    hf->dwFileKey = DecryptFileKey(szFileName,
+                                                   pFileEntry->ByteOffset,
+                                                   pFileEntry->dwFileSize,
+                                                   pFileEntry->dwFlags);
+                }
+            }
+        }
+        else
+        {
+            dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+        }
+    }
+
+    PtrFile[0] = hf;
+    return dwErrCode;
+}
+
 /*****************************************************************************/
 /* Public functions                                                          */
 /*****************************************************************************/
@@ -248,9 +347,7 @@ bool WINAPI SFileOpenFileEx(HANDLE hMpq, const char * szFileName, DWORD dwSearch
     TFileEntry  * pFileEntry = NULL;
     TMPQFile    * hf = NULL;
     DWORD dwHashIndex = HASH_ENTRY_FREE;
-    DWORD dwFileIndex = 0;
     DWORD dwErrCode = ERROR_SUCCESS;
-    bool bOpenByIndex = false;
 
     // Don't accept NULL pointer to file handle
     if(szFileName == NULL || *szFileName == 0)
@@ -307,109 +404,163 @@ bool WINAPI SFileOpenFileEx(HANDLE hMpq, const char * szFileName, DWORD dwSearch
         }
     }
 
-    // Check whether the file really exists in the MPQ
+    // Check the file entry and create the file handle
     if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = OpenFileEntry(ha, pFileEntry, dwHashIndex, szFileName, (dwSearchScope == SFILE_OPEN_CHECK_EXISTS), &hf);
+
+    // Give the file entry
+    if(PtrFile != NULL)
+        PtrFile[0] = hf;
+
+    // Return error code
+    if(dwErrCode != ERROR_SUCCESS)
+        SErrSetLastError(dwErrCode);
+    return (dwErrCode == ERROR_SUCCESS);
+}
+
+//-----------------------------------------------------------------------------
+// SFileHasFile
+//
+//   hMpq          - Handle of opened MPQ archive
+//   szFileName    - Name of file to look for
+
+bool WINAPI SFileHasFile(HANDLE hMpq, const char * szFileName)
+{
+    return SFileOpenFileEx(hMpq, szFileName, SFILE_OPEN_CHECK_EXISTS, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// SFileOpenFilesBatch / SFileHasFilesBatch
+//
+// Opens (or checks the existence of) many files at once. The name hashes
+// of a group of names are calculated first and the hash table entries
+// they point to are prefetched, so the cache misses of the hash table
+// probes overlap instead of being taken one by one.
+//
+//   hMpq          - Handle of opened MPQ archive
+//   szFileNames   - Array of file names
+//   dwFileCount   - Number of entries in szFileNames
+//   PtrFiles      - Receives the file handles (NULL for files that failed to open)
+//   PtrErrCodes   - Optional, receives error code for each file
+//
+// Returns the number of files that were successfully opened (or that exist).
+
+#define BATCH_OPEN_GROUP_SIZE   64
+
+static DWORD OpenFilesBatch(
+    HANDLE hMpq,
+    const char ** szFileNames,
+    DWORD dwFileCount,
+    HANDLE * PtrFiles,
+    LPDWORD PtrErrCodes)
+{
+    TMPQArchive * ha = IsValidMpqHandle(hMpq);
+    TFileNameHash NameHashes[BATCH_OPEN_GROUP_SIZE];
+    TFileEntry * FileEntries[BATCH_OPEN_GROUP_SIZE];
+    DWORD HashIndexes[BATCH_OPEN_GROUP_SIZE];
+    DWORD dwSucceeded = 0;
+    DWORD dwErrCode;
+    bool bCheckExists = (PtrFiles == NULL);
+
+    // Check the parameters
+    if(ha == NULL)
     {
-        // If we didn't find the file, try to open it using pseudo file name ("File
-        if(pFileEntry == NULL || (pFileEntry->dwFlags & MPQ_FILE_EXISTS) == 0)
-        {
-            // Check the pseudo-file name ("File00000001.ext")
-            if((bOpenByIndex = IsPseudoFileName(szFileName, &dwFileIndex)) == true)
-            {
-                // Get the file entry for the file
-                if(dwFileIndex < ha->dwFileTableSize)
-                {
-                    pFileEntry = ha->pFileTable + dwFileIndex;
-                }
-            }
+        SErrSetLastError(ERROR_INVALID_HANDLE);
+        return 0;
+    }
+    if(szFileNames == NULL && dwFileCount != 0)
+    {
+        SErrSetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
 
-            // Still not found?
-            if(pFileEntry == NULL || (pFileEntry->dwFlags & MPQ_FILE_EXISTS) == 0)
+    // Process the names in groups
+    for(DWORD dwGroupStart = 0; dwGroupStart < dwFileCount; dwGroupStart += BATCH_OPEN_GROUP_SIZE)
+    {
+        DWORD dwGroupSize = STORMLIB_MIN(dwFileCount - dwGroupStart, BATCH_OPEN_GROUP_SIZE);
+        const char ** szGroupNames = szFileNames + dwGroupStart;
+
+        // Patched archives need to go through the patch chain, one file at a time
+        if(ha->haPatch != NULL)
+        {
+            for(DWORD i = 0; i < dwGroupSize; i++)
             {
-                dwErrCode = ERROR_FILE_NOT_FOUND;
+                HANDLE hFile = NULL;
+
+                dwErrCode = ERROR_SUCCESS;
+                if(!SFileOpenFileEx(hMpq, szGroupNames[i], bCheckExists ? SFILE_OPEN_CHECK_EXISTS : SFILE_OPEN_FROM_MPQ, bCheckExists ? NULL : &hFile))
+                    dwErrCode = SErrGetLastError();
+                if(PtrFiles != NULL)
+                    PtrFiles[dwGroupStart + i] = hFile;
+                if(PtrErrCodes != NULL)
+                    PtrErrCodes[dwGroupStart + i] = dwErrCode;
+                dwSucceeded += (dwErrCode == ERROR_SUCCESS);
             }
+            continue;
         }
 
-        // Perform some checks of invalid files
-        if(pFileEntry != NULL)
+        // Pass 1: Calculate the name hashes and prefetch the first hash table entry for each name
+        for(DWORD i = 0; i < dwGroupSize; i++)
         {
-            // MPQ protectors use insanely amount of fake files, often with very high size.
-            // We won't open any files whose compressed size is bigger than archive size
-            // If the file is not compressed, its size cannot be bigger than archive size
-            if((pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK) == 0 && (pFileEntry->dwFileSize > ha->FileSize))
+            if(szGroupNames[i] != NULL && szGroupNames[i][0] != 0)
             {
-                dwErrCode = ERROR_FILE_CORRUPT;
-                pFileEntry = NULL;
+                CalculateNameHashes(ha, szGroupNames[i], NameHashes[i]);
+                if(ha->pHashTable != NULL)
+                    STORMLIB_PREFETCH(ha->pHashTable + (NameHashes[i].dwHashIndex & HASH_INDEX_MASK(ha)));
             }
-
-            // Ignore unknown loading flags (example: MPQ_2016_v1_WME4_4.w3x)
-//          if(pFileEntry->dwFlags & ~MPQ_FILE_VALID_FLAGS)
-//          {
-//              dwErrCode = ERROR_NOT_SUPPORTED;
-//              pFileEntry = NULL;
-//          }
         }
-    }
 
-    // Did the caller just wanted to know if the file exists?
-    if(dwErrCode == ERROR_SUCCESS && dwSearchScope != SFILE_OPEN_CHECK_EXISTS)
-    {
-        // Allocate file handle
-        hf = CreateFileHandle(ha, pFileEntry);
-        if(hf != NULL)
+        // Pass 2: Resolve the hash table probes and prefetch the file entries
+        for(DWORD i = 0; i < dwGroupSize; i++)
         {
-            // Get the hash index for the file
-            if(ha->pHashTable != NULL && dwHashIndex == HASH_ENTRY_FREE)
-                dwHashIndex = FindHashIndex(ha, dwFileIndex);
-            if(dwHashIndex != HASH_ENTRY_FREE)
-                hf->pHashEntry = ha->pHashTable + dwHashIndex;
-            hf->dwHashIndex = dwHashIndex;
-
-            // If the MPQ has sector CRC enabled, enable if for the file
-            if(ha->dwFlags & MPQ_FLAG_CHECK_SECTOR_CRC)
-                hf->bCheckSectorCRCs = true;
+            FileEntries[i] = NULL;
+            HashIndexes[i] = HASH_ENTRY_FREE;
 
-            // If we know the real file name, copy it to the file entry
-            if(bOpenByIndex == false)
+            if(szGroupNames[i] != NULL && szGroupNames[i][0] != 0)
             {
-                // If there is no file name yet, allocate it
-                AllocateFileName(ha, pFileEntry, szFileName);
-
-                // If the file is encrypted, we should detect the file key
-                if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
-                {
-                    hf->dwFileKey = DecryptFileKey(szFileName,
-                                                   pFileEntry->ByteOffset,
-                                                   pFileEntry->dwFileSize,
-                                                   pFileEntry->dwFlags);
-                }
+                FileEntries[i] = GetFileEntryLocale(ha, NameHashes[i], g_lcFileLocale, &HashIndexes[i]);
+                if(FileEntries[i] != NULL)
+                    STORMLIB_PREFETCH(FileEntries[i]);
             }
         }
-        else
+
+        // Pass 3: Verify the file entries and create the file handles
+        for(DWORD i = 0; i < dwGroupSize; i++)
         {
-            dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+            TMPQFile * hf = NULL;
+
+            dwErrCode = ERROR_INVALID_PARAMETER;
+            if(szGroupNames[i] != NULL && szGroupNames[i][0] != 0)
+                dwErrCode = OpenFileEntry(ha, FileEntries[i], HashIndexes[i], szGroupNames[i], bCheckExists, &hf);
+
+            if(PtrFiles != NULL)
+                PtrFiles[dwGroupStart + i] = (HANDLE)hf;
+            if(PtrErrCodes != NULL)
+                PtrErrCodes[dwGroupStart + i] = dwErrCode;
+            dwSucceeded += (dwErrCode == ERROR_SUCCESS);
         }
     }
 
-    // Give the file entry
-    if(PtrFile != NULL)
-        PtrFile[0] = hf;
-
-    // Return error code
-    if(dwErrCode != ERROR_SUCCESS)
-        SErrSetLastError(dwErrCode);
-    return (dwErrCode == ERROR_SUCCESS);
+    // Set the last error if not all files were opened
+    SErrSetLastError((dwSucceeded == dwFileCount) ? ERROR_SUCCESS : ERROR_FILE_NOT_FOUND);
+    return dwSucceeded;
 }
 
-//-----------------------------------------------------------------------------
-// SFileHasFile
-//
-//   hMpq          - Handle of opened MPQ archive
-//   szFileName    - Name of file to look for
+DWORD WINAPI SFileOpenFilesBatch(HANDLE hMpq, const char ** szFileNames, DWORD dwFileCount, HANDLE * PtrFiles, LPDWORD PtrErrCodes)
+{
+    // The array of file handles must be valid
+    if(PtrFiles == NULL)
+    {
+        SErrSetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
 
-bool WINAPI SFileHasFile(HANDLE hMpq, const char * szFileName)
+    return OpenFilesBatch(hMpq, szFileNames, dwFileCount, PtrFiles, PtrErrCodes);
+}
+
+DWORD WINAPI SFileHasFilesBatch(HANDLE hMpq, const char ** szFileNames, DWORD dwFileCount, LPDWORD PtrErrCodes)
 {
-    return SFileOpenFileEx(hMpq, szFileName, SFILE_OPEN_CHECK_EXISTS, NULL);
+    return OpenFilesBatch(hMpq, szFileNames, dwFileCount, NULL, PtrErrCodes);
 }
 
 //-----------------------------------------------------------------------------
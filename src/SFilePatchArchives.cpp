@@ -216,6 +216,78 @@ static DWORD ApplyFilePatch_COPY(
     return ERROR_SUCCESS;
 }
 
+#ifdef STORMLIB_X86_SIMD
+
+STORMLIB_TARGET_SSE2 static DWORD CombinePatchData_SSE2(LPBYTE pbTarget, const BYTE * pbDiff, const BYTE * pbOld, DWORD cbLength)
+{
+    DWORD i;
+
+    for(i = 0; (i + 0x20) <= cbLength; i += 0x20)
+    {
+        __m128i Data0 = _mm_add_epi8(_mm_loadu_si128((const __m128i *)(pbDiff + i)), _mm_loadu_si128((const __m128i *)(pbOld + i)));
+        __m128i Data1 = _mm_add_epi8(_mm_loadu_si128((const __m128i *)(pbDiff + i + 0x10)), _mm_loadu_si128((const __m128i *)(pbOld + i + 0x10)));
+
+        _mm_storeu_si128((__m128i *)(pbTarget + i), Data0);
+        _mm_storeu_si128((__m128i *)(pbTarget + i + 0x10), Data1);
+    }
+    return i;
+}
+
+#ifdef STORMLIB_X86_AVX2
+STORMLIB_TARGET_AVX2 static DWORD CombinePatchData_AVX2(LPBYTE pbTarget, const BYTE * pbDiff, const BYTE * pbOld, DWORD cbLength)
+{
+    DWORD i;
+
+    for(i = 0; (i + 0x40) <= cbLength; i += 0x40)
+    {
+        __m256i Data0 = _mm256_add_epi8(_mm256_loadu_si256((const __m256i *)(pbDiff + i)), _mm256_loadu_si256((const __m256i *)(pbOld + i)));
+        __m256i Data1 = _mm256_add_epi8(_mm256_loadu_si256((const __m256i *)(pbDiff + i + 0x20)), _mm256_loadu_si256((const __m256i *)(pbOld + i + 0x20)));
+
+        _mm256_storeu_si256((__m256i *)(pbTarget + i), Data0);
+        _mm256_storeu_si256((__m256i *)(pbTarget + i + 0x20), Data1);
+    }
+    return i;
+}
+#endif  // STORMLIB_X86_AVX2
+#endif  // STORMLIB_X86_SIMD
+
+// Stores the sum of the BSDIFF data block and the old file data to the target buffer.
+// The target buffer must not overlap with the source buffers
+void CombinePatchData(LPBYTE pbTarget, const BYTE * pbDiff, const BYTE * pbOld, DWORD cbLength)
+{
+    DWORD i = 0;
+
+#ifdef STORMLIB_X86_SIMD
+    {
+        DWORD dwFeatures = StormCpu_GetFeatures();
+
+#ifdef STORMLIB_X86_AVX2
+        if(dwFeatures & STORM_CPU_FEATURE_AVX2)
+            i = CombinePatchData_AVX2(pbTarget, pbDiff, pbOld, cbLength);
+        else
+#endif
+        if(dwFeatures & STORM_CPU_FEATURE_SSE2)
+            i = CombinePatchData_SSE2(pbTarget, pbDiff, pbOld, cbLength);
+    }
+#endif
+
+    // The rest (or everything, if there is no SIMD) by 32-bit words.
+    // Adding bytes without carries between them: add the lower 7 bits, then fix the top bits
+    for(; (i + sizeof(DWORD)) <= cbLength; i += sizeof(DWORD))
+    {
+        DWORD dwDiff;
+        DWORD dwOld;
+
+        memcpy(&dwDiff, pbDiff + i, sizeof(DWORD));
+        memcpy(&dwOld, pbOld + i, sizeof(DWORD));
+        dwDiff = ((dwDiff & 0x7F7F7F7F) + (dwOld & 0x7F7F7F7F)) ^ ((dwDiff ^ dwOld) & 0x80808080);
+        memcpy(pbTarget + i, &dwDiff, sizeof(DWORD));
+    }
+
+    for(; i < cbLength; i++)
+        pbTarget[i] = (BYTE)(pbDiff[i] + pbOld[i]);
+}
+
 static DWORD ApplyFilePatch_BSD0(
     TMPQPatcher * pPatcher,
     PMPQ_PATCH_HEADER pFullPatch,
@@ -267,24 +339,21 @@ static DWORD ApplyFilePatch_BSD0(
         DWORD dwAddDataLength = BSWAP_INT32_UNSIGNED(pCtrlBlock->dwAddDataLength);
         DWORD dwMovDataLength = BSWAP_INT32_UNSIGNED(pCtrlBlock->dwMovDataLength);
         DWORD dwOldMoveLength = BSWAP_INT32_UNSIGNED(pCtrlBlock->dwOldMoveLength);
-        DWORD i;
 
-        // Sanity check
-        if((dwNewOffset + dwAddDataLength) > dwNewSize)
+        // Sanity check. The diff string must fit into the patched file
+        // and it must start inside the original file
+        if(dwAddDataLength > (dwNewSize - dwNewOffset) || dwOldOffset > dwOldSize)
             return ERROR_FILE_CORRUPT;
 
-        // Read the diff string to the target buffer
-        memcpy(pbNewData + dwNewOffset, pDataBlock, dwAddDataLength);
-        pDataBlock += dwAddDataLength;
-
         // Get the longest block that we can combine
-        dwCombineSize = ((dwOldOffset + dwAddDataLength) >= dwOldSize) ? (dwOldSize - dwOldOffset) : dwAddDataLength;
-        if((dwNewOffset + dwCombineSize) > dwNewSize || (dwNewOffset + dwCombineSize) < dwNewOffset)
-            return ERROR_FILE_CORRUPT;
+        dwCombineSize = dwOldSize - dwOldOffset;
+        dwCombineSize = STORMLIB_MIN(dwCombineSize, dwAddDataLength);
 
-        // Now combine the patch data with the original file
-        for(i = 0; i < dwCombineSize; i++)
-            pbNewData[dwNewOffset + i] = pbNewData[dwNewOffset + i] + pbOldData[dwOldOffset + i];
+        // Combine the diff string with the original file directly into the target buffer.
+        // The rest of the diff string (past the end of the original file) is copied as-is
+        CombinePatchData(pbNewData + dwNewOffset, pDataBlock, pbOldData + dwOldOffset, dwCombineSize);
+        memcpy(pbNewData + dwNewOffset + dwCombineSize, pDataBlock + dwCombineSize, dwAddDataLength - dwCombineSize);
+        pDataBlock += dwAddDataLength;
 
         // Move the offsets
         dwNewOffset += dwAddDataLength;
@@ -1081,6 +1150,238 @@ void Patch_Finalize(TMPQPatcher * pPatcher)
     }
 }
 
+//-----------------------------------------------------------------------------
+// Cache of patched files
+//
+// The cache belongs to the base archive and keeps the complete result of the patching.
+// The files are identified by name, by the position of all files in the chain and
+// by the MD5s of all patches, so a file patched by a different set of patches doesn't
+// match. The position also tells apart locales of one file name that have equal sizes
+// and no MD5 in the (attributes). The cache holds whole
+// files, so there are few entries in it and they are searched linearly.
+// The cache is flushed when a patch archive is added to the chain.
+
+static void PatchCache_Unlink(TMPQPatchCache * pCache, TPatchCacheEntry * pEntry)
+{
+    if(pEntry->pPrev != NULL)
+        pEntry->pPrev->pNext = pEntry->pNext;
+    else
+        pCache->pFirst = pEntry->pNext;
+
+    if(pEntry->pNext != NULL)
+        pEntry->pNext->pPrev = pEntry->pPrev;
+    else
+        pCache->pLast = pEntry->pPrev;
+}
+
+static void PatchCache_LinkFirst(TMPQPatchCache * pCache, TPatchCacheEntry * pEntry)
+{
+    pEntry->pPrev = NULL;
+    pEntry->pNext = pCache->pFirst;
+    if(pCache->pFirst != NULL)
+        pCache->pFirst->pPrev = pEntry;
+    else
+        pCache->pLast = pEntry;
+    pCache->pFirst = pEntry;
+}
+
+// Removes the least recently used entry from the cache
+static void PatchCache_Evict(TMPQPatchCache * pCache)
+{
+    TPatchCacheEntry * pEntry = pCache->pLast;
+
+    PatchCache_Unlink(pCache, pEntry);
+    pCache->cbCacheUsed -= pEntry->cbData;
+    STORM_FREE(pEntry);
+}
+
+// Adds the position of the file in its archive to the identity of the patch chain
+static void PatchCache_AddFilePos(hash_state * md5_state, TMPQFile * hf)
+{
+    DWORD dwFileIndex = (DWORD)(hf->pFileEntry - hf->ha->pFileTable);
+
+    md5_process(md5_state, (LPBYTE)&dwFileIndex, sizeof(DWORD));
+    md5_process(md5_state, (LPBYTE)&hf->pFileEntry->ByteOffset, sizeof(ULONGLONG));
+}
+
+// Calculates the identity of the patch chain from the patch info of each patch file
+static bool PatchCache_GetChainMd5(TMPQFile * hf, LPBYTE chain_md5)
+{
+    hash_state md5_state;
+
+    md5_init(&md5_state);
+    md5_process(&md5_state, hf->pFileEntry->md5, MD5_DIGEST_SIZE);
+    md5_process(&md5_state, (LPBYTE)&hf->pFileEntry->dwFileSize, sizeof(DWORD));
+    PatchCache_AddFilePos(&md5_state, hf);
+
+    for(hf = hf->hfPatch; hf != NULL; hf = hf->hfPatch)
+    {
+        // The patch info is normally loaded by the first read
+        if(hf->pPatchInfo == NULL && AllocatePatchInfo(hf, true) != ERROR_SUCCESS)
+            return false;
+        md5_process(&md5_state, hf->pPatchInfo->md5, MD5_DIGEST_SIZE);
+        md5_process(&md5_state, (LPBYTE)&hf->pPatchInfo->dwDataSize, sizeof(DWORD));
+        PatchCache_AddFilePos(&md5_state, hf);
+    }
+
+    md5_done(&md5_state, chain_md5);
+    return true;
+}
+
+// Sets the maximum size of the cache. Zero frees the cache
+DWORD PatchCache_SetSize(TMPQArchive * ha, size_t cbCacheSize)
+{
+    TMPQPatchCache * pCache = ha->pPatchCache;
+
+    // Zero size means that we don't want the cache at all
+    if(cbCacheSize == 0)
+    {
+        PatchCache_Free(ha);
+        return ERROR_SUCCESS;
+    }
+
+    // Create the cache, if not done yet
+    if(pCache == NULL)
+    {
+        if((pCache = STORM_ALLOC(TMPQPatchCache, 1)) == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+        memset(pCache, 0, sizeof(TMPQPatchCache));
+        StormLock_Init(&pCache->Lock);
+        pCache->cbCacheSize = cbCacheSize;
+        ha->pPatchCache = pCache;
+        return ERROR_SUCCESS;
+    }
+
+    // Resize the existing cache. Evict the files that don't fit
+    StormLock_Enter(&pCache->Lock);
+    pCache->cbCacheSize = cbCacheSize;
+    while(pCache->cbCacheUsed > pCache->cbCacheSize)
+        PatchCache_Evict(pCache);
+    StormLock_Leave(&pCache->Lock);
+    return ERROR_SUCCESS;
+}
+
+// Gives the file handle a copy of the cached patched file, if there is one
+bool PatchCache_Load(TMPQFile * hf)
+{
+    TMPQPatchCache * pCache = hf->ha->pPatchCache;
+    TPatchCacheEntry * pEntry;
+    const char * szFileName = hf->pFileEntry->szFileName;
+    LPBYTE pbFileData = NULL;
+    DWORD dwNameHash;
+    BYTE chain_md5[MD5_DIGEST_SIZE];
+
+    if(pCache != NULL && szFileName != NULL && PatchCache_GetChainMd5(hf, chain_md5))
+    {
+        dwNameHash = HashString(szFileName, MPQ_HASH_NAME_A);
+        StormLock_Enter(&pCache->Lock);
+
+        // Find the entry
+        for(pEntry = pCache->pFirst; pEntry != NULL; pEntry = pEntry->pNext)
+        {
+            if(pEntry->dwNameHash == dwNameHash && !strcmp(pEntry->szFileName, szFileName) && !memcmp(pEntry->chain_md5, chain_md5, MD5_DIGEST_SIZE))
+                break;
+        }
+
+        // If found, copy the data and make the entry the most recently used one
+        if(pEntry != NULL && (pbFileData = STORM_ALLOC(BYTE, pEntry->cbData)) != NULL)
+        {
+            memcpy(pbFileData, pEntry + 1, pEntry->cbData);
+            PatchCache_Unlink(pCache, pEntry);
+            PatchCache_LinkFirst(pCache, pEntry);
+            hf->pbFileData = pbFileData;
+            hf->cbFileData = pEntry->cbData;
+            pCache->CacheHits++;
+        }
+        else
+        {
+            pCache->CacheMisses++;
+        }
+
+        StormLock_Leave(&pCache->Lock);
+    }
+    return (pbFileData != NULL);
+}
+
+// Inserts a copy of the patched file into the cache
+void PatchCache_Store(TMPQFile * hf)
+{
+    TMPQPatchCache * pCache = hf->ha->pPatchCache;
+    TPatchCacheEntry * pEntry;
+    const char * szFileName = hf->pFileEntry->szFileName;
+    size_t nLength;
+    BYTE chain_md5[MD5_DIGEST_SIZE];
+
+    // Don't cache files that would not fit at all
+    if(pCache != NULL && szFileName != NULL && hf->cbFileData != 0 && hf->cbFileData <= pCache->cbCacheSize)
+    {
+        if(!PatchCache_GetChainMd5(hf, chain_md5))
+            return;
+
+        // Allocate and fill the entry out of the lock
+        nLength = strlen(szFileName) + 1;
+        if((pEntry = (TPatchCacheEntry *)STORM_ALLOC(BYTE, sizeof(TPatchCacheEntry) + hf->cbFileData + nLength)) == NULL)
+            return;
+        memcpy(pEntry + 1, hf->pbFileData, hf->cbFileData);
+        memcpy((LPBYTE)(pEntry + 1) + hf->cbFileData, szFileName, nLength);
+        memcpy(pEntry->chain_md5, chain_md5, MD5_DIGEST_SIZE);
+        pEntry->szFileName = (const char *)(pEntry + 1) + hf->cbFileData;
+        pEntry->dwNameHash = HashString(szFileName, MPQ_HASH_NAME_A);
+        pEntry->cbData = hf->cbFileData;
+
+        StormLock_Enter(&pCache->Lock);
+
+        // Another thread may have inserted the same file in the meantime
+        for(TPatchCacheEntry * pTemp = pCache->pFirst; pTemp != NULL; pTemp = pTemp->pNext)
+        {
+            if(pTemp->dwNameHash == pEntry->dwNameHash && !strcmp(pTemp->szFileName, szFileName) && !memcmp(pTemp->chain_md5, chain_md5, MD5_DIGEST_SIZE))
+            {
+                StormLock_Leave(&pCache->Lock);
+                STORM_FREE(pEntry);
+                return;
+            }
+        }
+
+        // Make space for the new entry
+        while(pCache->pLast != NULL && (pCache->cbCacheUsed + pEntry->cbData) > pCache->cbCacheSize)
+            PatchCache_Evict(pCache);
+
+        // Insert the entry to the begin of the LRU list
+        PatchCache_LinkFirst(pCache, pEntry);
+        pCache->cbCacheUsed += pEntry->cbData;
+
+        StormLock_Leave(&pCache->Lock);
+    }
+}
+
+// Removes all files from the cache. Called when the patch chain changes
+void PatchCache_Flush(TMPQArchive * ha)
+{
+    TMPQPatchCache * pCache = ha->pPatchCache;
+
+    if(pCache != NULL)
+    {
+        StormLock_Enter(&pCache->Lock);
+        while(pCache->pLast != NULL)
+            PatchCache_Evict(pCache);
+        StormLock_Leave(&pCache->Lock);
+    }
+}
+
+void PatchCache_Free(TMPQArchive * ha)
+{
+    TMPQPatchCache * pCache = ha->pPatchCache;
+
+    if(pCache != NULL)
+    {
+        PatchCache_Flush(ha);
+        ha->pPatchCache = NULL;
+
+        StormLock_Free(&pCache->Lock);
+        STORM_FREE(pCache);
+    }
+}
+
 //-----------------------------------------------------------------------------
 // Public functions
 
@@ -1134,6 +1435,10 @@ bool WINAPI SFileOpenPatchArchive(
             // We need to remember the proper patch prefix to match names of patched files
             if(FindPatchPrefix(ha, (TMPQArchive *)hPatchMpq, szPatchPathPrefix))
             {
+                // The patched files cached so far may be patched differently now
+                for(TMPQArchive * haCache = ha; haCache != NULL; haCache = haCache->haPatch)
+                    PatchCache_Flush(haCache);
+
                 // Now add the patch archive to the list of patches to the original MPQ
                 while(ha != NULL)
                 {
@@ -1173,3 +1478,31 @@ bool WINAPI SFileIsPatchedArchive(HANDLE hMpq)
 
     return (ha->haPatch != NULL);
 }
+
+//-----------------------------------------------------------------------------
+// Sets the size of the cache of fully patched files.
+//
+//   hMpq       - Handle of the base archive
+//   CacheSize  - Maximum size of the cached files, in bytes. 0 disables the cache.
+
+bool WINAPI SFileSetPatchCacheSize(HANDLE hMpq, ULONGLONG CacheSize)
+{
+    TMPQArchive * ha;
+    DWORD dwErrCode;
+
+    // Check the archive handle
+    if((ha = IsValidMpqHandle(hMpq)) == NULL)
+    {
+        SErrSetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    // Don't allow more than the address space on 32-bit platforms
+    if(CacheSize > (size_t)(-1))
+        CacheSize = (size_t)(-1);
+
+    dwErrCode = PatchCache_SetSize(ha, (size_t)CacheSize);
+    if(dwErrCode != ERROR_SUCCESS)
+        SErrSetLastError(dwErrCode);
+    return (dwErrCode == ERROR_SUCCESS);
+}
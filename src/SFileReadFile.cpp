@@ -18,9 +18,410 @@
 
 int WINAPI SCompDecompressX(TMPQArchive * ha, void * pvOutBuffer, int * pcbOutBuffer, void * pbInBuffer, int cbInBuffer);
 
+//-----------------------------------------------------------------------------
+// Cache of decompressed file sectors
+//
+// The cache is shared by all file handles of the archive. Sectors are identified
+// by the file index and the sector index. Single unit files are cached as one sector.
+// The cache is flushed whenever the archive content or the file table changes.
+
+#define SECTOR_CACHE_MIN_BUCKETS    0x40
+#define SECTOR_CACHE_MAX_BUCKETS    0x10000
+
+static DWORD SectorCache_GetBucket(TMPQSectorCache * pCache, DWORD dwFileIndex, DWORD dwSectorIndex)
+{
+    DWORD dwHash = (dwFileIndex * 0x9E3779B1) ^ (dwSectorIndex * 0x85EBCA77);
+
+    return (dwHash ^ (dwHash >> 16)) & (pCache->dwBucketCount - 1);
+}
+
+static void SectorCache_Unlink(TMPQSectorCache * pCache, TSectorCacheEntry * pEntry)
+{
+    if(pEntry->pPrev != NULL)
+        pEntry->pPrev->pNext = pEntry->pNext;
+    else
+        pCache->pFirst = pEntry->pNext;
+
+    if(pEntry->pNext != NULL)
+        pEntry->pNext->pPrev = pEntry->pPrev;
+    else
+        pCache->pLast = pEntry->pPrev;
+}
+
+static void SectorCache_LinkFirst(TMPQSectorCache * pCache, TSectorCacheEntry * pEntry)
+{
+    pEntry->pPrev = NULL;
+    pEntry->pNext = pCache->pFirst;
+    if(pCache->pFirst != NULL)
+        pCache->pFirst->pPrev = pEntry;
+    else
+        pCache->pLast = pEntry;
+    pCache->pFirst = pEntry;
+}
+
+// Removes the least recently used entry from the cache
+static void SectorCache_Evict(TMPQSectorCache * pCache)
+{
+    TSectorCacheEntry * pEntry = pCache->pLast;
+    TSectorCacheEntry ** ppEntry;
+
+    // Remove the entry from its bucket
+    ppEntry = &pCache->Buckets[SectorCache_GetBucket(pCache, pEntry->dwFileIndex, pEntry->dwSectorIndex)];
+    while(ppEntry[0] != pEntry)
+        ppEntry = &ppEntry[0]->pNextInBucket;
+    ppEntry[0] = pEntry->pNextInBucket;
+
+    // Remove the entry from the LRU list and free it
+    SectorCache_Unlink(pCache, pEntry);
+    pCache->cbCacheUsed -= pEntry->cbData;
+    STORM_FREE(pEntry);
+}
+
+// Allocates the bucket array for the given cache size and re-inserts all entries
+static DWORD SectorCache_Rehash(TMPQSectorCache * pCache, DWORD dwSectorSize)
+{
+    TSectorCacheEntry ** Buckets;
+    TSectorCacheEntry * pEntry;
+    size_t nSectorCount = pCache->cbCacheSize / ((dwSectorSize != 0) ? dwSectorSize : 0x1000);
+    DWORD dwBucketCount = SECTOR_CACHE_MIN_BUCKETS;
+
+    // Keep the average bucket length at about one
+    while(dwBucketCount < nSectorCount && dwBucketCount < SECTOR_CACHE_MAX_BUCKETS)
+        dwBucketCount <<= 1;
+    if(dwBucketCount == pCache->dwBucketCount)
+        return ERROR_SUCCESS;
+
+    // Allocate new buckets
+    if((Buckets = STORM_ALLOC(TSectorCacheEntry *, dwBucketCount)) == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    memset(Buckets, 0, sizeof(TSectorCacheEntry *) * dwBucketCount);
+
+    // Re-insert all entries into the new buckets
+    STORM_FREE(pCache->Buckets);
+    pCache->Buckets = Buckets;
+    pCache->dwBucketCount = dwBucketCount;
+    for(pEntry = pCache->pFirst; pEntry != NULL; pEntry = pEntry->pNext)
+    {
+        DWORD dwBucket = SectorCache_GetBucket(pCache, pEntry->dwFileIndex, pEntry->dwSectorIndex);
+
+        pEntry->pNextInBucket = Buckets[dwBucket];
+        Buckets[dwBucket] = pEntry;
+    }
+    return ERROR_SUCCESS;
+}
+
+// Sets the maximum size of the cache. Zero frees the cache
+DWORD SectorCache_SetSize(TMPQArchive * ha, size_t cbCacheSize)
+{
+    TMPQSectorCache * pCache = ha->pSectorCache;
+    DWORD dwErrCode;
+
+    // Zero size means that we don't want the cache at all
+    if(cbCacheSize == 0)
+    {
+        SectorCache_Free(ha);
+        return ERROR_SUCCESS;
+    }
+
+    // Create the cache, if not done yet
+    if(pCache == NULL)
+    {
+        if((pCache = STORM_ALLOC(TMPQSectorCache, 1)) == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+        memset(pCache, 0, sizeof(TMPQSectorCache));
+        StormLock_Init(&pCache->Lock);
+        pCache->cbCacheSize = cbCacheSize;
+
+        // Allocate the buckets
+        if((dwErrCode = SectorCache_Rehash(pCache, ha->dwSectorSize)) != ERROR_SUCCESS)
+        {
+            StormLock_Free(&pCache->Lock);
+            STORM_FREE(pCache);
+            return dwErrCode;
+        }
+
+        ha->pSectorCache = pCache;
+        return ERROR_SUCCESS;
+    }
+
+    // Resize the existing cache. Evict the sectors that don't fit
+    StormLock_Enter(&pCache->Lock);
+    pCache->cbCacheSize = cbCacheSize;
+    while(pCache->cbCacheUsed > pCache->cbCacheSize)
+        SectorCache_Evict(pCache);
+    dwErrCode = SectorCache_Rehash(pCache, ha->dwSectorSize);
+    StormLock_Leave(&pCache->Lock);
+    return dwErrCode;
+}
+
+// Copies the cached sector to the buffer. The buffer size must match the sector size
+bool SectorCache_Load(TMPQArchive * ha, DWORD dwFileIndex, DWORD dwSectorIndex, void * pvBuffer, DWORD cbBuffer)
+{
+    TMPQSectorCache * pCache = ha->pSectorCache;
+    TSectorCacheEntry * pEntry;
+    bool bResult = false;
+
+    if(pCache != NULL)
+    {
+        StormLock_Enter(&pCache->Lock);
+
+        // Find the entry in the bucket
+        pEntry = pCache->Buckets[SectorCache_GetBucket(pCache, dwFileIndex, dwSectorIndex)];
+        while(pEntry != NULL && (pEntry->dwFileIndex != dwFileIndex || pEntry->dwSectorIndex != dwSectorIndex))
+            pEntry = pEntry->pNextInBucket;
+
+        // If found, copy the data and make the entry the most recently used one
+        if(pEntry != NULL && pEntry->cbData == cbBuffer)
+        {
+            memcpy(pvBuffer, pEntry + 1, cbBuffer);
+            SectorCache_Unlink(pCache, pEntry);
+            SectorCache_LinkFirst(pCache, pEntry);
+            pCache->CacheHits++;
+            bResult = true;
+        }
+        else
+        {
+            pCache->CacheMisses++;
+        }
+
+        StormLock_Leave(&pCache->Lock);
+    }
+    return bResult;
+}
+
+// Inserts a decompressed sector into the cache
+void SectorCache_Store(TMPQArchive * ha, DWORD dwFileIndex, DWORD dwSectorIndex, const void * pvData, DWORD cbData)
+{
+    TMPQSectorCache * pCache = ha->pSectorCache;
+    TSectorCacheEntry * pEntry;
+    DWORD dwBucket;
+
+    // Don't cache sectors that would not fit at all
+    if(pCache != NULL && cbData != 0 && cbData <= pCache->cbCacheSize)
+    {
+        // Allocate and fill the entry out of the lock
+        if((pEntry = (TSectorCacheEntry *)STORM_ALLOC(BYTE, sizeof(TSectorCacheEntry) + cbData)) == NULL)
+            return;
+        pEntry->dwFileIndex = dwFileIndex;
+        pEntry->dwSectorIndex = dwSectorIndex;
+        pEntry->cbData = cbData;
+        memcpy(pEntry + 1, pvData, cbData);
+
+        StormLock_Enter(&pCache->Lock);
+        dwBucket = SectorCache_GetBucket(pCache, dwFileIndex, dwSectorIndex);
+
+        // Another thread may have inserted the same sector in the meantime
+        for(TSectorCacheEntry * pTemp = pCache->Buckets[dwBucket]; pTemp != NULL; pTemp = pTemp->pNextInBucket)
+        {
+            if(pTemp->dwFileIndex == dwFileIndex && pTemp->dwSectorIndex == dwSectorIndex)
+            {
+                StormLock_Leave(&pCache->Lock);
+                STORM_FREE(pEntry);
+                return;
+            }
+        }
+
+        // Make space for the new entry
+        while(pCache->pLast != NULL && (pCache->cbCacheUsed + cbData) > pCache->cbCacheSize)
+            SectorCache_Evict(pCache);
+
+        // Insert the entry to the bucket and to the begin of the LRU list
+        pEntry->pNextInBucket = pCache->Buckets[dwBucket];
+        pCache->Buckets[dwBucket] = pEntry;
+        SectorCache_LinkFirst(pCache, pEntry);
+        pCache->cbCacheUsed += cbData;
+
+        StormLock_Leave(&pCache->Lock);
+    }
+}
+
+// Removes all sectors from the cache. Called when the archive is modified
+void SectorCache_Flush(TMPQArchive * ha)
+{
+    TMPQSectorCache * pCache = ha->pSectorCache;
+
+    if(pCache != NULL)
+    {
+        StormLock_Enter(&pCache->Lock);
+        while(pCache->pLast != NULL)
+            SectorCache_Evict(pCache);
+        StormLock_Leave(&pCache->Lock);
+    }
+}
+
+void SectorCache_Free(TMPQArchive * ha)
+{
+    TMPQSectorCache * pCache = ha->pSectorCache;
+
+    if(pCache != NULL)
+    {
+        SectorCache_Flush(ha);
+        ha->pSectorCache = NULL;
+
+        StormLock_Free(&pCache->Lock);
+        STORM_FREE(pCache->Buckets);
+        STORM_FREE(pCache);
+    }
+}
+
 //-----------------------------------------------------------------------------
 // Local functions
 
+// Describes a range of sectors that is being decrypted and decompressed
+struct TMpqSectorRange
+{
+    TMPQFile * hf;                          // MPQ file handle
+    LPBYTE pbOutBuffer;                     // Target buffer for the first sector
+    LPBYTE pbInBuffer;                      // Raw data of the first sector
+    LPDWORD ErrorCodes;                     // Error codes of the sectors (parallel processing only)
+    DWORD dwSectorIndex;                    // Index of the first sector in the file
+    DWORD dwRawSectorOffset;                // Raw offset of the first sector (relative to file begin)
+    DWORD dwBytesToRead;                    // Number of bytes to be produced
+};
+
+// Calculates location and size of the n-th sector of the range
+static void GetSectorInRange(
+    TMpqSectorRange * pRange,
+    DWORD dwSector,
+    LPBYTE * PtrOutSector,
+    DWORD * PtrBytesInThisSector,
+    LPBYTE * PtrInSector,
+    DWORD * PtrRawBytesInThisSector)
+{
+    TMPQFile * hf = pRange->hf;
+    DWORD dwSectorSize = hf->ha->dwSectorSize;
+    DWORD dwSectorOffset = dwSector * dwSectorSize;
+    DWORD dwBytesInThisSector = dwSectorSize;
+    DWORD dwRawBytesInThisSector;
+
+    // If there is not enough bytes in the last sector,
+    // cut the number of bytes in this sector
+    if(dwBytesInThisSector > (pRange->dwBytesToRead - dwSectorOffset))
+        dwBytesInThisSector = (pRange->dwBytesToRead - dwSectorOffset);
+    dwRawBytesInThisSector = dwBytesInThisSector;
+
+    PtrOutSector[0] = pRange->pbOutBuffer + dwSectorOffset;
+    PtrInSector[0] = pRange->pbInBuffer + dwSectorOffset;
+
+    // If the file is compressed, the raw sector position and size is taken from the sector offsets
+    if(hf->pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK)
+    {
+        DWORD dwIndex = pRange->dwSectorIndex + dwSector;
+
+        PtrInSector[0] = pRange->pbInBuffer + (hf->SectorOffsets[dwIndex] - pRange->dwRawSectorOffset);
+        dwRawBytesInThisSector = hf->SectorOffsets[dwIndex + 1] - hf->SectorOffsets[dwIndex];
+    }
+
+    PtrBytesInThisSector[0] = dwBytesInThisSector;
+    PtrRawBytesInThisSector[0] = dwRawBytesInThisSector;
+}
+
+// Decrypts, verifies and decompresses one sector.
+// Doesn't modify the file handle, so multiple sectors can be processed in parallel
+static DWORD ReadMpqSector(
+    TMPQFile * hf,
+    DWORD dwIndex,
+    LPBYTE pbOutSector,
+    DWORD dwBytesInThisSector,
+    LPBYTE pbInSector,
+    DWORD dwRawBytesInThisSector)
+{
+    TMPQArchive * ha = hf->ha;
+    TFileEntry * pFileEntry = hf->pFileEntry;
+
+    // If the file is encrypted, we have to decrypt the sector
+    if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
+    {
+        BSWAP_ARRAY32_UNSIGNED(pbInSector, dwRawBytesInThisSector);
+        DecryptMpqBlock(pbInSector, dwRawBytesInThisSector, hf->dwFileKey + dwIndex);
+        BSWAP_ARRAY32_UNSIGNED(pbInSector, dwRawBytesInThisSector);
+    }
+
+    // If the file has sector CRC check turned on, perform it
+    if(hf->bCheckSectorCRCs && hf->SectorChksums != NULL)
+    {
+        DWORD dwAdlerExpected = hf->SectorChksums[dwIndex];
+        DWORD dwAdlerValue = 0;
+
+        // We can only check sector CRC when it's not zero
+        // Neither can we check it if it's 0xFFFFFFFF.
+        if(dwAdlerExpected != 0 && dwAdlerExpected != 0xFFFFFFFF)
+        {
+            dwAdlerValue = adler32(0, pbInSector, dwRawBytesInThisSector);
+            if(dwAdlerValue != dwAdlerExpected)
+                return ERROR_CHECKSUM_ERROR;
+        }
+    }
+
+    // If the sector is really compressed, decompress it.
+    // WARNING : Some sectors may not be compressed, it can be determined only
+    // by comparing uncompressed and compressed size !!!
+    if(dwRawBytesInThisSector < dwBytesInThisSector)
+    {
+        if(dwRawBytesInThisSector != 0)
+        {
+            int cbOutSector = dwBytesInThisSector;
+            int cbInSector = dwRawBytesInThisSector;
+            int nResult = 0;
+
+            // Is the file compressed by Blizzard's multiple compression ?
+            if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS)
+            {
+                // Decompress the data. We need to perform MPQ-specific decompression,
+                // as multiple Blizzard games may have their own decompression tables
+                // and even decompression methods.
+                nResult = SCompDecompressX(ha, pbOutSector, &cbOutSector, pbInSector, cbInSector);
+            }
+
+            // Is the file compressed by PKWARE Data Compression Library ?
+            else if(pFileEntry->dwFlags & MPQ_FILE_IMPLODE)
+            {
+                nResult = SCompExplode(pbOutSector, &cbOutSector, pbInSector, cbInSector);
+            }
+
+            // Did the decompression fail ?
+            if(nResult == 0)
+                return ERROR_FILE_CORRUPT;
+
+            // Special case (MPQ_2024_v1_300TK2.09p.w3x, file File00010254.blp):
+            // Extracted less than required. Fill the rest with zeros
+            if((DWORD)(cbOutSector) < dwBytesInThisSector)
+            {
+                memset(pbOutSector + cbOutSector, 0, dwBytesInThisSector - cbOutSector);
+            }
+        }
+        else
+        {
+            memset(pbOutSector, 0, dwBytesInThisSector);
+        }
+    }
+    else
+    {
+        if(pbOutSector != pbInSector)
+            memcpy(pbOutSector, pbInSector, dwBytesInThisSector);
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Work routine for the worker pool. Processes one sector of the range
+static void ReadMpqSectorWorker(void * pvParam, DWORD dwSector)
+{
+    TMpqSectorRange * pRange = (TMpqSectorRange *)pvParam;
+    LPBYTE pbOutSector;
+    LPBYTE pbInSector;
+    DWORD dwRawBytesInThisSector;
+    DWORD dwBytesInThisSector;
+
+    GetSectorInRange(pRange, dwSector, &pbOutSector, &dwBytesInThisSector, &pbInSector, &dwRawBytesInThisSector);
+    pRange->ErrorCodes[dwSector] = ReadMpqSector(pRange->hf,
+                                                 pRange->dwSectorIndex + dwSector,
+                                                 pbOutSector,
+                                                 dwBytesInThisSector,
+                                                 pbInSector,
+                                                 dwRawBytesInThisSector);
+}
+
 //  hf            - MPQ File handle.
 //  pbBuffer      - Pointer to target buffer to store sectors.
 //  dwByteOffset  - Position of sector in the file (relative to file begin)
@@ -28,17 +429,16 @@ int WINAPI SCompDecompressX(TMPQArchive * ha, void * pvOutBuffer, int * pcbOutBu
 //  pdwBytesRead  - Stored number of bytes loaded
 static DWORD ReadMpqSectors(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset, DWORD dwBytesToRead, LPDWORD pdwBytesRead)
 {
+    TMpqSectorRange Range;
     ULONGLONG RawFilePos;
     TMPQArchive * ha = hf->ha;
     TFileEntry * pFileEntry = hf->pFileEntry;
     LPBYTE pbRawSector = NULL;
-    LPBYTE pbOutSector = pbBuffer;
     LPBYTE pbInSector = pbBuffer;
     DWORD dwRawBytesToRead;
     DWORD dwRawSectorOffset = dwByteOffset;
     DWORD dwSectorsToRead = dwBytesToRead / ha->dwSectorSize;
     DWORD dwSectorIndex = dwByteOffset / ha->dwSectorSize;
-    DWORD dwSectorsDone = 0;
     DWORD dwBytesRead = 0;
     DWORD dwErrCode = ERROR_SUCCESS;
 
@@ -102,125 +502,69 @@ static DWORD ReadMpqSectors(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset,
     // Set file pointer and read all required sectors
     if(FileStream_Read(ha->pStream, &RawFilePos, pbInSector, dwRawBytesToRead))
     {
-        // Now we have to decrypt and decompress all file sectors that have been loaded
-        for(DWORD i = 0; i < dwSectorsToRead; i++)
+        LPBYTE pbOutSector;
+        DWORD dwRawBytesInThisSector;
+        DWORD dwBytesInThisSector;
+
+        // Describe the sector range for the per-sector processing
+        Range.hf = hf;
+        Range.pbOutBuffer = pbBuffer;
+        Range.pbInBuffer = pbInSector;
+        Range.ErrorCodes = NULL;
+        Range.dwSectorIndex = dwSectorIndex;
+        Range.dwRawSectorOffset = dwRawSectorOffset;
+        Range.dwBytesToRead = dwBytesToRead;
+
+        // If the file is encrypted and we don't know the key, try to detect it by file content
+        if((pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED) && hf->dwFileKey == 0 && dwSectorsToRead != 0)
         {
-            DWORD dwRawBytesInThisSector = ha->dwSectorSize;
-            DWORD dwBytesInThisSector = ha->dwSectorSize;
-            DWORD dwIndex = dwSectorIndex + i;
+            GetSectorInRange(&Range, 0, &pbOutSector, &dwBytesInThisSector, &pbInSector, &dwRawBytesInThisSector);
 
-            // If there is not enough bytes in the last sector,
-            // cut the number of bytes in this sector
-            if(dwRawBytesInThisSector > dwBytesToRead)
-                dwRawBytesInThisSector = dwBytesToRead;
-            if(dwBytesInThisSector > dwBytesToRead)
-                dwBytesInThisSector = dwBytesToRead;
+            BSWAP_ARRAY32_UNSIGNED(pbInSector, dwRawBytesInThisSector);
+            hf->dwFileKey = DetectFileKeyByContent(pbInSector, dwBytesInThisSector, hf->dwDataSize);
+            BSWAP_ARRAY32_UNSIGNED(pbInSector, dwRawBytesInThisSector);
 
-            // If the file is compressed, we have to adjust the raw sector size
-            if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK)
-                dwRawBytesInThisSector = hf->SectorOffsets[dwIndex + 1] - hf->SectorOffsets[dwIndex];
+            if(hf->dwFileKey == 0)
+                dwErrCode = ERROR_UNKNOWN_FILE_KEY;
+        }
 
-            // If the file is encrypted, we have to decrypt the sector
-            if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
+        // If there are more sectors to be decrypted or decompressed and the worker pool is active,
+        // process them in parallel. Each sector is written into its own part of the output buffer.
+        if(dwErrCode == ERROR_SUCCESS && dwSectorsToRead > 1 && hf->bSerialSectors == false && StormWorkPool_GetThreadCount() > 1)
+        {
+            if(pFileEntry->dwFlags & (MPQ_FILE_COMPRESS_MASK | MPQ_FILE_ENCRYPTED))
             {
-                BSWAP_ARRAY32_UNSIGNED(pbInSector, dwRawBytesInThisSector);
-
-                // If we don't know the key, try to detect it by file content
-                if(hf->dwFileKey == 0)
+                if((Range.ErrorCodes = STORM_ALLOC(DWORD, dwSectorsToRead)) != NULL)
                 {
-                    hf->dwFileKey = DetectFileKeyByContent(pbInSector, dwBytesInThisSector, hf->dwDataSize);
-                    if(hf->dwFileKey == 0)
-                    {
-                        dwErrCode = ERROR_UNKNOWN_FILE_KEY;
-                        break;
-                    }
+                    StormWorkPool_Run(dwSectorsToRead, ReadMpqSectorWorker, &Range);
                 }
-
-                DecryptMpqBlock(pbInSector, dwRawBytesInThisSector, hf->dwFileKey + dwIndex);
-                BSWAP_ARRAY32_UNSIGNED(pbInSector, dwRawBytesInThisSector);
             }
+        }
 
-            // If the file has sector CRC check turned on, perform it
-            if(hf->bCheckSectorCRCs && hf->SectorChksums != NULL)
-            {
-                DWORD dwAdlerExpected = hf->SectorChksums[dwIndex];
-                DWORD dwAdlerValue = 0;
-
-                // We can only check sector CRC when it's not zero
-                // Neither can we check it if it's 0xFFFFFFFF.
-                if(dwAdlerExpected != 0 && dwAdlerExpected != 0xFFFFFFFF)
-                {
-                    dwAdlerValue = adler32(0, pbInSector, dwRawBytesInThisSector);
-                    if(dwAdlerValue != dwAdlerExpected)
-                    {
-                        dwErrCode = ERROR_CHECKSUM_ERROR;
-                        break;
-                    }
-                }
-            }
+        // Now we have to decrypt and decompress all file sectors that have been loaded.
+        // If the sectors have already been processed in parallel, only collect the results.
+        for(DWORD i = 0; i < dwSectorsToRead && dwErrCode == ERROR_SUCCESS; i++)
+        {
+            GetSectorInRange(&Range, i, &pbOutSector, &dwBytesInThisSector, &pbInSector, &dwRawBytesInThisSector);
 
-            // If the sector is really compressed, decompress it.
-            // WARNING : Some sectors may not be compressed, it can be determined only
-            // by comparing uncompressed and compressed size !!!
-            if(dwRawBytesInThisSector < dwBytesInThisSector)
-            {
-                if(dwRawBytesInThisSector != 0)
-                {
-                    int cbOutSector = dwBytesInThisSector;
-                    int cbInSector = dwRawBytesInThisSector;
-                    int nResult = 0;
-
-                    // Is the file compressed by Blizzard's multiple compression ?
-                    if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS)
-                    {
-                        // Remember the last used compression
-                        hf->dwCompression0 = pbInSector[0];
-
-                        // Decompress the data. We need to perform MPQ-specific decompression,
-                        // as multiple Blizzard games may have their own decompression tables
-                        // and even decompression methods.
-                        nResult = SCompDecompressX(ha, pbOutSector, &cbOutSector, pbInSector, cbInSector);
-                    }
-
-                    // Is the file compressed by PKWARE Data Compression Library ?
-                    else if(pFileEntry->dwFlags & MPQ_FILE_IMPLODE)
-                    {
-                        nResult = SCompExplode(pbOutSector, &cbOutSector, pbInSector, cbInSector);
-                    }
-
-                    // Did the decompression fail ?
-                    if(nResult == 0)
-                    {
-                        dwErrCode = ERROR_FILE_CORRUPT;
-                        break;
-                    }
-
-                    // Special case (MPQ_2024_v1_300TK2.09p.w3x, file File00010254.blp):
-                    // Extracted less than required. Fill the rest with zeros
-                    if((DWORD)(cbOutSector) < dwBytesInThisSector)
-                    {
-                        memset(pbOutSector + cbOutSector, 0, dwBytesInThisSector - cbOutSector);
-                    }
-                }
-                else
-                {
-                    memset(pbOutSector, 0, dwBytesInThisSector);
-                }
-            }
+            // Process the sector or retrieve the result of the parallel processing
+            if(Range.ErrorCodes == NULL)
+                dwErrCode = ReadMpqSector(hf, dwSectorIndex + i, pbOutSector, dwBytesInThisSector, pbInSector, dwRawBytesInThisSector);
             else
-            {
-                if(pbOutSector != pbInSector)
-                    memcpy(pbOutSector, pbInSector, dwBytesInThisSector);
-            }
+                dwErrCode = Range.ErrorCodes[i];
+            if(dwErrCode != ERROR_SUCCESS)
+                break;
+
+            // Remember the last used compression
+            if((pFileEntry->dwFlags & MPQ_FILE_COMPRESS) && dwRawBytesInThisSector != 0 && dwRawBytesInThisSector < dwBytesInThisSector)
+                hf->dwCompression0 = pbInSector[0];
 
-            // Move pointers
-            dwBytesToRead -= dwBytesInThisSector;
-            dwByteOffset += dwBytesInThisSector;
             dwBytesRead += dwBytesInThisSector;
-            pbOutSector += dwBytesInThisSector;
-            pbInSector += dwRawBytesInThisSector;
-            dwSectorsDone++;
         }
+
+        // Free the array of error codes
+        if(Range.ErrorCodes != NULL)
+            STORM_FREE(Range.ErrorCodes);
     }
     else
     {
@@ -236,6 +580,92 @@ static DWORD ReadMpqSectors(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset,
     return dwErrCode;
 }
 
+// Loads a run of sectors that are not in the sector cache and stores them to the cache
+static DWORD ReadMpqSectorRun(TMPQFile * hf, DWORD dwFileIndex, LPBYTE pbRunBuffer, DWORD dwRunOffset, DWORD dwRunBytes, LPDWORD pdwBytesRead)
+{
+    TMPQArchive * ha = hf->ha;
+    DWORD dwRunBytesRead = 0;
+    DWORD dwErrCode;
+
+    // ReadMpqSectors requires whole sectors. The last one is cut by the file size
+    dwRunBytes = ((dwRunBytes + ha->dwSectorSize - 1) / ha->dwSectorSize) * ha->dwSectorSize;
+    dwErrCode = ReadMpqSectors(hf, pbRunBuffer, dwRunOffset, dwRunBytes, &dwRunBytesRead);
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        for(DWORD dwOffset = 0; dwOffset < dwRunBytesRead; dwOffset += ha->dwSectorSize)
+        {
+            DWORD dwBytesInSector = STORMLIB_MIN(ha->dwSectorSize, dwRunBytesRead - dwOffset);
+
+            SectorCache_Store(ha, dwFileIndex, (dwRunOffset + dwOffset) / ha->dwSectorSize, pbRunBuffer + dwOffset, dwBytesInSector);
+        }
+    }
+
+    pdwBytesRead[0] += dwRunBytesRead;
+    return dwErrCode;
+}
+
+// Reads file sectors like ReadMpqSectors, but takes them from the archive sector cache
+// when possible. Consecutive sectors that are not cached are loaded at once.
+static DWORD ReadMpqSectorsCached(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset, DWORD dwBytesToRead, LPDWORD pdwBytesRead)
+{
+    TMPQArchive * ha = hf->ha;
+    LPBYTE pbRunBuffer = pbBuffer;
+    DWORD dwRunOffset = dwByteOffset;
+    DWORD dwRunBytes = 0;
+    DWORD dwFileIndex;
+    DWORD dwBytesRead = 0;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // If there is no cache, just read the sectors
+    if(ha->pSectorCache == NULL)
+        return ReadMpqSectors(hf, pbBuffer, dwByteOffset, dwBytesToRead, pdwBytesRead);
+    dwFileIndex = (DWORD)(hf->pFileEntry - ha->pFileTable);
+
+    // If there is not enough bytes remaining, cut dwBytesToRead
+    if((dwByteOffset + dwBytesToRead) > hf->dwDataSize)
+        dwBytesToRead = hf->dwDataSize - dwByteOffset;
+
+    while(dwBytesToRead != 0)
+    {
+        DWORD dwBytesInSector = STORMLIB_MIN(ha->dwSectorSize, dwBytesToRead);
+
+        if(SectorCache_Load(ha, dwFileIndex, (dwByteOffset / ha->dwSectorSize), pbBuffer, dwBytesInSector))
+        {
+            // Load the sectors that precede the cached one
+            if(dwRunBytes != 0)
+            {
+                dwErrCode = ReadMpqSectorRun(hf, dwFileIndex, pbRunBuffer, dwRunOffset, dwRunBytes, &dwBytesRead);
+                if(dwErrCode != ERROR_SUCCESS)
+                    break;
+                dwRunBytes = 0;
+            }
+            dwBytesRead += dwBytesInSector;
+        }
+        else
+        {
+            // Start a new run of sectors to be loaded or extend the current one
+            if(dwRunBytes == 0)
+            {
+                pbRunBuffer = pbBuffer;
+                dwRunOffset = dwByteOffset;
+            }
+            dwRunBytes += dwBytesInSector;
+        }
+
+        // Move to the next sector
+        dwBytesToRead -= dwBytesInSector;
+        dwByteOffset += dwBytesInSector;
+        pbBuffer += dwBytesInSector;
+    }
+
+    // Load the remaining run of sectors
+    if(dwErrCode == ERROR_SUCCESS && dwRunBytes != 0)
+        dwErrCode = ReadMpqSectorRun(hf, dwFileIndex, pbRunBuffer, dwRunOffset, dwRunBytes, &dwBytesRead);
+
+    *pdwBytesRead = dwBytesRead;
+    return dwErrCode;
+}
+
 static DWORD ReadMpqFileSingleUnit(TMPQFile * hf, void * pvBuffer, DWORD dwFilePos, DWORD dwToRead, LPDWORD pdwBytesRead)
 {
     ULONGLONG RawFilePos = hf->RawFilePos;
@@ -258,6 +688,10 @@ static DWORD ReadMpqFileSingleUnit(TMPQFile * hf, void * pvBuffer, DWORD dwFileP
         RawFilePos += hf->pPatchInfo->dwLength;
     pbRawData = hf->pbFileSector;
 
+    // If the file is in the sector cache, we don't need to load it
+    if(hf->dwSectorOffs != 0 && SectorCache_Load(ha, (DWORD)(pFileEntry - ha->pFileTable), 0, hf->pbFileSector, hf->dwDataSize))
+        hf->dwSectorOffs = 0;
+
     // If the file sector is not loaded yet, do it
     if(hf->dwSectorOffs != 0)
     {
@@ -343,6 +777,10 @@ static DWORD ReadMpqFileSingleUnit(TMPQFile * hf, void * pvBuffer, DWORD dwFileP
         if(pbCompressed != NULL)
             STORM_FREE(pbCompressed);
 
+        // Put the loaded file to the sector cache
+        if(dwErrCode == ERROR_SUCCESS)
+            SectorCache_Store(ha, (DWORD)(pFileEntry - ha->pFileTable), 0, hf->pbFileSector, hf->dwDataSize);
+
         // The file sector is now properly loaded
         hf->dwSectorOffs = 0;
     }
@@ -514,7 +952,7 @@ static DWORD ReadMpqFileSectorFile(TMPQFile * hf, void * pvBuffer, DWORD dwFileP
         if(hf->dwSectorOffs != dwFileSectorPos)
         {
             // Load one MPQ sector into archive buffer
-            dwErrCode = ReadMpqSectors(hf, hf->pbFileSector, dwFileSectorPos, ha->dwSectorSize, &dwBytesInSector);
+            dwErrCode = ReadMpqSectorsCached(hf, hf->pbFileSector, dwFileSectorPos, ha->dwSectorSize, &dwBytesInSector);
             if(dwErrCode != ERROR_SUCCESS)
                 return dwErrCode;
 
@@ -548,7 +986,7 @@ static DWORD ReadMpqFileSectorFile(TMPQFile * hf, void * pvBuffer, DWORD dwFileP
         DWORD dwBlockBytes = dwBytesToRead & ~dwSectorSizeMask;
 
         // Load all sectors to the output buffer
-        dwErrCode = ReadMpqSectors(hf, pbBuffer, dwFileSectorPos, dwBlockBytes, &dwBytesRead);
+        dwErrCode = ReadMpqSectorsCached(hf, pbBuffer, dwFileSectorPos, dwBlockBytes, &dwBytesRead);
         if(dwErrCode != ERROR_SUCCESS)
             return dwErrCode;
 
@@ -568,7 +1006,7 @@ static DWORD ReadMpqFileSectorFile(TMPQFile * hf, void * pvBuffer, DWORD dwFileP
         if(hf->dwSectorOffs != dwFileSectorPos)
         {
             // Load one MPQ sector into archive buffer
-            dwErrCode = ReadMpqSectors(hf, hf->pbFileSector, dwFileSectorPos, ha->dwSectorSize, &dwBytesRead);
+            dwErrCode = ReadMpqSectorsCached(hf, hf->pbFileSector, dwFileSectorPos, ha->dwSectorSize, &dwBytesRead);
             if(dwErrCode != ERROR_SUCCESS)
                 return dwErrCode;
 
@@ -599,6 +1037,10 @@ static DWORD ReadMpqFilePatchFile(TMPQFile * hf, void * pvBuffer, DWORD dwFilePo
     DWORD dwBytesRead = 0;
     DWORD dwErrCode = ERROR_SUCCESS;
 
+    // The patched file may have been cached by a previous open
+    if(dwErrCode == ERROR_SUCCESS && hf->pbFileData == NULL)
+        PatchCache_Load(hf);
+
     // Make sure that the patch file is loaded completely
     if(dwErrCode == ERROR_SUCCESS && hf->pbFileData == NULL)
     {
@@ -623,6 +1065,10 @@ static DWORD ReadMpqFilePatchFile(TMPQFile * hf, void * pvBuffer, DWORD dwFilePo
         // Finalize the patcher structure
         Patch_Finalize(&Patcher);
         dwBytesRead = 0;
+
+        // Remember the patched file for the next open
+        if(dwErrCode == ERROR_SUCCESS && hf->pbFileData != NULL)
+            PatchCache_Store(hf);
     }
 
     // If there is something to read, do it
@@ -772,6 +1218,135 @@ bool WINAPI SFileReadFile(HANDLE hFile, void * pvBuffer, DWORD dwToRead, LPDWORD
     return (dwErrCode == ERROR_SUCCESS);
 }
 
+//-----------------------------------------------------------------------------
+// SFileGetFileDataView
+
+// A view of the whole file data, given by SFileGetFileDataView
+struct TMPQDataView
+{
+    DWORD dwMagic;                              // ID_MPQ_VIEW
+    TMPQArchive * ha;                           // Archive that is kept open while a zero-copy view exists
+    const void * pvData;                        // Pointer to the file data
+
+//  BYTE FileData[file_size];                   // Followed by the file data, if the view is not zero-copy
+};
+
+// Returns the mapped file data if the file is stored in one piece
+// (not compressed, not encrypted, not patched) in a memory-mapped archive
+static const void * GetMappedFileData(TMPQFile * hf)
+{
+    TFileEntry * pFileEntry = hf->pFileEntry;
+
+    // Local files, patched files and MPK archives are not supported
+    if(hf->pStream != NULL || hf->hfPatch != NULL || pFileEntry == NULL || hf->ha->dwSubType == MPQ_SUBTYPE_MPK)
+        return NULL;
+
+    // The file data must be stored as-is
+    if(pFileEntry->dwFlags & (MPQ_FILE_COMPRESS_MASK | MPQ_FILE_ENCRYPTED | MPQ_FILE_PATCH_FILE))
+        return NULL;
+    if(pFileEntry->dwCmpSize < hf->dwDataSize)
+        return NULL;
+
+    return FileStream_GetMappedData(hf->ha->pStream, hf->RawFilePos, hf->dwDataSize);
+}
+
+bool WINAPI SFileGetFileDataView(HANDLE hFile, const void ** ppvData, LPDWORD pcbData, HANDLE * phView)
+{
+    TMPQDataView * pView;
+    const void * pvMappedData = NULL;
+    TMPQFile * hf;
+    DWORD dwFilePos;
+    DWORD dwFileSize;
+    DWORD dwBytesRead = 0;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Check valid parameters
+    if((hf = IsValidFileHandle(hFile)) == NULL)
+    {
+        SErrSetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    if(ppvData == NULL || pcbData == NULL || phView == NULL)
+    {
+        SErrSetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Get the file size
+    if((dwFileSize = SFileGetFileSize(hFile, NULL)) == SFILE_INVALID_SIZE)
+        return false;
+
+    // If the file is stored as-is in a mapped archive, we give the pointer to the mapped view.
+    // Otherwise, the file data are loaded into a buffer that follows the view structure
+    if(hf->pStream == NULL)
+        pvMappedData = GetMappedFileData(hf);
+    pView = (TMPQDataView *)STORM_ALLOC(BYTE, sizeof(TMPQDataView) + ((pvMappedData == NULL) ? dwFileSize : 0));
+    if(pView == NULL)
+    {
+        SErrSetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+
+    pView->dwMagic = ID_MPQ_VIEW;
+    pView->ha = NULL;
+    pView->pvData = (pvMappedData != NULL) ? pvMappedData : (pView + 1);
+
+    // Load the file data. Keep the file position as it was
+    if(pvMappedData == NULL && dwFileSize != 0)
+    {
+        dwFilePos = SFileSetFilePointer(hFile, 0, NULL, FILE_CURRENT);
+        SFileSetFilePointer(hFile, 0, NULL, FILE_BEGIN);
+        if(!SFileReadFile(hFile, pView + 1, dwFileSize, &dwBytesRead, NULL))
+            dwErrCode = SErrGetLastError();
+        SFileSetFilePointer(hFile, dwFilePos, NULL, FILE_BEGIN);
+    }
+
+    if(dwErrCode != ERROR_SUCCESS)
+    {
+        STORM_FREE(pView);
+        SErrSetLastError(dwErrCode);
+        return false;
+    }
+
+    // A zero-copy view holds a reference to the archive, like an open file.
+    // That keeps the archive, including the mapped view, alive until the view is released
+    if(pvMappedData != NULL)
+    {
+        pView->ha = hf->ha;
+        StormLock_Enter(&pView->ha->Lock);
+        pView->ha->dwFileCount++;
+        StormLock_Leave(&pView->ha->Lock);
+    }
+
+    // Give the view to the caller
+    ppvData[0] = pView->pvData;
+    pcbData[0] = dwFileSize;
+    phView[0] = (HANDLE)pView;
+    return true;
+}
+
+bool WINAPI SFileReleaseFileDataView(HANDLE hView)
+{
+    TMPQDataView * pView = (TMPQDataView *)hView;
+
+    // Check the view handle
+    if(pView == NULL || pView->dwMagic != ID_MPQ_VIEW)
+    {
+        SErrSetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    // Release the archive reference. This may close the archive
+    if(pView->ha != NULL)
+        DereferenceArchiveFiles(pView->ha);
+
+    // Free the view
+    pView->dwMagic = 0;
+    STORM_FREE(pView);
+    return true;
+}
+
 //-----------------------------------------------------------------------------
 // SFileGetFileArchive
 
@@ -938,3 +1513,31 @@ DWORD WINAPI SFileSetFilePointer(HANDLE hFile, LONG lFilePos, LONG * plFilePosHi
         *plFilePosHigh = (LONG)(NewPosition >> 32);
     return (DWORD)NewPosition;
 }
+
+//-----------------------------------------------------------------------------
+// Sets the size of the archive-wide cache of decompressed file sectors.
+//
+//   hMpq       - Handle of an open archive
+//   CacheSize  - Maximum size of the cached data, in bytes. 0 disables the cache.
+
+bool WINAPI SFileSetArchiveCacheSize(HANDLE hMpq, ULONGLONG CacheSize)
+{
+    TMPQArchive * ha;
+    DWORD dwErrCode;
+
+    // Check the archive handle
+    if((ha = IsValidMpqHandle(hMpq)) == NULL)
+    {
+        SErrSetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    // Don't allow more than the address space on 32-bit platforms
+    if(CacheSize > (size_t)(-1))
+        CacheSize = (size_t)(-1);
+
+    dwErrCode = SectorCache_SetSize(ha, (size_t)CacheSize);
+    if(dwErrCode != ERROR_SUCCESS)
+        SErrSetLastError(dwErrCode);
+    return (dwErrCode == ERROR_SUCCESS);
+}
@@ -20,7 +20,8 @@
 //-----------------------------------------------------------------------------
 // Local defines
 
-#define MPQ_DIGEST_UNIT_SIZE      0x10000
+#define MPQ_DIGEST_UNIT_SIZE      0x100000      // Size of one of the two buffers for hashing the signed data
+#define VERIFY_BUFFER_SIZE        0x100000      // Size of the read buffer for verifying whole files
 
 //-----------------------------------------------------------------------------
 // Known Blizzard public keys
@@ -180,79 +181,224 @@ static void CalculateArchiveRange(
     FileStream_GetSize(ha->pStream, &pSI->EndOfFile);
 }
 
-static bool CalculateMpqHashMd5(
+// Passes the buffers of the signed data to the hashing function
+typedef void (*MPQ_DIGEST_ROUTINE)(void * pvHashState, LPBYTE pbData, DWORD cbData);
+
+// Double-buffered reader of the signed data. A helper thread loads the next
+// buffer while the current one is being hashed, so the hashing overlaps the I/O
+struct TMpqDigestReader
+{
+    TMPQArchive * ha;                       // The archive being read
+    LPBYTE Buffers[2];                      // The two buffers, each MPQ_DIGEST_UNIT_SIZE bytes
+    DWORD Lengths[2];                       // Number of bytes loaded to each buffer (0 = the buffer is free)
+    ULONGLONG ReadPos;                      // Position of the next read
+    ULONGLONG EndData;                      // End of the signed data
+    DWORD dwErrCode;                        // Error code of the failed read
+    bool bStop;                             // Set when the hashing thread doesn't need more data
+    STORM_LOCK Lock;                        // Guards the buffer lengths, the error code and the stop flag
+    STORM_COND Cond;                        // Signalled when a buffer is loaded or freed
+};
+
+static void DigestReaderThread(void * pvParam)
+{
+    TMpqDigestReader * pReader = (TMpqDigestReader *)pvParam;
+    ULONGLONG ByteOffset;
+    DWORD dwIndex = 0;
+    DWORD dwToRead;
+    bool bResult;
+
+    StormLock_Enter(&pReader->Lock);
+    while(pReader->ReadPos < pReader->EndData && pReader->dwErrCode == ERROR_SUCCESS && pReader->bStop == false)
+    {
+        // Wait until the buffer is hashed
+        if(pReader->Lengths[dwIndex] != 0)
+        {
+            StormCond_Wait(&pReader->Cond, &pReader->Lock);
+            continue;
+        }
+
+        // Get the number of bytes to read
+        ByteOffset = pReader->ReadPos;
+        dwToRead = MPQ_DIGEST_UNIT_SIZE;
+        if((pReader->EndData - ByteOffset) < MPQ_DIGEST_UNIT_SIZE)
+            dwToRead = (DWORD)(pReader->EndData - ByteOffset);
+        StormLock_Leave(&pReader->Lock);
+
+        // Load the buffer without holding the lock
+        bResult = FileStream_Read(pReader->ha->pStream, &ByteOffset, pReader->Buffers[dwIndex], dwToRead);
+
+        // Pass the buffer to the hashing thread
+        StormLock_Enter(&pReader->Lock);
+        if(bResult)
+        {
+            pReader->Lengths[dwIndex] = dwToRead;
+            pReader->ReadPos += dwToRead;
+            dwIndex ^= 1;
+        }
+        else
+        {
+            pReader->dwErrCode = ERROR_CAN_NOT_COMPLETE;
+        }
+        StormCond_WakeAll(&pReader->Cond);
+    }
+    StormLock_Leave(&pReader->Lock);
+}
+
+// Reads the signed data (pSI->BeginMpqData to pSI->EndMpqData) and passes them
+// to the hashing function. If bZeroSignature is true, the weak signature is zeroed
+static bool CalculateMpqDigest(
     TMPQArchive * ha,
     PMPQ_SIGNATURE_INFO pSI,
-    LPBYTE pMd5Digest)
+    bool bZeroSignature,
+    MPQ_DIGEST_ROUTINE PfnDigest,
+    void * pvHashState)
 {
-    hash_state md5_ctx;
+    TMpqDigestReader Reader;
+    STORM_THREAD ReaderThread;
+    ULONGLONG StartTime = StormGetTickCount();
     ULONGLONG BeginBuffer;
     ULONGLONG EndBuffer;
-    LPBYTE pbDigestBuffer = NULL;
+    DWORD dwIndex = 0;
+    bool bThreadStarted = false;
 
-    // Allocate buffer for creating the MPQ digest.
-    pbDigestBuffer = STORM_ALLOC(BYTE, MPQ_DIGEST_UNIT_SIZE);
-    if(pbDigestBuffer == NULL)
+    // Allocate both buffers for creating the MPQ digest.
+    memset(&Reader, 0, sizeof(TMpqDigestReader));
+    Reader.Buffers[0] = STORM_ALLOC(BYTE, MPQ_DIGEST_UNIT_SIZE * 2);
+    if(Reader.Buffers[0] == NULL)
         return false;
-
-    // Initialize the MD5 hash state
-    md5_init(&md5_ctx);
+    Reader.Buffers[1] = Reader.Buffers[0] + MPQ_DIGEST_UNIT_SIZE;
+    Reader.ha = ha;
+    Reader.ReadPos = pSI->BeginMpqData;
+    Reader.EndData = pSI->EndMpqData;
+    StormLock_Init(&Reader.Lock);
+    StormCond_Init(&Reader.Cond);
+
+    // Start the reader thread, unless the data fit into one buffer.
+    // If the thread can't be created, the data are read and hashed alternately
+    if(pSI->BeginMpqData + MPQ_DIGEST_UNIT_SIZE < pSI->EndMpqData)
+        bThreadStarted = StormThread_Create(&ReaderThread, DigestReaderThread, &Reader);
 
     // Set the byte offset of begin of the data
     BeginBuffer = pSI->BeginMpqData;
 
     // Create the digest
-    for(;;)
+    while(BeginBuffer < pSI->EndMpqData)
     {
-        ULONGLONG BytesRemaining;
+        LPBYTE pbDigestBuffer = Reader.Buffers[dwIndex];
         LPBYTE pbSigBegin = NULL;
         LPBYTE pbSigEnd = NULL;
         DWORD dwToRead = MPQ_DIGEST_UNIT_SIZE;
 
-        // Check the number of bytes remaining
-        BytesRemaining = pSI->EndMpqData - BeginBuffer;
-        if(BytesRemaining < MPQ_DIGEST_UNIT_SIZE)
-            dwToRead = (DWORD)BytesRemaining;
-        if(dwToRead == 0)
-            break;
-
-        // Read the next chunk
-        if(!FileStream_Read(ha->pStream, &BeginBuffer, pbDigestBuffer, dwToRead))
+        // Wait for the reader thread to load the buffer
+        if(bThreadStarted)
         {
-            STORM_FREE(pbDigestBuffer);
-            return false;
+            StormLock_Enter(&Reader.Lock);
+            while(Reader.Lengths[dwIndex] == 0 && Reader.dwErrCode == ERROR_SUCCESS)
+                StormCond_Wait(&Reader.Cond, &Reader.Lock);
+            dwToRead = Reader.Lengths[dwIndex];
+            StormLock_Leave(&Reader.Lock);
+        }
+        else
+        {
+            // Check the number of bytes remaining
+            if((pSI->EndMpqData - BeginBuffer) < MPQ_DIGEST_UNIT_SIZE)
+                dwToRead = (DWORD)(pSI->EndMpqData - BeginBuffer);
+
+            // Read the next chunk
+            if(!FileStream_Read(ha->pStream, &BeginBuffer, pbDigestBuffer, dwToRead))
+                dwToRead = 0;
         }
 
+        // Stop on read error
+        if(dwToRead == 0)
+            break;
+
         // Move the current byte offset
         EndBuffer = BeginBuffer + dwToRead;
 
-        // Check if the signature is within the loaded digest
-        if(BeginBuffer <= pSI->BeginExclude && pSI->BeginExclude < EndBuffer)
-            pbSigBegin = pbDigestBuffer + (size_t)(pSI->BeginExclude - BeginBuffer);
-        if(BeginBuffer <= pSI->EndExclude && pSI->EndExclude < EndBuffer)
-            pbSigEnd = pbDigestBuffer + (size_t)(pSI->EndExclude - BeginBuffer);
-
         // Zero the part that belongs to the signature
-        if(pbSigBegin != NULL || pbSigEnd != NULL)
+        if(bZeroSignature)
         {
-            if(pbSigBegin == NULL)
-                pbSigBegin = pbDigestBuffer;
-            if(pbSigEnd == NULL)
-                pbSigEnd = pbDigestBuffer + dwToRead;
+            // Check if the signature is within the loaded digest
+            if(BeginBuffer <= pSI->BeginExclude && pSI->BeginExclude < EndBuffer)
+                pbSigBegin = pbDigestBuffer + (size_t)(pSI->BeginExclude - BeginBuffer);
+            if(BeginBuffer <= pSI->EndExclude && pSI->EndExclude < EndBuffer)
+                pbSigEnd = pbDigestBuffer + (size_t)(pSI->EndExclude - BeginBuffer);
 
-            memset(pbSigBegin, 0, (pbSigEnd - pbSigBegin));
+            if(pbSigBegin != NULL || pbSigEnd != NULL)
+            {
+                if(pbSigBegin == NULL)
+                    pbSigBegin = pbDigestBuffer;
+                if(pbSigEnd == NULL)
+                    pbSigEnd = pbDigestBuffer + dwToRead;
+
+                memset(pbSigBegin, 0, (pbSigEnd - pbSigBegin));
+            }
         }
 
         // Pass the buffer to the hashing function
-        md5_process(&md5_ctx, pbDigestBuffer, dwToRead);
+        PfnDigest(pvHashState, pbDigestBuffer, dwToRead);
+
+        // Give the buffer back to the reader thread
+        if(bThreadStarted)
+        {
+            StormLock_Enter(&Reader.Lock);
+            Reader.Lengths[dwIndex] = 0;
+            StormCond_WakeAll(&Reader.Cond);
+            StormLock_Leave(&Reader.Lock);
+        }
 
         // Move pointers
-        BeginBuffer += dwToRead;
+        BeginBuffer = EndBuffer;
+        dwIndex ^= 1;
+    }
+
+    // Stop the reader thread
+    if(bThreadStarted)
+    {
+        StormLock_Enter(&Reader.Lock);
+        Reader.bStop = true;
+        StormCond_WakeAll(&Reader.Cond);
+        StormLock_Leave(&Reader.Lock);
+        StormThread_Wait(ReaderThread);
     }
 
+    // Remember the amount of hashed data and the time for SFileGetFileInfo
+    ha->SignatureBytes = BeginBuffer - pSI->BeginMpqData;
+    ha->SignatureTime = StormGetTickCount() - StartTime;
+
+    StormCond_Free(&Reader.Cond);
+    StormLock_Free(&Reader.Lock);
+    STORM_FREE(Reader.Buffers[0]);
+    return (BeginBuffer >= pSI->EndMpqData);
+}
+
+static void DigestMd5(void * pvHashState, LPBYTE pbData, DWORD cbData)
+{
+    md5_process((hash_state *)pvHashState, pbData, cbData);
+}
+
+static void DigestSha1(void * pvHashState, LPBYTE pbData, DWORD cbData)
+{
+    sha1_process((hash_state *)pvHashState, pbData, cbData);
+}
+
+static bool CalculateMpqHashMd5(
+    TMPQArchive * ha,
+    PMPQ_SIGNATURE_INFO pSI,
+    LPBYTE pMd5Digest)
+{
+    hash_state md5_ctx;
+
+    // Initialize the MD5 hash state
+    md5_init(&md5_ctx);
+
+    // Create the digest
+    if(!CalculateMpqDigest(ha, pSI, true, DigestMd5, &md5_ctx))
+        return false;
+
     // Finalize the MD5 hash
     md5_done(&md5_ctx, pMd5Digest);
-    STORM_FREE(pbDigestBuffer);
     return true;
 }
 
@@ -282,49 +428,16 @@ static bool CalculateMpqHashSha1(
     unsigned char * sha1_tail1,
     unsigned char * sha1_tail2)
 {
-    ULONGLONG BeginBuffer;
     hash_state sha1_state_temp;
     hash_state sha1_state;
-    LPBYTE pbDigestBuffer = NULL;
     char szPlainName[MAX_PATH];
 
-    // Allocate buffer for creating the MPQ digest.
-    pbDigestBuffer = STORM_ALLOC(BYTE, MPQ_DIGEST_UNIT_SIZE);
-    if(pbDigestBuffer == NULL)
-        return false;
-
     // Initialize SHA1 state structure
     sha1_init(&sha1_state);
 
-    // Calculate begin of data to be hashed
-    BeginBuffer = pSI->BeginMpqData;
-
     // Create the digest
-    for(;;)
-    {
-        ULONGLONG BytesRemaining;
-        DWORD dwToRead = MPQ_DIGEST_UNIT_SIZE;
-
-        // Check the number of bytes remaining
-        BytesRemaining = pSI->EndMpqData - BeginBuffer;
-        if(BytesRemaining < MPQ_DIGEST_UNIT_SIZE)
-            dwToRead = (DWORD)BytesRemaining;
-        if(dwToRead == 0)
-            break;
-
-        // Read the next chunk
-        if(!FileStream_Read(ha->pStream, &BeginBuffer, pbDigestBuffer, dwToRead))
-        {
-            STORM_FREE(pbDigestBuffer);
-            return false;
-        }
-
-        // Pass the buffer to the hashing function
-        sha1_process(&sha1_state, pbDigestBuffer, dwToRead);
-
-        // Move pointers
-        BeginBuffer += dwToRead;
-    }
+    if(!CalculateMpqDigest(ha, pSI, false, DigestSha1, &sha1_state))
+        return false;
 
     // Add all three known tails and generate three hashes
     memcpy(&sha1_state_temp, &sha1_state, sizeof(hash_state));
@@ -338,9 +451,6 @@ static bool CalculateMpqHashSha1(
     memcpy(&sha1_state_temp, &sha1_state, sizeof(hash_state));
     AddTailToSha1(&sha1_state_temp, "ARCHIVE");
     sha1_done(&sha1_state_temp, sha1_tail2);
-
-    // Finalize the MD5 hash
-    STORM_FREE(pbDigestBuffer);
     return true;
 }
 
@@ -353,7 +463,8 @@ static DWORD VerifyRawMpqData(
     LPBYTE pbDataChunk;
     LPBYTE pbMD5Array1;                 // Calculated MD5 array
     LPBYTE pbMD5Array2;                 // MD5 array loaded from the MPQ
-    DWORD dwBytesInChunk;
+    DWORD dwBytesToRead;
+    DWORD dwChunksPerRead;
     DWORD dwChunkCount;
     DWORD dwChunkSize = ha->pHeader->dwRawChunkSize;
     DWORD dwMD5Size;
@@ -368,8 +479,12 @@ static DWORD VerifyRawMpqData(
     dwChunkCount = ((dwDataSize - 1) / dwChunkSize) + 1;
     dwMD5Size = dwChunkCount * MD5_DIGEST_SIZE;
 
-    // Allocate space for data chunk and for the MD5 array
-    pbDataChunk = STORM_ALLOC(BYTE, dwChunkSize);
+    // Read as many chunks at once as fit into the verify buffer
+    dwChunksPerRead = (dwChunkSize < VERIFY_BUFFER_SIZE) ? (VERIFY_BUFFER_SIZE / dwChunkSize) : 1;
+    dwChunksPerRead = STORMLIB_MIN(dwChunksPerRead, dwChunkCount);
+
+    // Allocate space for data chunks and for the MD5 array
+    pbDataChunk = STORM_ALLOC(BYTE, dwChunksPerRead * dwChunkSize);
     if(pbDataChunk == NULL)
         return ERROR_NOT_ENOUGH_MEMORY;
 
@@ -384,25 +499,25 @@ static DWORD VerifyRawMpqData(
     {
         LPBYTE pbMD5 = pbMD5Array1;
 
-        for(DWORD i = 0; i < dwChunkCount; i++)
+        for(DWORD i = 0; i < dwChunkCount; i += dwChunksPerRead)
         {
-            // Get the number of bytes in the chunk
-            dwBytesInChunk = STORMLIB_MIN(dwChunkSize, dwDataSize);
+            // Get the number of bytes in the chunks
+            dwBytesToRead = STORMLIB_MIN(dwChunksPerRead * dwChunkSize, dwDataSize);
 
-            // Read the data chunk
-            if(!FileStream_Read(ha->pStream, &DataOffset, pbDataChunk, dwBytesInChunk))
+            // Read the data chunks
+            if(!FileStream_Read(ha->pStream, &DataOffset, pbDataChunk, dwBytesToRead))
             {
                 dwErrCode = ERROR_FILE_CORRUPT;
                 break;
             }
 
-            // Calculate MD5
-            CalculateDataBlockHash(pbDataChunk, dwBytesInChunk, pbMD5);
+            // Calculate MD5 of each chunk
+            CalculateDataBlockHashes(pbDataChunk, dwBytesToRead, dwChunkSize, pbMD5);
+            pbMD5 += ((dwBytesToRead - 1) / dwChunkSize + 1) * MD5_DIGEST_SIZE;
 
-            // Move pointers and offsets
-            DataOffset += dwBytesInChunk;
-            dwDataSize -= dwBytesInChunk;
-            pbMD5 += MD5_DIGEST_SIZE;
+            // Move offsets
+            DataOffset += dwBytesToRead;
+            dwDataSize -= dwBytesToRead;
         }
     }
 
@@ -554,6 +669,122 @@ static DWORD VerifyStrongSignature(
     return ERROR_STRONG_SIGNATURE_ERROR;
 }
 
+// Reads the entire open file and verifies its sector CRCs, CRC32 and MD5
+static DWORD VerifyFileData(
+    HANDLE hFile,
+    DWORD dwFlags,
+    LPBYTE pbBuffer,
+    DWORD cbBuffer,
+    LPDWORD PtrCrc32,
+    unsigned char * md5)
+{
+    TMPQFile * hf = (TMPQFile *)hFile;
+    TFileEntry * pFileEntry = hf->pFileEntry;
+    hash_state md5_ctx;
+    unsigned char * pFileMd5;
+    DWORD dwVerifyResult = 0;
+    DWORD dwTotalBytes;
+    DWORD dwCrc32;
+
+    // Get the file size
+    dwTotalBytes = SFileGetFileSize(hFile, NULL);
+
+    // Initialize the CRC32 and MD5 contexts
+    md5_init(&md5_ctx);
+    dwCrc32 = crc32(0, Z_NULL, 0);
+
+    // Also turn on sector checksum verification
+    if(dwFlags & SFILE_VERIFY_SECTOR_CRC)
+        hf->bCheckSectorCRCs = true;
+
+    // Go through entire file and update both CRC32 and MD5
+    for(;;)
+    {
+        DWORD dwBytesRead = 0;
+
+        // Read data from file
+        SFileReadFile(hFile, pbBuffer, cbBuffer, &dwBytesRead, NULL);
+        if(dwBytesRead == 0)
+        {
+            if(SErrGetLastError() == ERROR_CHECKSUM_ERROR)
+                dwVerifyResult |= VERIFY_FILE_SECTOR_CRC_ERROR;
+            if(SErrGetLastError() == ERROR_UNKNOWN_FILE_KEY)
+                dwVerifyResult |= VERIFY_FILE_KEY_UNKNOWN;
+            break;
+        }
+
+        // Update CRC32 value
+        if(dwFlags & SFILE_VERIFY_FILE_CRC)
+            dwCrc32 = crc32(dwCrc32, pbBuffer, dwBytesRead);
+
+        // Update MD5 value
+        if(dwFlags & SFILE_VERIFY_FILE_MD5)
+            md5_process(&md5_ctx, pbBuffer, dwBytesRead);
+
+        // Decrement the total size
+        dwTotalBytes -= dwBytesRead;
+    }
+
+    // If the file has sector checksums, indicate it in the flags
+    if(dwFlags & SFILE_VERIFY_SECTOR_CRC)
+    {
+        if((hf->pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC) && hf->SectorChksums != NULL && hf->SectorChksums[0] != 0)
+            dwVerifyResult |= VERIFY_FILE_HAS_SECTOR_CRC;
+    }
+
+    // Check if the entire file has been read
+    // No point in checking CRC32 and MD5 if not
+    // Skip checksum checks if the file has patches
+    if(dwTotalBytes == 0)
+    {
+        // Check CRC32 and MD5 only if there is no patches
+        if(hf->hfPatch == NULL)
+        {
+            // Check if the CRC32 matches.
+            if(dwFlags & SFILE_VERIFY_FILE_CRC)
+            {
+                // Only check the CRC32 if it is valid
+                if(pFileEntry->dwCrc32 != 0)
+                {
+                    dwVerifyResult |= VERIFY_FILE_HAS_CHECKSUM;
+                    if(dwCrc32 != pFileEntry->dwCrc32)
+                        dwVerifyResult |= VERIFY_FILE_CHECKSUM_ERROR;
+                }
+            }
+
+            // Check if MD5 matches
+            if(dwFlags & SFILE_VERIFY_FILE_MD5)
+            {
+                // Patch files have their MD5 saved in the patch info
+                pFileMd5 = (hf->pPatchInfo != NULL) ? hf->pPatchInfo->md5 : pFileEntry->md5;
+                md5_done(&md5_ctx, md5);
+
+                // Only check the MD5 if it is valid
+                if(IsValidMD5(pFileMd5))
+                {
+                    dwVerifyResult |= VERIFY_FILE_HAS_MD5;
+                    if(memcmp(md5, pFileMd5, MD5_DIGEST_SIZE))
+                        dwVerifyResult |= VERIFY_FILE_MD5_ERROR;
+                }
+            }
+        }
+        else
+        {
+            // Patched files are MD5-checked automatically
+            dwVerifyResult |= VERIFY_FILE_HAS_MD5;
+        }
+    }
+    else
+    {
+        // If the file is encrypted by an unknown key, we can't tell whether it's damaged
+        if((dwVerifyResult & VERIFY_FILE_KEY_UNKNOWN) == 0)
+            dwVerifyResult |= VERIFY_READ_ERROR;
+    }
+
+    PtrCrc32[0] = dwCrc32;
+    return dwVerifyResult;
+}
+
 static DWORD VerifyFile(
     HANDLE hMpq,
     const char * szFileName,
@@ -561,15 +792,11 @@ static DWORD VerifyFile(
     char * pMD5,
     DWORD dwFlags)
 {
-    hash_state md5_ctx;
-    unsigned char * pFileMd5;
     unsigned char md5[MD5_DIGEST_SIZE];
     TFileEntry * pFileEntry;
-    TMPQFile * hf;
     BYTE Buffer[0x1000];
     HANDLE hFile = NULL;
     DWORD dwVerifyResult = 0;
-    DWORD dwTotalBytes = 0;
     DWORD dwCrc32 = 0;
 
     //
@@ -612,99 +839,7 @@ static DWORD VerifyFile(
     // Attempt to open the file
     if(SFileOpenFileEx(hMpq, szFileName, SFILE_OPEN_FROM_MPQ, &hFile))
     {
-        // Get the file size
-        hf = (TMPQFile *)hFile;
-        pFileEntry = hf->pFileEntry;
-        dwTotalBytes = SFileGetFileSize(hFile, NULL);
-
-        // Initialize the CRC32 and MD5 contexts
-        md5_init(&md5_ctx);
-        dwCrc32 = crc32(0, Z_NULL, 0);
-
-        // Also turn on sector checksum verification
-        if(dwFlags & SFILE_VERIFY_SECTOR_CRC)
-            hf->bCheckSectorCRCs = true;
-
-        // Go through entire file and update both CRC32 and MD5
-        for(;;)
-        {
-            DWORD dwBytesRead = 0;
-
-            // Read data from file
-            SFileReadFile(hFile, Buffer, sizeof(Buffer), &dwBytesRead, NULL);
-            if(dwBytesRead == 0)
-            {
-                if(SErrGetLastError() == ERROR_CHECKSUM_ERROR)
-                    dwVerifyResult |= VERIFY_FILE_SECTOR_CRC_ERROR;
-                break;
-            }
-
-            // Update CRC32 value
-            if(dwFlags & SFILE_VERIFY_FILE_CRC)
-                dwCrc32 = crc32(dwCrc32, Buffer, dwBytesRead);
-
-            // Update MD5 value
-            if(dwFlags & SFILE_VERIFY_FILE_MD5)
-                md5_process(&md5_ctx, Buffer, dwBytesRead);
-
-            // Decrement the total size
-            dwTotalBytes -= dwBytesRead;
-        }
-
-        // If the file has sector checksums, indicate it in the flags
-        if(dwFlags & SFILE_VERIFY_SECTOR_CRC)
-        {
-            if((hf->pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC) && hf->SectorChksums != NULL && hf->SectorChksums[0] != 0)
-                dwVerifyResult |= VERIFY_FILE_HAS_SECTOR_CRC;
-        }
-
-        // Check if the entire file has been read
-        // No point in checking CRC32 and MD5 if not
-        // Skip checksum checks if the file has patches
-        if(dwTotalBytes == 0)
-        {
-            // Check CRC32 and MD5 only if there is no patches
-            if(hf->hfPatch == NULL)
-            {
-                // Check if the CRC32 matches.
-                if(dwFlags & SFILE_VERIFY_FILE_CRC)
-                {
-                    // Only check the CRC32 if it is valid
-                    if(pFileEntry->dwCrc32 != 0)
-                    {
-                        dwVerifyResult |= VERIFY_FILE_HAS_CHECKSUM;
-                        if(dwCrc32 != pFileEntry->dwCrc32)
-                            dwVerifyResult |= VERIFY_FILE_CHECKSUM_ERROR;
-                    }
-                }
-
-                // Check if MD5 matches
-                if(dwFlags & SFILE_VERIFY_FILE_MD5)
-                {
-                    // Patch files have their MD5 saved in the patch info
-                    pFileMd5 = (hf->pPatchInfo != NULL) ? hf->pPatchInfo->md5 : pFileEntry->md5;
-                    md5_done(&md5_ctx, md5);
-
-                    // Only check the MD5 if it is valid
-                    if(IsValidMD5(pFileMd5))
-                    {
-                        dwVerifyResult |= VERIFY_FILE_HAS_MD5;
-                        if(memcmp(md5, pFileMd5, MD5_DIGEST_SIZE))
-                            dwVerifyResult |= VERIFY_FILE_MD5_ERROR;
-                    }
-                }
-            }
-            else
-            {
-                // Patched files are MD5-checked automatically
-                dwVerifyResult |= VERIFY_FILE_HAS_MD5;
-            }
-        }
-        else
-        {
-            dwVerifyResult |= VERIFY_READ_ERROR;
-        }
-
+        dwVerifyResult |= VerifyFileData(hFile, dwFlags, Buffer, sizeof(Buffer), &dwCrc32, md5);
         SFileCloseFile(hFile);
     }
     else
@@ -876,6 +1011,172 @@ DWORD SSignFileFinish(TMPQArchive * ha)
     return ERROR_SUCCESS;
 }
 
+//-----------------------------------------------------------------------------
+// Verifying all files of an archive
+
+struct TVerifyFile
+{
+    ULONGLONG ByteOffset;                   // Position of the file in the archive
+    DWORD dwFileIndex;                      // Index of the file in the file table
+};
+
+struct TVerifyWork
+{
+    TMPQArchive * ha;                       // The archive being verified
+    TVerifyFile * pFiles;                   // List of files to verify, sorted by file position
+    DWORD dwFileCount;                      // Number of files to verify
+    DWORD dwNextFile;                       // Index of the next file to be verified
+    DWORD dwFlags;                          // SFILE_VERIFY_XXX
+    DWORD dwErrCode;                        // The first error that prevented verifying the files
+    bool bSerialSectors;                    // If true, the sectors of each file are processed by its verifying thread
+
+    SFILE_VERIFY_CALLBACK VerifyCB;         // Per-file report callback
+    void * pvUserData;                      // User data for the callback
+    SFILE_VERIFY_INFO Info;                 // Report of the last verified file and the totals
+    ULONGLONG StartTime;                    // Time when the verification started, in milliseconds
+
+    STORM_LOCK Lock;                        // Lock for the file list and the report
+};
+
+static int CompareFilesByOffset(const void * pvFile1, const void * pvFile2)
+{
+    const TVerifyFile * pFile1 = (const TVerifyFile *)pvFile1;
+    const TVerifyFile * pFile2 = (const TVerifyFile *)pvFile2;
+
+    if(pFile1->ByteOffset != pFile2->ByteOffset)
+        return (pFile1->ByteOffset < pFile2->ByteOffset) ? -1 : +1;
+    return 0;
+}
+
+// Collects all existing files from the file table and sorts them by their position.
+// Every file entry is verified once, no matter how many hash entries (locales) point to it
+static DWORD CollectFilesToVerify(TVerifyWork * pWork)
+{
+    TMPQArchive * ha = pWork->ha;
+    TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TFileEntry * pFileEntry;
+    DWORD dwFileCount = 0;
+
+    // Allocate the list for the entire file table
+    pWork->pFiles = STORM_ALLOC(TVerifyFile, ha->dwFileTableSize + 1);
+    if(pWork->pFiles == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    // Insert all existing files
+    for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
+    {
+        if(pFileEntry->dwFlags & MPQ_FILE_EXISTS)
+        {
+            pWork->pFiles[dwFileCount].ByteOffset = pFileEntry->ByteOffset;
+            pWork->pFiles[dwFileCount].dwFileIndex = (DWORD)(pFileEntry - ha->pFileTable);
+            pWork->Info.TotalBytes += pFileEntry->dwCmpSize;
+            dwFileCount++;
+        }
+    }
+
+    // Sort the files by their position in the archive
+    qsort(pWork->pFiles, dwFileCount, sizeof(TVerifyFile), CompareFilesByOffset);
+    pWork->dwFileCount = dwFileCount;
+    return ERROR_SUCCESS;
+}
+
+// Verifies one file, as it is stored in the archive. Patches are not applied.
+static DWORD VerifyFileEntry(TVerifyWork * pWork, TFileEntry * pFileEntry, LPBYTE pbBuffer)
+{
+    unsigned char md5[MD5_DIGEST_SIZE];
+    TMPQArchive * ha = pWork->ha;
+    TMPQFile * hf;
+    DWORD dwVerifyResult = 0;
+    DWORD dwCrc32 = 0;
+
+    // If the file's raw MD5 doesn't match, don't bother with more checks
+    if((pWork->dwFlags & SFILE_VERIFY_RAW_MD5) && ha->pHeader->dwRawChunkSize != 0)
+    {
+        dwVerifyResult |= VERIFY_FILE_HAS_RAW_MD5;
+        if(VerifyRawMpqData(ha, pFileEntry->ByteOffset, pFileEntry->dwCmpSize) != ERROR_SUCCESS)
+            return dwVerifyResult | VERIFY_FILE_RAW_MD5_ERROR;
+    }
+
+    // Uncompressed files can't be bigger than the archive (see OpenFileEntry)
+    if((pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK) == 0 && (pFileEntry->dwFileSize > ha->FileSize))
+        return dwVerifyResult | VERIFY_OPEN_ERROR;
+
+    // Create the file handle for this file entry. Opening the file by its pseudo-name
+    // would search the entire hash table for every file
+    if((hf = CreateFileHandle(ha, pFileEntry)) == NULL)
+        return dwVerifyResult | VERIFY_OPEN_ERROR;
+    hf->dwHashIndex = HASH_ENTRY_FREE;
+    hf->bSerialSectors = pWork->bSerialSectors;
+
+    // If we know the file name, calculate the file key from it.
+    // Otherwise, the key is detected when the file is read
+    if((pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED) && pFileEntry->szFileName != NULL)
+        hf->dwFileKey = DecryptFileKey(pFileEntry->szFileName, pFileEntry->ByteOffset, pFileEntry->dwFileSize, pFileEntry->dwFlags);
+
+    dwVerifyResult |= VerifyFileData((HANDLE)hf, pWork->dwFlags, pbBuffer, VERIFY_BUFFER_SIZE, &dwCrc32, md5);
+    SFileCloseFile((HANDLE)hf);
+    return dwVerifyResult;
+}
+
+static void VerifyFilesWorker(void * pvParam, DWORD /* dwItemIndex */)
+{
+    TVerifyWork * pWork = (TVerifyWork *)pvParam;
+    TFileEntry * pFileEntry;
+    TVerifyFile * pFile;
+    LPBYTE pbBuffer;
+    char szPseudoName[MAX_PATH];
+
+    // Allocate the data buffer
+    pbBuffer = STORM_ALLOC(BYTE, VERIFY_BUFFER_SIZE);
+    if(pbBuffer == NULL)
+    {
+        StormLock_Enter(&pWork->Lock);
+        pWork->dwErrCode = (pWork->dwErrCode == ERROR_SUCCESS) ? ERROR_NOT_ENOUGH_MEMORY : pWork->dwErrCode;
+        StormLock_Leave(&pWork->Lock);
+        return;
+    }
+
+    for(;;)
+    {
+        DWORD dwVerifyResult;
+
+        // Take the next file from the list
+        StormLock_Enter(&pWork->Lock);
+        pFile = (pWork->dwNextFile < pWork->dwFileCount) ? &pWork->pFiles[pWork->dwNextFile++] : NULL;
+        StormLock_Leave(&pWork->Lock);
+        if(pFile == NULL)
+            break;
+
+        // Verify the file
+        pFileEntry = pWork->ha->pFileTable + pFile->dwFileIndex;
+        dwVerifyResult = VerifyFileEntry(pWork, pFileEntry, pbBuffer);
+
+        // Update the totals and report the file. The callback is never called from two threads at once
+        StormLock_Enter(&pWork->Lock);
+        if(pFileEntry->szFileName == NULL)
+            StringCreatePseudoFileName(szPseudoName, _countof(szPseudoName), pFile->dwFileIndex, "xxx");
+        pWork->Info.szFileName = (pFileEntry->szFileName != NULL) ? pFileEntry->szFileName : szPseudoName;
+        pWork->Info.dwFileIndex = pFile->dwFileIndex;
+        pWork->Info.dwVerifyResult = dwVerifyResult;
+        pWork->Info.ByteOffset = pFileEntry->ByteOffset;
+        pWork->Info.dwFileSize = pFileEntry->dwFileSize;
+        pWork->Info.dwCompSize = pFileEntry->dwCmpSize;
+        pWork->Info.dwFilesDone++;
+        pWork->Info.BytesRead += pFileEntry->dwCmpSize;
+        pWork->Info.ElapsedMs = StormGetTickCount() - pWork->StartTime;
+        pWork->Info.BytesPerSecond = (pWork->Info.ElapsedMs != 0) ? (pWork->Info.BytesRead * 1000 / pWork->Info.ElapsedMs) : 0;
+        if(dwVerifyResult & VERIFY_FILE_ERROR_MASK)
+            pWork->Info.dwFilesFailed++;
+        if(dwVerifyResult & VERIFY_FILE_KEY_UNKNOWN)
+            pWork->Info.dwFilesSkipped++;
+        if(pWork->VerifyCB != NULL)
+            pWork->VerifyCB(pWork->pvUserData, &pWork->Info);
+        StormLock_Leave(&pWork->Lock);
+    }
+
+    STORM_FREE(pbBuffer);
+}
+
 //-----------------------------------------------------------------------------
 // Public (exported) functions
 
@@ -1020,6 +1321,103 @@ DWORD WINAPI SFileVerifyArchive(HANDLE hMpq)
     return ERROR_NO_SIGNATURE;
 }
 
+//-----------------------------------------------------------------------------
+// SFileVerifyArchiveFiles
+//
+//   hMpq          - Handle of opened MPQ archive
+//   dwFlags       - Combination of SFILE_VERIFY_XXX (what to verify for each file)
+//   dwThreadCount - Maximum number of threads used by this call (0 = no limit).
+//                   The threads are taken from the worker pool (see SFileSetThreadCount).
+//                   With a limit below the pool size, each file is read and decompressed
+//                   by the thread that verifies it, so the call never uses more threads
+//   VerifyCB      - Optional callback, called after each file with its result,
+//                   and once at the end (with NULL file name) with the totals
+//   pvUserData    - User data for the callback
+//
+// All files stored in the archive are verified in the order of their position
+// in the archive. Patches are not applied. If some files fail the verification,
+// the function returns false and the last error is set to ERROR_FILE_CORRUPT.
+
+bool WINAPI SFileVerifyArchiveFiles(
+    HANDLE hMpq,
+    DWORD dwFlags,
+    DWORD dwThreadCount,
+    SFILE_VERIFY_CALLBACK VerifyCB,
+    void * pvUserData)
+{
+    TMPQArchive * ha = IsValidMpqHandle(hMpq);
+    TVerifyWork Work;
+    DWORD dwStreamFlags = 0;
+    DWORD dwWorkerCount;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Check the parameters
+    if(ha == NULL)
+    {
+        SErrSetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    // Prepare the work
+    memset(&Work, 0, sizeof(TVerifyWork));
+    StormLock_Init(&Work.Lock);
+    Work.ha = ha;
+    Work.dwFlags = dwFlags;
+    Work.VerifyCB = VerifyCB;
+    Work.pvUserData = pvUserData;
+    Work.StartTime = StormGetTickCount();
+
+    // Find the files and sort them by their position in the archive
+    dwErrCode = CollectFilesToVerify(&Work);
+    Work.Info.dwFileCount = Work.dwFileCount;
+
+    // Verify the files
+    if(dwErrCode == ERROR_SUCCESS && Work.dwFileCount != 0)
+    {
+        // Determine the number of threads that will verify files
+        dwWorkerCount = StormWorkPool_GetThreadCount();
+        if(dwThreadCount != 0 && dwThreadCount < dwWorkerCount)
+        {
+            Work.bSerialSectors = true;
+            dwWorkerCount = dwThreadCount;
+        }
+        if(dwWorkerCount > Work.dwFileCount)
+            dwWorkerCount = Work.dwFileCount;
+
+        // The archive is read in the order of file positions
+        FileStream_GetFlags(ha->pStream, &dwStreamFlags);
+        FileStream_SetAccessHint(ha->pStream, STREAM_FLAG_SEQUENTIAL);
+
+        StormWorkPool_Run(dwWorkerCount, VerifyFilesWorker, &Work);
+        dwErrCode = Work.dwErrCode;
+
+        FileStream_SetAccessHint(ha->pStream, dwStreamFlags & STREAM_ACCESS_HINT_MASK);
+    }
+
+    // Files that failed the verification
+    if(dwErrCode == ERROR_SUCCESS && Work.Info.dwFilesFailed != 0)
+        dwErrCode = ERROR_FILE_CORRUPT;
+
+    // Final call of the callback
+    if(VerifyCB != NULL)
+    {
+        Work.Info.szFileName = NULL;
+        Work.Info.dwVerifyResult = 0;
+        Work.Info.ElapsedMs = StormGetTickCount() - Work.StartTime;
+        Work.Info.BytesPerSecond = (Work.Info.ElapsedMs != 0) ? (Work.Info.BytesRead * 1000 / Work.Info.ElapsedMs) : 0;
+        VerifyCB(pvUserData, &Work.Info);
+    }
+
+    // Free the work
+    if(Work.pFiles != NULL)
+        STORM_FREE(Work.pFiles);
+    StormLock_Free(&Work.Lock);
+
+    if(dwErrCode != ERROR_SUCCESS)
+        SErrSetLastError(dwErrCode);
+    return (dwErrCode == ERROR_SUCCESS);
+}
+
 // Verifies the archive against the signature
 bool WINAPI SFileSignArchive(HANDLE hMpq, DWORD dwSignatureType)
 {
@@ -60,6 +60,8 @@
 // StormLib private defines
 
 #define ID_MPQ_FILE            0x46494c45     // Used internally for checking TMPQFile ('FILE')
+#define ID_MPQ_VIEW            0x57454956     // Used internally for checking TMPQDataView ('VIEW')
+#define ID_MPQ_BULK_ADD        0x4B4C5542     // Used internally for checking TMPQBulkAdd ('BULK')
 
 // Prevent problems with CRT "min" and "max" functions,
 // as they are not defined on all platforms
@@ -67,6 +69,41 @@
 #define STORMLIB_MAX(a, b) ((a > b) ? a : b)
 #define STORMLIB_UNUSED(p) ((void)(p))
 
+// Hint to the CPU to start loading the cache line with the given address
+#if defined(__GNUC__) || defined(__clang__)
+#define STORMLIB_PREFETCH(ptr) __builtin_prefetch(ptr)
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#define STORMLIB_PREFETCH(ptr) _mm_prefetch((const char *)(ptr), _MM_HINT_T0)
+#else
+#define STORMLIB_PREFETCH(ptr)
+#endif
+
+// SIMD code paths. Functions with these attributes are compiled for the given
+// instruction set and must only be called if the CPU supports it (see StormCpu_GetFeatures).
+// STORMLIB_X86_AVX2 is only defined if the compiler has AVX2 intrinsics
+// (Visual Studio 2012 or newer). Otherwise, only the SSE2 code paths are used
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#if (_MSC_VER >= 1700)
+#include <immintrin.h>
+#define STORMLIB_X86_AVX2
+#else
+#include <emmintrin.h>
+#endif
+#define STORMLIB_X86_SIMD
+#define STORMLIB_TARGET_SSE2
+#define STORMLIB_TARGET_AVX2
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__i386__) || defined(__x86_64__))
+#include <immintrin.h>
+#define STORMLIB_X86_SIMD
+#define STORMLIB_X86_AVX2
+#define STORMLIB_TARGET_SSE2 __attribute__((target("sse2")))
+#define STORMLIB_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Alignment of buffers, file offsets and lengths for direct (unbuffered) file I/O
+#define STORM_DIRECT_IO_ALIGNMENT   0x1000
+
 // Checks for data pointers aligned to 4-byte boundary
 #define STORMLIB_DWORD_ALIGNED(ptr) (((size_t)(ptr) & 0x03) == 0)
 
@@ -291,10 +328,23 @@ size_t UTF8_EncodeCodePoint(DWORD dwCodePoint, LPBYTE Utf8Buffer);
 #define MPQ_HASH_FILE_KEY       0x300
 #define MPQ_HASH_KEY2_MIX       0x400
 
+#define HASH_INDEX_MASK(ha) (ha->pHeader->dwHashTableSize ? (ha->pHeader->dwHashTableSize - 1) : 0)
+
 DWORD HashString(const char * szFileName, DWORD dwHashType);
 DWORD HashStringSlash(const char * szFileName, DWORD dwHashType);
 DWORD HashStringLower(const char * szFileName, DWORD dwHashType);
 
+// All hashes of a file name, calculated in a single pass by HashFileName
+struct TFileNameHash
+{
+    DWORD dwHashIndex;                      // MPQ_HASH_TABLE_INDEX
+    DWORD dwHashCheck1;                     // MPQ_HASH_NAME_A
+    DWORD dwHashCheck2;                     // MPQ_HASH_NAME_B
+    ULONGLONG JenkinsHash;                  // HashStringJenkins (only if requested, otherwise zero)
+};
+
+void  HashFileName(TMPQArchive * ha, const char * szFileName, TFileNameHash & NameHash, bool bJenkinsHash = false);
+
 void  InitializeMpqCryptography();
 
 DWORD GetNearestPowerOfTwo(DWORD dwFileCount);
@@ -315,6 +365,43 @@ bool IsValidMD5(LPBYTE pbMd5);
 bool IsValidSignature(LPBYTE pbSignature);
 bool VerifyDataBlockHash(void * pvDataBlock, DWORD cbDataBlock, LPBYTE expected_md5);
 void CalculateDataBlockHash(void * pvDataBlock, DWORD cbDataBlock, LPBYTE md5_hash);
+void CalculateDataBlockHashes(void * pvDataBlock, DWORD cbDataBlock, DWORD dwChunkSize, LPBYTE md5_array);
+
+//-----------------------------------------------------------------------------
+// Synchronization and thread functions
+
+typedef void (*STORM_THREAD_ROUTINE)(void * pvParam);
+typedef void (*STORM_WORK_ROUTINE)(void * pvParam, DWORD dwItemIndex);
+
+void  StormLock_Init(STORM_LOCK * pLock);
+void  StormLock_Enter(STORM_LOCK * pLock);
+void  StormLock_Leave(STORM_LOCK * pLock);
+void  StormLock_Free(STORM_LOCK * pLock);
+
+void  StormCond_Init(STORM_COND * pCond);
+void  StormCond_Wait(STORM_COND * pCond, STORM_LOCK * pLock);
+void  StormCond_WakeAll(STORM_COND * pCond);
+void  StormCond_Free(STORM_COND * pCond);
+
+bool  StormThread_Create(STORM_THREAD * pThread, STORM_THREAD_ROUTINE PfnThreadRoutine, void * pvParam);
+void  StormThread_Wait(STORM_THREAD Thread);
+DWORD StormThread_GetCpuCount();
+
+ULONGLONG StormGetTickCount();
+
+//-----------------------------------------------------------------------------
+// CPU features used by the SIMD code paths
+
+#define STORM_CPU_FEATURE_SSE2      0x00000001  // SSE2 instructions
+#define STORM_CPU_FEATURE_AVX2      0x00000002  // AVX2 instructions, supported by both CPU and OS
+
+DWORD StormCpu_GetFeatures();
+void  StormCpu_SetFeatureMask(DWORD dwFeatureMask);
+
+DWORD StormWorkPool_Create(DWORD dwThreadCount);
+DWORD StormWorkPool_GetThreadCount();
+void  StormWorkPool_Run(DWORD dwItemCount, STORM_WORK_ROUTINE PfnWorkRoutine, void * pvParam);
+void  StormWorkPool_Free();
 
 //-----------------------------------------------------------------------------
 // Handle validation functions
@@ -335,6 +422,7 @@ bool IsValidHashEntry(TMPQArchive * ha, TMPQHash * pHash);
 
 TMPQHash * FindFreeHashEntry(TMPQArchive * ha, DWORD dwStartIndex, DWORD dwHashCheck1, DWORD dwHashCheck2, LCID lcFileLocale);
 TMPQHash * GetFirstHashEntry(TMPQArchive * ha, const char * szFileName);
+TMPQHash * GetFirstHashEntry(TMPQArchive * ha, const TFileNameHash & NameHash);
 TMPQHash * GetNextHashEntry(TMPQArchive * ha, TMPQHash * pFirstHash, TMPQHash * pPrevHash);
 TMPQHash * AllocateHashEntry(TMPQArchive * ha, TFileEntry * pFileEntry, LCID lcFileLocale);
 
@@ -345,7 +433,12 @@ TMPQBetTable * LoadBetTable(TMPQArchive * ha);
 TMPQBlock * LoadBlockTable(TMPQArchive * ha, bool bDontFixEntries = false);
 TMPQBlock * TranslateBlockTable(TMPQArchive * ha, ULONGLONG * pcbTableSize, bool * pbNeedHiBlockTable);
 
+ULONGLONG GetFileEntryDataEnd(TMPQArchive * ha, TFileEntry * pFileEntry);
 ULONGLONG FindFreeMpqSpace(TMPQArchive * ha);
+ULONGLONG AllocateMpqSpace(TMPQArchive * ha, DWORD dwFileSize, ULONGLONG * PtrReservedEnd);
+void ReleaseMpqSpace(TMPQArchive * ha, ULONGLONG ByteOffset, ULONGLONG EndOffset);
+void ReleaseFileEntrySpace(TMPQArchive * ha, TFileEntry * pFileEntry, ULONGLONG ByteOffset, ULONGLONG EndOffset);
+void ResetMpqSpace(TMPQArchive * ha);
 
 // Functions that load the HET and BET tables
 DWORD CreateHashTable(TMPQArchive * ha, DWORD dwHashTableSize);
@@ -365,7 +458,9 @@ TMPQBetTable * CreateBetTable(DWORD dwMaxFileCount);
 void FreeBetTable(TMPQBetTable * pBetTable);
 
 // Functions for finding files in the file table
+void CalculateNameHashes(TMPQArchive * ha, const char * szFileName, TFileNameHash & NameHash);
 TFileEntry * GetFileEntryLocale(TMPQArchive * ha, const char * szFileName, LCID lcFileLocale, LPDWORD PtrHashIndex = NULL);
+TFileEntry * GetFileEntryLocale(TMPQArchive * ha, const TFileNameHash & NameHash, LCID lcFileLocale, LPDWORD PtrHashIndex = NULL);
 TFileEntry * GetFileEntryExact(TMPQArchive * ha, const char * szFileName, LCID lcFileLocale, LPDWORD PtrHashIndex = NULL);
 
 // Allocates file name in the file entry
@@ -415,6 +510,40 @@ bool DereferenceArchiveFiles(TMPQArchive * ha);
 bool DereferenceArchive(TMPQArchive * ha);
 void FreeFileHandle(TMPQFile *& hf);
 
+//-----------------------------------------------------------------------------
+// Cache of decompressed file sectors (SFileReadFile.cpp)
+
+// One cached sector. The sector data follow the structure
+typedef struct _TSectorCacheEntry
+{
+    struct _TSectorCacheEntry * pNextInBucket;  // Next entry with the same hash
+    struct _TSectorCacheEntry * pPrev;          // Previous entry in the LRU list (more recently used)
+    struct _TSectorCacheEntry * pNext;          // Next entry in the LRU list (less recently used)
+    DWORD dwFileIndex;                          // Index of the file in the file table
+    DWORD dwSectorIndex;                        // Index of the sector in the file
+    DWORD cbData;                               // Size of the decompressed sector data
+} TSectorCacheEntry;
+
+// Cache of decompressed sectors, shared by all file handles of an archive
+struct TMPQSectorCache
+{
+    STORM_LOCK Lock;                            // Guards the cache. File handles may be used by multiple threads
+    TSectorCacheEntry ** Buckets;               // Hash table of the cached entries
+    TSectorCacheEntry * pFirst;                 // The most recently used entry
+    TSectorCacheEntry * pLast;                  // The least recently used entry
+    DWORD dwBucketCount;                        // Number of buckets. Always power of two
+    size_t cbCacheSize;                         // Maximum amount of sector data in the cache
+    size_t cbCacheUsed;                         // Current amount of sector data in the cache
+    ULONGLONG CacheHits;                        // Number of sectors found in the cache
+    ULONGLONG CacheMisses;                      // Number of sectors not found in the cache
+};
+
+DWORD SectorCache_SetSize(TMPQArchive * ha, size_t cbCacheSize);
+bool  SectorCache_Load(TMPQArchive * ha, DWORD dwFileIndex, DWORD dwSectorIndex, void * pvBuffer, DWORD cbBuffer);
+void  SectorCache_Store(TMPQArchive * ha, DWORD dwFileIndex, DWORD dwSectorIndex, const void * pvData, DWORD cbData);
+void  SectorCache_Flush(TMPQArchive * ha);
+void  SectorCache_Free(TMPQArchive * ha);
+
 //-----------------------------------------------------------------------------
 // Patch functions
 
@@ -434,6 +563,36 @@ bool IsIncrementalPatchFile(const void * pvData, DWORD cbData, LPDWORD pdwPatche
 DWORD Patch_InitPatcher(TMPQPatcher * pPatcher, TMPQFile * hf);
 DWORD Patch_Process(TMPQPatcher * pPatcher, TMPQFile * hf);
 void Patch_Finalize(TMPQPatcher * pPatcher);
+void CombinePatchData(LPBYTE pbTarget, const BYTE * pbDiff, const BYTE * pbOld, DWORD cbLength);
+
+// One cached patched file. The file data and the file name follow the structure
+typedef struct _TPatchCacheEntry
+{
+    struct _TPatchCacheEntry * pPrev;           // Previous entry in the LRU list (more recently used)
+    struct _TPatchCacheEntry * pNext;           // Next entry in the LRU list (less recently used)
+    BYTE chain_md5[MD5_DIGEST_SIZE];            // MD5 of the patch chain (MD5s from the patch headers)
+    const char * szFileName;                    // Name of the file
+    DWORD dwNameHash;                           // Hash of the file name, for faster lookup
+    DWORD cbData;                               // Size of the patched file data
+} TPatchCacheEntry;
+
+// Cache of fully patched files, owned by the base archive
+struct TMPQPatchCache
+{
+    STORM_LOCK Lock;                            // Guards the cache. File handles may be used by multiple threads
+    TPatchCacheEntry * pFirst;                  // The most recently used entry
+    TPatchCacheEntry * pLast;                   // The least recently used entry
+    size_t cbCacheSize;                         // Maximum amount of file data in the cache
+    size_t cbCacheUsed;                         // Current amount of file data in the cache
+    ULONGLONG CacheHits;                        // Number of files found in the cache
+    ULONGLONG CacheMisses;                      // Number of files not found in the cache
+};
+
+DWORD PatchCache_SetSize(TMPQArchive * ha, size_t cbCacheSize);
+bool  PatchCache_Load(TMPQFile * hf);
+void  PatchCache_Store(TMPQFile * hf);
+void  PatchCache_Flush(TMPQArchive * ha);
+void  PatchCache_Free(TMPQArchive * ha);
 
 //-----------------------------------------------------------------------------
 // Utility functions
@@ -485,6 +644,13 @@ DWORD SFileAddFile_Finish(
     TMPQFile * hf
     );
 
+// Frees all bulk add handles of the archive that have not been committed yet
+void AbortBulkAdds(TMPQArchive * ha);
+
+// Recovery of an interrupted in-place compacting (SFileCompactArchive.cpp)
+DWORD LoadCompactJournal(TMPQArchive * ha);
+DWORD FinishCompactJournal(TMPQArchive * ha);
+
 //-----------------------------------------------------------------------------
 // Attributes support
 
@@ -188,6 +188,14 @@ extern "C" {
 #define SFILE_OPEN_ANY_LOCALE       0xFFFFFFFE  // Reserved for StormLib internal use
 #define SFILE_OPEN_LOCAL_FILE       0xFFFFFFFF  // Open a local file
 
+// Flags for SFileExtractFiles
+#define SFILE_EXTRACT_DIRECT_IO     0x00000001  // Write the files without the page cache (O_DIRECT, Linux only)
+#define SFILE_EXTRACT_PREALLOCATE   0x00000002  // Reserve the disk space for each file before writing it (Linux only)
+#define SFILE_EXTRACT_STOP_ON_ERROR 0x00000004  // Stop the extraction when a file fails to extract
+
+// Flags for SFilePrefetchArchive
+#define SFILE_PREFETCH_WAIT         0x00000001  // Wait until the prefetch loads the whole archive
+
 // Flags for TMPQArchive::dwFlags. Used internally
 #define MPQ_FLAG_READ_ONLY          0x00000001  // If set, the MPQ has been open for read-only access
 #define MPQ_FLAG_CHANGED            0x00000002  // If set, the MPQ tables have been changed
@@ -207,6 +215,7 @@ extern "C" {
 #define MPQ_FLAG_ATTRIBUTES_NEW     0x00008000  // Set when (attributes) invalidated by InvalidateInternalFiles
 #define MPQ_FLAG_SIGNATURE_NONE     0x00010000  // Set when no (signature) was found in InvalidateInternalFiles
 #define MPQ_FLAG_SIGNATURE_NEW      0x00020000  // Set when (signature) invalidated by InvalidateInternalFiles
+#define MPQ_FLAG_COMPACT_JOURNAL    0x00040000  // Set when the journal of an interrupted in-place compacting has been applied
 
 // Values for TMPQArchive::dwSubType
 #define MPQ_SUBTYPE_MPQ             0x00000000  // The file is a MPQ file (Blizzard games)
@@ -334,6 +343,11 @@ extern "C" {
 #define STREAM_FLAG_READ_ONLY       0x00000100  // Stream is read only
 #define STREAM_FLAG_WRITE_SHARE     0x00000200  // Allow write sharing when open for write
 #define STREAM_FLAG_USE_BITMAP      0x00000400  // If the file has a file bitmap, load it and use it
+#define STREAM_FLAG_SEQUENTIAL      0x00000800  // Hint: the file will be read mostly sequentially (extracting, compacting)
+#define STREAM_FLAG_RANDOM_ACCESS   0x00001000  // Hint: the file will be read at random offsets (serving lookups)
+#define STREAM_ACCESS_HINT_MASK     0x00001800  // Mask for the access hints
+#define STREAM_FLAG_DIRECT_IO       0x00002000  // Write the file without the page cache (O_DIRECT). Only for newly created files on Linux
+#define STREAM_FLAG_VERIFY_BLOCKS   0x00004000  // Verify the MD5 of each block that is read (STREAM_PROVIDER_BLOCK4)
 #define STREAM_OPTIONS_MASK         0x0000FF00  // Mask for stream options
 
 #define STREAM_PROVIDERS_MASK       0x000000FF  // Mask to get stream providers
@@ -378,6 +392,7 @@ extern "C" {
 #define VERIFY_FILE_MD5_ERROR           0x0080  // MD5 check failed
 #define VERIFY_FILE_HAS_RAW_MD5         0x0100  // File has raw data MD5
 #define VERIFY_FILE_RAW_MD5_ERROR       0x0200  // Raw MD5 check failed
+#define VERIFY_FILE_KEY_UNKNOWN         0x0400  // File is encrypted and its key could not be detected. The data have not been verified
 #define VERIFY_FILE_ERROR_MASK      (VERIFY_OPEN_ERROR | VERIFY_READ_ERROR | VERIFY_FILE_SECTOR_CRC_ERROR | VERIFY_FILE_CHECKSUM_ERROR | VERIFY_FILE_MD5_ERROR | VERIFY_FILE_RAW_MD5_ERROR)
 
 // Flags for SFileVerifyRawData (for MPQs version 4.0 or higher)
@@ -483,6 +498,15 @@ typedef enum _SFileInfoClass
     SFileInfoEncryptionKeyRaw,              // Unfixed value of the file key
     SFileInfoCRC32,                         // CRC32 of the file
 
+    // Info classes for archives that were added later. They follow the file classes,
+    // so that the values of the existing classes don't change
+    SFileMpqCacheHits,                      // Number of file sectors found in the sector cache (ULONGLONG)
+    SFileMpqCacheMisses,                    // Number of file sectors not found in the sector cache (ULONGLONG)
+    SFileMpqSignatureBytes,                 // Number of bytes hashed by the last SFileVerifyArchive (ULONGLONG)
+    SFileMpqSignatureSpeed,                 // Hashing speed of the last SFileVerifyArchive, in bytes per second (ULONGLONG)
+    SFileMpqPatchCacheHits,                 // Number of patched files found in the patch cache (ULONGLONG)
+    SFileMpqPatchCacheMisses,               // Number of patched files not found in the patch cache (ULONGLONG)
+
     SFileInfoInvalid = 0xFFF,               // Invalid file info class
 } SFileInfoClass;
 
@@ -502,6 +526,9 @@ typedef void (WINAPI * SFILE_COMPACT_CALLBACK)(void * pvUserData, DWORD dwWorkTy
 
 typedef struct TFileStream TFileStream;
 typedef struct TMPQBits TMPQBits;
+typedef struct TMPQSectorCache TMPQSectorCache;
+typedef struct TMPQPatchCache TMPQPatchCache;
+typedef struct TMPQBulkAdd TMPQBulkAdd;
 
 //-----------------------------------------------------------------------------
 // Structures related to MPQ format
@@ -827,6 +854,13 @@ typedef struct _TMPQNameCache
 
 } TMPQNameCache;
 
+// Structure for a range of free space in the MPQ
+typedef struct _TMPQExtent
+{
+    ULONGLONG ByteOffset;                       // Begin of the free space (relative to the MPQ header)
+    ULONGLONG EndOffset;                        // End of the free space (relative to the MPQ header)
+} TMPQExtent;
+
 // Archive handle structure
 typedef struct _TMPQArchive
 {
@@ -870,14 +904,30 @@ typedef struct _TMPQArchive
 
     DWORD          dwFileCount;                 // Number of open files
     DWORD          dwRefCount;                  // Number of references
+    STORM_LOCK     Lock;                        // Guards the archive data that are lazily updated by file handles
+    char        ** pRetiredNames;               // Pseudo names replaced by real ones. Other threads may still read them, so they are freed on close
+    DWORD          dwRetiredNames;              // Number of entries in pRetiredNames
+    DWORD          dwRetiredNamesMax;           // Allocated number of entries in pRetiredNames
+    TMPQSectorCache * pSectorCache;             // Cache of decompressed file sectors (NULL if not enabled)
+    TMPQPatchCache * pPatchCache;               // Cache of patched files (NULL if not enabled)
 
     SFILE_ADDFILE_CALLBACK pfnAddFileCB;        // Callback function for adding files
     void         * pvAddFileUserData;           // User data thats passed to the callback
+    ULONGLONG      BulkAddPos;                  // Position of the next file added by SFileCommitBulkAdd (0 if no bulk add is running)
+    DWORD          dwBulkAddFileIndex;          // During SFileCommitBulkAdd, file entries below this index are known to be used
+    TMPQBulkAdd  * pFirstBulkAdd;               // Bulk add handles that have been neither committed nor aborted
+    ULONGLONG      EndOfData;                   // End of the file data, excluding internal files (0 if not determined yet)
+    TMPQExtent   * pFreeSpace;                  // Holes left by deleted and replaced files, sorted by position
+    DWORD          dwFreeSpaceCount;            // Number of entries in pFreeSpace
+    DWORD          dwFreeSpaceMax;              // Allocated number of entries in pFreeSpace
 
     SFILE_COMPACT_CALLBACK pfnCompactCB;        // Callback function for compacting the archive
     ULONGLONG      CompactBytesProcessed;       // Amount of bytes that have been processed during a particular compact call
     ULONGLONG      CompactTotalBytes;           // Total amount of bytes to be compacted
     void         * pvCompactUserData;           // User data thats passed to the callback
+
+    ULONGLONG      SignatureBytes;              // Number of bytes hashed by the last signature check
+    ULONGLONG      SignatureTime;               // Duration of the last signature check, in milliseconds
 } TMPQArchive;
 
 // File handle structure
@@ -911,12 +961,16 @@ typedef struct _TMPQFile
     DWORD          dwSectorSize;                // Size of the file sector. For single unit files, this is equal to the file size
 
     void         * hctx;                        // Hash state for MD5. Used when saving file to MPQ
+    void         * pWriteBatch;                 // Batch of sectors for pipelined compression. Used when saving file to MPQ
     DWORD          dwCrc32;                     // CRC32 value, used when saving file to MPQ
+    ULONGLONG      ReservedEnd;                 // End of the space reserved for the file data, used when saving file to MPQ
+    TMPQExtent     Replaced;                    // Space of the file data replaced by this file, used when saving file to MPQ
 
     DWORD          dwAddFileError;              // Result of the "Add File" operations
 
     bool           bLoadedSectorCRCs;           // If true, we already tried to load sector CRCs
     bool           bCheckSectorCRCs;            // If true, then SFileReadFile will check sector CRCs when reading the file
+    bool           bSerialSectors;              // If true, then SFileReadFile processes the sectors on the calling thread only
     bool           bIsWriteHandle;              // If true, this handle has been created by SFileCreateFile
 } TMPQFile;
 
@@ -961,6 +1015,46 @@ typedef struct _SFILE_MARKERS
     const char * szBlockTableKey;               // Replacement for "(block table)"
 } SFILE_MARKERS, *PSFILE_MARKERS;
 
+// Progress of SFileExtractFiles, passed to the callback after each file
+typedef struct _SFILE_EXTRACT_INFO
+{
+    const char * szFileName;                    // Name of the file that has just been processed. NULL in the final call
+    DWORD dwErrCode;                            // Result of extracting the file
+    DWORD dwFilesDone;                          // Number of files processed so far (including the failed ones)
+    DWORD dwFilesFailed;                        // Number of files that failed to extract
+    DWORD dwFileCount;                          // Total number of files to extract
+    ULONGLONG BytesWritten;                     // Total bytes written to the disk so far
+    ULONGLONG BytesRead;                        // Total bytes read from the archive so far (compressed size)
+    ULONGLONG TotalBytes;                       // Total size of all files to extract
+    ULONGLONG ElapsedMs;                        // Milliseconds since the extraction started
+    ULONGLONG BytesPerSecond;                   // Average write throughput
+
+} SFILE_EXTRACT_INFO, *PSFILE_EXTRACT_INFO;
+
+typedef void (WINAPI * SFILE_EXTRACT_CALLBACK)(void * pvUserData, PSFILE_EXTRACT_INFO pExtractInfo);
+
+// Report of SFileVerifyArchiveFiles, passed to the callback after each file
+typedef struct _SFILE_VERIFY_INFO
+{
+    const char * szFileName;                    // Name of the verified file (pseudo-name if not known). NULL in the final call
+    DWORD dwFileIndex;                          // Index of the file in the file table
+    DWORD dwVerifyResult;                       // Result of the verification (VERIFY_XXX flags)
+    ULONGLONG ByteOffset;                       // Position of the file, relative to the begin of the archive
+    DWORD dwFileSize;                           // Size of the file
+    DWORD dwCompSize;                           // Compressed size of the file
+    DWORD dwFilesDone;                          // Number of files verified so far
+    DWORD dwFilesFailed;                        // Number of files that failed the verification
+    DWORD dwFilesSkipped;                       // Number of files that could not be verified (VERIFY_FILE_KEY_UNKNOWN)
+    DWORD dwFileCount;                          // Total number of files to verify
+    ULONGLONG BytesRead;                        // Total bytes verified so far (compressed size)
+    ULONGLONG TotalBytes;                       // Total compressed size of all files
+    ULONGLONG ElapsedMs;                        // Milliseconds since the verification started
+    ULONGLONG BytesPerSecond;                   // Average read throughput
+
+} SFILE_VERIFY_INFO, *PSFILE_VERIFY_INFO;
+
+typedef void (WINAPI * SFILE_VERIFY_CALLBACK)(void * pvUserData, PSFILE_VERIFY_INFO pVerifyInfo);
+
 //-----------------------------------------------------------------------------
 // TMPQBits support - functions
 
@@ -981,6 +1075,19 @@ struct TStreamBitmap
     // Followed by the BYTE array, each bit means availability of one block
 };
 
+// Structure used by FileStream_GetBlockStats
+struct TStreamBlockStats
+{
+    ULONGLONG StreamSize;                       // Size of the stream, in bytes
+    ULONGLONG BytesAvailable;                   // Number of bytes in the available blocks
+    DWORD BlockCount;                           // Number of blocks in the stream
+    DWORD BlockSize;                            // Size of one block
+    DWORD BlocksAvailable;                      // Number of available blocks
+    DWORD MissingRuns;                          // Number of continuous runs of missing blocks
+    DWORD FirstMissingBlock;                    // Index of the first missing block (BlockCount if there is none)
+    DWORD IsComplete;                           // Nonzero if the file is complete
+};
+
 // UNICODE versions of the file access functions
 TFileStream * FileStream_CreateFile(LPCTSTR szFileName, DWORD dwStreamFlags);
 TFileStream * FileStream_OpenFile(LPCTSTR szFileName, DWORD dwStreamFlags);
@@ -991,6 +1098,10 @@ size_t FileStream_Prefix(const TCHAR * szFileName, DWORD * pdwProvider);
 bool FileStream_SetCallback(TFileStream * pStream, SFILE_DOWNLOAD_CALLBACK pfnCallback, void * pvUserData);
 
 bool FileStream_GetBitmap(TFileStream * pStream, void * pvBitmap, DWORD cbBitmap, DWORD * pcbLengthNeeded);
+bool FileStream_GetBlockStats(TFileStream * pStream, TStreamBlockStats * pStats);
+bool FileStream_Prefetch(TFileStream * pStream, ULONGLONG ByteOffset, ULONGLONG Length);
+bool FileStream_WaitPrefetch(TFileStream * pStream);
+bool FileStream_CancelPrefetch(TFileStream * pStream);
 bool FileStream_Read(TFileStream * pStream, ULONGLONG * pByteOffset, void * pvBuffer, DWORD dwBytesToRead);
 bool FileStream_Write(TFileStream * pStream, ULONGLONG * pByteOffset, const void * pvBuffer, DWORD dwBytesToWrite);
 bool FileStream_SetSize(TFileStream * pStream, ULONGLONG NewFileSize);
@@ -998,6 +1109,11 @@ bool FileStream_GetSize(TFileStream * pStream, ULONGLONG * pFileSize);
 bool FileStream_GetPos(TFileStream * pStream, ULONGLONG * pByteOffset);
 bool FileStream_GetTime(TFileStream * pStream, ULONGLONG * pFT);
 bool FileStream_GetFlags(TFileStream * pStream, LPDWORD pdwStreamFlags);
+const void * FileStream_GetMappedData(TFileStream * pStream, ULONGLONG ByteOffset, DWORD dwBytesToRead);
+bool FileStream_SetAccessHint(TFileStream * pStream, DWORD dwAccessHint);
+bool FileStream_SetReadAhead(TFileStream * pStream, DWORD cbReadAhead);
+bool FileStream_Preallocate(TFileStream * pStream, ULONGLONG FileSize);
+bool FileStream_Copy(TFileStream * pStream, ULONGLONG * pByteOffset, TFileStream * pSrcStream, ULONGLONG SrcByteOffset, DWORD dwBytesToCopy);
 bool FileStream_Replace(TFileStream * pStream, TFileStream * pNewStream);
 void FileStream_Close(TFileStream * pStream);
 
@@ -1031,6 +1147,10 @@ bool   WINAPI SFileSetArchiveMarkers(PSFILE_MARKERS pMarkers);
 LCID   WINAPI SFileGetLocale();
 LCID   WINAPI SFileSetLocale(LCID lcFileLocale);
 
+// Number of threads that decrypt and decompress file sectors (1 = no parallelism, 0 = all CPUs)
+DWORD  WINAPI SFileGetThreadCount();
+bool   WINAPI SFileSetThreadCount(DWORD dwThreadCount);
+
 //-----------------------------------------------------------------------------
 // Functions for archive manipulation
 
@@ -1041,6 +1161,8 @@ bool   WINAPI SFileCreateArchive(const TCHAR * szMpqName, DWORD dwCreateFlags, D
 bool   WINAPI SFileCreateArchive2(const TCHAR * szMpqName, PSFILE_CREATE_MPQ pCreateInfo, HANDLE * phMpq);
 
 bool   WINAPI SFileSetDownloadCallback(HANDLE hMpq, SFILE_DOWNLOAD_CALLBACK DownloadCB, void * pvUserData);
+bool   WINAPI SFilePrefetchArchive(HANDLE hMpq, DWORD dwFlags);
+bool   WINAPI SFileCancelPrefetch(HANDLE hMpq);
 bool   WINAPI SFileFlushArchive(HANDLE hMpq);
 bool   WINAPI SFileCloseArchive(HANDLE hMpq);
 
@@ -1053,11 +1175,15 @@ DWORD  WINAPI SFileAddListFileEntries(HANDLE hMpq, const char ** listFileEntries
 // Archive compacting
 bool   WINAPI SFileSetCompactCallback(HANDLE hMpq, SFILE_COMPACT_CALLBACK CompactCB, void * pvUserData);
 bool   WINAPI SFileCompactArchive(HANDLE hMpq, const TCHAR * szListFile, bool bReserved);
+bool   WINAPI SFileCompactArchiveInPlace(HANDLE hMpq, const TCHAR * szListFile, ULONGLONG BytesToReclaim);
 
 // Changing the maximum file count
 DWORD  WINAPI SFileGetMaxFileCount(HANDLE hMpq);
 bool   WINAPI SFileSetMaxFileCount(HANDLE hMpq, DWORD dwMaxFileCount);
 
+// Cache of decompressed file sectors, shared by all files of the archive. Zero size disables the cache
+bool   WINAPI SFileSetArchiveCacheSize(HANDLE hMpq, ULONGLONG CacheSize);
+
 // Changing (attributes) file
 DWORD  WINAPI SFileGetAttributes(HANDLE hMpq);
 bool   WINAPI SFileSetAttributes(HANDLE hMpq, DWORD dwFlags);
@@ -1069,18 +1195,27 @@ bool   WINAPI SFileUpdateFileAttributes(HANDLE hMpq, const char * szFileName);
 bool   WINAPI SFileOpenPatchArchive(HANDLE hMpq, const TCHAR * szPatchMpqName, const char * szPatchPathPrefix, DWORD dwFlags);
 bool   WINAPI SFileIsPatchedArchive(HANDLE hMpq);
 
+// Cache of fully patched files of the archive. Zero size disables the cache
+bool   WINAPI SFileSetPatchCacheSize(HANDLE hMpq, ULONGLONG CacheSize);
+
 //-----------------------------------------------------------------------------
 // Functions for file manipulation
 
 // Reading from MPQ file
 bool   WINAPI SFileHasFile(HANDLE hMpq, const char * szFileName);
 bool   WINAPI SFileOpenFileEx(HANDLE hMpq, const char * szFileName, DWORD dwSearchScope, HANDLE * phFile);
+DWORD  WINAPI SFileOpenFilesBatch(HANDLE hMpq, const char ** szFileNames, DWORD dwFileCount, HANDLE * phFiles, LPDWORD pdwErrCodes);
+DWORD  WINAPI SFileHasFilesBatch(HANDLE hMpq, const char ** szFileNames, DWORD dwFileCount, LPDWORD pdwErrCodes);
 bool   WINAPI SFileGetFileArchive(HANDLE hFile, HANDLE * phMpq);
 DWORD  WINAPI SFileGetFileSize(HANDLE hFile, LPDWORD pdwFileSizeHigh);
 DWORD  WINAPI SFileSetFilePointer(HANDLE hFile, LONG lFilePos, LONG * plFilePosHigh, DWORD dwMoveMethod);
 bool   WINAPI SFileReadFile(HANDLE hFile, void * lpBuffer, DWORD dwToRead, LPDWORD pdwRead, LPOVERLAPPED lpOverlapped);
 bool   WINAPI SFileCloseFile(HANDLE hFile);
 
+// Read-only view of the whole file data. Zero-copy on memory-mapped archives, for stored files
+bool   WINAPI SFileGetFileDataView(HANDLE hFile, const void ** ppvData, LPDWORD pcbData, HANDLE * phView);
+bool   WINAPI SFileReleaseFileDataView(HANDLE hView);
+
 // Retrieving info about a file in the archive
 bool   WINAPI SFileGetFileInfo(HANDLE hMpqOrFile, SFileInfoClass InfoClass, void * pvFileInfo, DWORD cbFileInfo, LPDWORD pcbLengthNeeded);
 bool   WINAPI SFileGetFileName(HANDLE hFile, char * szFileName); // szFileName must be at least MAX_PATH chars
@@ -1088,6 +1223,7 @@ bool   WINAPI SFileFreeFileInfo(void * pvFileInfo, SFileInfoClass InfoClass);
 
 // High-level extract function
 bool   WINAPI SFileExtractFile(HANDLE hMpq, const char * szToExtract, const TCHAR * szExtracted, DWORD dwSearchScope);
+bool   WINAPI SFileExtractFiles(HANDLE hMpq, const char * szMask, const TCHAR * szTargetDir, DWORD dwFlags, DWORD dwThreadCount, SFILE_EXTRACT_CALLBACK ExtractCB, void * pvUserData);
 
 //-----------------------------------------------------------------------------
 // Functions for file and archive verification
@@ -1102,6 +1238,9 @@ DWORD  WINAPI SFileVerifyFile(HANDLE hMpq, const char * szFileName, DWORD dwFlag
 // Verifies raw data of the archive. Only works for MPQs version 4 or newer
 DWORD  WINAPI SFileVerifyRawData(HANDLE hMpq, DWORD dwWhatToVerify, const char * szFileName);
 
+// Verifies all files of the archive on multiple threads. For dwFlags, use SFILE_VERIFY_XXX
+bool   WINAPI SFileVerifyArchiveFiles(HANDLE hMpq, DWORD dwFlags, DWORD dwThreadCount, SFILE_VERIFY_CALLBACK VerifyCB, void * pvUserData);
+
 // Verifies the signature, if present
 bool   WINAPI SFileSignArchive(HANDLE hMpq, DWORD dwSignatureType);
 DWORD  WINAPI SFileVerifyArchive(HANDLE hMpq);
@@ -1137,6 +1276,12 @@ bool   WINAPI SFileSetDataCompression(DWORD DataCompression);
 
 bool   WINAPI SFileSetAddFileCallback(HANDLE hMpq, SFILE_ADDFILE_CALLBACK AddFileCB, void * pvUserData);
 
+bool   WINAPI SFileBeginBulkAdd(HANDLE hMpq, HANDLE * phBulkAdd);
+bool   WINAPI SFileBulkAddFile(HANDLE hBulkAdd, const TCHAR * szFileName, const char * szArchivedName, DWORD dwFlags, DWORD dwCompression, DWORD dwCompressionNext);
+bool   WINAPI SFileBulkAddData(HANDLE hBulkAdd, const void * pvData, DWORD cbData, const char * szArchivedName, ULONGLONG FileTime, DWORD dwFlags, DWORD dwCompression, DWORD dwCompressionNext);
+bool   WINAPI SFileCommitBulkAdd(HANDLE hBulkAdd);
+bool   WINAPI SFileAbortBulkAdd(HANDLE hBulkAdd);
+
 //-----------------------------------------------------------------------------
 // Compression and decompression
 
@@ -104,8 +104,12 @@
     #define STORMLIB_LITTLE_ENDIAN
   #endif
 
+  #include <pthread.h>
+
   #define STORMLIB_MAC
   #define STORMLIB_HAS_MMAP                         // Indicate that we have mmap support
+  #define STORMLIB_HAS_PREAD                        // Indicate that we have pread/pwrite support
+  #define STORMLIB_HAS_PTHREADS                     // Indicate that we have POSIX threads
   #define STORMLIB_PLATFORM_DEFINED                 // The platform is known now
 
 #endif
@@ -308,6 +312,26 @@
     #define STORMLIB_HAS_MMAP
   #endif
 
+  // Positioned I/O and POSIX threads
+  #include <pthread.h>
+  #define STORMLIB_HAS_PREAD
+  #define STORMLIB_HAS_PTHREADS
+
+  // Positioned reads to multiple buffers
+  #if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+    #include <sys/uio.h>
+    #define STORMLIB_HAS_PREADV
+  #endif
+
+  // Copying data between files without passing them through user space
+  #if defined(__linux__)
+    #include <sys/sendfile.h>
+    #define STORMLIB_HAS_SENDFILE
+    #if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+      #define STORMLIB_HAS_COPY_FILE_RANGE
+    #endif
+  #endif
+
   #define STORMLIB_LINUX
   #define STORMLIB_PLATFORM_DEFINED
 
@@ -362,6 +386,7 @@
   #define _tcslen   strlen
   #define _tcscpy   strcpy
   #define _tcscat   strcat
+  #define _tcscmp   strcmp
   #define _tcschr   strchr
   #define _tcsrchr  strrchr
   #define _tcsstr   strstr
@@ -383,6 +408,8 @@
   #define stat64  stat
   #define fstat64 fstat
   #define lseek64 lseek
+  #define pread64 pread
+  #define pwrite64 pwrite
   #define ftruncate64 ftruncate
   #define off64_t off_t
   #define O_LARGEFILE 0
@@ -393,6 +420,8 @@
   #define stat64  stat
   #define fstat64 fstat
   #define lseek64 lseek
+  #define pread64 pread
+  #define pwrite64 pwrite
   #define ftruncate64 ftruncate
   #define off64_t off_t
   #ifndef O_LARGEFILE
@@ -400,6 +429,22 @@
   #endif
 #endif
 
+// Synchronization objects. On platforms without thread support,
+// the lock is a dummy and all operations are performed serially
+#if defined(STORMLIB_WINDOWS)
+  typedef CRITICAL_SECTION STORM_LOCK;
+  typedef CONDITION_VARIABLE STORM_COND;
+  typedef HANDLE STORM_THREAD;
+#elif defined(STORMLIB_HAS_PTHREADS)
+  typedef pthread_mutex_t STORM_LOCK;
+  typedef pthread_cond_t STORM_COND;
+  typedef pthread_t STORM_THREAD;
+#else
+  typedef int STORM_LOCK;
+  typedef int STORM_COND;
+  typedef int STORM_THREAD;
+#endif
+
 // Platform-specific error codes for non-Windows platforms
 #ifndef ERROR_SUCCESS
   #define ERROR_SUCCESS                  0
@@ -32,6 +32,9 @@
 
 #ifndef STORMLIB_WINDOWS
 #include <dirent.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <alsa/asoundlib.h>                 // sudo apt-get install libasound2-dev
 #endif
 
@@ -50,6 +53,7 @@
 #define SHA256_DIGEST_SIZE              0x20
 
 typedef DWORD (*FS_SEARCH_CALLBACK)(LPCTSTR szFullPath, void * lpContext);
+typedef DWORD (*CPU_PATH_CALLBACK)(TLogHelper & Logger, void * lpContext);
 
 typedef enum _EXTRA_TYPE
 {
@@ -2407,1474 +2411,4601 @@ static DWORD TestFileStreamOperations(LPCTSTR szPlainName, DWORD dwStreamFlags)
     return dwErrCode;
 }
 
-static DWORD TestArchive_LoadFiles(TLogHelper * pLogger, HANDLE hMpq, DWORD bIgnoreOpenErrors, ...)
+// Reads the same range from both streams and compares the data
+static DWORD CompareStreamRange(TLogHelper & Logger, TFileStream * pStream1, TFileStream * pStream2, LPBYTE pbBuffer1, LPBYTE pbBuffer2, ULONGLONG ByteOffset, DWORD dwLength)
 {
-    PFILE_DATA pFileData;
-    const char * szFileName;
-    va_list argList;
-    DWORD dwSearchFlags = (bIgnoreOpenErrors) ? SEARCH_FLAG_IGNORE_ERRORS : 0;
+    ULONGLONG ByteOffset1 = ByteOffset;
+    ULONGLONG ByteOffset2 = ByteOffset;
+
+    if(!FileStream_Read(pStream1, &ByteOffset1, pbBuffer1, dwLength) || !FileStream_Read(pStream2, &ByteOffset2, pbBuffer2, dwLength))
+        return Logger.PrintErrorVa("Failed to read %u bytes from offset " fmt_I64u_a, dwLength, ByteOffset);
+    if(memcmp(pbBuffer1, pbBuffer2, dwLength))
+        return Logger.PrintErrorVa("Data of %u bytes from offset " fmt_I64u_a " differ", dwLength, ByteOffset);
+    return ERROR_SUCCESS;
+}
+
+// Verifies the block statistics against the block bitmap of the stream
+static DWORD CheckStreamBlockStats(TLogHelper & Logger, TFileStream * pStream)
+{
+    TStreamBlockStats Stats;
+    TStreamBitmap * pBitmap;
+    ULONGLONG BytesAvailable = 0;
+    LPBYTE Bitmap;
+    DWORD FirstMissingBlock = 0xFFFFFFFF;
+    DWORD BlocksAvailable = 0;
+    DWORD MissingRuns = 0;
+    DWORD cbBitmap = 0;
     DWORD dwErrCode = ERROR_SUCCESS;
 
-    va_start(argList, bIgnoreOpenErrors);
-    while((szFileName = va_arg(argList, const char *)) != NULL)
+    // Load the complete bitmap
+    FileStream_GetBitmap(pStream, NULL, 0, &cbBitmap);
+    if((pBitmap = (TStreamBitmap *)STORM_ALLOC(BYTE, cbBitmap)) == NULL)
+        return Logger.PrintError("Failed to allocate the stream bitmap");
+    if(!FileStream_GetBitmap(pStream, pBitmap, cbBitmap, NULL) || !FileStream_GetBlockStats(pStream, &Stats))
+        dwErrCode = Logger.PrintError("Failed to retrieve the stream bitmap");
+
+    // Calculate the statistics from the bitmap
+    if(dwErrCode == ERROR_SUCCESS)
     {
-        if(SFileHasFile(hMpq, szFileName))
+        Bitmap = (LPBYTE)(pBitmap + 1);
+        for(DWORD i = 0; i < pBitmap->BlockCount; i++)
         {
-            dwErrCode = LoadMpqFile(*pLogger, hMpq, szFileName, 0, dwSearchFlags, &pFileData);
-            if(dwErrCode != ERROR_SUCCESS && bIgnoreOpenErrors == 0)
+            if(Bitmap[i / 8] & (1 << (i & 7)))
             {
-                pLogger->PrintError("Error loading the file %s", szFileName);
-                break;
+                BytesAvailable += STORMLIB_MIN(pBitmap->BlockSize, pBitmap->StreamSize - (ULONGLONG)i * pBitmap->BlockSize);
+                BlocksAvailable++;
             }
             else
             {
-                dwErrCode = ERROR_SUCCESS;
-                STORM_FREE(pFileData);
-                pFileData = NULL;
+                if(i == 0 || (Bitmap[(i - 1) / 8] & (1 << ((i - 1) & 7))))
+                    MissingRuns++;
+                FirstMissingBlock = STORMLIB_MIN(FirstMissingBlock, i);
             }
         }
-    }
-    va_end(argList);
-
-    return dwErrCode;
-}
-
-//-----------------------------------------------------------------------------
-// Testing opening an embedded archives
-
-typedef std::vector<HANDLE> HANDLE_LIST;
-
-static DWORD TestOpenArchive_SearchEmbedded(TLogHelper & Logger, HANDLE_LIST & Mpqs, hash_state & md5_ctx, HANDLE hParentMPQ, LPCTSTR szListFile)
-{
-    SFILE_FIND_DATA sf;
-    HANDLE hChildMPQ;
-    HANDLE hFind;
-    size_t nLength;
-    LPSTR szExtension;
-    DWORD dwErrCode = ERROR_SUCCESS;
-    bool bFound = true;
+        FirstMissingBlock = STORMLIB_MIN(FirstMissingBlock, pBitmap->BlockCount);
 
-    // Hash names of all files within the archive. Go recursively.
-    if((hFind = SFileFindFirstFile(hParentMPQ, "*", &sf, szListFile)) != NULL)
-    {
-        while(bFound)
+        if(Stats.BlockCount != pBitmap->BlockCount || Stats.BlocksAvailable != BlocksAvailable || Stats.BytesAvailable != BytesAvailable ||
+           Stats.MissingRuns != MissingRuns || Stats.FirstMissingBlock != FirstMissingBlock)
         {
-            // Add the file name to the MPQ hash
-            nLength = strlen(sf.cFileName);
-            md5_process(&md5_ctx, (unsigned char *)(sf.cFileName), (unsigned long)(nLength));
-            Logger.FileCount++;
-
-            // If the found file is a MPQ, then we open it as embedded MPQ
-            if((szExtension = strrchr(sf.cFileName, '.')) != NULL)
-            {
-                if(!_stricmp(szExtension, ".mpq"))
-                {
-                    // Attempt to open the embedded archive
-                    if(!SFileOpenFileArchive(hParentMPQ, sf.cFileName, 0, 0, &hChildMPQ))
-                    {
-                        Logger.PrintError("Failed to open embedded MPQ: %s", sf.cFileName);
-                        break;
-                    }
-
-                    // Insert the archive handle to the list of MPQs
-                    Mpqs.push_back(hChildMPQ);
-
-                    // Recursively search the MPQ
-                    dwErrCode = TestOpenArchive_SearchEmbedded(Logger, Mpqs, md5_ctx, hChildMPQ, szListFile);
-                    if(dwErrCode != ERROR_SUCCESS)
-                        break;
-                }
-            }
-
-            bFound = SFileFindNextFile(hFind, &sf);
+            dwErrCode = Logger.PrintErrorVa("Block statistics differ from the bitmap (available blocks: %u/%u, missing runs: %u/%u)",
+                                            Stats.BlocksAvailable, BlocksAvailable, Stats.MissingRuns, MissingRuns);
         }
-        SFileFindClose(hFind);
-    }
-    else
-    {
-        Logger.PrintError("Failed to search the archive");
-        dwErrCode = SErrGetLastError();
     }
+
+    STORM_FREE(pBitmap);
     return dwErrCode;
 }
 
-static DWORD TestOpenArchive_Embedded(const TEST_INFO1 & MpqInfo)
+// Reads from a block stream (a mirror of a local file) with various sizes and alignments,
+// then measures the time of small, block-aligned and unaligned reads from the mirror
+static DWORD TestFileStream_BlockRead(LPCTSTR szMirrorName, LPCTSTR szMasterName, DWORD dwFileSize)
 {
-    TLogHelper Logger("TestEmbeddedMpq", MpqInfo.szName1);
-    hash_state md5_ctx;
-    HANDLE_LIST Mpqs;
-    HANDLE hParentMPQ = NULL;
+    TFileStream * pStream1 = NULL;              // Master file
+    TFileStream * pStream2 = NULL;              // Mirror file
+    TLogHelper Logger("BlockReadTest", szMirrorName);
+    ULONGLONG ByteOffset;
+    TCHAR szMirrorPath[MAX_PATH + MAX_PATH];
+    TCHAR szMasterPath[MAX_PATH];
+    TCHAR szCopyPath[MAX_PATH];
+    LPBYTE pbBuffer1 = STORM_ALLOC(BYTE, dwFileSize + 1);
+    LPBYTE pbBuffer2 = STORM_ALLOC(BYTE, dwFileSize + 1);
+    DWORD Lengths[] = {0x10, 0x1000, 0x4000, 0x10000, 0x41234, 0x100000};
+    DWORD TimedLengths[] = {0x10, 0x4000, 0x4321};
+    LPCSTR TimedNames[] = {"Small", "Block-aligned", "Unaligned"};
+    DWORD dwRandom = 0x55AA33CC;
+    DWORD dwReadCount = 0x40000;
+    DWORD dwReadTime;
     DWORD dwErrCode = ERROR_SUCCESS;
-    TCHAR szListFile[MAX_PATH] = {0};
-    BYTE md5_hash[MD5_DIGEST_SIZE];
 
-    // Get the listfile
-    if(GetExtraType(MpqInfo.pExtra) == ListFile)
-        CreateFullPathName(szListFile, _countof(szListFile), szListFileDir, ((PTEST_EXTRA_ONEFILE)(MpqInfo.pExtra))->szFile);
+    if(pbBuffer1 == NULL || pbBuffer2 == NULL)
+        dwErrCode = Logger.PrintError("Failed to allocate buffers");
 
-    // Copy the archive so we won't fuck up the original one
-    dwErrCode = OpenExistingArchiveWithCopy(&Logger, MpqInfo.szName1, MpqInfo.szName1, &hParentMPQ, 0);
+    // Create the master file with random data and delete the mirror file
     if(dwErrCode == ERROR_SUCCESS)
     {
-        // Search the archive for embedded MPQs
-        md5_init(&md5_ctx);
-        dwErrCode = TestOpenArchive_SearchEmbedded(Logger, Mpqs, md5_ctx, hParentMPQ, szListFile);
-        md5_done(&md5_ctx, md5_hash);
+        CreateFullPathName(szMasterPath, _countof(szMasterPath), NULL, szMasterName);
+        CreateFullPathName(szCopyPath, _countof(szCopyPath), NULL, szMirrorName);
+        _tremove(szCopyPath);
+        _stprintf(szMirrorPath, _T("%s*%s"), szCopyPath, szMasterPath);
 
-        // Close the master MPQ first.
-        // The reference counting should take care of proper memory deallocation
-        SFileCloseArchive(hParentMPQ);
-        hParentMPQ = NULL;
+        for(DWORD i = 0; i < dwFileSize; i++)
+        {
+            dwRandom = dwRandom * 1103515245 + 12345;
+            pbBuffer1[i] = (BYTE)(dwRandom >> 24);
+        }
 
-        // Now close each of the child MPQs
-        for(size_t i = 0; i < Mpqs.size(); i++)
-            SFileCloseArchive(Mpqs[i]);
+        if((pStream1 = FileStream_CreateFile(szMasterPath, 0)) == NULL)
+            return Logger.PrintError(_T("Failed to create %s"), szMasterPath);
+        if(!FileStream_Write(pStream1, NULL, pbBuffer1, dwFileSize))
+            dwErrCode = Logger.PrintError(_T("Failed to write %s"), szMasterPath);
+        FileStream_Close(pStream1);
     }
 
-    // Verify the file count
-    return VerifyFileCountAndHash(Logger, md5_hash, MpqInfo.szDataHash, MpqInfo.dwFlags, Logger.FileCount);
-}
-
-//-----------------------------------------------------------------------------
-// Testing opening a single archive
-
-static DWORD TestOpenArchive_VerifySignature(TLogHelper & Logger, HANDLE hMpq, DWORD dwDoItIfNonZero)
-{
-    DWORD dwSignatures = 0;
-    DWORD dwVerifyError;
-
-    // Only do it if we asked to
-    if(dwDoItIfNonZero)
+    // Open both master and mirror file
+    if(dwErrCode == ERROR_SUCCESS)
     {
-        // Query the signature types
-        Logger.PrintProgress("Retrieving signatures ...");
-        TestGetFileInfo(&Logger, hMpq, SFileMpqSignatures, &dwSignatures, sizeof(DWORD), NULL, true, ERROR_SUCCESS);
+        pStream1 = FileStream_OpenFile(szMasterPath, STREAM_FLAG_READ_ONLY);
+        pStream2 = FileStream_OpenFile(szMirrorPath, STREAM_FLAG_READ_ONLY | STREAM_FLAG_USE_BITMAP);
+        if(pStream1 == NULL || pStream2 == NULL)
+            dwErrCode = Logger.PrintError(_T("Failed to open %s"), szMirrorPath);
+    }
 
-        // Are there some signatures at all?
-        if(dwSignatures == 0)
+    // Read with all lengths from aligned and unaligned offsets, into aligned and unaligned buffers.
+    // The first reads are loaded from the master, next reads from the mirror
+    for(DWORD nPass = 0; nPass < 2 && dwErrCode == ERROR_SUCCESS; nPass++)
+    {
+        for(size_t i = 0; i < _countof(Lengths) && dwErrCode == ERROR_SUCCESS; i++)
         {
-            Logger.PrintMessage("No signatures present in the file");
-            return ERROR_FILE_CORRUPT;
+            for(DWORD j = 0; j < 0x20 && dwErrCode == ERROR_SUCCESS; j++)
+            {
+                dwRandom = dwRandom * 1103515245 + 12345;
+                ByteOffset = (dwRandom >> 8) % (dwFileSize - Lengths[i]);
+                if(j & 1)
+                    ByteOffset &= ~(ULONGLONG)0x3FFF;
+
+                Logger.PrintProgress("Reading %u bytes from offset " fmt_I64u_a " ...", Lengths[i], ByteOffset);
+                dwErrCode = CompareStreamRange(Logger, pStream1, pStream2, pbBuffer1, pbBuffer2 + (j & 2), ByteOffset, Lengths[i]);
+            }
         }
 
-        // Verify any of the present signatures
-        Logger.PrintProgress("Verifying archive signature ...");
-        dwVerifyError = SFileVerifyArchive(hMpq);
+        // Part of the blocks is loaded now, check the availability
+        if(dwErrCode == ERROR_SUCCESS)
+            dwErrCode = CheckStreamBlockStats(Logger, pStream2);
+    }
 
-        // Verify the result
-        if((dwSignatures & SIGNATURE_TYPE_STRONG) && (dwVerifyError != ERROR_STRONG_SIGNATURE_OK))
+    // The end of the file and the whole file
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CompareStreamRange(Logger, pStream1, pStream2, pbBuffer1, pbBuffer2, dwFileSize - 0x10, 0x10);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CompareStreamRange(Logger, pStream1, pStream2, pbBuffer1, pbBuffer2 + 1, 0, dwFileSize);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CheckStreamBlockStats(Logger, pStream2);
+
+    // All blocks are in the mirror now. Measure the time per read: small reads (such as
+    // header probes), reads of whole blocks and reads that start and end inside a block
+    for(size_t i = 0; i < _countof(TimedLengths) && dwErrCode == ERROR_SUCCESS; i++)
+    {
+        Logger.PrintProgress("Measuring the speed of reading %u bytes ...", TimedLengths[i]);
+        Logger.SetStartTime();
+        for(DWORD j = 0; j < dwReadCount; j++)
         {
-            Logger.PrintMessage("Strong signature verification error");
-            return ERROR_FILE_CORRUPT;
+            ByteOffset = (j * 0x9E3779B1) % (dwFileSize - TimedLengths[i]);
+            if(TimedLengths[i] == 0x4000)
+                ByteOffset &= ~(ULONGLONG)0x3FFF;
+            else
+                ByteOffset |= 1;
+
+            if(!FileStream_Read(pStream2, &ByteOffset, pbBuffer2, TimedLengths[i]))
+            {
+                dwErrCode = SErrGetLastError();
+                Logger.PrintErrorVa("Failed to read %u bytes from offset " fmt_I64u_a, TimedLengths[i], ByteOffset);
+                break;
+            }
         }
+        dwReadTime = Logger.SetEndTime();
 
-        // Verify the result
-        if((dwSignatures & SIGNATURE_TYPE_WEAK) && (dwVerifyError != ERROR_WEAK_SIGNATURE_OK))
+        if(dwErrCode == ERROR_SUCCESS)
         {
-            Logger.PrintMessage("Weak signature verification error");
-            return ERROR_FILE_CORRUPT;
+            DWORD dwReadNs = (DWORD)(((ULONGLONG)dwReadTime * 1000000) / dwReadCount);
+            Logger.PrintMessage("%s reads of %u bytes: %u.%03u us per read", TimedNames[i], TimedLengths[i], dwReadNs / 1000, dwReadNs % 1000);
         }
     }
-    return ERROR_SUCCESS;
+
+    if(pStream2 != NULL)
+        FileStream_Close(pStream2);
+    if(pStream1 != NULL)
+        FileStream_Close(pStream1);
+    STORM_FREE(pbBuffer2);
+    STORM_FREE(pbBuffer1);
+    return Logger.PrintVerdict(dwErrCode);
 }
 
-static DWORD TestOpenArchive_Extra_ListFile(TLogHelper & Logger, HANDLE hMpq, PTEST_EXTRA_ONEFILE pExtra)
+// Creates a block4 file (.MPQ.0) from the data: each 0x4000 bytes of data are followed by their MD5 as text
+static DWORD CreateBlock4File(TLogHelper & Logger, LPCTSTR szFileName, LPBYTE pbData, DWORD cbData)
 {
+    TFileStream * pStream;
+    BYTE md5_digest[MD5_DIGEST_SIZE];
+    char szMd5[MD5_DIGEST_SIZE * 2 + 1];
     DWORD dwErrCode = ERROR_SUCCESS;
-    TCHAR szFullName[MAX_PATH];
 
-    if(IS_VALID_STRING(pExtra->szFile))
+    if((pStream = FileStream_CreateFile(szFileName, 0)) == NULL)
+        return Logger.PrintError(_T("Failed to create %s"), szFileName);
+
+    for(DWORD cbOffset = 0; cbOffset < cbData && dwErrCode == ERROR_SUCCESS; cbOffset += 0x4000)
     {
-        Logger.PrintProgress(_T("Adding listfile %s ..."), pExtra->szFile);
-        CreateFullPathName(szFullName, _countof(szFullName), szListFileDir, pExtra->szFile);
-        if((dwErrCode = SFileAddListFile(hMpq, szFullName)) != ERROR_SUCCESS)
-            Logger.PrintMessage("Failed to add the listfile to the MPQ");
+        DWORD cbBlock = STORMLIB_MIN(cbData - cbOffset, 0x4000);
+
+        CalculateDataBlockHash(pbData + cbOffset, cbBlock, md5_digest);
+        SMemBinToStr(szMd5, _countof(szMd5), md5_digest, MD5_DIGEST_SIZE);
+        if(!FileStream_Write(pStream, NULL, pbData + cbOffset, cbBlock) || !FileStream_Write(pStream, NULL, szMd5, MD5_DIGEST_SIZE * 2))
+            dwErrCode = Logger.PrintError(_T("Failed to write %s"), szFileName);
     }
+
+    FileStream_Close(pStream);
     return dwErrCode;
 }
 
-static DWORD TestOpenArchive_Extra_Utf8File(TLogHelper & Logger, HANDLE hMpq, PTEST_EXTRA_UTF8 pExtra)
+// Reads a block4 stream through the file and the mapped base providers, with and without
+// the verification of the block MD5s, then checks that a corrupt block is detected
+static DWORD TestFileStream_Block4(LPCTSTR szPlainName, DWORD dwFileSize)
 {
+    TFileStream * pStream = NULL;
+    TLogHelper Logger("Block4Test", szPlainName);
+    ULONGLONG ByteOffset;
+    ULONGLONG FileSize = 0;
+    TCHAR szFullPath[MAX_PATH];
+    LPBYTE pbBuffer1 = STORM_ALLOC(BYTE, dwFileSize + 1);
+    LPBYTE pbBuffer2 = STORM_ALLOC(BYTE, dwFileSize + 1);
+    DWORD BaseProviders[] = {BASE_PROVIDER_FILE, BASE_PROVIDER_MAP};
+    DWORD Lengths[] = {0x10, 0x4000, 0x4020, 0x10000, 0x41234, 0x100000};
+    DWORD dwStreamFlags;
+    DWORD dwRandom = 0x5A5AC3C3;
     DWORD dwErrCode = ERROR_SUCCESS;
-    TCHAR szFullName[MAX_PATH];
-    TCHAR szListName[MAX_PATH];
+    BYTE CorruptByte;
 
-    if(IS_VALID_STRING(pExtra->szListFile))
+    if(pbBuffer1 == NULL || pbBuffer2 == NULL)
+        dwErrCode = Logger.PrintError("Failed to allocate buffers");
+
+    // Create the block4 file with random data
+    if(dwErrCode == ERROR_SUCCESS)
     {
-        StringCopy(szListName, _countof(szListName), (const char *)pExtra->szListFile);
-        Logger.PrintProgress(_T("Adding listfile %s ..."), szListName);
-        CreateFullPathName(szFullName, _countof(szFullName), szListFileDir, szListName);
-        if((dwErrCode = SFileAddListFile(hMpq, szFullName)) != ERROR_SUCCESS)
-            Logger.PrintMessage("Failed to add the listfile to the MPQ");
-    }
-    return dwErrCode;
-}
+        for(DWORD i = 0; i < dwFileSize; i++)
+        {
+            dwRandom = dwRandom * 1103515245 + 12345;
+            pbBuffer1[i] = (BYTE)(dwRandom >> 24);
+        }
 
-static DWORD TestOpenArchive_Extra_TwoFiles(TLogHelper & Logger, HANDLE hMpq, DWORD dwSearchFlags, PTEST_EXTRA_TWOFILES pExtra)
-{
-    PFILE_DATA pFileData1 = NULL;
-    PFILE_DATA pFileData2 = NULL;
-    DWORD dwErrCode = ERROR_SUCCESS;
+        CreateFullPathName(szFullPath, _countof(szFullPath), NULL, szPlainName);
+        dwErrCode = CreateBlock4File(Logger, szFullPath, pbBuffer1, dwFileSize);
+    }
 
-    // Perform actions
-    for(;;)
+    // Read with all base providers, with and without the verification
+    for(DWORD i = 0; i < _countof(BaseProviders) * 2 && dwErrCode == ERROR_SUCCESS; i++)
     {
-        // Load and verify the first file, if any
-        if(IS_VALID_STRING(pExtra->szFile1))
+        dwStreamFlags = STREAM_PROVIDER_BLOCK4 | BaseProviders[i / 2] | STREAM_FLAG_READ_ONLY | ((i & 1) ? STREAM_FLAG_VERIFY_BLOCKS : 0);
+        if((pStream = FileStream_OpenFile(szFullPath, dwStreamFlags)) == NULL)
         {
-            if((dwErrCode = LoadMpqFile(Logger, hMpq, pExtra->szFile1, 0, dwSearchFlags, &pFileData1)) != ERROR_SUCCESS)
-                break;
+            dwErrCode = Logger.PrintError(_T("Failed to open %s"), szFullPath);
+            break;
         }
 
-        // Load and verify the second file, if any
-        if(IS_VALID_STRING(pExtra->szFile2))
+        // Check the size of the stream
+        FileStream_GetSize(pStream, &FileSize);
+        if(FileSize != dwFileSize)
+            dwErrCode = Logger.PrintErrorVa("Size of the block4 stream is " fmt_I64u_a " instead of %u", FileSize, dwFileSize);
+
+        // Read with all lengths from aligned and unaligned offsets
+        for(size_t j = 0; j < _countof(Lengths) && dwErrCode == ERROR_SUCCESS; j++)
         {
-            if((dwErrCode = LoadMpqFile(Logger, hMpq, pExtra->szFile2, 0, dwSearchFlags, &pFileData2)) != ERROR_SUCCESS)
-                break;
+            for(DWORD k = 0; k < 0x20 && dwErrCode == ERROR_SUCCESS; k++)
+            {
+                dwRandom = dwRandom * 1103515245 + 12345;
+                ByteOffset = (dwRandom >> 8) % (dwFileSize - Lengths[j]);
+                if(k & 1)
+                    ByteOffset &= ~(ULONGLONG)0x3FFF;
+
+                Logger.PrintProgress("Reading %u bytes from offset " fmt_I64u_a " ...", Lengths[j], ByteOffset);
+                if(!FileStream_Read(pStream, &ByteOffset, pbBuffer2 + (k & 2), Lengths[j]))
+                    dwErrCode = Logger.PrintErrorVa("Failed to read %u bytes from offset " fmt_I64u_a, Lengths[j], ByteOffset);
+                else if(memcmp(pbBuffer1 + ByteOffset, pbBuffer2 + (k & 2), Lengths[j]))
+                    dwErrCode = Logger.PrintErrorVa("Data of %u bytes from offset " fmt_I64u_a " differ", Lengths[j], ByteOffset);
+            }
         }
 
-        // If two files were given, they must be equal
-        if(pFileData1 && pFileData2)
+        // Read the whole stream at once
+        if(dwErrCode == ERROR_SUCCESS)
         {
-            dwErrCode = CompareTwoFiles(Logger, pFileData1, pFileData2);
+            ByteOffset = 0;
+            if(!FileStream_Read(pStream, &ByteOffset, pbBuffer2, dwFileSize) || memcmp(pbBuffer1, pbBuffer2, dwFileSize))
+                dwErrCode = Logger.PrintError("Failed to read the whole block4 stream");
         }
-        break;
-    }
-
-    // Free buffers and exit
-    if(pFileData2 != NULL)
-        STORM_FREE(pFileData2);
-    if(pFileData1 != NULL)
-        STORM_FREE(pFileData1);
-    return dwErrCode;
-}
 
-static DWORD TestOpenArchive_Extra_Patches(TLogHelper & Logger, HANDLE hMpq, PTEST_EXTRA_PATCHES pExtra)
-{
-    LPCTSTR szPatch;
-    TCHAR szFullPath[MAX_PATH];
-    DWORD dwErrCode = ERROR_SUCCESS;
+        FileStream_Close(pStream);
+        pStream = NULL;
+    }
 
-    // Open all patches that are in the multi-SZ list
-    if(IS_VALID_STRING(pExtra->szPatchList))
+    // Corrupt one byte of the fifth block
+    if(dwErrCode == ERROR_SUCCESS)
     {
-        for(szPatch = pExtra->szPatchList; szPatch[0] != 0; szPatch = szPatch + _tcslen(szPatch) + 1)
+        if((pStream = FileStream_OpenFile(szFullPath, 0)) != NULL)
         {
-            Logger.PrintProgress(_T("Adding patch %s ..."), GetShortPlainName(szPatch));
-            CreateFullPathName(szFullPath, _countof(szFullPath), szMpqPatchDir, szPatch);
-            if(!SFileOpenPatchArchive(hMpq, szFullPath, NULL, 0))
-                return Logger.PrintError(_T("Failed to add patch %s ..."), szFullPath);
+            ByteOffset = 5 * (0x4000 + 0x20) + 0x123;
+            CorruptByte = pbBuffer1[5 * 0x4000 + 0x123] ^ 0x01;
+            if(!FileStream_Write(pStream, &ByteOffset, &CorruptByte, 1))
+                dwErrCode = Logger.PrintError(_T("Failed to write %s"), szFullPath);
+            FileStream_Close(pStream);
+        }
+        else
+        {
+            dwErrCode = Logger.PrintError(_T("Failed to open %s"), szFullPath);
         }
     }
 
-    // Verify the patch count of the given file
-    if(IS_VALID_STRING(pExtra->szFileName))
-        dwErrCode = VerifyFilePatchCount(&Logger, hMpq, pExtra->szFileName, pExtra->dwPatchCount);
-    return dwErrCode;
+    // The corrupt block must fail the verification. Other blocks must be read
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwStreamFlags = STREAM_PROVIDER_BLOCK4 | STREAM_FLAG_READ_ONLY | STREAM_FLAG_VERIFY_BLOCKS;
+        if((pStream = FileStream_OpenFile(szFullPath, dwStreamFlags)) != NULL)
+        {
+            ByteOffset = 4 * 0x4000;
+            if(!FileStream_Read(pStream, &ByteOffset, pbBuffer2, 0x4000))
+                dwErrCode = Logger.PrintError("Failed to read a valid block");
+            ByteOffset = 5 * 0x4000 + 0x100;
+            if(dwErrCode == ERROR_SUCCESS && FileStream_Read(pStream, &ByteOffset, pbBuffer2, 0x100))
+                dwErrCode = Logger.PrintError("A corrupt block passed the verification");
+            if(dwErrCode == ERROR_SUCCESS && SErrGetLastError() != ERROR_FILE_CORRUPT)
+                dwErrCode = Logger.PrintError("Unexpected error code for a corrupt block");
+            FileStream_Close(pStream);
+        }
+        else
+        {
+            dwErrCode = Logger.PrintError(_T("Failed to open %s"), szFullPath);
+        }
+    }
+
+    STORM_FREE(pbBuffer2);
+    STORM_FREE(pbBuffer1);
+    return Logger.PrintVerdict(dwErrCode);
 }
 
-static DWORD TestOpenArchive_Extra_HashValues(TLogHelper & Logger, HANDLE hMpq, PTEST_EXTRA_HASHVALS pExtra)
+// Checks that all blocks of the stream have been loaded
+static DWORD CheckStreamComplete(TLogHelper & Logger, TFileStream * pStream)
 {
+    TStreamBlockStats Stats;
+    DWORD dwErrCode;
+
+    if((dwErrCode = CheckStreamBlockStats(Logger, pStream)) != ERROR_SUCCESS)
+        return dwErrCode;
+    if(!FileStream_GetBlockStats(pStream, &Stats))
+        return Logger.PrintError("Failed to retrieve the block statistics");
+    if(Stats.BlocksAvailable != Stats.BlockCount)
+        return Logger.PrintErrorVa("The prefetch left %u blocks of %u missing", Stats.BlockCount - Stats.BlocksAvailable, Stats.BlockCount);
+    return ERROR_SUCCESS;
+}
+
+// Loads a mirror stream by the background prefetch while reading it,
+// then prefetches a mirrored MPQ by SFilePrefetchArchive
+static DWORD TestFileStream_Prefetch(LPCTSTR szMirrorName, LPCTSTR szMasterName, LPCTSTR szMpqName, DWORD dwFileSize)
+{
+    TFileStream * pStream1 = NULL;              // Master file
+    TFileStream * pStream2 = NULL;              // Mirror file
+    TStreamBitmap * pBitmap = NULL;
+    TLogHelper Logger("PrefetchTest", szMirrorName);
+    ULONGLONG ByteOffset;
+    HANDLE hMpq = NULL;
     HANDLE hFile = NULL;
+    TCHAR szMirrorPath[MAX_PATH + MAX_PATH];
+    TCHAR szMasterPath[MAX_PATH];
+    TCHAR szCopyPath[MAX_PATH];
+    LPBYTE pbBuffer1 = STORM_ALLOC(BYTE, dwFileSize + 1);
+    LPBYTE pbBuffer2 = STORM_ALLOC(BYTE, dwFileSize + 1);
+    LPBYTE Bitmap;
+    char szFileName[MAX_PATH];
+    DWORD dwFileCount = 0x10;
+    DWORD cbMpqFile = dwFileSize / 0x20;
+    DWORD dwRandom = 0x33CC55AA;
+    DWORD dwBytesRead = 0;
+    DWORD cbBitmap = 0;
     DWORD dwErrCode = ERROR_SUCCESS;
-    DWORD dwHash1 = 0;
-    DWORD dwHash2 = 0;
-    DWORD cbHash = 0;
 
-    for(size_t i = 0; i < _countof(pExtra->Items); i++)
+    if(pbBuffer1 == NULL || pbBuffer2 == NULL)
+        dwErrCode = Logger.PrintError("Failed to allocate buffers");
+
+    // Create the master file with random data and delete the mirror file
+    if(dwErrCode == ERROR_SUCCESS)
     {
-        PTEST_EXTRA_HASHVAL pItem = &pExtra->Items[i];
+        CreateFullPathName(szMasterPath, _countof(szMasterPath), NULL, szMasterName);
+        CreateFullPathName(szCopyPath, _countof(szCopyPath), NULL, szMirrorName);
+        _tremove(szCopyPath);
+        _stprintf(szMirrorPath, _T("%s*%s"), szCopyPath, szMasterPath);
 
-        if(SFileOpenFileEx(hMpq, pItem->szFileName, 0, &hFile))
+        for(DWORD i = 0; i < dwFileSize; i++)
         {
-            if(SFileGetFileInfo(hFile, SFileInfoNameHash1, &dwHash1, sizeof(dwHash1), &cbHash))
-            {
-                assert(cbHash == sizeof(DWORD));
-            }
+            dwRandom = dwRandom * 1103515245 + 12345;
+            pbBuffer1[i] = (BYTE)(dwRandom >> 24);
+        }
 
-            if(SFileGetFileInfo(hFile, SFileInfoNameHash2, &dwHash2, sizeof(dwHash2), &cbHash))
-            {
-                assert(cbHash == sizeof(DWORD));
-            }
+        if((pStream1 = FileStream_CreateFile(szMasterPath, 0)) == NULL)
+            return Logger.PrintError(_T("Failed to create %s"), szMasterPath);
+        if(!FileStream_Write(pStream1, NULL, pbBuffer1, dwFileSize))
+            dwErrCode = Logger.PrintError(_T("Failed to write %s"), szMasterPath);
+        FileStream_Close(pStream1);
+    }
 
-            if(dwHash1 != pItem->dwHash1 || dwHash2 != pItem->dwHash2)
-            {
-                dwErrCode = Logger.PrintError("Name hash values mismatch on %s", pItem->szFileName);
-            }
+    // Open both master and mirror file
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        pStream1 = FileStream_OpenFile(szMasterPath, STREAM_FLAG_READ_ONLY);
+        pStream2 = FileStream_OpenFile(szMirrorPath, STREAM_FLAG_READ_ONLY | STREAM_FLAG_USE_BITMAP);
+        if(pStream1 == NULL || pStream2 == NULL)
+            dwErrCode = Logger.PrintError(_T("Failed to open %s"), szMirrorPath);
+    }
+
+    // Queue the second half of the file, then the whole file
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        Logger.PrintProgress("Prefetching the mirror ...");
+        if(!FileStream_Prefetch(pStream2, dwFileSize / 2, dwFileSize) || !FileStream_Prefetch(pStream2, 0, dwFileSize))
+            dwErrCode = Logger.PrintError("Failed to start the prefetch");
+    }
+
+    // Read the file while the prefetch runs
+    for(DWORD i = 0; i < 0x40 && dwErrCode == ERROR_SUCCESS; i++)
+    {
+        dwRandom = dwRandom * 1103515245 + 12345;
+        ByteOffset = (dwRandom >> 8) % (dwFileSize - 0x10000);
+        dwErrCode = CompareStreamRange(Logger, pStream1, pStream2, pbBuffer1, pbBuffer2, ByteOffset, 0x10000);
+    }
 
+    // Wait until the whole file is loaded. No read may be needed then
+    if(dwErrCode == ERROR_SUCCESS && !FileStream_WaitPrefetch(pStream2))
+        dwErrCode = Logger.PrintError("The prefetch failed");
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CheckStreamComplete(Logger, pStream2);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CompareStreamRange(Logger, pStream1, pStream2, pbBuffer1, pbBuffer2, 0, dwFileSize);
+    if(pStream2 != NULL)
+        FileStream_Close(pStream2);
+    pStream2 = NULL;
+
+    // Cancel the prefetch of a new mirror. The loaded blocks stay in the mirror
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        _tremove(szCopyPath);
+        if((pStream2 = FileStream_OpenFile(szMirrorPath, STREAM_FLAG_READ_ONLY | STREAM_FLAG_USE_BITMAP)) == NULL)
+            dwErrCode = Logger.PrintError(_T("Failed to open %s"), szMirrorPath);
+    }
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        Logger.PrintProgress("Cancelling the prefetch ...");
+        if(!FileStream_Prefetch(pStream2, 0, dwFileSize) || !FileStream_CancelPrefetch(pStream2))
+            dwErrCode = Logger.PrintError("Failed to cancel the prefetch");
+        if(dwErrCode == ERROR_SUCCESS && !FileStream_WaitPrefetch(pStream2) && SErrGetLastError() != ERROR_CAN_NOT_COMPLETE)
+            dwErrCode = Logger.PrintError("Unexpected result of a cancelled prefetch");
+    }
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CheckStreamBlockStats(Logger, pStream2);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CompareStreamRange(Logger, pStream1, pStream2, pbBuffer1, pbBuffer2, 0, dwFileSize);
+    if(pStream2 != NULL)
+        FileStream_Close(pStream2);
+    if(pStream1 != NULL)
+        FileStream_Close(pStream1);
+
+    // Create an MPQ with files of random data
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CreateNewArchive(&Logger, szMpqName, MPQ_CREATE_ARCHIVE_V4 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, dwFileCount, &hMpq);
+    for(DWORD i = 0; i < dwFileCount && dwErrCode == ERROR_SUCCESS; i++)
+    {
+        sprintf(szFileName, "File%02u.bin", i);
+        if(SFileCreateFile(hMpq, szFileName, 0, cbMpqFile, 0, MPQ_FILE_COMPRESS, &hFile))
+        {
+            if(!SFileWriteFile(hFile, pbBuffer1 + i * cbMpqFile, cbMpqFile, MPQ_COMPRESSION_ZLIB))
+                dwErrCode = Logger.PrintError("Failed to write data to the MPQ");
             SFileCloseFile(hFile);
         }
+        else
+        {
+            dwErrCode = Logger.PrintError("Failed to create a file in the MPQ");
+        }
     }
-    return dwErrCode;
-}
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    hMpq = NULL;
 
-static DWORD TestOpenArchive_ExtraType(TLogHelper & Logger, HANDLE hMpq, DWORD dwSearchFlags, const void * pExtra)
-{
-    switch(GetExtraType(pExtra))
+    // Open the mirror of the MPQ and prefetch it while reading the files
+    if(dwErrCode == ERROR_SUCCESS)
     {
-        case ListFile:
-            return TestOpenArchive_Extra_ListFile(Logger, hMpq, (PTEST_EXTRA_ONEFILE)(pExtra));
+        CreateFullPathName(szMasterPath, _countof(szMasterPath), NULL, szMpqName);
+        _tremove(szCopyPath);
+        _stprintf(szMirrorPath, _T("%s*%s"), szCopyPath, szMasterPath);
 
-        case Utf8File:
-            return TestOpenArchive_Extra_Utf8File(Logger, hMpq, (PTEST_EXTRA_UTF8)(pExtra));
+        if(!SFileOpenArchive(szMirrorPath, 0, MPQ_OPEN_READ_ONLY, &hMpq))
+            dwErrCode = Logger.PrintError(_T("Failed to open %s"), szMirrorPath);
+        else if(!SFilePrefetchArchive(hMpq, 0))
+            dwErrCode = Logger.PrintError("Failed to start the prefetch of the MPQ");
+    }
+    for(DWORD i = dwFileCount; i > 0 && dwErrCode == ERROR_SUCCESS; i--)
+    {
+        sprintf(szFileName, "File%02u.bin", i - 1);
+        Logger.PrintProgress("Reading %s ...", szFileName);
+        if(!SFileOpenFileEx(hMpq, szFileName, 0, &hFile))
+            dwErrCode = Logger.PrintError("Failed to open %s", szFileName);
+        if(dwErrCode == ERROR_SUCCESS)
+        {
+            if(!SFileReadFile(hFile, pbBuffer2, cbMpqFile, &dwBytesRead, NULL) || dwBytesRead != cbMpqFile)
+                dwErrCode = Logger.PrintError("Failed to read %s", szFileName);
+            else if(memcmp(pbBuffer2, pbBuffer1 + (i - 1) * cbMpqFile, cbMpqFile))
+                dwErrCode = Logger.PrintError("Data of %s differ", szFileName);
+            SFileCloseFile(hFile);
+        }
+    }
 
-        case TwoFiles:
-            return TestOpenArchive_Extra_TwoFiles(Logger, hMpq, dwSearchFlags, (PTEST_EXTRA_TWOFILES)(pExtra));
+    // Wait for the prefetch and check that the whole mirror is loaded
+    if(dwErrCode == ERROR_SUCCESS && !SFilePrefetchArchive(hMpq, SFILE_PREFETCH_WAIT))
+        dwErrCode = Logger.PrintError("The prefetch of the MPQ failed");
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        SFileGetFileInfo(hMpq, SFileMpqStreamBitmap, NULL, 0, &cbBitmap);
+        if((pBitmap = (TStreamBitmap *)STORM_ALLOC(BYTE, cbBitmap)) == NULL)
+            dwErrCode = Logger.PrintError("Failed to allocate the stream bitmap");
+        else if(!SFileGetFileInfo(hMpq, SFileMpqStreamBitmap, pBitmap, cbBitmap, NULL))
+            dwErrCode = Logger.PrintError("Failed to retrieve the stream bitmap");
+    }
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        Bitmap = (LPBYTE)(pBitmap + 1);
+        for(DWORD i = 0; i < pBitmap->BlockCount && dwErrCode == ERROR_SUCCESS; i++)
+        {
+            if((Bitmap[i / 8] & (1 << (i & 7))) == 0)
+                dwErrCode = Logger.PrintErrorVa("Block %u of the MPQ has not been prefetched", i);
+        }
+    }
+    if(pBitmap != NULL)
+        STORM_FREE(pBitmap);
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
 
-        case PatchList:
-            return TestOpenArchive_Extra_Patches(Logger, hMpq, (PTEST_EXTRA_PATCHES)(pExtra));
+    STORM_FREE(pbBuffer2);
+    STORM_FREE(pbBuffer1);
+    return Logger.PrintVerdict(dwErrCode);
+}
 
-        case HashValues:
-            return TestOpenArchive_Extra_HashValues(Logger, hMpq, (PTEST_EXTRA_HASHVALS)(pExtra));
+#ifndef STORMLIB_WINDOWS
 
-        default:
-            return ERROR_SUCCESS;
+// Loopback HTTP/1.1 server serving one file from memory
+struct THttpTestServer
+{
+    STORM_LOCK Lock;                        // Guards the counters and the stop flag
+    LPBYTE pbFileData;                      // Data of the served file
+    DWORD cbFileData;                       // Size of the served file
+    DWORD dwRequestsPerConnection;          // If nonzero, the server silently drops the connection after this number of requests
+    DWORD dwConnections;                    // Number of accepted connections
+    DWORD dwRequests;                       // Number of received requests
+    int hListen;                            // Listening socket
+    int nPort;                              // Port on 127.0.0.1
+    bool bStop;                             // Set when the server thread should end
+};
+
+static bool HttpTestServer_Send(int hSocket, const void * pvData, size_t cbData)
+{
+    const char * pbData = (const char *)pvData;
+
+    while(cbData != 0)
+    {
+#ifdef MSG_NOSIGNAL
+        ssize_t nSent = send(hSocket, pbData, cbData, MSG_NOSIGNAL);
+#else
+        ssize_t nSent = send(hSocket, pbData, cbData, 0);
+#endif
+        if(nSent <= 0)
+            return false;
+        pbData += nSent;
+        cbData -= nSent;
     }
+    return true;
 }
 
-static DWORD TestOpenArchive_ModifyArchive(TLogHelper & Logger, HANDLE hMpq, DWORD dwFlags)
+static void HttpTestServer_Serve(THttpTestServer * pServer, int hSocket)
 {
-    DWORD dwExpectedError;
-    DWORD dwErrCode = ERROR_SUCCESS;
-    TCHAR szFullPath[MAX_PATH];
+    char szRequest[0x1000];
+    char szHeader[0x200];
+    DWORD dwMaxRequests = 0;
+    DWORD dwRequests = 0;
 
-    // Modify the archive, if required
-    if(dwFlags & TFLG_MODIFY)
+    for(;;)
     {
-        Logger.PrintProgress("Modifying archive ...");
+        const char * szRange;
+        size_t cbRequest = 0;
+        ssize_t nReceived;
+        DWORD dwStartOffset = 0;
+        DWORD dwEndOffset = pServer->cbFileData - 1;
+        bool bIsHead;
 
-        if(dwFlags & TFLG_BIGFILE)
+        // Receive the request. The client never sends the next request before it gets the response
+        szRequest[0] = 0;
+        while(strstr(szRequest, "\r\n\r\n") == NULL)
         {
-            dwExpectedError = (dwFlags & TFLG_WILL_FAIL) ? ERROR_DISK_FULL : ERROR_SUCCESS;
+            if(cbRequest >= sizeof(szRequest) - 1 || (nReceived = recv(hSocket, szRequest + cbRequest, sizeof(szRequest) - 1 - cbRequest, 0)) <= 0)
+                return;
+            cbRequest += nReceived;
+            szRequest[cbRequest] = 0;
+        }
 
-            CreateFullPathName(szFullPath, _countof(szFullPath), szDataFileDir, _T("new-file-big.mp4"));
-            dwErrCode = AddLocalFileToMpq(&Logger, hMpq, "added-extra-file.mp4", szFullPath);
-            dwErrCode = (dwErrCode == dwExpectedError) ? ERROR_SUCCESS : ERROR_FILE_CORRUPT;
+        StormLock_Enter(&pServer->Lock);
+        dwMaxRequests = pServer->dwRequestsPerConnection;
+        pServer->dwRequests++;
+        StormLock_Leave(&pServer->Lock);
+        bIsHead = (strncmp(szRequest, "HEAD ", 5) == 0);
+
+        // Only "/StormLibTest.bin" exists
+        if(strncmp(szRequest + (bIsHead ? 5 : 4), "/StormLibTest.bin ", 18))
+        {
+            strcpy(szHeader, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+            if(!HttpTestServer_Send(hSocket, szHeader, strlen(szHeader)))
+                return;
+            continue;
+        }
+
+        // Send either the whole file or the requested range
+        if((szRange = strstr(szRequest, "\r\nRange: bytes=")) != NULL)
+        {
+            sscanf(szRange + 15, "%u-%u", &dwStartOffset, &dwEndOffset);
+            if(dwEndOffset >= pServer->cbFileData)
+                dwEndOffset = pServer->cbFileData - 1;
+            sprintf(szHeader, "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %u-%u/%u\r\nContent-Length: %u\r\n\r\n",
+                              dwStartOffset, dwEndOffset, pServer->cbFileData, dwEndOffset - dwStartOffset + 1);
         }
         else
         {
-            dwExpectedError = (dwFlags & TFLG_READ_ONLY) ? ERROR_ACCESS_DENIED : ERROR_SUCCESS;
-            dwErrCode = AddFileToMpq(&Logger, hMpq, "AddedFile01.txt", "This is a file added to signed MPQ", MPQ_FILE_COMPRESS, 0, dwExpectedError);
+            sprintf(szHeader, "HTTP/1.1 200 OK\r\nAccept-Ranges: bytes\r\nContent-Length: %u\r\n\r\n", pServer->cbFileData);
         }
+
+        if(!HttpTestServer_Send(hSocket, szHeader, strlen(szHeader)))
+            return;
+        if(bIsHead == false && !HttpTestServer_Send(hSocket, pServer->pbFileData + dwStartOffset, dwEndOffset - dwStartOffset + 1))
+            return;
+
+        // Simulate a server that closes idle keep-alive connections
+        if(dwMaxRequests != 0 && ++dwRequests >= dwMaxRequests)
+            return;
     }
-    return dwErrCode;
 }
 
-static DWORD TestOpenArchive_SignArchive(TLogHelper & Logger, HANDLE hMpq, DWORD dwDoItIfNonZero)
+static void HttpTestServer_Thread(void * pvParam)
 {
-    // Sign the MPQ archive, if required
-    if(dwDoItIfNonZero)
+    THttpTestServer * pServer = (THttpTestServer *)pvParam;
+    bool bStop = false;
+    int nOption = 1;
+
+    while(bStop == false)
     {
-        Logger.PrintProgress("Signing the MPQ ...");
-        if(!SFileSignArchive(hMpq, SIGNATURE_TYPE_WEAK))
+        int hSocket = accept(pServer->hListen, NULL, NULL);
+
+        if(hSocket == -1)
+            break;
+
+        StormLock_Enter(&pServer->Lock);
+        if((bStop = pServer->bStop) == false)
+            pServer->dwConnections++;
+        StormLock_Leave(&pServer->Lock);
+
+        // Don't delay the body after the response header
+        if(bStop == false)
         {
-            Logger.PrintMessage("Failed to create archive signature");
-            return ERROR_FILE_CORRUPT;
+            setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, &nOption, sizeof(nOption));
+            HttpTestServer_Serve(pServer, hSocket);
         }
+        close(hSocket);
     }
-    return ERROR_SUCCESS;
 }
 
-static DWORD TestOpenArchive_GetFileInfo(TLogHelper & Logger, HANDLE hMpq, DWORD dwFlags)
+static bool HttpTestServer_Start(THttpTestServer * pServer, STORM_THREAD * pThread)
 {
-    if(dwFlags & TFLG_GET_FILE_INFO)
+    struct sockaddr_in Address;
+    socklen_t cbAddress = sizeof(Address);
+
+    // Listen on an ephemeral port of the loopback interface
+    memset(&Address, 0, sizeof(Address));
+    Address.sin_family = AF_INET;
+    Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if((pServer->hListen = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        return false;
+    if(bind(pServer->hListen, (struct sockaddr *)&Address, sizeof(Address)) == 0 && listen(pServer->hListen, 4) == 0)
     {
-        TMPQHeader Header = {0};
-        HANDLE hFile = NULL;
-        DWORD dwExpectedError;
-        DWORD cbLength;
-        BYTE DataBuff[0x400];
+        if(getsockname(pServer->hListen, (struct sockaddr *)&Address, &cbAddress) == 0)
+        {
+            pServer->nPort = ntohs(Address.sin_port);
+            if(StormThread_Create(pThread, HttpTestServer_Thread, pServer))
+                return true;
+        }
+    }
 
-        // Retrieve the version of the MPQ
-        Logger.PrintProgress("Checking SFileGetFileInfo");
-        SFileGetFileInfo(hMpq, SFileMpqHeader, &Header, sizeof(TMPQHeader), NULL);
+    close(pServer->hListen);
+    return false;
+}
 
-        // Test on invalid archive/file handle
-        TestGetFileInfo(&Logger, NULL, SFileMpqBetHeader,  NULL, 0, NULL, false, ERROR_INVALID_HANDLE);
-        TestGetFileInfo(&Logger, NULL, SFileInfoInvalid,   NULL, 0, NULL, false, ERROR_INVALID_HANDLE);
-        TestGetFileInfo(&Logger, NULL, SFileInfoNameHash1, NULL, 0, NULL, false, ERROR_INVALID_HANDLE);
+static void HttpTestServer_Stop(THttpTestServer * pServer, STORM_THREAD Thread)
+{
+    struct sockaddr_in Address;
+    int hSocket;
 
-        // Valid handle but all parameters NULL
-        dwExpectedError = (Header.wFormatVersion == MPQ_FORMAT_VERSION_4) ? ERROR_INSUFFICIENT_BUFFER : ERROR_FILE_NOT_FOUND;
-        TestGetFileInfo(&Logger, hMpq, SFileMpqBetHeader, NULL, 0, NULL, false, dwExpectedError);
-        TestGetFileInfo(&Logger, hMpq, SFileMpqBetHeader, NULL, 0, &cbLength, false, dwExpectedError);
+    StormLock_Enter(&pServer->Lock);
+    pServer->bStop = true;
+    StormLock_Leave(&pServer->Lock);
 
-        // When we call SFileInfo with buffer = NULL and nonzero buffer size, it is ignored
-        TestGetFileInfo(&Logger, hMpq, SFileMpqBetHeader, NULL, 3, &cbLength, false, dwExpectedError);
+    // Wake up the accept() with a dummy connection
+    memset(&Address, 0, sizeof(Address));
+    Address.sin_family = AF_INET;
+    Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    Address.sin_port = htons((unsigned short)pServer->nPort);
+    if((hSocket = socket(AF_INET, SOCK_STREAM, 0)) != -1)
+    {
+        connect(hSocket, (struct sockaddr *)&Address, sizeof(Address));
+        close(hSocket);
+    }
 
-        // When we call SFileInfo with buffer != NULL and nonzero buffer size, it should return error
-        TestGetFileInfo(&Logger, hMpq, SFileMpqBetHeader, DataBuff, 3, &cbLength, false, dwExpectedError);
+    StormThread_Wait(Thread);
+    close(pServer->hListen);
+}
 
-        // Request for bet table header should also succeed if we want header only
-        dwExpectedError = (Header.wFormatVersion == MPQ_FORMAT_VERSION_4) ? ERROR_SUCCESS : ERROR_FILE_NOT_FOUND;
-        TestGetFileInfo(&Logger, hMpq, SFileMpqBetHeader, DataBuff, sizeof(TMPQBetHeader), &cbLength, (dwExpectedError == ERROR_SUCCESS), dwExpectedError);
-        TestGetFileInfo(&Logger, hMpq, SFileMpqBetHeader, DataBuff, sizeof(DataBuff), &cbLength, (dwExpectedError == ERROR_SUCCESS), dwExpectedError);
+// Returns the counters of the server and resets them
+static void HttpTestServer_GetCounters(THttpTestServer * pServer, DWORD * pdwConnections, DWORD * pdwRequests)
+{
+    StormLock_Enter(&pServer->Lock);
+    *pdwConnections = pServer->dwConnections;
+    *pdwRequests = pServer->dwRequests;
+    pServer->dwConnections = pServer->dwRequests = 0;
+    StormLock_Leave(&pServer->Lock);
+}
 
-        // Try to retrieve strong signature from the MPQ
-        dwExpectedError = (Header.wFormatVersion == MPQ_FORMAT_VERSION_4) ? ERROR_FILE_NOT_FOUND : ERROR_INSUFFICIENT_BUFFER;
-        TestGetFileInfo(&Logger, hMpq, SFileMpqStrongSignature, NULL, 0, NULL, false, dwExpectedError);
-        TestGetFileInfo(&Logger, hMpq, SFileMpqStrongSignature, NULL, 0, &cbLength, false, dwExpectedError);
-        if(Header.wFormatVersion == MPQ_FORMAT_VERSION_1)
-            assert(cbLength == MPQ_STRONG_SIGNATURE_SIZE + 4);
+// Reads a file from a loopback HTTP server, both directly and through a mirror file.
+// Verifies that the connection is kept alive, that the read-ahead saves requests
+// and that the mirror loads each run of missing blocks with one range request
+static DWORD TestFileStream_HttpMirror(LPCTSTR szMirrorName, DWORD dwFileSize)
+{
+    THttpTestServer Server;
+    STORM_THREAD Thread;
+    TStreamBlockStats Stats;
+    TFileStream * pStream = NULL;
+    TLogHelper Logger("HttpMirrorTest", szMirrorName);
+    ULONGLONG ByteOffset;
+    ULONGLONG FileSize = 0;
+    TCHAR szMirrorPath[MAX_PATH + MAX_PATH];
+    TCHAR szCopyPath[MAX_PATH];
+    TCHAR szUrl[MAX_PATH];
+    LPBYTE pbFileData = STORM_ALLOC(BYTE, dwFileSize);
+    LPBYTE pbBuffer = STORM_ALLOC(BYTE, dwFileSize);
+    DWORD dwConnections = 0;
+    DWORD dwRequests = 0;
+    DWORD dwRandom = 0x1234ABCD;
+    DWORD dwErrCode = ERROR_SUCCESS;
 
-        // Retrieve the signature
-        dwExpectedError = (Header.wFormatVersion == MPQ_FORMAT_VERSION_4) ? ERROR_FILE_NOT_FOUND : ERROR_SUCCESS;
-        TestGetFileInfo(&Logger, hMpq, SFileMpqStrongSignature, DataBuff, sizeof(DataBuff), &cbLength, (dwExpectedError == ERROR_SUCCESS), dwExpectedError);
-        if(Header.wFormatVersion == MPQ_FORMAT_VERSION_1)
-            assert(memcmp(DataBuff, "NGIS", 4) == 0);
+    if(pbFileData == NULL || pbBuffer == NULL)
+    {
+        STORM_FREE(pbBuffer);
+        STORM_FREE(pbFileData);
+        return Logger.PrintError("Failed to allocate buffers");
+    }
 
-        // Check SFileGetFileInfo on a listfile
-        if(SFileOpenFileEx(hMpq, LISTFILE_NAME, 0, &hFile))
+    // Prepare the file data and start the server
+    for(DWORD i = 0; i < dwFileSize; i++)
+    {
+        dwRandom = dwRandom * 1103515245 + 12345;
+        pbFileData[i] = (BYTE)(dwRandom >> 24);
+    }
+    memset(&Server, 0, sizeof(THttpTestServer));
+    StormLock_Init(&Server.Lock);
+    Server.pbFileData = pbFileData;
+    Server.cbFileData = dwFileSize;
+    if(!HttpTestServer_Start(&Server, &Thread))
+    {
+        StormLock_Free(&Server.Lock);
+        STORM_FREE(pbBuffer);
+        STORM_FREE(pbFileData);
+        return Logger.PrintError("Failed to start the HTTP server");
+    }
+    _stprintf(szUrl, _T("http://127.0.0.1:%u/StormLibTest.bin"), (unsigned int)Server.nPort);
+
+    // Missing file must not open
+    if((pStream = FileStream_OpenFile(_T("http://127.0.0.1:1/StormLibTest.bin"), STREAM_FLAG_READ_ONLY)) != NULL)
+    {
+        dwErrCode = Logger.PrintError("Connection to a closed port succeeded");
+        FileStream_Close(pStream);
+    }
+
+    // Direct HTTP stream: sequential small reads are served from the read-ahead data
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        Logger.PrintProgress("Reading directly from the server ...");
+        if((pStream = FileStream_OpenFile(szUrl, STREAM_FLAG_READ_ONLY)) == NULL)
+            dwErrCode = Logger.PrintError(_T("Failed to open %s"), szUrl);
+    }
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        if(!FileStream_GetSize(pStream, &FileSize) || FileSize != dwFileSize)
+            dwErrCode = Logger.PrintError("The size of the HTTP file is wrong");
+    }
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        for(DWORD i = 0; i < 0x100000 && dwErrCode == ERROR_SUCCESS; i += 0x1000)
         {
-            TestGetFileInfo(&Logger, hMpq, SFileInfoFileTime, DataBuff, sizeof(DataBuff), &cbLength, false, ERROR_INVALID_HANDLE);
-            TestGetFileInfo(&Logger, hFile, SFileInfoFileTime, DataBuff, sizeof(DataBuff), &cbLength, true, ERROR_SUCCESS);
-            SFileCloseFile(hFile);
+            if(!FileStream_Read(pStream, NULL, pbBuffer + i, 0x1000))
+                dwErrCode = Logger.PrintError("Failed to read from the server");
+        }
+        if(dwErrCode == ERROR_SUCCESS && memcmp(pbBuffer, pbFileData, 0x100000))
+            dwErrCode = Logger.PrintError("Data read from the server differ");
+
+        // One HEAD request plus one request for each read-ahead
+        HttpTestServer_GetCounters(&Server, &dwConnections, &dwRequests);
+        if(dwErrCode == ERROR_SUCCESS && (dwConnections != 1 || dwRequests != 1 + (0x100000 / 0x10000)))
+            dwErrCode = Logger.PrintErrorVa("Unexpected number of connections and requests (%u, %u)", dwConnections, dwRequests);
+    }
+
+    // Random reads without read-ahead, including the end of the file
+    if(dwErrCode == ERROR_SUCCESS && !FileStream_SetReadAhead(pStream, 0))
+        dwErrCode = Logger.PrintError("Failed to set the read-ahead");
+    for(DWORD i = 0; i < 0x40 && dwErrCode == ERROR_SUCCESS; i++)
+    {
+        DWORD dwLength = (i == 0) ? 0x10 : ((i * 0x9E3779B1) % 0x20000) + 1;
+
+        dwRandom = dwRandom * 1103515245 + 12345;
+        ByteOffset = (i == 0) ? (dwFileSize - dwLength) : ((dwRandom >> 8) % (dwFileSize - dwLength));
+        if(!FileStream_Read(pStream, &ByteOffset, pbBuffer, dwLength) || memcmp(pbBuffer, pbFileData + ByteOffset, dwLength))
+            dwErrCode = Logger.PrintErrorVa("Failed to read %u bytes from offset " fmt_I64u_a, dwLength, ByteOffset);
+    }
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        ByteOffset = dwFileSize - 0x10;
+        if(FileStream_Read(pStream, &ByteOffset, pbBuffer, 0x20) || SErrGetLastError() != ERROR_HANDLE_EOF)
+            dwErrCode = Logger.PrintError("Reading beyond the end of the file did not fail");
+    }
+    if(pStream != NULL)
+        FileStream_Close(pStream);
+    pStream = NULL;
+
+    // Mirror stream: read scattered ranges, then the whole file
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        Logger.PrintProgress("Reading from the server through a mirror ...");
+        CreateFullPathName(szCopyPath, _countof(szCopyPath), NULL, szMirrorName);
+        _tremove(szCopyPath);
+        _stprintf(szMirrorPath, _T("%s*%s"), szCopyPath, szUrl);
+
+        if((pStream = FileStream_OpenFile(szMirrorPath, STREAM_FLAG_READ_ONLY | STREAM_FLAG_USE_BITMAP)) == NULL)
+            dwErrCode = Logger.PrintError(_T("Failed to open %s"), szMirrorPath);
+    }
+    if(dwErrCode == ERROR_SUCCESS && !FileStream_SetReadAhead(pStream, 0))
+        dwErrCode = Logger.PrintError("Failed to set the read-ahead of the master stream");
+    HttpTestServer_GetCounters(&Server, &dwConnections, &dwRequests);
+    for(DWORD i = 0; i < 0x20 && dwErrCode == ERROR_SUCCESS; i++)
+    {
+        ByteOffset = ((ULONGLONG)i * 0x9E3779B1) % (dwFileSize - 0x100);
+        if(!FileStream_Read(pStream, &ByteOffset, pbBuffer, 0x100) || memcmp(pbBuffer, pbFileData + ByteOffset, 0x100))
+            dwErrCode = Logger.PrintErrorVa("Failed to read 256 bytes from offset " fmt_I64u_a, ByteOffset);
+    }
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        // Each run of missing blocks must be loaded with one request
+        // Bigger reads are split to pieces of 256 KB, which can split a run too
+        FileStream_GetBlockStats(pStream, &Stats);
+        HttpTestServer_GetCounters(&Server, &dwConnections, &dwRequests);
+        ByteOffset = 0;
+        if(!FileStream_Read(pStream, &ByteOffset, pbBuffer, dwFileSize) || memcmp(pbBuffer, pbFileData, dwFileSize))
+            dwErrCode = Logger.PrintError("Failed to read the whole file through the mirror");
+
+        HttpTestServer_GetCounters(&Server, &dwConnections, &dwRequests);
+        if(dwErrCode == ERROR_SUCCESS && (dwConnections != 0 || dwRequests > Stats.MissingRuns + (dwFileSize / 0x40000) + 1))
+            dwErrCode = Logger.PrintErrorVa("Unexpected number of connections and requests (%u, %u)", dwConnections, dwRequests);
+    }
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        // The complete file is in the mirror now
+        ByteOffset = 0;
+        if(!FileStream_Read(pStream, &ByteOffset, pbBuffer, dwFileSize) || memcmp(pbBuffer, pbFileData, dwFileSize))
+            dwErrCode = Logger.PrintError("Failed to read the whole file from the mirror");
+
+        HttpTestServer_GetCounters(&Server, &dwConnections, &dwRequests);
+        if(dwErrCode == ERROR_SUCCESS && dwRequests != 0)
+            dwErrCode = Logger.PrintErrorVa("The complete mirror still sent %u requests", dwRequests);
+    }
+    if(pStream != NULL)
+        FileStream_Close(pStream);
+    pStream = NULL;
+
+    // Server that drops the kept-alive connections: the client must reconnect
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        Logger.PrintProgress("Reading from a server that drops the connections ...");
+        StormLock_Enter(&Server.Lock);
+        Server.dwRequestsPerConnection = 3;
+        StormLock_Leave(&Server.Lock);
+
+        if((pStream = FileStream_OpenFile(szUrl, STREAM_FLAG_READ_ONLY)) == NULL)
+            dwErrCode = Logger.PrintError(_T("Failed to open %s"), szUrl);
+    }
+    for(DWORD i = 0; i < 0x10 && dwErrCode == ERROR_SUCCESS; i++)
+    {
+        ByteOffset = ((ULONGLONG)i * 0x61C88647) % (dwFileSize - 0x1000);
+        if(!FileStream_Read(pStream, &ByteOffset, pbBuffer, 0x1000) || memcmp(pbBuffer, pbFileData + ByteOffset, 0x1000))
+            dwErrCode = Logger.PrintErrorVa("Failed to read 4096 bytes from offset " fmt_I64u_a, ByteOffset);
+    }
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        HttpTestServer_GetCounters(&Server, &dwConnections, &dwRequests);
+        if(dwConnections < 2)
+            dwErrCode = Logger.PrintErrorVa("Expected reconnections, got %u connections", dwConnections);
+    }
+    if(pStream != NULL)
+        FileStream_Close(pStream);
+
+    HttpTestServer_Stop(&Server, Thread);
+    StormLock_Free(&Server.Lock);
+    STORM_FREE(pbBuffer);
+    STORM_FREE(pbFileData);
+    return Logger.PrintVerdict(dwErrCode);
+}
+
+#endif  // STORMLIB_WINDOWS
+
+static DWORD TestArchive_LoadFiles(TLogHelper * pLogger, HANDLE hMpq, DWORD bIgnoreOpenErrors, ...)
+{
+    PFILE_DATA pFileData;
+    const char * szFileName;
+    va_list argList;
+    DWORD dwSearchFlags = (bIgnoreOpenErrors) ? SEARCH_FLAG_IGNORE_ERRORS : 0;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    va_start(argList, bIgnoreOpenErrors);
+    while((szFileName = va_arg(argList, const char *)) != NULL)
+    {
+        if(SFileHasFile(hMpq, szFileName))
+        {
+            dwErrCode = LoadMpqFile(*pLogger, hMpq, szFileName, 0, dwSearchFlags, &pFileData);
+            if(dwErrCode != ERROR_SUCCESS && bIgnoreOpenErrors == 0)
+            {
+                pLogger->PrintError("Error loading the file %s", szFileName);
+                break;
+            }
+            else
+            {
+                dwErrCode = ERROR_SUCCESS;
+                STORM_FREE(pFileData);
+                pFileData = NULL;
+            }
+        }
+    }
+    va_end(argList);
+
+    return dwErrCode;
+}
+
+//-----------------------------------------------------------------------------
+// Testing opening an embedded archives
+
+typedef std::vector<HANDLE> HANDLE_LIST;
+
+static DWORD TestOpenArchive_SearchEmbedded(TLogHelper & Logger, HANDLE_LIST & Mpqs, hash_state & md5_ctx, HANDLE hParentMPQ, LPCTSTR szListFile)
+{
+    SFILE_FIND_DATA sf;
+    HANDLE hChildMPQ;
+    HANDLE hFind;
+    size_t nLength;
+    LPSTR szExtension;
+    DWORD dwErrCode = ERROR_SUCCESS;
+    bool bFound = true;
+
+    // Hash names of all files within the archive. Go recursively.
+    if((hFind = SFileFindFirstFile(hParentMPQ, "*", &sf, szListFile)) != NULL)
+    {
+        while(bFound)
+        {
+            // Add the file name to the MPQ hash
+            nLength = strlen(sf.cFileName);
+            md5_process(&md5_ctx, (unsigned char *)(sf.cFileName), (unsigned long)(nLength));
+            Logger.FileCount++;
+
+            // If the found file is a MPQ, then we open it as embedded MPQ
+            if((szExtension = strrchr(sf.cFileName, '.')) != NULL)
+            {
+                if(!_stricmp(szExtension, ".mpq"))
+                {
+                    // Attempt to open the embedded archive
+                    if(!SFileOpenFileArchive(hParentMPQ, sf.cFileName, 0, 0, &hChildMPQ))
+                    {
+                        Logger.PrintError("Failed to open embedded MPQ: %s", sf.cFileName);
+                        break;
+                    }
+
+                    // Insert the archive handle to the list of MPQs
+                    Mpqs.push_back(hChildMPQ);
+
+                    // Recursively search the MPQ
+                    dwErrCode = TestOpenArchive_SearchEmbedded(Logger, Mpqs, md5_ctx, hChildMPQ, szListFile);
+                    if(dwErrCode != ERROR_SUCCESS)
+                        break;
+                }
+            }
+
+            bFound = SFileFindNextFile(hFind, &sf);
+        }
+        SFileFindClose(hFind);
+    }
+    else
+    {
+        Logger.PrintError("Failed to search the archive");
+        dwErrCode = SErrGetLastError();
+    }
+    return dwErrCode;
+}
+
+static DWORD TestOpenArchive_Embedded(const TEST_INFO1 & MpqInfo)
+{
+    TLogHelper Logger("TestEmbeddedMpq", MpqInfo.szName1);
+    hash_state md5_ctx;
+    HANDLE_LIST Mpqs;
+    HANDLE hParentMPQ = NULL;
+    DWORD dwErrCode = ERROR_SUCCESS;
+    TCHAR szListFile[MAX_PATH] = {0};
+    BYTE md5_hash[MD5_DIGEST_SIZE];
+
+    // Get the listfile
+    if(GetExtraType(MpqInfo.pExtra) == ListFile)
+        CreateFullPathName(szListFile, _countof(szListFile), szListFileDir, ((PTEST_EXTRA_ONEFILE)(MpqInfo.pExtra))->szFile);
+
+    // Copy the archive so we won't fuck up the original one
+    dwErrCode = OpenExistingArchiveWithCopy(&Logger, MpqInfo.szName1, MpqInfo.szName1, &hParentMPQ, 0);
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        // Search the archive for embedded MPQs
+        md5_init(&md5_ctx);
+        dwErrCode = TestOpenArchive_SearchEmbedded(Logger, Mpqs, md5_ctx, hParentMPQ, szListFile);
+        md5_done(&md5_ctx, md5_hash);
+
+        // Close the master MPQ first.
+        // The reference counting should take care of proper memory deallocation
+        SFileCloseArchive(hParentMPQ);
+        hParentMPQ = NULL;
+
+        // Now close each of the child MPQs
+        for(size_t i = 0; i < Mpqs.size(); i++)
+            SFileCloseArchive(Mpqs[i]);
+    }
+
+    // Verify the file count
+    return VerifyFileCountAndHash(Logger, md5_hash, MpqInfo.szDataHash, MpqInfo.dwFlags, Logger.FileCount);
+}
+
+//-----------------------------------------------------------------------------
+// Testing opening a single archive
+
+static DWORD TestOpenArchive_VerifySignature(TLogHelper & Logger, HANDLE hMpq, DWORD dwDoItIfNonZero)
+{
+    ULONGLONG SignatureBytes = 0;
+    DWORD dwSignatures = 0;
+    DWORD dwVerifyError;
+
+    // Only do it if we asked to
+    if(dwDoItIfNonZero)
+    {
+        // Query the signature types
+        Logger.PrintProgress("Retrieving signatures ...");
+        TestGetFileInfo(&Logger, hMpq, SFileMpqSignatures, &dwSignatures, sizeof(DWORD), NULL, true, ERROR_SUCCESS);
+
+        // Are there some signatures at all?
+        if(dwSignatures == 0)
+        {
+            Logger.PrintMessage("No signatures present in the file");
+            return ERROR_FILE_CORRUPT;
+        }
+
+        // Verify any of the present signatures
+        Logger.PrintProgress("Verifying archive signature ...");
+        dwVerifyError = SFileVerifyArchive(hMpq);
+
+        // Verify the result
+        if((dwSignatures & SIGNATURE_TYPE_STRONG) && (dwVerifyError != ERROR_STRONG_SIGNATURE_OK))
+        {
+            Logger.PrintMessage("Strong signature verification error");
+            return ERROR_FILE_CORRUPT;
+        }
+
+        // Verify the result
+        if((dwSignatures & SIGNATURE_TYPE_WEAK) && (dwVerifyError != ERROR_WEAK_SIGNATURE_OK))
+        {
+            Logger.PrintMessage("Weak signature verification error");
+            return ERROR_FILE_CORRUPT;
+        }
+
+        // The amount of the hashed data must be known after the verification
+        TestGetFileInfo(&Logger, hMpq, SFileMpqSignatureBytes, &SignatureBytes, sizeof(ULONGLONG), NULL, true, ERROR_SUCCESS);
+        if(SignatureBytes == 0)
+        {
+            Logger.PrintMessage("No data hashed by the signature verification");
+            return ERROR_FILE_CORRUPT;
         }
     }
     return ERROR_SUCCESS;
 }
 
-static DWORD TestOpenArchive(
-    LPCTSTR szMpqName1,                             // (UTF-8) Name of the MPQ
-    LPCTSTR szMpqName2,                             // (UTF-8) Name of the MPQ (original name or name of a copy)
-    LPCSTR szExpectedHash,                          // Expected name+data hash
-    DWORD dwFlags,                                  // Test flags. Lower bits contains the number of files
-    const void * pExtra)                            // Extra parameter
-{
-    TLogHelper Logger("TestReadingMpq", szMpqName1);
-    HANDLE hMpq = NULL;
-    DWORD dwExpectedFileCount = 0;
-    DWORD dwSearchFlags = 0;
-    DWORD dwOpenFlags = 0;
-    DWORD dwMpqFlags = 0;
-    DWORD dwErrCode;
-    TCHAR szMpqNameBuff[MAX_PATH];
+static DWORD TestOpenArchive_Extra_ListFile(TLogHelper & Logger, HANDLE hMpq, PTEST_EXTRA_ONEFILE pExtra)
+{
+    DWORD dwErrCode = ERROR_SUCCESS;
+    TCHAR szFullName[MAX_PATH];
+
+    if(IS_VALID_STRING(pExtra->szFile))
+    {
+        Logger.PrintProgress(_T("Adding listfile %s ..."), pExtra->szFile);
+        CreateFullPathName(szFullName, _countof(szFullName), szListFileDir, pExtra->szFile);
+        if((dwErrCode = SFileAddListFile(hMpq, szFullName)) != ERROR_SUCCESS)
+            Logger.PrintMessage("Failed to add the listfile to the MPQ");
+    }
+    return dwErrCode;
+}
+
+static DWORD TestOpenArchive_Extra_Utf8File(TLogHelper & Logger, HANDLE hMpq, PTEST_EXTRA_UTF8 pExtra)
+{
+    DWORD dwErrCode = ERROR_SUCCESS;
+    TCHAR szFullName[MAX_PATH];
+    TCHAR szListName[MAX_PATH];
+
+    if(IS_VALID_STRING(pExtra->szListFile))
+    {
+        StringCopy(szListName, _countof(szListName), (const char *)pExtra->szListFile);
+        Logger.PrintProgress(_T("Adding listfile %s ..."), szListName);
+        CreateFullPathName(szFullName, _countof(szFullName), szListFileDir, szListName);
+        if((dwErrCode = SFileAddListFile(hMpq, szFullName)) != ERROR_SUCCESS)
+            Logger.PrintMessage("Failed to add the listfile to the MPQ");
+    }
+    return dwErrCode;
+}
+
+static DWORD TestOpenArchive_Extra_TwoFiles(TLogHelper & Logger, HANDLE hMpq, DWORD dwSearchFlags, PTEST_EXTRA_TWOFILES pExtra)
+{
+    PFILE_DATA pFileData1 = NULL;
+    PFILE_DATA pFileData2 = NULL;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Perform actions
+    for(;;)
+    {
+        // Load and verify the first file, if any
+        if(IS_VALID_STRING(pExtra->szFile1))
+        {
+            if((dwErrCode = LoadMpqFile(Logger, hMpq, pExtra->szFile1, 0, dwSearchFlags, &pFileData1)) != ERROR_SUCCESS)
+                break;
+        }
+
+        // Load and verify the second file, if any
+        if(IS_VALID_STRING(pExtra->szFile2))
+        {
+            if((dwErrCode = LoadMpqFile(Logger, hMpq, pExtra->szFile2, 0, dwSearchFlags, &pFileData2)) != ERROR_SUCCESS)
+                break;
+        }
+
+        // If two files were given, they must be equal
+        if(pFileData1 && pFileData2)
+        {
+            dwErrCode = CompareTwoFiles(Logger, pFileData1, pFileData2);
+        }
+        break;
+    }
+
+    // Free buffers and exit
+    if(pFileData2 != NULL)
+        STORM_FREE(pFileData2);
+    if(pFileData1 != NULL)
+        STORM_FREE(pFileData1);
+    return dwErrCode;
+}
+
+static DWORD TestOpenArchive_Extra_Patches(TLogHelper & Logger, HANDLE hMpq, PTEST_EXTRA_PATCHES pExtra)
+{
+    LPCTSTR szPatch;
+    TCHAR szFullPath[MAX_PATH];
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Open all patches that are in the multi-SZ list
+    if(IS_VALID_STRING(pExtra->szPatchList))
+    {
+        for(szPatch = pExtra->szPatchList; szPatch[0] != 0; szPatch = szPatch + _tcslen(szPatch) + 1)
+        {
+            Logger.PrintProgress(_T("Adding patch %s ..."), GetShortPlainName(szPatch));
+            CreateFullPathName(szFullPath, _countof(szFullPath), szMpqPatchDir, szPatch);
+            if(!SFileOpenPatchArchive(hMpq, szFullPath, NULL, 0))
+                return Logger.PrintError(_T("Failed to add patch %s ..."), szFullPath);
+        }
+    }
+
+    // Verify the patch count of the given file
+    if(IS_VALID_STRING(pExtra->szFileName))
+        dwErrCode = VerifyFilePatchCount(&Logger, hMpq, pExtra->szFileName, pExtra->dwPatchCount);
+    return dwErrCode;
+}
+
+static DWORD TestOpenArchive_Extra_HashValues(TLogHelper & Logger, HANDLE hMpq, PTEST_EXTRA_HASHVALS pExtra)
+{
+    HANDLE hFile = NULL;
+    DWORD dwErrCode = ERROR_SUCCESS;
+    DWORD dwHash1 = 0;
+    DWORD dwHash2 = 0;
+    DWORD cbHash = 0;
+
+    for(size_t i = 0; i < _countof(pExtra->Items); i++)
+    {
+        PTEST_EXTRA_HASHVAL pItem = &pExtra->Items[i];
+
+        if(SFileOpenFileEx(hMpq, pItem->szFileName, 0, &hFile))
+        {
+            if(SFileGetFileInfo(hFile, SFileInfoNameHash1, &dwHash1, sizeof(dwHash1), &cbHash))
+            {
+                assert(cbHash == sizeof(DWORD));
+            }
+
+            if(SFileGetFileInfo(hFile, SFileInfoNameHash2, &dwHash2, sizeof(dwHash2), &cbHash))
+            {
+                assert(cbHash == sizeof(DWORD));
+            }
+
+            if(dwHash1 != pItem->dwHash1 || dwHash2 != pItem->dwHash2)
+            {
+                dwErrCode = Logger.PrintError("Name hash values mismatch on %s", pItem->szFileName);
+            }
+
+            SFileCloseFile(hFile);
+        }
+    }
+    return dwErrCode;
+}
+
+static DWORD TestOpenArchive_ExtraType(TLogHelper & Logger, HANDLE hMpq, DWORD dwSearchFlags, const void * pExtra)
+{
+    switch(GetExtraType(pExtra))
+    {
+        case ListFile:
+            return TestOpenArchive_Extra_ListFile(Logger, hMpq, (PTEST_EXTRA_ONEFILE)(pExtra));
+
+        case Utf8File:
+            return TestOpenArchive_Extra_Utf8File(Logger, hMpq, (PTEST_EXTRA_UTF8)(pExtra));
+
+        case TwoFiles:
+            return TestOpenArchive_Extra_TwoFiles(Logger, hMpq, dwSearchFlags, (PTEST_EXTRA_TWOFILES)(pExtra));
+
+        case PatchList:
+            return TestOpenArchive_Extra_Patches(Logger, hMpq, (PTEST_EXTRA_PATCHES)(pExtra));
+
+        case HashValues:
+            return TestOpenArchive_Extra_HashValues(Logger, hMpq, (PTEST_EXTRA_HASHVALS)(pExtra));
+
+        default:
+            return ERROR_SUCCESS;
+    }
+}
+
+static DWORD TestOpenArchive_ModifyArchive(TLogHelper & Logger, HANDLE hMpq, DWORD dwFlags)
+{
+    DWORD dwExpectedError;
+    DWORD dwErrCode = ERROR_SUCCESS;
+    TCHAR szFullPath[MAX_PATH];
+
+    // Modify the archive, if required
+    if(dwFlags & TFLG_MODIFY)
+    {
+        Logger.PrintProgress("Modifying archive ...");
+
+        if(dwFlags & TFLG_BIGFILE)
+        {
+            dwExpectedError = (dwFlags & TFLG_WILL_FAIL) ? ERROR_DISK_FULL : ERROR_SUCCESS;
+
+            CreateFullPathName(szFullPath, _countof(szFullPath), szDataFileDir, _T("new-file-big.mp4"));
+            dwErrCode = AddLocalFileToMpq(&Logger, hMpq, "added-extra-file.mp4", szFullPath);
+            dwErrCode = (dwErrCode == dwExpectedError) ? ERROR_SUCCESS : ERROR_FILE_CORRUPT;
+        }
+        else
+        {
+            dwExpectedError = (dwFlags & TFLG_READ_ONLY) ? ERROR_ACCESS_DENIED : ERROR_SUCCESS;
+            dwErrCode = AddFileToMpq(&Logger, hMpq, "AddedFile01.txt", "This is a file added to signed MPQ", MPQ_FILE_COMPRESS, 0, dwExpectedError);
+        }
+    }
+    return dwErrCode;
+}
+
+static DWORD TestOpenArchive_SignArchive(TLogHelper & Logger, HANDLE hMpq, DWORD dwDoItIfNonZero)
+{
+    // Sign the MPQ archive, if required
+    if(dwDoItIfNonZero)
+    {
+        Logger.PrintProgress("Signing the MPQ ...");
+        if(!SFileSignArchive(hMpq, SIGNATURE_TYPE_WEAK))
+        {
+            Logger.PrintMessage("Failed to create archive signature");
+            return ERROR_FILE_CORRUPT;
+        }
+    }
+    return ERROR_SUCCESS;
+}
+
+static DWORD TestOpenArchive_GetFileInfo(TLogHelper & Logger, HANDLE hMpq, DWORD dwFlags)
+{
+    if(dwFlags & TFLG_GET_FILE_INFO)
+    {
+        TMPQHeader Header = {0};
+        HANDLE hFile = NULL;
+        DWORD dwExpectedError;
+        DWORD cbLength;
+        BYTE DataBuff[0x400];
+
+        // Retrieve the version of the MPQ
+        Logger.PrintProgress("Checking SFileGetFileInfo");
+        SFileGetFileInfo(hMpq, SFileMpqHeader, &Header, sizeof(TMPQHeader), NULL);
+
+        // Test on invalid archive/file handle
+        TestGetFileInfo(&Logger, NULL, SFileMpqBetHeader,  NULL, 0, NULL, false, ERROR_INVALID_HANDLE);
+        TestGetFileInfo(&Logger, NULL, SFileInfoInvalid,   NULL, 0, NULL, false, ERROR_INVALID_HANDLE);
+        TestGetFileInfo(&Logger, NULL, SFileInfoNameHash1, NULL, 0, NULL, false, ERROR_INVALID_HANDLE);
+
+        // Valid handle but all parameters NULL
+        dwExpectedError = (Header.wFormatVersion == MPQ_FORMAT_VERSION_4) ? ERROR_INSUFFICIENT_BUFFER : ERROR_FILE_NOT_FOUND;
+        TestGetFileInfo(&Logger, hMpq, SFileMpqBetHeader, NULL, 0, NULL, false, dwExpectedError);
+        TestGetFileInfo(&Logger, hMpq, SFileMpqBetHeader, NULL, 0, &cbLength, false, dwExpectedError);
+
+        // When we call SFileInfo with buffer = NULL and nonzero buffer size, it is ignored
+        TestGetFileInfo(&Logger, hMpq, SFileMpqBetHeader, NULL, 3, &cbLength, false, dwExpectedError);
+
+        // When we call SFileInfo with buffer != NULL and nonzero buffer size, it should return error
+        TestGetFileInfo(&Logger, hMpq, SFileMpqBetHeader, DataBuff, 3, &cbLength, false, dwExpectedError);
+
+        // Request for bet table header should also succeed if we want header only
+        dwExpectedError = (Header.wFormatVersion == MPQ_FORMAT_VERSION_4) ? ERROR_SUCCESS : ERROR_FILE_NOT_FOUND;
+        TestGetFileInfo(&Logger, hMpq, SFileMpqBetHeader, DataBuff, sizeof(TMPQBetHeader), &cbLength, (dwExpectedError == ERROR_SUCCESS), dwExpectedError);
+        TestGetFileInfo(&Logger, hMpq, SFileMpqBetHeader, DataBuff, sizeof(DataBuff), &cbLength, (dwExpectedError == ERROR_SUCCESS), dwExpectedError);
+
+        // Try to retrieve strong signature from the MPQ
+        dwExpectedError = (Header.wFormatVersion == MPQ_FORMAT_VERSION_4) ? ERROR_FILE_NOT_FOUND : ERROR_INSUFFICIENT_BUFFER;
+        TestGetFileInfo(&Logger, hMpq, SFileMpqStrongSignature, NULL, 0, NULL, false, dwExpectedError);
+        TestGetFileInfo(&Logger, hMpq, SFileMpqStrongSignature, NULL, 0, &cbLength, false, dwExpectedError);
+        if(Header.wFormatVersion == MPQ_FORMAT_VERSION_1)
+            assert(cbLength == MPQ_STRONG_SIGNATURE_SIZE + 4);
+
+        // Retrieve the signature
+        dwExpectedError = (Header.wFormatVersion == MPQ_FORMAT_VERSION_4) ? ERROR_FILE_NOT_FOUND : ERROR_SUCCESS;
+        TestGetFileInfo(&Logger, hMpq, SFileMpqStrongSignature, DataBuff, sizeof(DataBuff), &cbLength, (dwExpectedError == ERROR_SUCCESS), dwExpectedError);
+        if(Header.wFormatVersion == MPQ_FORMAT_VERSION_1)
+            assert(memcmp(DataBuff, "NGIS", 4) == 0);
+
+        // Check SFileGetFileInfo on a listfile
+        if(SFileOpenFileEx(hMpq, LISTFILE_NAME, 0, &hFile))
+        {
+            TestGetFileInfo(&Logger, hMpq, SFileInfoFileTime, DataBuff, sizeof(DataBuff), &cbLength, false, ERROR_INVALID_HANDLE);
+            TestGetFileInfo(&Logger, hFile, SFileInfoFileTime, DataBuff, sizeof(DataBuff), &cbLength, true, ERROR_SUCCESS);
+            SFileCloseFile(hFile);
+        }
+    }
+    return ERROR_SUCCESS;
+}
+
+static DWORD TestOpenArchive(
+    LPCTSTR szMpqName1,                             // (UTF-8) Name of the MPQ
+    LPCTSTR szMpqName2,                             // (UTF-8) Name of the MPQ (original name or name of a copy)
+    LPCSTR szExpectedHash,                          // Expected name+data hash
+    DWORD dwFlags,                                  // Test flags. Lower bits contains the number of files
+    const void * pExtra)                            // Extra parameter
+{
+    TLogHelper Logger("TestReadingMpq", szMpqName1);
+    HANDLE hMpq = NULL;
+    DWORD dwExpectedFileCount = 0;
+    DWORD dwSearchFlags = 0;
+    DWORD dwOpenFlags = 0;
+    DWORD dwMpqFlags = 0;
+    DWORD dwErrCode;
+    TCHAR szMpqNameBuff[MAX_PATH];
+
+    // Propagate the open MPQ flags from the input
+    dwOpenFlags |= (dwFlags & TFLG_WILL_FAIL) ? MPQ_OPEN_DONT_REPORT_FAILURE : 0;
+    dwOpenFlags |= (dwFlags & TFLG_READ_ONLY) ? STREAM_FLAG_READ_ONLY : 0;
+
+    // Shall we switch the name of the MPQ?
+    szMpqName1 = SwapMpqName(szMpqNameBuff, _countof(szMpqNameBuff), szMpqName1, (PTEST_EXTRA_UTF8)(pExtra));
+
+    // If the file is a partial MPQ, don't load all files
+    if(_tcsstr(szMpqName1, _T(".MPQ.part")) == NULL)
+        dwSearchFlags |= SEARCH_FLAG_LOAD_FILES;
+
+    // If we shall hash the files, do it
+    if(IS_VALID_STRING(szExpectedHash))
+    {
+        dwExpectedFileCount = (dwFlags & TFLG_VALUE_MASK);
+        dwSearchFlags |= SEARCH_FLAG_HASH_FILES;
+    }
+
+    // Copy the archive so we won't fuck up the original one
+    dwErrCode = OpenExistingArchiveWithCopy(&Logger, szMpqName1, szMpqName2, &hMpq, dwOpenFlags);
+    while(dwErrCode == ERROR_SUCCESS)
+    {
+        // Check for malformed MPQs
+        SFileGetFileInfo(hMpq, SFileMpqFlags, &dwMpqFlags, sizeof(dwMpqFlags), NULL);
+        dwSearchFlags |= (dwMpqFlags & MPQ_FLAG_MALFORMED) ? SEARCH_FLAG_IGNORE_ERRORS : 0;
+        dwSearchFlags |= (GetExtraType(pExtra) == PatchList) ? SEARCH_FLAG_IGNORE_ERRORS : 0;
+
+        // Verify signature before any changes
+        if((dwErrCode = TestOpenArchive_VerifySignature(Logger, hMpq, (dwFlags & TFLG_SIGCHECK_BEFORE))) != ERROR_SUCCESS)
+            break;
+
+        // Perform extra action, dependent on the data passed
+        if((dwErrCode = TestOpenArchive_ExtraType(Logger, hMpq, dwSearchFlags, pExtra)) != ERROR_SUCCESS)
+            break;
+
+        // Modify the archive, if required
+        if((dwErrCode = TestOpenArchive_ModifyArchive(Logger, hMpq, dwFlags)) != ERROR_SUCCESS)
+            break;
+
+        // Sign the archive, if needed
+        if((dwErrCode = TestOpenArchive_SignArchive(Logger, hMpq, (dwFlags & TFLG_SIGN_ARCHIVE))) != ERROR_SUCCESS)
+            break;
+
+        // Test the SFileGetFileInfo, if required
+        if((dwErrCode = TestOpenArchive_GetFileInfo(Logger, hMpq, dwFlags)) != ERROR_SUCCESS)
+            break;
+
+        // Verify signature after any changes
+        if((dwErrCode = TestOpenArchive_VerifySignature(Logger, hMpq, (dwFlags & TFLG_SIGCHECK_AFTER))) != ERROR_SUCCESS)
+            break;
+
+        // Attempt to open the (listfile), (attributes), (signature)
+        if((TestArchive_LoadFiles(&Logger, hMpq, (dwMpqFlags & MPQ_FLAG_MALFORMED), LISTFILE_NAME, ATTRIBUTES_NAME, SIGNATURE_NAME, NULL)) != ERROR_SUCCESS)
+            break;
+
+        // If required, we search the archive and compare file cound and name hash
+        if((dwErrCode = VerifyDataChecksum(Logger, hMpq, dwSearchFlags, szExpectedHash, dwExpectedFileCount)) != ERROR_SUCCESS)
+            break;
+
+        break;
+    }
+
+    // Reset error code, if the failure is expected
+    if((dwErrCode != ERROR_SUCCESS || hMpq == NULL) && (dwFlags & TFLG_WILL_FAIL))
+        SErrSetLastError(dwErrCode = ERROR_SUCCESS);
+
+    // Cleanup and exit
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    return Logger.PrintVerdict(dwErrCode);
+}
+
+static DWORD TestOpenArchive(const TEST_INFO1 & TestInfo)
+{
+    return TestOpenArchive(TestInfo.szName1,            // Name of the MPQ
+                           TestInfo.szName2,            // Name of the listfile or NULL
+                           TestInfo.szDataHash,         // Compound name+data hash
+                           TestInfo.dwFlags,            // Test flags
+                           TestInfo.pExtra);            // Extra parameter
+}
+
+//-----------------------------------------------------------------------------
+// Reading archives with sectors decompressed by the worker pool
+
+static DWORD TestOpenArchive_ThreadCount(const TEST_INFO1 & TestInfo, DWORD dwThreadCount)
+{
+    DWORD dwErrCode;
+
+    // The results must be the same like with the serial reading
+    SFileSetThreadCount(dwThreadCount);
+    dwErrCode = TestOpenArchive(TestInfo);
+    SFileSetThreadCount(1);
+    return dwErrCode;
+}
+
+//-----------------------------------------------------------------------------
+// Concurrent reading from one archive handle
+
+struct TConcurrentFile
+{
+    char szFileName[MAX_PATH];                      // Name of the file in the MPQ
+    DWORD dwFileSize;                               // Size of the file, as loaded by the main thread
+    DWORD dwCrc32;                                  // CRC32 of the file data
+};
+
+struct TConcurrentWorker
+{
+    std::vector<TConcurrentFile> * pFiles;          // Shared list of files, read-only
+    HANDLE hMpq;                                    // Shared archive handle
+    DWORD dwStartIndex;                             // Index of the first file this thread reads
+    DWORD dwPassCount;                              // How many times to read all the files
+    DWORD dwFilesRead;                              // Number of files successfully read
+    DWORD dwMismatches;                             // Number of files whose content differs
+    DWORD dwErrCode;                                // The first error encountered
+};
+
+static DWORD ReadFileCrc32(HANDLE hMpq, LPCSTR szFileName, DWORD dwChunkSize, DWORD * PtrFileSize, DWORD * PtrCrc32)
+{
+    LPBYTE pbBuffer;
+    HANDLE hFile = NULL;
+    DWORD dwTotalRead = 0;
+    DWORD dwBytesRead = 0;
+    DWORD dwCrc32 = 0;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    if((pbBuffer = STORM_ALLOC(BYTE, dwChunkSize)) == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    if(SFileOpenFileEx(hMpq, szFileName, 0, &hFile))
+    {
+        // Read the file in chunks that don't match the sector size
+        for(;;)
+        {
+            dwBytesRead = 0;
+            if(!SFileReadFile(hFile, pbBuffer, dwChunkSize, &dwBytesRead, NULL))
+            {
+                dwErrCode = SErrGetLastError();
+                if(dwErrCode == ERROR_HANDLE_EOF)
+                    dwErrCode = ERROR_SUCCESS;
+            }
+
+            dwCrc32 = crc32(dwCrc32, pbBuffer, dwBytesRead);
+            dwTotalRead += dwBytesRead;
+
+            if(dwErrCode != ERROR_SUCCESS || dwBytesRead < dwChunkSize)
+                break;
+        }
+        SFileCloseFile(hFile);
+    }
+    else
+    {
+        dwErrCode = SErrGetLastError();
+    }
+
+    PtrFileSize[0] = dwTotalRead;
+    PtrCrc32[0] = dwCrc32;
+    STORM_FREE(pbBuffer);
+    return dwErrCode;
+}
+
+// Loads the name, size and CRC32 of all files in the archive
+static DWORD LoadReferenceCrcs(TLogHelper & Logger, HANDLE hMpq, std::vector<TConcurrentFile> & Files)
+{
+    SFILE_FIND_DATA sf;
+    HANDLE hFind;
+
+    Logger.PrintProgress(_T("Loading reference data ..."));
+    hFind = SFileFindFirstFile(hMpq, "*", &sf, NULL);
+    if(hFind != NULL)
+    {
+        do
+        {
+            TConcurrentFile File;
+
+            StringCopy(File.szFileName, _countof(File.szFileName), sf.cFileName);
+            if(ReadFileCrc32(hMpq, File.szFileName, 0x10000, &File.dwFileSize, &File.dwCrc32) == ERROR_SUCCESS)
+                Files.push_back(File);
+        }
+        while(SFileFindNextFile(hFind, &sf));
+        SFileFindClose(hFind);
+    }
+
+    if(Files.size() == 0)
+        return Logger.PrintError(_T("No files found in the archive"));
+    return ERROR_SUCCESS;
+}
+
+static void ConcurrentReadWorker(void * pvParam)
+{
+    TConcurrentWorker * pWorker = (TConcurrentWorker *)pvParam;
+    std::vector<TConcurrentFile> & Files = *pWorker->pFiles;
+    size_t nFileCount = Files.size();
+
+    for(DWORD dwPass = 0; dwPass < pWorker->dwPassCount; dwPass++)
+    {
+        for(size_t i = 0; i < nFileCount; i++)
+        {
+            TConcurrentFile & File = Files[(pWorker->dwStartIndex + i) % nFileCount];
+            DWORD dwFileSize = 0;
+            DWORD dwCrc32 = 0;
+            DWORD dwErrCode;
+
+            // Each worker reads with a different chunk size
+            dwErrCode = ReadFileCrc32(pWorker->hMpq, File.szFileName, 0x1234 + pWorker->dwStartIndex * 0x111, &dwFileSize, &dwCrc32);
+            if(dwErrCode != ERROR_SUCCESS)
+            {
+                if(pWorker->dwErrCode == ERROR_SUCCESS)
+                    pWorker->dwErrCode = dwErrCode;
+                continue;
+            }
+
+            if(dwFileSize != File.dwFileSize || dwCrc32 != File.dwCrc32)
+                pWorker->dwMismatches++;
+            pWorker->dwFilesRead++;
+        }
+    }
+}
+
+static DWORD TestOpenArchive_ConcurrentRead(LPCTSTR szPlainName, DWORD dwThreadCount)
+{
+    std::vector<TConcurrentWorker> Workers(dwThreadCount);
+    std::vector<STORM_THREAD> Threads(dwThreadCount);
+    std::vector<TConcurrentFile> Files;
+    TLogHelper Logger("ConcurrentReadTest", szPlainName);
+    HANDLE hMpq = NULL;
+    DWORD dwStartedThreads = 0;
+    DWORD dwErrCode;
+    TCHAR szFullPath[MAX_PATH];
+
+    // Open the archive once. All threads will share the handle
+    CreateFullPathName(szFullPath, _countof(szFullPath), szMpqSubDir, szPlainName);
+    dwErrCode = OpenExistingArchive(&Logger, szFullPath, 0, &hMpq);
+
+    // Load the reference data from a single thread
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = LoadReferenceCrcs(Logger, hMpq, Files);
+
+    // Start the worker threads
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        Logger.PrintProgress(_T("Reading files from %u threads ..."), dwThreadCount);
+        for(DWORD i = 0; i < dwThreadCount; i++)
+        {
+            Workers[i].pFiles = &Files;
+            Workers[i].hMpq = hMpq;
+            Workers[i].dwStartIndex = (DWORD)((Files.size() * i) / dwThreadCount);
+            Workers[i].dwPassCount = 2;
+            Workers[i].dwFilesRead = 0;
+            Workers[i].dwMismatches = 0;
+            Workers[i].dwErrCode = ERROR_SUCCESS;
+
+            if(!StormThread_Create(&Threads[i], ConcurrentReadWorker, &Workers[i]))
+            {
+                dwErrCode = Logger.PrintError(_T("Failed to create a worker thread"));
+                break;
+            }
+            dwStartedThreads++;
+        }
+
+        // Wait for all threads and check their results
+        for(DWORD i = 0; i < dwStartedThreads; i++)
+        {
+            StormThread_Wait(Threads[i]);
+
+            if(Workers[i].dwErrCode != ERROR_SUCCESS)
+            {
+                Logger.PrintErrorVa(_T("Thread %u failed to read a file"), i);
+                dwErrCode = Workers[i].dwErrCode;
+            }
+            else if(Workers[i].dwMismatches != 0)
+            {
+                Logger.PrintErrorVa(_T("Thread %u read %u files with wrong content"), i, Workers[i].dwMismatches);
+                dwErrCode = ERROR_FILE_CORRUPT;
+            }
+        }
+    }
+
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    return Logger.PrintVerdict(dwErrCode);
+}
+
+//-----------------------------------------------------------------------------
+// Reading files through the archive-wide sector cache
+
+static DWORD TestOpenArchive_SectorCache(LPCTSTR szPlainName, ULONGLONG CacheSize)
+{
+    std::vector<TConcurrentFile> Files;
+    TLogHelper Logger("SectorCacheTest", szPlainName);
+    ULONGLONG CacheHits = 0;
+    ULONGLONG CacheMisses = 0;
+    HANDLE hMpq = NULL;
+    DWORD dwErrCode;
+    TCHAR szFullPath[MAX_PATH];
+
+    // Open the archive
+    CreateFullPathName(szFullPath, _countof(szFullPath), szMpqSubDir, szPlainName);
+    dwErrCode = OpenExistingArchive(&Logger, szFullPath, 0, &hMpq);
+
+    // Load the reference data with the cache turned off
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        TestGetFileInfo(&Logger, hMpq, SFileMpqCacheHits, &CacheHits, sizeof(ULONGLONG), NULL, false, ERROR_FILE_NOT_FOUND);
+        dwErrCode = LoadReferenceCrcs(Logger, hMpq, Files);
+    }
+
+    // Turn the cache on and read all files twice. The second pass should hit the cache
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        if(!SFileSetArchiveCacheSize(hMpq, CacheSize))
+            dwErrCode = Logger.PrintError(_T("Failed to set the sector cache size"));
+    }
+
+    for(DWORD dwPass = 0; dwPass < 2 && dwErrCode == ERROR_SUCCESS; dwPass++)
+    {
+        for(size_t i = 0; i < Files.size(); i++)
+        {
+            DWORD dwFileSize = 0;
+            DWORD dwCrc32 = 0;
+
+            // Use a chunk size that is not aligned to sectors
+            dwErrCode = ReadFileCrc32(hMpq, Files[i].szFileName, 0x1234, &dwFileSize, &dwCrc32);
+            if(dwErrCode != ERROR_SUCCESS)
+            {
+                Logger.PrintError("Failed to read the file %s", Files[i].szFileName);
+                break;
+            }
+
+            if(dwFileSize != Files[i].dwFileSize || dwCrc32 != Files[i].dwCrc32)
+            {
+                Logger.PrintError("Different content of the file %s", Files[i].szFileName);
+                dwErrCode = ERROR_FILE_CORRUPT;
+                break;
+            }
+        }
+    }
+
+    // Check the cache counters
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        SFileGetFileInfo(hMpq, SFileMpqCacheHits, &CacheHits, sizeof(ULONGLONG), NULL);
+        SFileGetFileInfo(hMpq, SFileMpqCacheMisses, &CacheMisses, sizeof(ULONGLONG), NULL);
+        if(CacheHits == 0 || CacheMisses == 0)
+            dwErrCode = Logger.PrintError(_T("The sector cache was not used"));
+    }
+
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    return Logger.PrintVerdict(dwErrCode);
+}
+
+// Gets data views of all files in a memory-mapped archive. The views
+// must stay valid after both the files and the archive are closed.
+// A file stored as-is must be given as a pointer into the mapped archive
+static DWORD TestOpenArchive_DataView(LPCTSTR szPlainName, LPCTSTR szCopyName)
+{
+    std::vector<TConcurrentFile> Files;
+    std::vector<HANDLE> Views;
+    std::vector<const void *> ViewData;
+    TLogHelper Logger("DataViewTest", szPlainName);
+    TMPQArchive * ha;
+    ULONGLONG MpqSize = 0;
+    LPCSTR szStoredName = "StormLibTest_Stored.txt";
+    LPBYTE pbMpqData = NULL;
+    HANDLE hFile;
+    HANDLE hView;
+    HANDLE hMpq = NULL;
+    bool bStoredFileFound = false;
+    DWORD dwErrCode;
+    TCHAR szFullPath[MAX_PATH];
+
+    // Add a file that is neither compressed nor encrypted to a copy of the archive
+    dwErrCode = OpenExistingArchiveWithCopy(&Logger, szPlainName, szCopyName, &hMpq);
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwErrCode = AddFileToMpq(&Logger, hMpq, szStoredName, "This file is stored as-is, so its view points into the mapped archive.", MPQ_FILE_REPLACEEXISTING);
+        SFileCloseArchive(hMpq);
+        hMpq = NULL;
+    }
+
+    // Open the archive as memory-mapped file
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        CreateFullPathName(szFullPath, _countof(szFullPath), NULL, szCopyName);
+        dwErrCode = OpenExistingArchive(&Logger, szFullPath, BASE_PROVIDER_MAP | STREAM_FLAG_READ_ONLY, &hMpq);
+    }
+
+    // Get the mapped view of the whole archive
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        ha = IsValidMpqHandle(hMpq);
+        FileStream_GetSize(ha->pStream, &MpqSize);
+        if((pbMpqData = (LPBYTE)FileStream_GetMappedData(ha->pStream, 0, (DWORD)MpqSize)) == NULL)
+            dwErrCode = Logger.PrintError("The archive is not memory-mapped");
+    }
+
+    // Load the reference data
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = LoadReferenceCrcs(Logger, hMpq, Files);
+
+    // Get the view of every file and close the file right away
+    for(size_t i = 0; i < Files.size() && dwErrCode == ERROR_SUCCESS; i++)
+    {
+        const void * pvData = NULL;
+        DWORD cbData = 0;
+
+        if(!SFileOpenFileEx(hMpq, Files[i].szFileName, 0, &hFile))
+        {
+            dwErrCode = Logger.PrintError("Failed to open the file %s", Files[i].szFileName);
+            break;
+        }
+
+        if(SFileGetFileDataView(hFile, &pvData, &cbData, &hView))
+        {
+            if(cbData != Files[i].dwFileSize || crc32(0, (LPBYTE)pvData, cbData) != Files[i].dwCrc32)
+                dwErrCode = Logger.PrintError("Different content of the file %s", Files[i].szFileName);
+            if(!_stricmp(Files[i].szFileName, szStoredName))
+            {
+                if((LPBYTE)pvData < pbMpqData || (LPBYTE)pvData + cbData > pbMpqData + MpqSize)
+                    dwErrCode = Logger.PrintError("The view of %s is not in the mapped archive", Files[i].szFileName);
+                bStoredFileFound = true;
+            }
+            Views.push_back(hView);
+            ViewData.push_back(pvData);
+        }
+        else
+        {
+            dwErrCode = Logger.PrintError("Failed to get data view of the file %s", Files[i].szFileName);
+        }
+        SFileCloseFile(hFile);
+    }
+
+    // The stored file must have been among the checked files
+    if(dwErrCode == ERROR_SUCCESS && bStoredFileFound == false)
+        dwErrCode = Logger.PrintError("The file %s was not found in the archive", szStoredName);
+
+    // Close the archive. The views must still be readable
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    for(size_t i = 0; i < Views.size(); i++)
+    {
+        if(dwErrCode == ERROR_SUCCESS && crc32(0, (LPBYTE)ViewData[i], Files[i].dwFileSize) != Files[i].dwCrc32)
+            dwErrCode = Logger.PrintError("The view of %s was changed after the archive was closed", Files[i].szFileName);
+        SFileReleaseFileDataView(Views[i]);
+    }
+
+    return Logger.PrintVerdict(dwErrCode);
+}
+
+// Opens all files of an archive with one call of SFileOpenFilesBatch and compares
+// the results with SFileOpenFileEx. Some of the names do not exist in the archive.
+static DWORD TestOpenArchive_BatchOpen(LPCTSTR szPlainName)
+{
+    std::vector<TConcurrentFile> Files;
+    std::vector<const char *> FileNames;
+    std::vector<HANDLE> FileHandles;
+    std::vector<DWORD> ErrCodes;
+    std::vector<DWORD> ExistCodes;
+    TLogHelper Logger("BatchOpenTest", szPlainName);
+    HANDLE hMpq = NULL;
+    DWORD dwOpenCount = 0;
+    DWORD dwHasCount = 0;
+    DWORD dwExpected = 0;
+    DWORD dwErrCode;
+
+    // Open the archive
+    dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
+
+    // Load the reference data
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = LoadReferenceCrcs(Logger, hMpq, Files);
+
+    // Prepare the names. Put a nonexistent name after every file
+    for(size_t i = 0; i < Files.size(); i++)
+    {
+        FileNames.push_back(Files[i].szFileName);
+        FileNames.push_back("NonExistentFile.xxx");
+    }
+    FileHandles.resize(FileNames.size());
+    ErrCodes.resize(FileNames.size());
+    ExistCodes.resize(FileNames.size());
+
+    // Open the files in one batch
+    if(dwErrCode == ERROR_SUCCESS && FileNames.size() != 0)
+    {
+        dwOpenCount = SFileOpenFilesBatch(hMpq, &FileNames[0], (DWORD)FileNames.size(), &FileHandles[0], &ErrCodes[0]);
+        dwHasCount = SFileHasFilesBatch(hMpq, &FileNames[0], (DWORD)FileNames.size(), &ExistCodes[0]);
+    }
+
+    // Compare the results with single-file functions
+    for(size_t i = 0; i < FileNames.size() && dwErrCode == ERROR_SUCCESS; i++)
+    {
+        HANDLE hFile = NULL;
+        bool bExists = SFileOpenFileEx(hMpq, FileNames[i], 0, &hFile);
+
+        if(bExists != (ErrCodes[i] == ERROR_SUCCESS) || bExists != (ExistCodes[i] == ERROR_SUCCESS))
+            dwErrCode = Logger.PrintError("Different result of the batch open of %s", FileNames[i]);
+        if(bExists != (FileHandles[i] != NULL))
+            dwErrCode = Logger.PrintError("Invalid file handle for %s", FileNames[i]);
+        dwExpected += (bExists ? 1 : 0);
+
+        // Verify the content of the file opened by the batch
+        if(dwErrCode == ERROR_SUCCESS && FileHandles[i] != NULL && (i & 1) == 0)
+        {
+            TConcurrentFile & File = Files[i / 2];
+            LPBYTE pbBuffer = STORM_ALLOC(BYTE, File.dwFileSize + 1);
+            DWORD dwBytesRead = 0;
+
+            if(pbBuffer != NULL)
+            {
+                SFileReadFile(FileHandles[i], pbBuffer, File.dwFileSize, &dwBytesRead, NULL);
+                if(dwBytesRead != File.dwFileSize || crc32(0, pbBuffer, dwBytesRead) != File.dwCrc32)
+                    dwErrCode = Logger.PrintError("Different content of the file %s", File.szFileName);
+                STORM_FREE(pbBuffer);
+            }
+        }
+
+        if(hFile != NULL)
+            SFileCloseFile(hFile);
+    }
+
+    // Check the number of opened files
+    if(dwErrCode == ERROR_SUCCESS && (dwOpenCount != dwExpected || dwHasCount != dwExpected))
+        dwErrCode = Logger.PrintError("Unexpected number of files opened by the batch");
+
+    // Close all handles
+    for(size_t i = 0; i < FileHandles.size(); i++)
+    {
+        if(FileHandles[i] != NULL)
+            SFileCloseFile(FileHandles[i]);
+    }
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    return Logger.PrintVerdict(dwErrCode);
+}
+
+//-----------------------------------------------------------------------------
+// Extracting whole archives
+
+static void WINAPI ExtractFilesCallback(void * pvUserData, PSFILE_EXTRACT_INFO pExtractInfo)
+{
+    PSFILE_EXTRACT_INFO pFinalInfo = (PSFILE_EXTRACT_INFO)pvUserData;
+
+    // Remember the final call
+    if(pExtractInfo->szFileName == NULL)
+        memcpy(pFinalInfo, pExtractInfo, sizeof(SFILE_EXTRACT_INFO));
+}
+
+// Returns true if the file name doesn't need to be escaped by SFileExtractFiles
+static bool IsPlainAsciiName(const char * szFileName)
+{
+    for(; szFileName[0] != 0; szFileName++)
+    {
+        if(!isalnum((BYTE)szFileName[0]) && strchr("\\_-. ()", szFileName[0]) == NULL)
+            return false;
+    }
+    return true;
+}
+
+// Extracts all files of the archive with multiple threads (optionally limited for the call)
+// and compares the extracted files with the files in the archive
+static DWORD TestOpenArchive_ExtractFiles(LPCTSTR szPlainName, DWORD dwThreadCount, DWORD dwCallThreadCount)
+{
+    std::vector<TConcurrentFile> Files;
+    SFILE_EXTRACT_INFO FinalInfo;
+    TLogHelper Logger("ExtractFilesTest", szPlainName);
+    HANDLE hMpq = NULL;
+    DWORD dwErrCode;
+    TCHAR szTargetDir[MAX_PATH];
+    TCHAR szLocalName[MAX_PATH];
+    TCHAR szRelativeName[MAX_PATH];
+
+    // Open the archive
+    memset(&FinalInfo, 0, sizeof(SFILE_EXTRACT_INFO));
+    CreateFullPathName(szTargetDir, _countof(szTargetDir), szMpqSubDir, _T("StormLibTest_Extracted"));
+    dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
+
+    // Load the reference data
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = LoadReferenceCrcs(Logger, hMpq, Files);
+
+    // Extract all files
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        Logger.PrintProgress("Extracting files ...");
+        SFileSetThreadCount(dwThreadCount);
+        if(!SFileExtractFiles(hMpq, "*", szTargetDir, SFILE_EXTRACT_PREALLOCATE, dwCallThreadCount, ExtractFilesCallback, &FinalInfo))
+            dwErrCode = Logger.PrintError(_T("Failed to extract files to %s"), szTargetDir);
+        SFileSetThreadCount(1);
+    }
+
+    // Check the final statistics
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        if(FinalInfo.dwFilesDone != FinalInfo.dwFileCount || FinalInfo.dwFilesFailed != 0 || FinalInfo.BytesWritten != FinalInfo.TotalBytes)
+            dwErrCode = Logger.PrintError("Unexpected statistics of the extraction");
+    }
+
+    // Compare the extracted files with the files in the archive
+    for(size_t i = 0; i < Files.size() && dwErrCode == ERROR_SUCCESS; i++)
+    {
+        TFileStream * pStream;
+        ULONGLONG FileSize = 0;
+        LPBYTE pbBuffer;
+
+        // Only check the files whose names are not changed by the extraction
+        if(!IsPlainAsciiName(Files[i].szFileName))
+            continue;
+
+        // Create the local name of the file
+        szRelativeName[0] = '/';
+        StringCopy(szRelativeName + 1, _countof(szRelativeName) - 1, Files[i].szFileName);
+        CreateFullPathName(szLocalName, _countof(szLocalName), szMpqSubDir, _T("StormLibTest_Extracted"), szRelativeName);
+
+        // Load the file and verify its CRC32
+        if((pStream = FileStream_OpenFile(szLocalName, STREAM_FLAG_READ_ONLY)) != NULL)
+        {
+            FileStream_GetSize(pStream, &FileSize);
+            if((pbBuffer = STORM_ALLOC(BYTE, (size_t)FileSize + 1)) != NULL)
+            {
+                if(FileSize != Files[i].dwFileSize || !FileStream_Read(pStream, NULL, pbBuffer, (DWORD)FileSize) || crc32(0, pbBuffer, (DWORD)FileSize) != Files[i].dwCrc32)
+                    dwErrCode = Logger.PrintError("Different content of the extracted file %s", Files[i].szFileName);
+                STORM_FREE(pbBuffer);
+            }
+            FileStream_Close(pStream);
+        }
+        else
+        {
+            dwErrCode = Logger.PrintError("The file %s was not extracted", Files[i].szFileName);
+        }
+    }
+
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    return Logger.PrintVerdict(dwErrCode);
+}
+
+//-----------------------------------------------------------------------------
+// Code paths selected by CPU features
+
+// Fills a buffer with pseudo-random bytes
+static void FillTestData(LPBYTE pbData, DWORD cbData, DWORD dwRandom)
+{
+    for(DWORD i = 0; i < cbData; i++)
+    {
+        dwRandom = dwRandom * 1103515245 + 12345;
+        pbData[i] = (BYTE)(dwRandom >> 24);
+    }
+}
+
+// Runs the test once with the plain C code and once with each SIMD code path the CPU supports,
+// then restores the default code paths. The dwUsedFeatures are the CPU features the tested
+// code checks for; a feature mask that doesn't change them would only repeat an earlier run
+static DWORD TestCpuCodePaths(TLogHelper & Logger, DWORD dwUsedFeatures, CPU_PATH_CALLBACK PfnTest, void * lpContext)
+{
+    DWORD FeatureMasks[] = {0, STORM_CPU_FEATURE_SSE2, 0xFFFFFFFF};
+    DWORD TestedFeatures[_countof(FeatureMasks)];
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    for(size_t m = 0; m < _countof(FeatureMasks) && dwErrCode == ERROR_SUCCESS; m++)
+    {
+        bool bAlreadyTested = false;
+
+        // Skip the mask if it selects the same code as one of the previous masks
+        StormCpu_SetFeatureMask(FeatureMasks[m]);
+        TestedFeatures[m] = StormCpu_GetFeatures() & dwUsedFeatures;
+        for(size_t i = 0; i < m; i++)
+            bAlreadyTested = bAlreadyTested || (TestedFeatures[i] == TestedFeatures[m]);
+        if(bAlreadyTested)
+            continue;
+
+        Logger.PrintProgress("Checking code paths for CPU features 0x%X ...", StormCpu_GetFeatures());
+        dwErrCode = PfnTest(Logger, lpContext);
+    }
+
+    // Restore the default code paths
+    StormCpu_SetFeatureMask(0xFFFFFFFF);
+    return dwErrCode;
+}
+
+//-----------------------------------------------------------------------------
+// Encryption of MPQ data blocks
+
+// The original implementation of the MPQ encryption, used as a reference
+static void ReferenceCryptMpqBlock(LPDWORD DataBlock, DWORD dwLength, DWORD dwKey1, bool bEncrypt)
+{
+    static DWORD KeyMix[0x100];
+    DWORD dwKey2 = 0xEEEEEEEE;
+    DWORD dwValue32;
+
+    // Same as StormBuffer[MPQ_HASH_KEY2_MIX + i]
+    if(KeyMix[0] == 0)
+    {
+        DWORD dwSeed = 0x00100001;
+
+        for(DWORD i = 0; i < 0x100; i++)
+        {
+            for(DWORD j = 0; j < 5; j++)
+            {
+                DWORD dwTemp1 = ((dwSeed = (dwSeed * 125 + 3) % 0x2AAAAB) & 0xFFFF) << 0x10;
+                DWORD dwTemp2 = ((dwSeed = (dwSeed * 125 + 3) % 0x2AAAAB) & 0xFFFF);
+
+                if(j == 4)
+                    KeyMix[i] = dwTemp1 | dwTemp2;
+            }
+        }
+    }
+
+    for(DWORD i = 0; i < (dwLength / sizeof(DWORD)); i++)
+    {
+        dwKey2 += KeyMix[dwKey1 & 0xFF];
+        dwValue32 = DataBlock[i];
+        DataBlock[i] = dwValue32 ^ (dwKey1 + dwKey2);
+        dwValue32 = bEncrypt ? dwValue32 : DataBlock[i];
+        dwKey1 = ((~dwKey1 << 0x15) + 0x11111111) | (dwKey1 >> 0x0B);
+        dwKey2 = dwValue32 + dwKey2 + (dwKey2 << 5) + 3;
+    }
+}
+
+struct TMpqBlocksTest
+{
+    LPDWORD Original;                               // Data before encryption
+    LPDWORD Expected;                               // Data processed by the reference code
+    LPDWORD Buffer;                                 // Data processed by the tested code
+    DWORD dwMaxLength;                              // Length of the longest block
+};
+
+// Compares EncryptMpqBlock and DecryptMpqBlock with the reference and measures their speed
+static DWORD CheckMpqBlocksCodePath(TLogHelper & Logger, void * lpContext)
+{
+    TMpqBlocksTest * pTest = (TMpqBlocksTest *)lpContext;
+    LPDWORD Original = pTest->Original;
+    LPDWORD Expected = pTest->Expected;
+    LPDWORD Buffer = pTest->Buffer;
+    DWORD dwMaxLength = pTest->dwMaxLength;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Short blocks of all lengths, then a few long ones. Also check unaligned blocks
+    // and that the bytes beyond the last whole DWORD are not touched
+    for(DWORD i = 0; i < 400 && dwErrCode == ERROR_SUCCESS; i++)
+    {
+        DWORD dwLength = (i < 360) ? i : (dwMaxLength - (i & 0x07));
+        DWORD dwKey1 = i * 0x2F3B1A97 + 0x1234;
+        LPBYTE pbBuffer = (LPBYTE)Buffer + (i & 0x03);
+
+        for(DWORD j = 0; j < 2; j++)
+        {
+            memcpy(Expected, Original, dwLength + 4);
+            ReferenceCryptMpqBlock(Expected, dwLength & ~0x03, dwKey1, (j == 0));
+
+            memcpy(pbBuffer, Original, dwLength + 4);
+            if(j == 0)
+                EncryptMpqBlock(pbBuffer, dwLength, dwKey1);
+            else
+                DecryptMpqBlock(pbBuffer, dwLength, dwKey1);
+
+            if(memcmp(pbBuffer, Expected, dwLength + 4))
+            {
+                Logger.PrintMessage("%s of %u bytes differs from the reference", (j == 0) ? "Encryption" : "Decryption", dwLength);
+                dwErrCode = ERROR_FILE_CORRUPT;
+                break;
+            }
+        }
+    }
+
+    // Measure the speed of both directions
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        DWORD dwEncryptTime;
+        DWORD dwDecryptTime;
+        DWORD dwRounds = 0x10000000 / dwMaxLength;
+
+        Logger.SetStartTime();
+        for(DWORD i = 0; i < dwRounds; i++)
+            EncryptMpqBlock(Buffer, dwMaxLength, i);
+        dwEncryptTime = Logger.SetEndTime();
+
+        Logger.SetStartTime();
+        for(DWORD i = 0; i < dwRounds; i++)
+            DecryptMpqBlock(Buffer, dwMaxLength, i);
+        dwDecryptTime = Logger.SetEndTime();
+
+        // The block length doesn't have to divide 256 MB, so use the bytes actually processed
+        Logger.PrintMessage("CPU features 0x%X: encryption %u MB/s, decryption %u MB/s", StormCpu_GetFeatures(),
+                            (DWORD)((ULONGLONG)dwRounds * dwMaxLength * 1000 / 0x100000 / STORMLIB_MAX(dwEncryptTime, 1)),
+                            (DWORD)((ULONGLONG)dwRounds * dwMaxLength * 1000 / 0x100000 / STORMLIB_MAX(dwDecryptTime, 1)));
+    }
+    return dwErrCode;
+}
+
+// Verifies EncryptMpqBlock and DecryptMpqBlock with all code paths the CPU supports
+static DWORD TestCryptography_MpqBlocks(DWORD dwMaxLength)
+{
+    TLogHelper Logger("MpqBlockCryptTest");
+    TMpqBlocksTest Test;
+    DWORD dwBufferSize = (dwMaxLength / sizeof(DWORD) + 2) * sizeof(DWORD);
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // The encryption tables are normally prepared when an archive is open
+    InitializeMpqCryptography();
+
+    Test.Original = STORM_ALLOC(DWORD, dwBufferSize / sizeof(DWORD));
+    Test.Expected = STORM_ALLOC(DWORD, dwBufferSize / sizeof(DWORD));
+    Test.Buffer = STORM_ALLOC(DWORD, dwBufferSize / sizeof(DWORD));
+    Test.dwMaxLength = dwMaxLength;
+    if(Test.Original == NULL || Test.Expected == NULL || Test.Buffer == NULL)
+    {
+        Logger.PrintMessage("Failed to allocate buffers");
+        dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        // There is no SSE2 code for the encryption, only the plain C code and AVX2
+        FillTestData((LPBYTE)Test.Original, dwBufferSize, 0x9E3779B9);
+        dwErrCode = TestCpuCodePaths(Logger, STORM_CPU_FEATURE_AVX2, CheckMpqBlocksCodePath, &Test);
+    }
+
+    STORM_FREE(Test.Buffer);
+    STORM_FREE(Test.Expected);
+    STORM_FREE(Test.Original);
+    return Logger.PrintVerdict(dwErrCode);
+}
+
+struct TMd5ChunksTest
+{
+    LPBYTE pbData;                                  // Data to hash, one byte longer than the longest block
+    LPBYTE Expected;                                // MD5 of the chunks, calculated one by one
+    LPBYTE md5_array;                               // MD5 of the chunks, calculated by the tested code
+    DWORD dwMaxLength;                              // Length of the longest block
+};
+
+// Compares CalculateDataBlockHashes with MD5 of single chunks and measures its speed
+static DWORD CheckMd5ChunksCodePath(TLogHelper & Logger, void * lpContext)
+{
+    TMd5ChunksTest * pTest = (TMd5ChunksTest *)lpContext;
+    DWORD ChunkSizes[] = {1, 55, 56, 64, 119, 120, 0x200, 0x4000};
+    LPBYTE pbData = pTest->pbData;
+    LPBYTE Expected = pTest->Expected;
+    LPBYTE md5_array = pTest->md5_array;
+    DWORD dwMaxLength = pTest->dwMaxLength;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Various chunk sizes around the MD5 padding limits, with a partial last chunk
+    // and with a data block that doesn't start at an aligned address
+    for(size_t c = 0; c < _countof(ChunkSizes) && dwErrCode == ERROR_SUCCESS; c++)
+    {
+        DWORD dwChunkSize = ChunkSizes[c];
+        DWORD dwLength = STORMLIB_MIN(dwChunkSize * 19 + (DWORD)(c * 7), dwMaxLength);
+        DWORD dwChunkCount = (dwLength - 1) / dwChunkSize + 1;
+
+        for(DWORD i = 0; i < dwChunkCount; i++)
+        {
+            DWORD dwBytesInChunk = STORMLIB_MIN(dwChunkSize, dwLength - i * dwChunkSize);
+            CalculateDataBlockHash(pbData + 1 + i * dwChunkSize, dwBytesInChunk, Expected + i * MD5_DIGEST_SIZE);
+        }
+
+        CalculateDataBlockHashes(pbData + 1, dwLength, dwChunkSize, md5_array);
+        if(memcmp(md5_array, Expected, dwChunkCount * MD5_DIGEST_SIZE))
+        {
+            Logger.PrintMessage("MD5 of %u bytes in chunks of %u bytes differ from the reference", dwLength, dwChunkSize);
+            dwErrCode = ERROR_FILE_CORRUPT;
+            break;
+        }
+    }
+
+    // Measure the speed with the most common chunk size
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        DWORD dwRounds = (0x10000000 + dwMaxLength - 1) / dwMaxLength;
+        DWORD dwHashTime;
+
+        Logger.SetStartTime();
+        for(DWORD i = 0; i < dwRounds; i++)
+            CalculateDataBlockHashes(pbData, dwMaxLength, 0x4000, md5_array);
+        dwHashTime = Logger.SetEndTime();
+
+        // The rounds cover at least 256 MB, so the time is well above the timer resolution
+        Logger.PrintMessage("CPU features 0x%X: MD5 of 16 KB chunks %u MB/s (%u ms)", StormCpu_GetFeatures(),
+                            (DWORD)(((ULONGLONG)dwRounds * dwMaxLength * 1000 / 0x100000) / STORMLIB_MAX(dwHashTime, 1)), dwHashTime);
+    }
+    return dwErrCode;
+}
+
+// Verifies that the MD5 of multiple chunks are the same with all code paths the CPU supports
+static DWORD TestCryptography_Md5Chunks(DWORD dwMaxLength)
+{
+    TLogHelper Logger("Md5ChunksTest");
+    TMd5ChunksTest Test;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    Test.pbData = STORM_ALLOC(BYTE, dwMaxLength + 1);
+    Test.Expected = STORM_ALLOC(BYTE, dwMaxLength);
+    Test.md5_array = STORM_ALLOC(BYTE, dwMaxLength);
+    Test.dwMaxLength = dwMaxLength;
+    if(Test.pbData == NULL || Test.Expected == NULL || Test.md5_array == NULL)
+    {
+        Logger.PrintMessage("Failed to allocate buffers");
+        dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        FillTestData(Test.pbData, dwMaxLength + 1, 0x9E3779B9);
+        dwErrCode = TestCpuCodePaths(Logger, STORM_CPU_FEATURE_SSE2 | STORM_CPU_FEATURE_AVX2, CheckMd5ChunksCodePath, &Test);
+    }
+
+    STORM_FREE(Test.md5_array);
+    STORM_FREE(Test.Expected);
+    STORM_FREE(Test.pbData);
+    return Logger.PrintVerdict(dwErrCode);
+}
+
+struct TCombinePatchTest
+{
+    LPBYTE pbOldData;                               // Data of the old file
+    LPBYTE pbDiffData;                              // Differences between the old and the new file
+    LPBYTE pbNewData;                               // New file, combined by the tested code
+    LPBYTE pbExpected;                              // New file, combined byte by byte
+    DWORD dwFileSize;                               // Size of the files
+};
+
+// Compares CombinePatchData with the reference, both for short strings
+// and by replaying the control blocks of a synthetic patch of a big file
+static DWORD CheckCombinePatchCodePath(TLogHelper & Logger, void * lpContext)
+{
+    TCombinePatchTest * pTest = (TCombinePatchTest *)lpContext;
+    LPBYTE pbOldData = pTest->pbOldData;
+    LPBYTE pbDiffData = pTest->pbDiffData;
+    LPBYTE pbNewData = pTest->pbNewData;
+    LPBYTE pbExpected = pTest->pbExpected;
+    DWORD dwFileSize = pTest->dwFileSize;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // All lengths up to a few vectors, with the buffers at odd addresses
+    for(DWORD dwLength = 0; dwLength < 0x100 && dwErrCode == ERROR_SUCCESS; dwLength++)
+    {
+        memset(pbNewData, 0xCC, dwLength + 2);
+        CombinePatchData(pbNewData + 1, pbDiffData + (dwLength & 3), pbOldData + (dwLength & 3), dwLength);
+        if(memcmp(pbNewData + 1, pbExpected + (dwLength & 3), dwLength) || pbNewData[0] != 0xCC || pbNewData[dwLength + 1] != 0xCC)
+        {
+            Logger.PrintMessage("Combined data of %u bytes differ from the reference", dwLength);
+            dwErrCode = ERROR_FILE_CORRUPT;
+        }
+    }
+
+    // Replay the patch. Each control block combines a string of the data block
+    // with the old file, then copies a short string from the extra block
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        DWORD dwSeed = 0x13579BDF;
+
+        memset(pbNewData, 0xCC, dwFileSize);
+        for(DWORD dwOffset = 0; dwOffset < dwFileSize; )
+        {
+            DWORD dwAddLength;
+            DWORD dwMovLength;
+
+            dwSeed = dwSeed * 1103515245 + 12345;
+            dwAddLength = STORMLIB_MIN(0x100 + ((dwSeed >> 8) & 0xFFFF), dwFileSize - dwOffset);
+            dwMovLength = STORMLIB_MIN((dwSeed >> 24), dwFileSize - dwOffset - dwAddLength);
+
+            CombinePatchData(pbNewData + dwOffset, pbDiffData + dwOffset, pbOldData + dwOffset, dwAddLength);
+            memcpy(pbNewData + dwOffset + dwAddLength, pbExpected + dwOffset + dwAddLength, dwMovLength);
+            dwOffset += dwAddLength + dwMovLength;
+        }
+
+        if(memcmp(pbNewData, pbExpected, dwFileSize))
+        {
+            Logger.PrintMessage("The patched file differs from the reference");
+            dwErrCode = ERROR_FILE_CORRUPT;
+        }
+    }
+    return dwErrCode;
+}
+
+// Verifies the combining of BSDIFF data with the old file with all code paths the CPU supports
+static DWORD TestPatchData_Combine(DWORD dwFileSize)
+{
+    TLogHelper Logger("CombinePatchTest");
+    TCombinePatchTest Test;
+    DWORD dwRandom = 0x2468ACE0;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    Test.pbOldData = STORM_ALLOC(BYTE, dwFileSize + 1);
+    Test.pbDiffData = STORM_ALLOC(BYTE, dwFileSize + 1);
+    Test.pbNewData = STORM_ALLOC(BYTE, dwFileSize + 1);
+    Test.pbExpected = STORM_ALLOC(BYTE, dwFileSize + 1);
+    Test.dwFileSize = dwFileSize;
+    if(Test.pbOldData == NULL || Test.pbDiffData == NULL || Test.pbNewData == NULL || Test.pbExpected == NULL)
+    {
+        Logger.PrintMessage("Failed to allocate buffers");
+        dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    // The old file is random, the diff is mostly zeros, like in real patches
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        FillTestData(Test.pbOldData, dwFileSize + 1, 0x9E3779B9);
+        for(DWORD i = 0; i < dwFileSize + 1; i++)
+        {
+            dwRandom = dwRandom * 1103515245 + 12345;
+            Test.pbDiffData[i] = ((dwRandom >> 8) & 0x0F) ? 0 : (BYTE)(dwRandom >> 16);
+            Test.pbExpected[i] = (BYTE)(Test.pbOldData[i] + Test.pbDiffData[i]);
+        }
+
+        dwErrCode = TestCpuCodePaths(Logger, STORM_CPU_FEATURE_SSE2 | STORM_CPU_FEATURE_AVX2, CheckCombinePatchCodePath, &Test);
+    }
+
+    STORM_FREE(Test.pbExpected);
+    STORM_FREE(Test.pbNewData);
+    STORM_FREE(Test.pbDiffData);
+    STORM_FREE(Test.pbOldData);
+    return Logger.PrintVerdict(dwErrCode);
+}
+
+//-----------------------------------------------------------------------------
+// Reopening archives
+
+static void WINAPI CompactCallback(void * pvUserData, DWORD dwWork, ULONGLONG BytesDone, ULONGLONG TotalBytes)
+{
+    TLogHelper * pLogger = (TLogHelper *)pvUserData;
+    LPCSTR szWork = NULL;
+
+    switch(dwWork)
+    {
+        case CCB_CHECKING_FILES:
+            szWork = "Checking files in archive";
+            break;
+
+        case CCB_CHECKING_HASH_TABLE:
+            szWork = "Checking hash table";
+            break;
+
+        case CCB_COPYING_NON_MPQ_DATA:
+            szWork = "Copying non-MPQ data";
+            break;
+
+        case CCB_COMPACTING_FILES:
+            szWork = "Compacting files";
+            break;
+
+        case CCB_CLOSING_ARCHIVE:
+            szWork = "Closing archive";
+            break;
+    }
+
+    if(szWork != NULL)
+    {
+        if(pLogger != NULL)
+            pLogger->PrintProgress("%s " fmt_X_of_Y_a " ...", szWork, BytesDone, TotalBytes);
+        else
+            printf("%s " fmt_X_of_Y_a " ...     \r", szWork, BytesDone, TotalBytes);
+    }
+}
+
+static DWORD TestReopenArchive_CompactArchive(TLogHelper & Logger, HANDLE hMpq, DWORD dwFlags)
+{
+    if(dwFlags & TFLG_COMPACT)
+    {
+        // Set the compact callback
+        Logger.PrintProgress("Compacting archive ...");
+        if(!SFileSetCompactCallback(hMpq, CompactCallback, &Logger))
+            return Logger.PrintError("Failed to set the compact callback");
+
+        // Compact the archive
+        if(!SFileCompactArchive(hMpq, NULL, false))
+            return Logger.PrintError("Failed to compact archive");
+    }
+    return ERROR_SUCCESS;
+}
+
+static DWORD TestReopenArchive(
+    LPCTSTR szMpqName1,                             // Name of the MPQ
+    LPCSTR szExpectedHash,                          // Expected name+data hash
+    DWORD dwFlags)                                  // Test flags. Lower bits contains the number of files
+{
+    TLogHelper Logger("Test_ReopenMpq", szMpqName1);
+    ULONGLONG PreMpqDataSize = (dwFlags & TFLG_ADD_USER_DATA) ? 0x400 : 0;
+    ULONGLONG UserDataSize = (dwFlags & TFLG_ADD_USER_DATA) ? 0x531 : 0;
+    LPCTSTR szCopyName = _T("StormLibTest_Reopened.mpq");
+    HANDLE hMpq;
+    DWORD dwExpectedFileCount = 0;
+    DWORD dwSearchFlags = SEARCH_FLAG_LOAD_FILES;
+    TCHAR szFullPath[MAX_PATH];
+    DWORD dwErrCode;
+
+    // If we shall hash the files, do it
+    if(IS_VALID_STRING(szExpectedHash))
+    {
+        dwExpectedFileCount = (dwFlags & TFLG_VALUE_MASK);
+        dwSearchFlags |= SEARCH_FLAG_HASH_FILES;
+    }
+
+    // Create copy of the archive, with interleaving some user data
+    dwErrCode = CreateFileCopy(&Logger, szMpqName1, szCopyName, szFullPath, _countof(szFullPath), PreMpqDataSize, UserDataSize);
+
+    // Open the archive and read the hash of the files
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        if((dwErrCode = OpenExistingArchive(&Logger, szFullPath, 0, &hMpq)) == ERROR_SUCCESS)
+        {
+            // Verify presence of (listfile) and (attributes)
+            CheckIfFileIsPresent(&Logger, hMpq, LISTFILE_NAME, (dwFlags & TFLG_HAS_LISTFILE));
+            CheckIfFileIsPresent(&Logger, hMpq, ATTRIBUTES_NAME, (dwFlags & TFLG_HAS_ATTRIBUTES));
+
+            // If required, we search the archive and compare file cound and name hash
+            dwErrCode = VerifyDataChecksum(Logger, hMpq, dwSearchFlags, szExpectedHash, dwExpectedFileCount);
+            SFileCloseArchive(hMpq);
+        }
+    }
+
+    // Try to modify and/or compact the MPQ
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        // Open the archive again
+        if((dwErrCode = OpenExistingArchive(&Logger, szFullPath, 0, &hMpq)) == ERROR_SUCCESS)
+        {
+            // Modify the archive, if required
+            if((dwErrCode = TestOpenArchive_ModifyArchive(Logger, hMpq, dwFlags)) == ERROR_SUCCESS)
+            {
+                dwErrCode = TestReopenArchive_CompactArchive(Logger, hMpq, dwFlags);
+            }
+            SFileCloseArchive(hMpq);
+        }
+    }
+
+    // Open the archive and load some files
+    if((dwErrCode == ERROR_SUCCESS) && STORMLIB_TEST_FLAGS(dwFlags, TFLG_COMPACT | TFLG_MODIFY | TFLG_BIGFILE, TFLG_COMPACT))
+    {
+        // Open the archive
+        if((dwErrCode = OpenExistingArchive(&Logger, szFullPath, 0, &hMpq)) == ERROR_SUCCESS)
+        {
+            // Verify presence of (listfile) and (attributes)
+            CheckIfFileIsPresent(&Logger, hMpq, LISTFILE_NAME, (dwFlags & TFLG_HAS_LISTFILE));
+            CheckIfFileIsPresent(&Logger, hMpq, ATTRIBUTES_NAME, (dwFlags & TFLG_HAS_ATTRIBUTES));
+
+            // Search the archive and load every file
+            dwErrCode = VerifyDataChecksum(Logger, hMpq, dwSearchFlags, szExpectedHash, dwExpectedFileCount);
+        }
+        SFileCloseArchive(hMpq);
+    }
+    return dwErrCode;
+}
+
+static DWORD TestOpenArchive_SignatureTest(LPCTSTR szPlainName, LPCTSTR szOriginalName, DWORD dwFlags)
+{
+    TLogHelper Logger("Test_Signature", szPlainName);
+    HANDLE hMpq;
+    DWORD dwCreateFlags = MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES | MPQ_FORMAT_VERSION_1;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Create a new archive or copy existing
+    if(dwFlags & SFLAG_CREATE_ARCHIVE)
+    {
+        dwCreateFlags |= (dwFlags & SFLAG_SIGN_AT_CREATE) ? MPQ_CREATE_SIGNATURE : 0;
+        dwErrCode = CreateNewArchive_V2(&Logger, szPlainName, dwCreateFlags, 4000, &hMpq);
+    }
+    else
+    {
+        szOriginalName = (szOriginalName) ? szOriginalName : szPlainName;
+        dwErrCode = OpenExistingArchiveWithCopy(&Logger, szPlainName, szOriginalName, &hMpq);
+    }
+
+    // Continue with archive signature tests
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        // Shall we check the signatures before modifications?
+        if(dwErrCode == ERROR_SUCCESS)
+        {
+            dwErrCode = TestOpenArchive_VerifySignature(Logger, hMpq, (dwFlags & SFLAG_VERIFY_BEFORE));
+        }
+
+        // Shall we modify the archive?
+        if(dwErrCode == ERROR_SUCCESS)
+        {
+            dwErrCode = TestOpenArchive_ModifyArchive(Logger, hMpq, (dwFlags & SFLAG_MODIFY_ARCHIVE));
+        }
+
+        // Shall we sign the archive?
+        if(dwErrCode == ERROR_SUCCESS)
+        {
+            dwErrCode = TestOpenArchive_SignArchive(Logger, hMpq, (dwFlags & SFLAG_SIGN_ARCHIVE));
+        }
+
+        // Shall we check the signatures after modifications?
+        if(dwErrCode == ERROR_SUCCESS)
+        {
+            dwErrCode = TestOpenArchive_VerifySignature(Logger, hMpq, (dwFlags & SFLAG_VERIFY_AFTER));
+        }
+
+        SFileCloseArchive(hMpq);
+    }
+    return dwErrCode;
+}
+
+static DWORD TestCreateArchive(LPCTSTR szPlainName, LPCSTR szFileName, DWORD dwFlags)
+{
+    TLogHelper Logger("CreateNewMpq", szPlainName);
+    HANDLE hMpq = NULL;
+    DWORD dwMaxFileCount = dwFlags & 0x0000FFFF;
+    DWORD dwCreateFlags = 0;
+    DWORD dwFileCount = 0;
+    DWORD dwErrCode;
+
+    // Fixup the MPQ format
+    dwCreateFlags |= (dwFlags & CFLG_EMPTY) ? 0 : MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES;
+    dwCreateFlags |= (dwFlags & CFLG_V2) ? MPQ_CREATE_ARCHIVE_V2 : 0;
+    dwCreateFlags |= (dwFlags & CFLG_V4) ? MPQ_CREATE_ARCHIVE_V4 : 0;
+
+    // Create the full path name
+    dwErrCode = CreateNewArchive(&Logger, szPlainName, dwCreateFlags, dwMaxFileCount, &hMpq);
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        // Add non-standard names, if needed
+        if(dwFlags & CFLG_NONSTD_NAMES)
+        {
+            // Add few files and close the archive
+            AddFileToMpq(&Logger, hMpq, "AddedFile000.txt", "This is the file data 000.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "\\/\\/\\/\\AddedFile001.txt", "This is the file data 001.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "\\\\\\\\\\\\\\\\", "This is the file data 002.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "////////////////", "This is the file data 003.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "//\\//\\//\\//\\", "This is the file data 004.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "................", "This is the file data 005.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "//****//****//****//****.***", "This is the file data 006.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "//*??*//*??*//*??*//?**?.?*?", "This is the file data 007.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "\\/\\/File.txt", "This is the file data 008.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "\\/\\/File.txt..", "This is the file data 009.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "Dir1\\Dir2\\Dir3\\File.txt..", "This is the file data 010.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "\\Dir1\\Dir2\\Dir3\\File.txt..", "This is the file data 011.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "\\\\Dir1\\\\Dir2\\\\Dir3\\\\File.txt..", "This is the file data 012.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "/Dir1/Dir2/Dir3/File.txt..", "This is the file data 013.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "////Dir1////Dir2////Dir3////File.txt..", "This is the file data 014.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "\\//\\Dir1\\//\\Dir2\\//\\File.txt..", "This is the file data 015.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "\x10\x11\x12\x13\\\x14\x15\x16\x17\\\x18\x19\x1a\x1b\\\x1c\x1D\x1E\x1F.txt", "This is the file data 016.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "\x09\x20\x09\x20\\\x20\x09\x20\x09\\\x09\x20\x09\x20\\\x20\x09\x20\x09.txt", "This is the file data 017.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "\x80\x91\xA2\xB3\\\xC4\xD5\xE6\xF7\\\x80\x91\xA2\xB3.txt", "This is the file data 018.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "Dir1\x20\x09\x20\\Dir2\x20\x09\x20\\File.txt\x09\x09\x20\x2e", "This is the file data 019.", MPQ_FILE_COMPRESS);
+            AddFileToMpq(&Logger, hMpq, "Dir1\x20\x09\x20\\Dir2\x20\x09\x20\\\x09\x20\x2e\x09\x20\x2e", "This is the file data 020.", MPQ_FILE_COMPRESS);
+        }
+
+        // Like MPQEditor: Flush archive, add one file, flush again
+        if(dwFlags & CFLG_MPQEDITOR)
+        {
+            SFileFlushArchive(hMpq);
+            dwErrCode = AddFileToMpq(&Logger, hMpq, szFileName, "This is the file data.", MPQ_FILE_COMPRESS);
+            SFileFlushArchive(hMpq);
+        }
+
+        // Search the archive
+        SearchArchive(&Logger, hMpq);
+        SFileCloseArchive(hMpq);
+    }
+
+    // Reopen the empty MPQ
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
+        if(dwErrCode == ERROR_SUCCESS)
+        {
+            // Retrieve the number of files
+            SFileGetFileInfo(hMpq, SFileMpqNumberOfFiles, &dwFileCount, sizeof(dwFileCount), NULL);
+
+            // Special check for empty MPQs
+            if(dwFlags & CFLG_EMPTY)
+            {
+                if(dwFileCount != 0)
+                    dwErrCode = ERROR_FILE_CORRUPT;
+                CheckIfFileIsPresent(&Logger, hMpq, "File00000000.xxx", false);
+                CheckIfFileIsPresent(&Logger, hMpq, LISTFILE_NAME, false);
+                SearchArchive(&Logger, hMpq);
+            }
+            else
+            {
+                if(dwFileCount == 0)
+                    dwErrCode = ERROR_FILE_CORRUPT;
+            }
+
+            // Close the MPQ
+            SFileCloseArchive(hMpq);
+        }
+    }
+
+    return dwErrCode;
+}
+
+static DWORD TestCreateArchive(const TEST_INFO2 & TestInfo)
+{
+    TCHAR szPlainNameT[MAX_PATH];
+
+    // Always prefix the archive name with "StormLibTest_"
+    StringCopy(szPlainNameT, _countof(szPlainNameT), "StormLibTest_");
+    StringCat(szPlainNameT, _countof(szPlainNameT), TestInfo.szName1);
+
+    // Perform creation of the archive
+    return TestCreateArchive(szPlainNameT, TestInfo.szName2, TestInfo.dwFlags);
+}
+
+static DWORD TestRenameFile(LPCTSTR szPlainName)
+{
+    TLogHelper Logger("TestRenameFile", szPlainName);
+    LPCSTR szSourceFile = "war3map.mmp";
+    LPCSTR szTargetFile = "war3map.wts";
+    HANDLE hMpq = NULL;
+    DWORD dwErrCode;
+    DWORD dwFailed = 0;
+    LCID LCID_RURU = 0x0419;
+    LCID LCID_ESES = 0x040A;
+
+    // Create copy of the archive and open it
+    dwErrCode = OpenExistingArchiveWithCopy(&Logger, szPlainName, szPlainName, &hMpq);
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        // Try to rename an existing file to "war3map.wts".
+        // This must fail because the file already exists.
+        if(SFileRenameFile(hMpq, szSourceFile, szTargetFile))
+            dwFailed++;
+
+        // Now change locale of an existing file to Russian
+        if(SetLocaleForFileOperations(hMpq, szSourceFile, LCID_RURU) != ERROR_SUCCESS)
+            dwFailed++;
+
+        // The rename should work now
+        if(!SFileRenameFile(hMpq, szSourceFile, szTargetFile))
+            dwFailed++;
+
+        // Changing the file locale to Neutral should fail now,
+        // because such file already exists
+        if(SetLocaleForFileOperations(hMpq, szTargetFile, 0) != ERROR_ALREADY_EXISTS)
+            dwFailed++;
+
+        // Pick another source file
+        szSourceFile = "war3map.shd";
+
+        // Change the file locale to Spain
+        if(SetLocaleForFileOperations(hMpq, szSourceFile, LCID_ESES) != ERROR_SUCCESS)
+            dwFailed++;
+
+        // This rename should also work, because there is no target file with Spanish locale
+        if(!SFileRenameFile(hMpq, szSourceFile, szTargetFile))
+            dwFailed++;
+
+        // Evaluate the result
+        if(dwFailed != 0)
+            dwErrCode = ERROR_CAN_NOT_COMPLETE;
+        SFileCloseArchive(hMpq);
+    }
+
+    // Restore the original file locale
+    SFileSetLocale(LANG_NEUTRAL);
+    return dwErrCode;
+}
+
+static DWORD TestCreateArchive_TestGaps(LPCTSTR szPlainName)
+{
+    TLogHelper Logger("TestCreateGaps", szPlainName);
+    ULONGLONG ByteOffset1 = 0xFFFFFFFF;
+    ULONGLONG ByteOffset2 = 0xEEEEEEEE;
+    HANDLE hMpq = NULL;
+    HANDLE hFile = NULL;
+    TCHAR szFullPath[MAX_PATH];
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Create new MPQ
+    dwErrCode = CreateNewArchive_V2(&Logger, szPlainName, MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES | MPQ_FORMAT_VERSION_4, 4000, &hMpq);
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        // Add one file and flush the archive
+        dwErrCode = AddFileToMpq(&Logger, hMpq, "AddedFile01.txt", "This is the file data.", MPQ_FILE_COMPRESS);
+        SFileCloseArchive(hMpq);
+        hMpq = NULL;
+    }
+
+    // Reopen the MPQ and add another file.
+    // The new file must be added to the position of the (listfile)
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        CreateFullPathName(szFullPath, _countof(szFullPath), NULL, szPlainName);
+        dwErrCode = OpenExistingArchive(&Logger, szFullPath, 0, &hMpq);
+        if(dwErrCode == ERROR_SUCCESS)
+        {
+            // Retrieve the position of the (listfile)
+            if(SFileOpenFileEx(hMpq, LISTFILE_NAME, 0, &hFile))
+            {
+                SFileGetFileInfo(hFile, SFileInfoByteOffset, &ByteOffset1, sizeof(ULONGLONG), NULL);
+                SFileCloseFile(hFile);
+            }
+            else
+                dwErrCode = SErrGetLastError();
+        }
+    }
+
+    // Add another file and check its position. It must be at the position of the former listfile
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        LPCSTR szAddedFile = "AddedFile02.txt";
+
+        // Add another file
+        dwErrCode = AddFileToMpq(&Logger, hMpq, szAddedFile, "This is the second added file.", MPQ_FILE_COMPRESS);
+
+        // Retrieve the position of the (listfile)
+        if(SFileOpenFileEx(hMpq, szAddedFile, 0, &hFile))
+        {
+            SFileGetFileInfo(hFile, SFileInfoByteOffset, &ByteOffset2, sizeof(ULONGLONG), NULL);
+            SFileCloseFile(hFile);
+        }
+        else
+            dwErrCode = SErrGetLastError();
+    }
+
+    // Now check the positions
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        if(ByteOffset1 != ByteOffset2)
+        {
+            Logger.PrintError("The added file was not written to the position of (listfile)");
+            dwErrCode = ERROR_FILE_CORRUPT;
+        }
+    }
+
+    // Close the archive if needed
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    return dwErrCode;
+}
+
+static DWORD TestCreateArchive_FillArchive(LPCTSTR szPlainName, DWORD dwCreateFlags)
+{
+    TLogHelper Logger("TestCreateFull", szPlainName);
+    LPCSTR szFileData = "TestCreateArchive_FillArchive: Testing file data";
+    char szFileName[MAX_PATH];
+    HANDLE hMpq = NULL;
+    DWORD dwMaxFileCount = 6;
+    DWORD dwCompression = MPQ_COMPRESSION_ZLIB;
+    DWORD dwFlags = MPQ_FILE_ENCRYPTED | MPQ_FILE_COMPRESS;
+    DWORD dwErrCode;
+
+    //
+    // Note that StormLib will round the maxfile count
+    // up to hash table size (nearest power of two)
+    //
+    if((dwCreateFlags & MPQ_CREATE_LISTFILE) == 0)
+        dwMaxFileCount++;
+    if((dwCreateFlags & MPQ_CREATE_ATTRIBUTES) == 0)
+        dwMaxFileCount++;
+
+    // Create the new MPQ archive
+    dwErrCode = CreateNewArchive_V2(&Logger, szPlainName, dwCreateFlags, dwMaxFileCount, &hMpq);
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        // Flush the archive first
+        SFileFlushArchive(hMpq);
+
+        // Add all files
+        for(unsigned int i = 0; i < dwMaxFileCount; i++)
+        {
+            sprintf(szFileName, "AddedFile%03u.txt", i);
+            dwErrCode = AddFileToMpq(&Logger, hMpq, szFileName, szFileData, dwFlags, dwCompression);
+            if(dwErrCode != ERROR_SUCCESS)
+                break;
+        }
+
+        // Flush the archive again
+        SFileFlushArchive(hMpq);
+    }
 
-    // Propagate the open MPQ flags from the input
-    dwOpenFlags |= (dwFlags & TFLG_WILL_FAIL) ? MPQ_OPEN_DONT_REPORT_FAILURE : 0;
-    dwOpenFlags |= (dwFlags & TFLG_READ_ONLY) ? STREAM_FLAG_READ_ONLY : 0;
+    // Now the MPQ should be full. It must not be possible to add another file
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwErrCode = AddFileToMpq(&Logger, hMpq, "ShouldNotBeHere.txt", szFileData, MPQ_FILE_COMPRESS, MPQ_COMPRESSION_ZLIB, ERROR_DISK_FULL);
+        assert(dwErrCode != ERROR_SUCCESS);
+        dwErrCode = ERROR_SUCCESS;
+    }
 
-    // Shall we switch the name of the MPQ?
-    szMpqName1 = SwapMpqName(szMpqNameBuff, _countof(szMpqNameBuff), szMpqName1, (PTEST_EXTRA_UTF8)(pExtra));
+    // Close the archive to enforce saving all tables
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    hMpq = NULL;
 
-    // If the file is a partial MPQ, don't load all files
-    if(_tcsstr(szMpqName1, _T(".MPQ.part")) == NULL)
-        dwSearchFlags |= SEARCH_FLAG_LOAD_FILES;
+    // Reopen the archive again
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
 
-    // If we shall hash the files, do it
-    if(IS_VALID_STRING(szExpectedHash))
+    // The archive should still be full
+    if(dwErrCode == ERROR_SUCCESS)
     {
-        dwExpectedFileCount = (dwFlags & TFLG_VALUE_MASK);
-        dwSearchFlags |= SEARCH_FLAG_HASH_FILES;
+        CheckIfFileIsPresent(&Logger, hMpq, LISTFILE_NAME, (dwCreateFlags & MPQ_CREATE_LISTFILE) ? true : false);
+        CheckIfFileIsPresent(&Logger, hMpq, ATTRIBUTES_NAME, (dwCreateFlags & MPQ_CREATE_ATTRIBUTES) ? true : false);
+        dwErrCode = AddFileToMpq(&Logger, hMpq, "ShouldNotBeHere.txt", szFileData, MPQ_FILE_COMPRESS, MPQ_COMPRESSION_ZLIB, ERROR_DISK_FULL);
+        assert(dwErrCode != ERROR_SUCCESS);
+        dwErrCode = ERROR_SUCCESS;
     }
 
-    // Copy the archive so we won't fuck up the original one
-    dwErrCode = OpenExistingArchiveWithCopy(&Logger, szMpqName1, szMpqName2, &hMpq, dwOpenFlags);
-    while(dwErrCode == ERROR_SUCCESS)
+    // The (listfile) and (attributes) must be present
+    if(dwErrCode == ERROR_SUCCESS)
     {
-        // Check for malformed MPQs
-        SFileGetFileInfo(hMpq, SFileMpqFlags, &dwMpqFlags, sizeof(dwMpqFlags), NULL);
-        dwSearchFlags |= (dwMpqFlags & MPQ_FLAG_MALFORMED) ? SEARCH_FLAG_IGNORE_ERRORS : 0;
-        dwSearchFlags |= (GetExtraType(pExtra) == PatchList) ? SEARCH_FLAG_IGNORE_ERRORS : 0;
+        CheckIfFileIsPresent(&Logger, hMpq, LISTFILE_NAME, (dwCreateFlags & MPQ_CREATE_LISTFILE) ? true : false);
+        CheckIfFileIsPresent(&Logger, hMpq, ATTRIBUTES_NAME, (dwCreateFlags & MPQ_CREATE_ATTRIBUTES) ? true : false);
+        dwErrCode = RemoveMpqFile(&Logger, hMpq, szFileName, ERROR_SUCCESS);
+    }
 
-        // Verify signature before any changes
-        if((dwErrCode = TestOpenArchive_VerifySignature(Logger, hMpq, (dwFlags & TFLG_SIGCHECK_BEFORE))) != ERROR_SUCCESS)
-            break;
+    // Now add the file again. This time, it should be possible OK
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwErrCode = AddFileToMpq(&Logger, hMpq, szFileName, szFileData, dwFlags, dwCompression, ERROR_SUCCESS);
+        assert(dwErrCode == ERROR_SUCCESS);
+    }
 
-        // Perform extra action, dependent on the data passed
-        if((dwErrCode = TestOpenArchive_ExtraType(Logger, hMpq, dwSearchFlags, pExtra)) != ERROR_SUCCESS)
-            break;
+    // Now add the file again. This time, it should fail
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwErrCode = AddFileToMpq(&Logger, hMpq, szFileName, szFileData, dwFlags, dwCompression, ERROR_ALREADY_EXISTS);
+        assert(dwErrCode != ERROR_SUCCESS);
+        dwErrCode = ERROR_SUCCESS;
+    }
 
-        // Modify the archive, if required
-        if((dwErrCode = TestOpenArchive_ModifyArchive(Logger, hMpq, dwFlags)) != ERROR_SUCCESS)
-            break;
+    // Now add the file again. This time, it should fail
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwErrCode = AddFileToMpq(&Logger, hMpq, "ShouldNotBeHere.txt", szFileData, dwFlags, dwCompression, ERROR_DISK_FULL);
+        assert(dwErrCode != ERROR_SUCCESS);
+        dwErrCode = ERROR_SUCCESS;
+    }
 
-        // Sign the archive, if needed
-        if((dwErrCode = TestOpenArchive_SignArchive(Logger, hMpq, (dwFlags & TFLG_SIGN_ARCHIVE))) != ERROR_SUCCESS)
-            break;
+    // Close the archive and return
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    hMpq = NULL;
 
-        // Test the SFileGetFileInfo, if required
-        if((dwErrCode = TestOpenArchive_GetFileInfo(Logger, hMpq, dwFlags)) != ERROR_SUCCESS)
-            break;
+    // Reopen the archive for the third time to verify that both internal files are there
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
+        if(dwErrCode == ERROR_SUCCESS)
+        {
+            CheckIfFileIsPresent(&Logger, hMpq, LISTFILE_NAME, (dwCreateFlags & MPQ_CREATE_LISTFILE) ? true : false);
+            CheckIfFileIsPresent(&Logger, hMpq, ATTRIBUTES_NAME, (dwCreateFlags & MPQ_CREATE_ATTRIBUTES) ? true : false);
+            SFileCloseArchive(hMpq);
+        }
+    }
 
-        // Verify signature after any changes
-        if((dwErrCode = TestOpenArchive_VerifySignature(Logger, hMpq, (dwFlags & TFLG_SIGCHECK_AFTER))) != ERROR_SUCCESS)
-            break;
+    return dwErrCode;
+}
 
-        // Attempt to open the (listfile), (attributes), (signature)
-        if((TestArchive_LoadFiles(&Logger, hMpq, (dwMpqFlags & MPQ_FLAG_MALFORMED), LISTFILE_NAME, ATTRIBUTES_NAME, SIGNATURE_NAME, NULL)) != ERROR_SUCCESS)
-            break;
+static DWORD TestCreateArchive_IncMaxFileCount(LPCTSTR szPlainName)
+{
+    TLogHelper Logger("IncMaxFileCount", szPlainName);
+    LPCSTR szFileData = "TestCreateArchive_IncMaxFileCount: Testing file data";
+    char szFileName[MAX_PATH];
+    HANDLE hMpq = NULL;
+    DWORD dwMaxFileCount = 1;
+    DWORD dwErrCode;
 
-        // If required, we search the archive and compare file cound and name hash
-        if((dwErrCode = VerifyDataChecksum(Logger, hMpq, dwSearchFlags, szExpectedHash, dwExpectedFileCount)) != ERROR_SUCCESS)
-            break;
+    // Create the new MPQ
+    dwErrCode = CreateNewArchive(&Logger, szPlainName, MPQ_CREATE_ARCHIVE_V4 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, dwMaxFileCount, &hMpq);
 
-        break;
+    // Now add exactly one file
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwErrCode = AddFileToMpq(&Logger, hMpq, "AddFile_base.txt", szFileData);
+        SFileFlushArchive(hMpq);
+        SFileCloseArchive(hMpq);
     }
 
-    // Reset error code, if the failure is expected
-    if((dwErrCode != ERROR_SUCCESS || hMpq == NULL) && (dwFlags & TFLG_WILL_FAIL))
-        SErrSetLastError(dwErrCode = ERROR_SUCCESS);
+    // Now add 10 files. Each time we cannot add the file due to archive being full,
+    // we increment the max file count
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        for(unsigned int i = 0; i < 10; i++)
+        {
+            // Open the archive again
+            dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
+            if(dwErrCode != ERROR_SUCCESS)
+                break;
 
-    // Cleanup and exit
-    if(hMpq != NULL)
-        SFileCloseArchive(hMpq);
-    return Logger.PrintVerdict(dwErrCode);
+            // Add one file
+            sprintf(szFileName, "AddFile_%04u.txt", i);
+            dwErrCode = AddFileToMpq(&Logger, hMpq, szFileName, szFileData, 0, 0, ERROR_UNDETERMINED_RESULT);
+            if(dwErrCode != ERROR_SUCCESS)
+            {
+                // Increment the max file count by one
+                dwMaxFileCount = SFileGetMaxFileCount(hMpq) + 1;
+                Logger.PrintProgress("Increasing max file count to %u ...", dwMaxFileCount);
+                SFileSetMaxFileCount(hMpq, dwMaxFileCount);
+
+                // Attempt to create the file again
+                dwErrCode = AddFileToMpq(&Logger, hMpq, szFileName, szFileData, 0, 0, ERROR_SUCCESS);
+            }
+
+            // Compact the archive and close it
+            SFileSetCompactCallback(hMpq, CompactCallback, &Logger);
+            SFileCompactArchive(hMpq, NULL, false);
+            SFileCloseArchive(hMpq);
+            if(dwErrCode != ERROR_SUCCESS)
+                break;
+        }
+    }
+
+    return dwErrCode;
 }
 
-static DWORD TestOpenArchive(const TEST_INFO1 & TestInfo)
+static DWORD TestCreateArchive_FileFlagTest(LPCTSTR szPlainName)
 {
-    return TestOpenArchive(TestInfo.szName1,            // Name of the MPQ
-                           TestInfo.szName2,            // Name of the listfile or NULL
-                           TestInfo.szDataHash,         // Compound name+data hash
-                           TestInfo.dwFlags,            // Test flags
-                           TestInfo.pExtra);            // Extra parameter
-}
+    TLogHelper Logger("TestFileFlag", szPlainName);
+    HANDLE hMpq = NULL;                 // Handle of created archive
+    TCHAR szFileName1[MAX_PATH];
+    TCHAR szFileName2[MAX_PATH];
+    TCHAR szFullPath[MAX_PATH];
+    LPCSTR szMiddleFile = "FileTest_10.exe";
+    LCID LocaleIDs[] = {0x000, 0x405, 0x406, 0x407};
+    char szArchivedName[MAX_PATH];
+    DWORD dwMaxFileCount = 0;
+    DWORD dwFileCount = 0;
+    DWORD dwErrCode;
+
+    // Create paths for local file to be added
+    CreateFullPathName(szFileName1, _countof(szFileName1), szDataFileDir, _T("new-file.exe"));
+    CreateFullPathName(szFileName2, _countof(szFileName2), szDataFileDir, _T("new-file.bin"));
+    SFileSetLocale(LANG_NEUTRAL);
+
+    // Create an empty file that will serve as holder for the MPQ
+    dwErrCode = CreateEmptyFile(&Logger, szPlainName, 0x100000, szFullPath);
+
+    // Create new MPQ archive over that file
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CreateNewArchive(&Logger, szPlainName, MPQ_CREATE_ARCHIVE_V1 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, 17, &hMpq);
+
+    // Add the same file multiple times
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwMaxFileCount = SFileGetMaxFileCount(hMpq);
+        for(size_t i = 0; AddFlags[i] != 0xFFFFFFFF; i++)
+        {
+            sprintf(szArchivedName, "FileTest_%02u.exe", (unsigned int)i);
+            dwErrCode = AddLocalFileToMpq(&Logger, hMpq, szArchivedName, szFileName1, AddFlags[i], 0);
+            if(dwErrCode != ERROR_SUCCESS)
+                break;
+
+            dwFileCount++;
+        }
+    }
+
+    // Delete a file in the middle of the file table
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        Logger.PrintProgress("Removing file %s ...", szMiddleFile);
+        dwErrCode = RemoveMpqFile(&Logger, hMpq, szMiddleFile, ERROR_SUCCESS);
+        dwFileCount--;
+    }
+
+    // Add one more file
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwErrCode = AddLocalFileToMpq(&Logger, hMpq, "FileTest_xx.exe", szFileName1);
+        dwFileCount++;
+    }
+
+    // Try to decrement max file count. This must succeed
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        Logger.PrintProgress("Attempting to decrement max file count ...");
+        if(SFileSetMaxFileCount(hMpq, 5))
+            dwErrCode = Logger.PrintError("Max file count decremented, even if it should fail");
+    }
 
-//-----------------------------------------------------------------------------
-// Reopening archives
+    // Add ZeroSize.txt several times under a different locale
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        for(size_t i = 0; i < _countof(LocaleIDs); i++)
+        {
+            bool bMustSucceed = ((dwFileCount + 2) < dwMaxFileCount);
 
-static void WINAPI CompactCallback(void * pvUserData, DWORD dwWork, ULONGLONG BytesDone, ULONGLONG TotalBytes)
-{
-    TLogHelper * pLogger = (TLogHelper *)pvUserData;
-    LPCSTR szWork = NULL;
+            SFileSetLocale(LocaleIDs[i]);
+            dwErrCode = AddLocalFileToMpq(&Logger, hMpq, "ZeroSize_1.txt", szFileName2);
+            if(dwErrCode != ERROR_SUCCESS)
+            {
+                if(bMustSucceed == false)
+                    dwErrCode = ERROR_SUCCESS;
+                break;
+            }
 
-    switch(dwWork)
+            dwFileCount++;
+        }
+    }
+
+    // Add ZeroSize.txt again several times under a different locale
+    if(dwErrCode == ERROR_SUCCESS)
     {
-        case CCB_CHECKING_FILES:
-            szWork = "Checking files in archive";
-            break;
+        for(size_t i = 0; LocaleIDs[i] != 0xFFFF; i++)
+        {
+            bool bMustSucceed = ((dwFileCount + 2) < dwMaxFileCount);
 
-        case CCB_CHECKING_HASH_TABLE:
-            szWork = "Checking hash table";
-            break;
+            SFileSetLocale(LocaleIDs[i]);
+            dwErrCode = AddLocalFileToMpq(&Logger, hMpq, "ZeroSize_2.txt", szFileName2, 0, 0, bMustSucceed);
+            if(dwErrCode != ERROR_SUCCESS)
+            {
+                if(bMustSucceed == false)
+                    dwErrCode = ERROR_SUCCESS;
+                break;
+            }
 
-        case CCB_COPYING_NON_MPQ_DATA:
-            szWork = "Copying non-MPQ data";
-            break;
+            dwFileCount++;
+        }
+    }
 
-        case CCB_COMPACTING_FILES:
-            szWork = "Compacting files";
-            break;
+    // Verify how many files did we add to the MPQ
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        if(dwFileCount + 2 != dwMaxFileCount)
+        {
+            Logger.PrintErrorVa("Number of files added to MPQ was unexpected (expected %u, added %u)", dwFileCount, dwMaxFileCount - 2);
+            dwErrCode = ERROR_FILE_CORRUPT;
+        }
+    }
 
-        case CCB_CLOSING_ARCHIVE:
-            szWork = "Closing archive";
-            break;
+    // Test rename function
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        Logger.PrintProgress("Testing rename files ...");
+        SFileSetLocale(LANG_NEUTRAL);
+        if(!SFileRenameFile(hMpq, "FileTest_08.exe", "FileTest_08a.exe"))
+            dwErrCode = Logger.PrintError("Failed to rename the file");
     }
 
-    if(szWork != NULL)
+    if(dwErrCode == ERROR_SUCCESS)
     {
-        if(pLogger != NULL)
-            pLogger->PrintProgress("%s " fmt_X_of_Y_a " ...", szWork, BytesDone, TotalBytes);
-        else
-            printf("%s " fmt_X_of_Y_a " ...     \r", szWork, BytesDone, TotalBytes);
+        if(!SFileRenameFile(hMpq, "FileTest_08a.exe", "FileTest_08.exe"))
+            dwErrCode = Logger.PrintError("Failed to rename the file");
     }
-}
 
-static DWORD TestReopenArchive_CompactArchive(TLogHelper & Logger, HANDLE hMpq, DWORD dwFlags)
-{
-    if(dwFlags & TFLG_COMPACT)
+    if(dwErrCode == ERROR_SUCCESS)
     {
-        // Set the compact callback
-        Logger.PrintProgress("Compacting archive ...");
-        if(!SFileSetCompactCallback(hMpq, CompactCallback, &Logger))
-            return Logger.PrintError("Failed to set the compact callback");
+        if(SFileRenameFile(hMpq, "FileTest_10.exe", "FileTest_10a.exe"))
+        {
+            Logger.PrintError("Rename test succeeded even if it shouldn't");
+            dwErrCode = ERROR_FILE_CORRUPT;
+        }
+    }
 
-        // Compact the archive
-        if(!SFileCompactArchive(hMpq, NULL, false))
-            return Logger.PrintError("Failed to compact archive");
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        if(SFileRenameFile(hMpq, "FileTest_10a.exe", "FileTest_10.exe"))
+        {
+            Logger.PrintError("Rename test succeeded even if it shouldn't");
+            dwErrCode = ERROR_FILE_CORRUPT;
+        }
     }
-    return ERROR_SUCCESS;
+
+    // Close the archive
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    hMpq = NULL;
+
+    // Try to reopen the archive
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = OpenExistingArchive(&Logger, szFullPath, 0, NULL);
+    return dwErrCode;
 }
 
-static DWORD TestReopenArchive(
-    LPCTSTR szMpqName1,                             // Name of the MPQ
-    LPCSTR szExpectedHash,                          // Expected name+data hash
-    DWORD dwFlags)                                  // Test flags. Lower bits contains the number of files
+static DWORD TestCreateArchive_WaveCompressionsTest(LPCTSTR szPlainName, LPCTSTR szWaveFile)
 {
-    TLogHelper Logger("Test_ReopenMpq", szMpqName1);
-    ULONGLONG PreMpqDataSize = (dwFlags & TFLG_ADD_USER_DATA) ? 0x400 : 0;
-    ULONGLONG UserDataSize = (dwFlags & TFLG_ADD_USER_DATA) ? 0x531 : 0;
-    LPCTSTR szCopyName = _T("StormLibTest_Reopened.mpq");
-    HANDLE hMpq;
-    DWORD dwExpectedFileCount = 0;
-    DWORD dwSearchFlags = SEARCH_FLAG_LOAD_FILES;
-    TCHAR szFullPath[MAX_PATH];
+    TLogHelper Logger("TestCompressions", szPlainName);
+    HANDLE hMpq = NULL;                 // Handle of created archive
+    TCHAR szFileName[MAX_PATH];         // Source file to be added
+    char szArchivedName[MAX_PATH];
+    DWORD dwCmprCount = sizeof(WaveCompressions) / sizeof(DWORD);
+    DWORD dwAddedFiles = 0;
+    DWORD dwFoundFiles = 0;
     DWORD dwErrCode;
 
-    // If we shall hash the files, do it
-    if(IS_VALID_STRING(szExpectedHash))
-    {
-        dwExpectedFileCount = (dwFlags & TFLG_VALUE_MASK);
-        dwSearchFlags |= SEARCH_FLAG_HASH_FILES;
-    }
+    // Create paths for local file to be added
+    CreateFullPathName(szFileName, _countof(szFileName), szDataFileDir, szWaveFile);
 
-    // Create copy of the archive, with interleaving some user data
-    dwErrCode = CreateFileCopy(&Logger, szMpqName1, szCopyName, szFullPath, _countof(szFullPath), PreMpqDataSize, UserDataSize);
+    // Create new archive
+    dwErrCode = CreateNewArchive(&Logger, szPlainName, MPQ_CREATE_ARCHIVE_V1 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, 0x40, &hMpq);
 
-    // Open the archive and read the hash of the files
+    // Add the same file multiple times
     if(dwErrCode == ERROR_SUCCESS)
     {
-        if((dwErrCode = OpenExistingArchive(&Logger, szFullPath, 0, &hMpq)) == ERROR_SUCCESS)
+        Logger.UserTotal = dwCmprCount;
+        for(unsigned int i = 0; i < dwCmprCount; i++)
         {
-            // Verify presence of (listfile) and (attributes)
-            CheckIfFileIsPresent(&Logger, hMpq, LISTFILE_NAME, (dwFlags & TFLG_HAS_LISTFILE));
-            CheckIfFileIsPresent(&Logger, hMpq, ATTRIBUTES_NAME, (dwFlags & TFLG_HAS_ATTRIBUTES));
+            sprintf(szArchivedName, "WaveFile_%02u.wav", i + 1);
+            dwErrCode = AddLocalFileToMpq(&Logger, hMpq, szArchivedName, szFileName, MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED | MPQ_FILE_SECTOR_CRC, WaveCompressions[i]);
+            if(dwErrCode != ERROR_SUCCESS)
+                break;
 
-            // If required, we search the archive and compare file cound and name hash
-            dwErrCode = VerifyDataChecksum(Logger, hMpq, dwSearchFlags, szExpectedHash, dwExpectedFileCount);
-            SFileCloseArchive(hMpq);
+            Logger.UserCount++;
+            dwAddedFiles++;
         }
+
+        SFileCloseArchive(hMpq);
     }
 
-    // Try to modify and/or compact the MPQ
+    // Reopen the archive extract each WAVE file and try to play it
     if(dwErrCode == ERROR_SUCCESS)
     {
-        // Open the archive again
-        if((dwErrCode = OpenExistingArchive(&Logger, szFullPath, 0, &hMpq)) == ERROR_SUCCESS)
+        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
+        if(dwErrCode == ERROR_SUCCESS)
         {
-            // Modify the archive, if required
-            if((dwErrCode = TestOpenArchive_ModifyArchive(Logger, hMpq, dwFlags)) == ERROR_SUCCESS)
-            {
-                dwErrCode = TestReopenArchive_CompactArchive(Logger, hMpq, dwFlags);
-            }
+            SearchArchive(&Logger, hMpq, SEARCH_FLAG_LOAD_FILES | SEARCH_FLAG_PLAY_WAVES, &dwFoundFiles, NULL);
             SFileCloseArchive(hMpq);
         }
-    }
 
-    // Open the archive and load some files
-    if((dwErrCode == ERROR_SUCCESS) && STORMLIB_TEST_FLAGS(dwFlags, TFLG_COMPACT | TFLG_MODIFY | TFLG_BIGFILE, TFLG_COMPACT))
-    {
-        // Open the archive
-        if((dwErrCode = OpenExistingArchive(&Logger, szFullPath, 0, &hMpq)) == ERROR_SUCCESS)
+        // Check if the number of found files is the same like the number of added files
+        // DOn;t forget that there will be (listfile) and (attributes)
+        if(dwFoundFiles != (dwAddedFiles + 2))
         {
-            // Verify presence of (listfile) and (attributes)
-            CheckIfFileIsPresent(&Logger, hMpq, LISTFILE_NAME, (dwFlags & TFLG_HAS_LISTFILE));
-            CheckIfFileIsPresent(&Logger, hMpq, ATTRIBUTES_NAME, (dwFlags & TFLG_HAS_ATTRIBUTES));
-
-            // Search the archive and load every file
-            dwErrCode = VerifyDataChecksum(Logger, hMpq, dwSearchFlags, szExpectedHash, dwExpectedFileCount);
+            Logger.PrintError("Number of found files does not match number of added files.");
+            dwErrCode = ERROR_FILE_CORRUPT;
         }
-        SFileCloseArchive(hMpq);
     }
+
     return dwErrCode;
 }
 
-static DWORD TestOpenArchive_SignatureTest(LPCTSTR szPlainName, LPCTSTR szOriginalName, DWORD dwFlags)
+static DWORD TestCreateArchive_ListFilePos(LPCTSTR szPlainName)
 {
-    TLogHelper Logger("Test_Signature", szPlainName);
-    HANDLE hMpq;
-    DWORD dwCreateFlags = MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES | MPQ_FORMAT_VERSION_1;
-    DWORD dwErrCode = ERROR_SUCCESS;
+    PFILE_DATA pFileData;
+    LPCSTR szReaddedFile = "AddedFile_##.txt";
+    LPCSTR szFileMask = "AddedFile_%02u.txt";
+    TLogHelper Logger("ListFilePos", szPlainName);
+    HANDLE hMpq = NULL;                 // Handle of created archive
+    char szArchivedName[MAX_PATH];
+    DWORD dwMaxFileCount = 0x0E;
+    DWORD dwFileCount = 0;
+    size_t i;
+    DWORD dwErrCode;
 
-    // Create a new archive or copy existing
-    if(dwFlags & SFLAG_CREATE_ARCHIVE)
+    // Create a new archive with the limit of 0x20 files
+    dwErrCode = CreateNewArchive(&Logger, szPlainName, MPQ_CREATE_ARCHIVE_V4 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, dwMaxFileCount, &hMpq);
+
+    // Add maximum files files
+    if(dwErrCode == ERROR_SUCCESS)
     {
-        dwCreateFlags |= (dwFlags & SFLAG_SIGN_AT_CREATE) ? MPQ_CREATE_SIGNATURE : 0;
-        dwErrCode = CreateNewArchive_V2(&Logger, szPlainName, dwCreateFlags, 4000, &hMpq);
+        for(i = 0; i < dwMaxFileCount; i++)
+        {
+            sprintf(szArchivedName, szFileMask, i);
+            dwErrCode = AddFileToMpq(&Logger, hMpq, szArchivedName, "This is a text data.", 0, 0, ERROR_SUCCESS);
+            if(dwErrCode != ERROR_SUCCESS)
+                break;
+
+            dwFileCount++;
+        }
     }
-    else
+
+    // Delete few middle files
+    if(dwErrCode == ERROR_SUCCESS)
     {
-        szOriginalName = (szOriginalName) ? szOriginalName : szPlainName;
-        dwErrCode = OpenExistingArchiveWithCopy(&Logger, szPlainName, szOriginalName, &hMpq);
+        for(i = 0; i < (dwMaxFileCount / 2); i++)
+        {
+            sprintf(szArchivedName, szFileMask, i);
+            dwErrCode = RemoveMpqFile(&Logger, hMpq, szArchivedName, ERROR_SUCCESS);
+            if(dwErrCode != ERROR_SUCCESS)
+                break;
+
+            dwFileCount--;
+        }
     }
 
-    // Continue with archive signature tests
+    // Close the archive
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    hMpq = NULL;
+
+    // Reopen the archive to catch any asserts
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
+
+    // Check that (listfile) is at the end
     if(dwErrCode == ERROR_SUCCESS)
     {
-        // Shall we check the signatures before modifications?
-        if(dwErrCode == ERROR_SUCCESS)
+        if(LoadMpqFile(Logger, hMpq, LISTFILE_NAME, 0, 0, &pFileData) == ERROR_SUCCESS)
         {
-            dwErrCode = TestOpenArchive_VerifySignature(Logger, hMpq, (dwFlags & SFLAG_VERIFY_BEFORE));
+            if(pFileData->dwBlockIndex < dwFileCount)
+                Logger.PrintMessage("Unexpected file index of %s", LISTFILE_NAME);
+            STORM_FREE(pFileData);
         }
 
-        // Shall we modify the archive?
-        if(dwErrCode == ERROR_SUCCESS)
+        if(LoadMpqFile(Logger, hMpq, ATTRIBUTES_NAME, 0, 0, &pFileData) == ERROR_SUCCESS)
         {
-            dwErrCode = TestOpenArchive_ModifyArchive(Logger, hMpq, (dwFlags & SFLAG_MODIFY_ARCHIVE));
+            if(pFileData->dwBlockIndex <= dwFileCount)
+                Logger.PrintMessage("Unexpected file index of %s", ATTRIBUTES_NAME);
+            STORM_FREE(pFileData);
         }
 
-        // Shall we sign the archive?
+        // Add new file to the archive. It should be added to the last position
+        dwErrCode = AddFileToMpq(&Logger, hMpq, szReaddedFile, "This is a re-added file.", 0, 0, ERROR_SUCCESS);
         if(dwErrCode == ERROR_SUCCESS)
         {
-            dwErrCode = TestOpenArchive_SignArchive(Logger, hMpq, (dwFlags & SFLAG_SIGN_ARCHIVE));
+            // Force update of the tables
+            SFileFlushArchive(hMpq);
+
+            // Load the file
+            if(LoadMpqFile(Logger, hMpq, szReaddedFile, 0, 0, &pFileData) == ERROR_SUCCESS)
+            {
+                if(pFileData->dwBlockIndex != dwFileCount)
+                    Logger.PrintMessage("Unexpected file index of %s", szReaddedFile);
+                STORM_FREE(pFileData);
+            }
         }
 
-        // Shall we check the signatures after modifications?
-        if(dwErrCode == ERROR_SUCCESS)
+        SFileCloseArchive(hMpq);
+    }
+
+    return dwErrCode;
+}
+
+static DWORD TestCreateArchive_BigArchive(LPCTSTR szPlainName)
+{
+    TLogHelper Logger("TestBigArchive", szPlainName);
+    HANDLE hMpq = NULL;                 // Handle of created archive
+    TCHAR szLocalFileName[MAX_PATH];
+    char szArchivedName[MAX_PATH];
+    DWORD dwMaxFileCount = 0x20;
+    DWORD dwAddedCount = 0;
+    size_t i;
+    DWORD dwErrCode;
+
+    // Create a new archive with the limit of 0x20 files
+    dwErrCode = CreateNewArchive(&Logger, szPlainName, MPQ_CREATE_ARCHIVE_V3 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, dwMaxFileCount, &hMpq);
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        LPCSTR szFileMask = "AddedFile_%02u.txt";
+
+        // Now add few really big files
+        CreateFullPathName(szLocalFileName, _countof(szLocalFileName), szMpqSubDir, _T("MPQ_1997_v1_Diablo1_DIABDAT.MPQ"));
+        Logger.UserTotal = (dwMaxFileCount / 2);
+
+        for(i = 0; i < dwMaxFileCount / 2; i++)
         {
-            dwErrCode = TestOpenArchive_VerifySignature(Logger, hMpq, (dwFlags & SFLAG_VERIFY_AFTER));
+            sprintf(szArchivedName, szFileMask, i + 1);
+            dwErrCode = AddLocalFileToMpq(&Logger, hMpq, szArchivedName, szLocalFileName, 0, 0, true);
+            if(dwErrCode != ERROR_SUCCESS)
+                break;
+
+            Logger.UserCount++;
+            dwAddedCount++;
         }
+    }
+
+    // Close the archive
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    hMpq = NULL;
+
+    // Reopen the archive to catch any asserts
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
+
+    // Check that (listfile) is at the end
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        CheckIfFileIsPresent(&Logger, hMpq, LISTFILE_NAME, true);
+        CheckIfFileIsPresent(&Logger, hMpq, ATTRIBUTES_NAME, true);
 
         SFileCloseArchive(hMpq);
     }
+
     return dwErrCode;
 }
 
-static DWORD TestCreateArchive(LPCTSTR szPlainName, LPCSTR szFileName, DWORD dwFlags)
+// Benchmark for applying a large listfile to an archive with a big hash table.
+// The hash table is much bigger than the number of files and most names
+// in the listfile are not in the archive, like with community listfiles.
+static DWORD TestCreateArchive_ListFileSpeed(LPCTSTR szPlainName, DWORD dwFileCount, DWORD dwNameCount)
 {
-    TLogHelper Logger("CreateNewMpq", szPlainName);
+    TLogHelper Logger("ListFileSpeedTest", szPlainName);
+    std::vector<const char *> NameList;
+    std::vector<char> NameBuffer;
+    SFILE_FIND_DATA sf;
+    HANDLE hFind;
     HANDLE hMpq = NULL;
-    DWORD dwMaxFileCount = dwFlags & 0x0000FFFF;
-    DWORD dwCreateFlags = 0;
-    DWORD dwFileCount = 0;
+    DWORD dwNamedCount = 0;
+    DWORD dwTotalCount = 0;
+    DWORD dwSingleCount;
+    DWORD dwTickCount;
     DWORD dwErrCode;
+    char szFileName[MAX_PATH];
 
-    // Fixup the MPQ format
-    dwCreateFlags |= (dwFlags & CFLG_EMPTY) ? 0 : MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES;
-    dwCreateFlags |= (dwFlags & CFLG_V2) ? MPQ_CREATE_ARCHIVE_V2 : 0;
-    dwCreateFlags |= (dwFlags & CFLG_V4) ? MPQ_CREATE_ARCHIVE_V4 : 0;
+    // Create an archive without (listfile), with 512K entries in the hash table
+    dwErrCode = CreateNewArchive(&Logger, szPlainName, MPQ_CREATE_ARCHIVE_V2, 0x80000, &hMpq);
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        for(DWORD i = 0; i < dwFileCount; i++)
+        {
+            sprintf(szFileName, "Data\\File%06u.txt", i);
+            dwErrCode = AddFileToMpq(&Logger, hMpq, szFileName, szFileName, MPQ_FILE_COMPRESS, MPQ_COMPRESSION_ZLIB);
+            if(dwErrCode != ERROR_SUCCESS)
+                break;
+        }
+        SFileCloseArchive(hMpq);
+        hMpq = NULL;
+    }
 
-    // Create the full path name
-    dwErrCode = CreateNewArchive(&Logger, szPlainName, dwCreateFlags, dwMaxFileCount, &hMpq);
+    // Reopen the archive. Names of all files are unknown now
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
+
+    // Prepare the list of names. Only few of them are in the archive
     if(dwErrCode == ERROR_SUCCESS)
     {
-        // Add non-standard names, if needed
-        if(dwFlags & CFLG_NONSTD_NAMES)
+        NameBuffer.resize((size_t)dwNameCount * 0x20);
+        for(DWORD i = 0; i < dwNameCount; i++)
         {
-            // Add few files and close the archive
-            AddFileToMpq(&Logger, hMpq, "AddedFile000.txt", "This is the file data 000.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "\\/\\/\\/\\AddedFile001.txt", "This is the file data 001.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "\\\\\\\\\\\\\\\\", "This is the file data 002.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "////////////////", "This is the file data 003.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "//\\//\\//\\//\\", "This is the file data 004.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "................", "This is the file data 005.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "//****//****//****//****.***", "This is the file data 006.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "//*??*//*??*//*??*//?**?.?*?", "This is the file data 007.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "\\/\\/File.txt", "This is the file data 008.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "\\/\\/File.txt..", "This is the file data 009.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "Dir1\\Dir2\\Dir3\\File.txt..", "This is the file data 010.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "\\Dir1\\Dir2\\Dir3\\File.txt..", "This is the file data 011.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "\\\\Dir1\\\\Dir2\\\\Dir3\\\\File.txt..", "This is the file data 012.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "/Dir1/Dir2/Dir3/File.txt..", "This is the file data 013.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "////Dir1////Dir2////Dir3////File.txt..", "This is the file data 014.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "\\//\\Dir1\\//\\Dir2\\//\\File.txt..", "This is the file data 015.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "\x10\x11\x12\x13\\\x14\x15\x16\x17\\\x18\x19\x1a\x1b\\\x1c\x1D\x1E\x1F.txt", "This is the file data 016.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "\x09\x20\x09\x20\\\x20\x09\x20\x09\\\x09\x20\x09\x20\\\x20\x09\x20\x09.txt", "This is the file data 017.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "\x80\x91\xA2\xB3\\\xC4\xD5\xE6\xF7\\\x80\x91\xA2\xB3.txt", "This is the file data 018.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "Dir1\x20\x09\x20\\Dir2\x20\x09\x20\\File.txt\x09\x09\x20\x2e", "This is the file data 019.", MPQ_FILE_COMPRESS);
-            AddFileToMpq(&Logger, hMpq, "Dir1\x20\x09\x20\\Dir2\x20\x09\x20\\\x09\x20\x2e\x09\x20\x2e", "This is the file data 020.", MPQ_FILE_COMPRESS);
+            char * szName = &NameBuffer[(size_t)i * 0x20];
+
+            if(i < dwFileCount)
+                sprintf(szName, "Data\\File%06u.txt", i);
+            else
+                sprintf(szName, "Missing\\Name%08u.txt", i);
+            NameList.push_back(szName);
         }
 
-        // Like MPQEditor: Flush archive, add one file, flush again
-        if(dwFlags & CFLG_MPQEDITOR)
+        // For comparison, apply some of the names one at a time. Each call
+        // looks through the whole hash table, like the listfile code used to do for each name
+        dwSingleCount = STORMLIB_MIN(dwNameCount, 200);
+        Logger.PrintProgress("Applying %u names one by one ...", dwSingleCount);
+        Logger.SetStartTime();
+        for(DWORD i = 0; i < dwSingleCount; i++)
         {
-            SFileFlushArchive(hMpq);
-            dwErrCode = AddFileToMpq(&Logger, hMpq, szFileName, "This is the file data.", MPQ_FILE_COMPRESS);
-            SFileFlushArchive(hMpq);
+            if(SFileAddListFileEntries(hMpq, &NameList[i], 1) != ERROR_SUCCESS)
+            {
+                dwErrCode = Logger.PrintError("Failed to add the listfile entry");
+                break;
+            }
         }
+        dwTickCount = Logger.SetEndTime();
+        Logger.PrintMessage("One by one: %u names in %u ms (%u ns per name)", dwSingleCount, dwTickCount, (DWORD)((ULONGLONG)dwTickCount * 1000000 / STORMLIB_MAX(dwSingleCount, 1)));
+    }
 
-        // Search the archive
-        SearchArchive(&Logger, hMpq);
-        SFileCloseArchive(hMpq);
+    // Apply all names at once and measure the time
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        Logger.PrintProgress("Applying %u names ...", dwNameCount);
+        Logger.SetStartTime();
+        if(SFileAddListFileEntries(hMpq, &NameList[0], dwNameCount) != ERROR_SUCCESS)
+            dwErrCode = Logger.PrintError("Failed to add the listfile entries");
+        dwTickCount = Logger.SetEndTime();
+        Logger.PrintMessage("All at once: %u names in %u ms (%u ns per name)", dwNameCount, dwTickCount, (DWORD)((ULONGLONG)dwTickCount * 1000000 / STORMLIB_MAX(dwNameCount, 1)));
     }
 
-    // Reopen the empty MPQ
+    // All files in the archive must have their names now
     if(dwErrCode == ERROR_SUCCESS)
     {
-        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
-        if(dwErrCode == ERROR_SUCCESS)
+        hFind = SFileFindFirstFile(hMpq, "*", &sf, NULL);
+        if(hFind != NULL)
         {
-            // Retrieve the number of files
-            SFileGetFileInfo(hMpq, SFileMpqNumberOfFiles, &dwFileCount, sizeof(dwFileCount), NULL);
-
-            // Special check for empty MPQs
-            if(dwFlags & CFLG_EMPTY)
+            do
             {
-                if(dwFileCount != 0)
-                    dwErrCode = ERROR_FILE_CORRUPT;
-                CheckIfFileIsPresent(&Logger, hMpq, "File00000000.xxx", false);
-                CheckIfFileIsPresent(&Logger, hMpq, LISTFILE_NAME, false);
-                SearchArchive(&Logger, hMpq);
-            }
-            else
-            {
-                if(dwFileCount == 0)
-                    dwErrCode = ERROR_FILE_CORRUPT;
+                if(!_strnicmp(sf.cFileName, "Data\\File", 9))
+                    dwNamedCount++;
+                dwTotalCount++;
             }
+            while(SFileFindNextFile(hFind, &sf));
+            SFileFindClose(hFind);
+        }
 
-            // Close the MPQ
-            SFileCloseArchive(hMpq);
+        if(dwNamedCount != dwFileCount)
+        {
+            Logger.PrintErrorVa("Only %u of %u files got their names", dwNamedCount, dwFileCount);
+            dwErrCode = ERROR_FILE_CORRUPT;
         }
     }
 
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
     return dwErrCode;
 }
 
-static DWORD TestCreateArchive(const TEST_INFO2 & TestInfo)
+// Allocates a buffer filled with pseudo-random letters from a small alphabet, so that it compresses well
+static LPBYTE AllocateCompressibleData(DWORD cbData, DWORD dwRandom, DWORD dwLetterMask)
 {
-    TCHAR szPlainNameT[MAX_PATH];
-
-    // Always prefix the archive name with "StormLibTest_"
-    StringCopy(szPlainNameT, _countof(szPlainNameT), "StormLibTest_");
-    StringCat(szPlainNameT, _countof(szPlainNameT), TestInfo.szName1);
+    LPBYTE pbData;
 
-    // Perform creation of the archive
-    return TestCreateArchive(szPlainNameT, TestInfo.szName2, TestInfo.dwFlags);
+    if((pbData = STORM_ALLOC(BYTE, cbData)) != NULL)
+    {
+        for(DWORD i = 0; i < cbData; i++)
+        {
+            dwRandom = dwRandom * 1103515245 + 12345;
+            pbData[i] = (BYTE)('a' + ((dwRandom >> 16) & dwLetterMask));
+        }
+    }
+    return pbData;
 }
 
-static DWORD TestRenameFile(LPCTSTR szPlainName)
+// Verifies that two created archives are identical and that all files in the second one can be loaded
+static DWORD VerifyIdenticalArchives(TLogHelper * pLogger, LPCTSTR szPlainName1, LPCTSTR szPlainName2)
 {
-    TLogHelper Logger("TestRenameFile", szPlainName);
-    LPCSTR szSourceFile = "war3map.mmp";
-    LPCSTR szTargetFile = "war3map.wts";
+    TFileStream * pStream1;
+    TFileStream * pStream2;
     HANDLE hMpq = NULL;
     DWORD dwErrCode;
-    DWORD dwFailed = 0;
-    LCID LCID_RURU = 0x0419;
-    LCID LCID_ESES = 0x040A;
+    TCHAR szFullPath1[MAX_PATH];
+    TCHAR szFullPath2[MAX_PATH];
+
+    // Both archives must be identical
+    CreateFullPathName(szFullPath1, _countof(szFullPath1), NULL, szPlainName1);
+    CreateFullPathName(szFullPath2, _countof(szFullPath2), NULL, szPlainName2);
+    pStream1 = FileStream_OpenFile(szFullPath1, STREAM_FLAG_READ_ONLY);
+    pStream2 = FileStream_OpenFile(szFullPath2, STREAM_FLAG_READ_ONLY);
+    if(pStream1 != NULL && pStream2 != NULL)
+        dwErrCode = CompareTwoLocalFilesRR(pLogger, pStream1, pStream2, 1000);
+    else
+        dwErrCode = pLogger->PrintError("Failed to open the created archives");
+    FileStream_Close(pStream2);
+    FileStream_Close(pStream1);
 
-    // Create copy of the archive and open it
-    dwErrCode = OpenExistingArchiveWithCopy(&Logger, szPlainName, szPlainName, &hMpq);
+    // Verify the files in the archive
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = OpenExistingArchive(pLogger, szFullPath2, 0, &hMpq);
     if(dwErrCode == ERROR_SUCCESS)
     {
-        // Try to rename an existing file to "war3map.wts".
-        // This must fail because the file already exists.
-        if(SFileRenameFile(hMpq, szSourceFile, szTargetFile))
-            dwFailed++;
+        dwErrCode = SearchArchive(pLogger, hMpq, SEARCH_FLAG_LOAD_FILES);
+        SFileCloseArchive(hMpq);
+    }
+    return dwErrCode;
+}
 
-        // Now change locale of an existing file to Russian
-        if(SetLocaleForFileOperations(hMpq, szSourceFile, LCID_RURU) != ERROR_SUCCESS)
-            dwFailed++;
+// Creates an archive with compressed files, written in chunks that don't match the sectors
+static DWORD CreateArchive_CompressedFiles(TLogHelper * pLogger, LPCTSTR szPlainName, LPBYTE pbData, DWORD cbData, DWORD dwThreadCount)
+{
+    HANDLE hMpq = NULL;
+    HANDLE hFile = NULL;
+    DWORD FileFlags[] =
+    {
+        MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED | MPQ_FILE_SECTOR_CRC,
+        MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED | MPQ_FILE_KEY_V2,
+        MPQ_FILE_IMPLODE,
+        MPQ_FILE_COMPRESS | MPQ_FILE_SECTOR_CRC
+    };
+    DWORD dwErrCode;
+    char szFileName[MAX_PATH];
 
-        // The rename should work now
-        if(!SFileRenameFile(hMpq, szSourceFile, szTargetFile))
-            dwFailed++;
+    // The thread count applies to all files written from now on
+    SFileSetThreadCount(dwThreadCount);
+    dwErrCode = CreateNewArchive(pLogger, szPlainName, MPQ_CREATE_ARCHIVE_V4 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, 0x10, &hMpq);
 
-        // Changing the file locale to Neutral should fail now,
-        // because such file already exists
-        if(SetLocaleForFileOperations(hMpq, szTargetFile, 0) != ERROR_ALREADY_EXISTS)
-            dwFailed++;
+    for(DWORD i = 0; i < _countof(FileFlags) && dwErrCode == ERROR_SUCCESS; i++)
+    {
+        DWORD dwFileSize = cbData - i * 0x1234;
+        DWORD dwChunkSize = 0x0FED + i * 0x3333;
 
-        // Pick another source file
-        szSourceFile = "war3map.shd";
+        sprintf(szFileName, "Data\\File%02u.bin", i);
+        pLogger->PrintProgress("Adding file %s ...", szFileName);
+        if(SFileCreateFile(hMpq, szFileName, 0, dwFileSize, 0, FileFlags[i], &hFile))
+        {
+            // Alternate the compressions, so that each sector is compressed by the one that completed it
+            for(DWORD dwFilePos = 0, j = 0; dwFilePos < dwFileSize; dwFilePos += dwChunkSize, j++)
+            {
+                DWORD dwCompression = (j & 1) ? MPQ_COMPRESSION_BZIP2 : MPQ_COMPRESSION_ZLIB;
 
-        // Change the file locale to Spain
-        if(SetLocaleForFileOperations(hMpq, szSourceFile, LCID_ESES) != ERROR_SUCCESS)
-            dwFailed++;
+                if(!SFileWriteFile(hFile, pbData + dwFilePos, STORMLIB_MIN(dwChunkSize, dwFileSize - dwFilePos), dwCompression))
+                {
+                    dwErrCode = pLogger->PrintError("Failed to write data to the MPQ");
+                    break;
+                }
+            }
 
-        // This rename should also work, because there is no target file with Spanish locale
-        if(!SFileRenameFile(hMpq, szSourceFile, szTargetFile))
-            dwFailed++;
+            if(!SFileFinishFile(hFile) && dwErrCode == ERROR_SUCCESS)
+                dwErrCode = pLogger->PrintError("Failed to finish the file %s", szFileName);
+        }
+        else
+        {
+            dwErrCode = pLogger->PrintError("Failed to create the file %s", szFileName);
+        }
+    }
+
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    SFileSetThreadCount(1);
+    return dwErrCode;
+}
+
+// Compressing sectors in parallel must give exactly the same archive as the sequential compression
+static DWORD TestCreateArchive_ParallelCompression(LPCTSTR szPlainName1, LPCTSTR szPlainName2, DWORD dwThreadCount)
+{
+    TLogHelper Logger("ParallelCompressionTest", szPlainName2);
+    LPBYTE pbData;
+    DWORD cbData = 0x300000;
+    DWORD dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+
+    // Prepare compressible data
+    if((pbData = AllocateCompressibleData(cbData, 0x12345678, 0x07)) != NULL)
+        dwErrCode = ERROR_SUCCESS;
+
+    // Create the same archive without and with the worker pool
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CreateArchive_CompressedFiles(&Logger, szPlainName1, pbData, cbData, 1);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CreateArchive_CompressedFiles(&Logger, szPlainName2, pbData, cbData, dwThreadCount);
 
-        // Evaluate the result
-        if(dwFailed != 0)
-            dwErrCode = ERROR_CAN_NOT_COMPLETE;
-        SFileCloseArchive(hMpq);
-    }
+    // Both archives must be identical
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = VerifyIdenticalArchives(&Logger, szPlainName1, szPlainName2);
 
-    // Restore the original file locale
-    SFileSetLocale(LANG_NEUTRAL);
-    return dwErrCode;
+    if(pbData != NULL)
+        STORM_FREE(pbData);
+    return Logger.PrintVerdict(dwErrCode);
 }
 
-static DWORD TestCreateArchive_TestGaps(LPCTSTR szPlainName)
+// Adds many files from memory, either one by one or by the bulk add functions
+static DWORD CreateArchive_ManyFiles(TLogHelper * pLogger, LPCTSTR szPlainName, LPBYTE pbData, DWORD cbData, DWORD dwThreadCount, bool bBulkAdd)
 {
-    TLogHelper Logger("TestCreateGaps", szPlainName);
-    ULONGLONG ByteOffset1 = 0xFFFFFFFF;
-    ULONGLONG ByteOffset2 = 0xEEEEEEEE;
+    HANDLE hBulkAdd = NULL;
     HANDLE hMpq = NULL;
     HANDLE hFile = NULL;
-    TCHAR szFullPath[MAX_PATH];
-    DWORD dwErrCode = ERROR_SUCCESS;
+    DWORD FileFlags[] =
+    {
+        MPQ_FILE_COMPRESS,
+        MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED | MPQ_FILE_SECTOR_CRC,
+        MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED | MPQ_FILE_KEY_V2,
+        MPQ_FILE_IMPLODE,
+        MPQ_FILE_ENCRYPTED,
+        MPQ_FILE_COMPRESS | MPQ_FILE_SINGLE_UNIT,
+        0
+    };
+    DWORD dwErrCode;
+    char szFileName[MAX_PATH];
 
-    // Create new MPQ
-    dwErrCode = CreateNewArchive_V2(&Logger, szPlainName, MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES | MPQ_FORMAT_VERSION_4, 4000, &hMpq);
-    if(dwErrCode == ERROR_SUCCESS)
+    // Create the archive and begin the bulk add
+    SFileSetThreadCount(dwThreadCount);
+    dwErrCode = CreateNewArchive(pLogger, szPlainName, MPQ_CREATE_ARCHIVE_V4 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, 0x100, &hMpq);
+    if(dwErrCode == ERROR_SUCCESS && bBulkAdd)
     {
-        // Add one file and flush the archive
-        dwErrCode = AddFileToMpq(&Logger, hMpq, "AddedFile01.txt", "This is the file data.", MPQ_FILE_COMPRESS);
-        SFileCloseArchive(hMpq);
-        hMpq = NULL;
+        if(!SFileBeginBulkAdd(hMpq, &hBulkAdd))
+            dwErrCode = pLogger->PrintError("Failed to begin the bulk add");
     }
 
-    // Reopen the MPQ and add another file.
-    // The new file must be added to the position of the (listfile)
-    if(dwErrCode == ERROR_SUCCESS)
+    // Internal files must be refused
+    if(dwErrCode == ERROR_SUCCESS && hBulkAdd != NULL)
     {
-        CreateFullPathName(szFullPath, _countof(szFullPath), NULL, szPlainName);
-        dwErrCode = OpenExistingArchive(&Logger, szFullPath, 0, &hMpq);
-        if(dwErrCode == ERROR_SUCCESS)
+        if(SFileBulkAddData(hBulkAdd, pbData, 0x10, LISTFILE_NAME, 0, MPQ_FILE_COMPRESS, MPQ_COMPRESSION_ZLIB, MPQ_COMPRESSION_NEXT_SAME) || SErrGetLastError() != ERROR_INTERNAL_FILE)
         {
-            // Retrieve the position of the (listfile)
-            if(SFileOpenFileEx(hMpq, LISTFILE_NAME, 0, &hFile))
-            {
-                SFileGetFileInfo(hFile, SFileInfoByteOffset, &ByteOffset1, sizeof(ULONGLONG), NULL);
-                SFileCloseFile(hFile);
-            }
-            else
-                dwErrCode = SErrGetLastError();
+            pLogger->PrintMessage("SFileBulkAddData accepted an internal file");
+            dwErrCode = ERROR_CAN_NOT_COMPLETE;
         }
     }
 
-    // Add another file and check its position. It must be at the position of the former listfile
-    if(dwErrCode == ERROR_SUCCESS)
+    for(DWORD i = 0; i < 200 && dwErrCode == ERROR_SUCCESS; i++)
     {
-        LPCSTR szAddedFile = "AddedFile02.txt";
+        DWORD dwFileSize = (i % 25) ? ((i % 13) ? ((i * 0x3F1) % 0x9000) : 0) : (cbData - i * 0x111);
+        DWORD dwCompression = (i & 1) ? MPQ_COMPRESSION_BZIP2 : MPQ_COMPRESSION_ZLIB;
+        DWORD dwFlags = FileFlags[i % _countof(FileFlags)];
 
-        // Add another file
-        dwErrCode = AddFileToMpq(&Logger, hMpq, szAddedFile, "This is the second added file.", MPQ_FILE_COMPRESS);
-
-        // Retrieve the position of the (listfile)
-        if(SFileOpenFileEx(hMpq, szAddedFile, 0, &hFile))
+        sprintf(szFileName, "Data\\File%03u.bin", i);
+        pLogger->PrintProgress("Adding file %s ...", szFileName);
+        if(hBulkAdd != NULL)
         {
-            SFileGetFileInfo(hFile, SFileInfoByteOffset, &ByteOffset2, sizeof(ULONGLONG), NULL);
-            SFileCloseFile(hFile);
+            if(!SFileBulkAddData(hBulkAdd, pbData + i, dwFileSize, szFileName, 0, dwFlags, dwCompression, MPQ_COMPRESSION_NEXT_SAME))
+                dwErrCode = pLogger->PrintError("Failed to queue the file %s", szFileName);
         }
         else
-            dwErrCode = SErrGetLastError();
+        {
+            if(SFileCreateFile(hMpq, szFileName, 0, dwFileSize, 0, dwFlags, &hFile))
+            {
+                if(!SFileWriteFile(hFile, pbData + i, dwFileSize, dwCompression))
+                    dwErrCode = pLogger->PrintError("Failed to write data to the MPQ");
+                if(!SFileFinishFile(hFile) && dwErrCode == ERROR_SUCCESS)
+                    dwErrCode = pLogger->PrintError("Failed to finish the file %s", szFileName);
+            }
+            else
+            {
+                dwErrCode = pLogger->PrintError("Failed to create the file %s", szFileName);
+            }
+        }
     }
 
-    // Now check the positions
-    if(dwErrCode == ERROR_SUCCESS)
+    // Add all files at once
+    if(hBulkAdd != NULL)
     {
-        if(ByteOffset1 != ByteOffset2)
+        if(dwErrCode == ERROR_SUCCESS)
         {
-            Logger.PrintError("The added file was not written to the position of (listfile)");
-            dwErrCode = ERROR_FILE_CORRUPT;
+            if(!SFileCommitBulkAdd(hBulkAdd))
+                dwErrCode = pLogger->PrintError("Failed to commit the bulk add");
+        }
+        else
+        {
+            SFileAbortBulkAdd(hBulkAdd);
         }
     }
 
-    // Close the archive if needed
     if(hMpq != NULL)
         SFileCloseArchive(hMpq);
+    SFileSetThreadCount(1);
     return dwErrCode;
 }
 
-static DWORD TestCreateArchive_FillArchive(LPCTSTR szPlainName, DWORD dwCreateFlags)
+// Adding files by the bulk add functions must give the same archive as adding them one by one
+static DWORD TestCreateArchive_BulkAdd(LPCTSTR szPlainName1, LPCTSTR szPlainName2, DWORD dwThreadCount)
 {
-    TLogHelper Logger("TestCreateFull", szPlainName);
-    LPCSTR szFileData = "TestCreateArchive_FillArchive: Testing file data";
-    char szFileName[MAX_PATH];
+    TLogHelper Logger("BulkAddTest", szPlainName2);
+    HANDLE hBulkAdd = NULL;
     HANDLE hMpq = NULL;
-    DWORD dwMaxFileCount = 6;
-    DWORD dwCompression = MPQ_COMPRESSION_ZLIB;
-    DWORD dwFlags = MPQ_FILE_ENCRYPTED | MPQ_FILE_COMPRESS;
-    DWORD dwErrCode;
+    LPBYTE pbData;
+    DWORD cbData = 0x60000;
+    DWORD dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+    TCHAR szFullPath[MAX_PATH];
 
-    //
-    // Note that StormLib will round the maxfile count
-    // up to hash table size (nearest power of two)
-    //
-    if((dwCreateFlags & MPQ_CREATE_LISTFILE) == 0)
-        dwMaxFileCount++;
-    if((dwCreateFlags & MPQ_CREATE_ATTRIBUTES) == 0)
-        dwMaxFileCount++;
+    // Prepare compressible data
+    if((pbData = AllocateCompressibleData(cbData, 0x87654321, 0x0F)) != NULL)
+        dwErrCode = ERROR_SUCCESS;
 
-    // Create the new MPQ archive
-    dwErrCode = CreateNewArchive_V2(&Logger, szPlainName, dwCreateFlags, dwMaxFileCount, &hMpq);
+    // Create the same archive by adding files one by one and at once
     if(dwErrCode == ERROR_SUCCESS)
-    {
-        // Flush the archive first
-        SFileFlushArchive(hMpq);
+        dwErrCode = CreateArchive_ManyFiles(&Logger, szPlainName1, pbData, cbData, 1, false);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CreateArchive_ManyFiles(&Logger, szPlainName2, pbData, cbData, dwThreadCount, true);
 
-        // Add all files
-        for(unsigned int i = 0; i < dwMaxFileCount; i++)
+    // Both archives must be identical
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = VerifyIdenticalArchives(&Logger, szPlainName1, szPlainName2);
+
+    // Closing the archive must drop the bulk add that has not been committed
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        CreateFullPathName(szFullPath, _countof(szFullPath), NULL, szPlainName2);
+        dwErrCode = OpenExistingArchive(&Logger, szFullPath, 0, &hMpq);
+    }
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        if(SFileBeginBulkAdd(hMpq, &hBulkAdd))
         {
-            sprintf(szFileName, "AddedFile%03u.txt", i);
-            dwErrCode = AddFileToMpq(&Logger, hMpq, szFileName, szFileData, dwFlags, dwCompression);
-            if(dwErrCode != ERROR_SUCCESS)
-                break;
+            if(!SFileBulkAddData(hBulkAdd, pbData, cbData, "Data\\Uncommitted.bin", 0, MPQ_FILE_COMPRESS, MPQ_COMPRESSION_ZLIB, MPQ_COMPRESSION_NEXT_SAME))
+                dwErrCode = Logger.PrintError("Failed to queue the file");
         }
-
-        // Flush the archive again
-        SFileFlushArchive(hMpq);
+        else
+        {
+            dwErrCode = Logger.PrintError("Failed to begin the bulk add");
+        }
+        SFileCloseArchive(hMpq);
+    }
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = OpenExistingArchive(&Logger, szFullPath, 0, &hMpq);
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        if(SFileHasFile(hMpq, "Data\\Uncommitted.bin"))
+        {
+            Logger.PrintMessage("The file of an uncommitted bulk add is in the archive");
+            dwErrCode = ERROR_CAN_NOT_COMPLETE;
+        }
+        SFileCloseArchive(hMpq);
     }
 
-    // Now the MPQ should be full. It must not be possible to add another file
+    if(pbData != NULL)
+        STORM_FREE(pbData);
+    return Logger.PrintVerdict(dwErrCode);
+}
+
+// Adds a file with the given data to the archive. Returns the position of the file data
+static DWORD AddFileData(TLogHelper * pLogger, HANDLE hMpq, LPCSTR szFileName, LPBYTE pbData, DWORD cbData, DWORD dwFlags, ULONGLONG * PtrByteOffset)
+{
+    HANDLE hFile = NULL;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    pLogger->PrintProgress("Adding file %s ...", szFileName);
+    if(!SFileCreateFile(hMpq, szFileName, 0, cbData, 0, dwFlags, &hFile))
+        return pLogger->PrintError("Failed to create the file %s", szFileName);
+
+    if(!SFileWriteFile(hFile, pbData, cbData, MPQ_COMPRESSION_ZLIB))
+        dwErrCode = pLogger->PrintError("Failed to write data to the MPQ");
     if(dwErrCode == ERROR_SUCCESS)
+        SFileGetFileInfo(hFile, SFileInfoByteOffset, PtrByteOffset, sizeof(ULONGLONG), NULL);
+    if(!SFileFinishFile(hFile) && dwErrCode == ERROR_SUCCESS)
+        dwErrCode = pLogger->PrintError("Failed to finish the file %s", szFileName);
+    return dwErrCode;
+}
+
+// Files added after other files were removed or replaced must be stored in the holes
+static DWORD TestModifyArchive_ReuseFreeSpace(LPCTSTR szPlainName, DWORD dwCreateFlags)
+{
+    TLogHelper Logger("ReuseSpaceTest", szPlainName);
+    ULONGLONG LastFilePos = 0;
+    ULONGLONG ByteOffset = 0;
+    HANDLE hMpq = NULL;
+    LPBYTE pbData;
+    DWORD dwRandom = 0x13572468;
+    DWORD cbData = 0x20000;
+    DWORD dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+    char szFileName[MAX_PATH];
+
+    // Prepare compressible data
+    if((pbData = STORM_ALLOC(BYTE, cbData)) != NULL)
     {
-        dwErrCode = AddFileToMpq(&Logger, hMpq, "ShouldNotBeHere.txt", szFileData, MPQ_FILE_COMPRESS, MPQ_COMPRESSION_ZLIB, ERROR_DISK_FULL);
-        assert(dwErrCode != ERROR_SUCCESS);
+        for(DWORD i = 0; i < cbData; i++)
+        {
+            dwRandom = dwRandom * 1103515245 + 12345;
+            pbData[i] = (BYTE)('a' + ((dwRandom >> 16) & 0x07));
+        }
         dwErrCode = ERROR_SUCCESS;
     }
 
-    // Close the archive to enforce saving all tables
+    // Create the archive with 60 files and remember where the last file begins
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CreateNewArchive(&Logger, szPlainName, dwCreateFlags | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, 0x100, &hMpq);
+    for(DWORD i = 0; i < 60 && dwErrCode == ERROR_SUCCESS; i++)
+    {
+        sprintf(szFileName, "Data\\File%03u.bin", i);
+        dwErrCode = AddFileData(&Logger, hMpq, szFileName, pbData + i, 0x4000 + i * 0x400, MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED | MPQ_FILE_KEY_V2, &ByteOffset);
+        LastFilePos = STORMLIB_MAX(LastFilePos, ByteOffset);
+    }
+    if(dwErrCode == ERROR_SUCCESS)
+        SFileFlushArchive(hMpq);
+
+    // Remove every other file and replace some of the remaining ones
+    for(DWORD i = 0; i < 60 && dwErrCode == ERROR_SUCCESS; i += 2)
+    {
+        sprintf(szFileName, "Data\\File%03u.bin", i);
+        dwErrCode = RemoveMpqFile(&Logger, hMpq, szFileName, ERROR_SUCCESS);
+    }
+    for(DWORD i = 1; i < 60 && dwErrCode == ERROR_SUCCESS; i += 6)
+    {
+        sprintf(szFileName, "Data\\File%03u.bin", i);
+        dwErrCode = AddFileData(&Logger, hMpq, szFileName, pbData + i, 0x1000, MPQ_FILE_COMPRESS | MPQ_FILE_REPLACEEXISTING, &ByteOffset);
+    }
+
+    // Smaller files must fit into the holes
+    for(DWORD i = 0; i < 40 && dwErrCode == ERROR_SUCCESS; i++)
+    {
+        sprintf(szFileName, "Data\\NewFile%03u.bin", i);
+        dwErrCode = AddFileData(&Logger, hMpq, szFileName, pbData + i, 0x2000 + i * 0x100, MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED | MPQ_FILE_SECTOR_CRC, &ByteOffset);
+        if(dwErrCode == ERROR_SUCCESS && ByteOffset >= LastFilePos)
+        {
+            Logger.PrintMessage("The file %s has not been stored in a hole", szFileName);
+            dwErrCode = ERROR_CAN_NOT_COMPLETE;
+        }
+    }
     if(hMpq != NULL)
         SFileCloseArchive(hMpq);
     hMpq = NULL;
 
-    // Reopen the archive again
+    // Verify the files in the archive
     if(dwErrCode == ERROR_SUCCESS)
         dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
-
-    // The archive should still be full
     if(dwErrCode == ERROR_SUCCESS)
     {
-        CheckIfFileIsPresent(&Logger, hMpq, LISTFILE_NAME, (dwCreateFlags & MPQ_CREATE_LISTFILE) ? true : false);
-        CheckIfFileIsPresent(&Logger, hMpq, ATTRIBUTES_NAME, (dwCreateFlags & MPQ_CREATE_ATTRIBUTES) ? true : false);
-        dwErrCode = AddFileToMpq(&Logger, hMpq, "ShouldNotBeHere.txt", szFileData, MPQ_FILE_COMPRESS, MPQ_COMPRESSION_ZLIB, ERROR_DISK_FULL);
-        assert(dwErrCode != ERROR_SUCCESS);
-        dwErrCode = ERROR_SUCCESS;
+        dwErrCode = SearchArchive(&Logger, hMpq, SEARCH_FLAG_LOAD_FILES);
+        SFileCloseArchive(hMpq);
     }
 
-    // The (listfile) and (attributes) must be present
-    if(dwErrCode == ERROR_SUCCESS)
+    if(pbData != NULL)
+        STORM_FREE(pbData);
+    return Logger.PrintVerdict(dwErrCode);
+}
+
+// Compares the files that have not been removed with the data they were created from
+static DWORD VerifyCompactedFiles(TLogHelper * pLogger, HANDLE hMpq, LPBYTE pbData, DWORD dwFileCount)
+{
+    PFILE_DATA pFileData = NULL;
+    DWORD dwErrCode = ERROR_SUCCESS;
+    char szFileName[MAX_PATH];
+
+    for(DWORD i = 0; i < dwFileCount && dwErrCode == ERROR_SUCCESS; i++)
     {
-        CheckIfFileIsPresent(&Logger, hMpq, LISTFILE_NAME, (dwCreateFlags & MPQ_CREATE_LISTFILE) ? true : false);
-        CheckIfFileIsPresent(&Logger, hMpq, ATTRIBUTES_NAME, (dwCreateFlags & MPQ_CREATE_ATTRIBUTES) ? true : false);
-        dwErrCode = RemoveMpqFile(&Logger, hMpq, szFileName, ERROR_SUCCESS);
+        DWORD dwFileSize = 0x2000 + i * 0x1800;
+
+        // Every third file has been removed
+        if((i % 3) == 0)
+            continue;
+
+        sprintf(szFileName, "Data\\File%03u.bin", i);
+        dwErrCode = LoadMpqFile(*pLogger, hMpq, szFileName, 0, 0, &pFileData);
+        if(dwErrCode == ERROR_SUCCESS)
+        {
+            if(pFileData->dwFileSize != dwFileSize || memcmp(pFileData->FileData, pbData + i, dwFileSize))
+            {
+                pLogger->PrintMessage("The content of %s has changed", szFileName);
+                dwErrCode = ERROR_FILE_CORRUPT;
+            }
+            STORM_FREE(pFileData);
+        }
     }
+    return dwErrCode;
+}
 
-    // Now add the file again. This time, it should be possible OK
+// Compacting the archive must not change the content of the files. The files are copied
+// as one block if possible (by the kernel for local files) and sector by sector if the file key
+// depends on the position. In-place compaction moves the files through the journal if the new
+// position overlaps the old one, otherwise directly
+static DWORD TestModifyArchive_CompactContents(LPCTSTR szPlainName, bool bInPlace)
+{
+    TLogHelper Logger("CompactContentsTest", szPlainName);
+    ULONGLONG ByteOffset = 0;
+    HANDLE hMpq = NULL;
+    LPBYTE pbData;
+    DWORD FileFlags[] =
+    {
+        MPQ_FILE_COMPRESS | MPQ_FILE_SECTOR_CRC,
+        MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED | MPQ_FILE_KEY_V2,
+        MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED,
+        MPQ_FILE_COMPRESS | MPQ_FILE_SINGLE_UNIT,
+        MPQ_FILE_ENCRYPTED | MPQ_FILE_KEY_V2,
+        0
+    };
+    DWORD dwFileCount = 36;
+    DWORD cbData = 0x40000;
+    DWORD dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+    char szFileName[MAX_PATH];
+
+    // Prepare compressible data
+    if((pbData = AllocateCompressibleData(cbData, 0x11223344, 0x0F)) != NULL)
+        dwErrCode = ERROR_SUCCESS;
+
+    // Create the archive with files of all kinds, then remove every third file
     if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CreateNewArchive(&Logger, szPlainName, MPQ_CREATE_ARCHIVE_V2 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, 0x100, &hMpq);
+    for(DWORD i = 0; i < dwFileCount && dwErrCode == ERROR_SUCCESS; i++)
     {
-        dwErrCode = AddFileToMpq(&Logger, hMpq, szFileName, szFileData, dwFlags, dwCompression, ERROR_SUCCESS);
-        assert(dwErrCode == ERROR_SUCCESS);
+        sprintf(szFileName, "Data\\File%03u.bin", i);
+        dwErrCode = AddFileData(&Logger, hMpq, szFileName, pbData + i, 0x2000 + i * 0x1800, FileFlags[i % _countof(FileFlags)], &ByteOffset);
     }
-
-    // Now add the file again. This time, it should fail
-    if(dwErrCode == ERROR_SUCCESS)
+    for(DWORD i = 0; i < dwFileCount && dwErrCode == ERROR_SUCCESS; i += 3)
     {
-        dwErrCode = AddFileToMpq(&Logger, hMpq, szFileName, szFileData, dwFlags, dwCompression, ERROR_ALREADY_EXISTS);
-        assert(dwErrCode != ERROR_SUCCESS);
-        dwErrCode = ERROR_SUCCESS;
+        sprintf(szFileName, "Data\\File%03u.bin", i);
+        dwErrCode = RemoveMpqFile(&Logger, hMpq, szFileName, ERROR_SUCCESS);
     }
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = VerifyCompactedFiles(&Logger, hMpq, pbData, dwFileCount);
 
-    // Now add the file again. This time, it should fail
+    // Compact the archive
     if(dwErrCode == ERROR_SUCCESS)
     {
-        dwErrCode = AddFileToMpq(&Logger, hMpq, "ShouldNotBeHere.txt", szFileData, dwFlags, dwCompression, ERROR_DISK_FULL);
-        assert(dwErrCode != ERROR_SUCCESS);
-        dwErrCode = ERROR_SUCCESS;
+        Logger.PrintProgress("Compacting archive ...");
+        if(!(bInPlace ? SFileCompactArchiveInPlace(hMpq, NULL, 0) : SFileCompactArchive(hMpq, NULL, false)))
+            dwErrCode = Logger.PrintError("Failed to compact the archive");
     }
-
-    // Close the archive and return
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = VerifyCompactedFiles(&Logger, hMpq, pbData, dwFileCount);
     if(hMpq != NULL)
         SFileCloseArchive(hMpq);
     hMpq = NULL;
 
-    // Reopen the archive for the third time to verify that both internal files are there
+    // Verify the files after reopening the archive
     if(dwErrCode == ERROR_SUCCESS)
-    {
         dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
-        if(dwErrCode == ERROR_SUCCESS)
-        {
-            CheckIfFileIsPresent(&Logger, hMpq, LISTFILE_NAME, (dwCreateFlags & MPQ_CREATE_LISTFILE) ? true : false);
-            CheckIfFileIsPresent(&Logger, hMpq, ATTRIBUTES_NAME, (dwCreateFlags & MPQ_CREATE_ATTRIBUTES) ? true : false);
-            SFileCloseArchive(hMpq);
-        }
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwErrCode = VerifyCompactedFiles(&Logger, hMpq, pbData, dwFileCount);
+        SFileCloseArchive(hMpq);
     }
 
-    return dwErrCode;
+    if(pbData != NULL)
+        STORM_FREE(pbData);
+    return Logger.PrintVerdict(dwErrCode);
 }
 
-static DWORD TestCreateArchive_IncMaxFileCount(LPCTSTR szPlainName)
+// Compacting the archive in place must slide the files into the holes
+static DWORD TestModifyArchive_CompactInPlace(LPCTSTR szPlainName, DWORD dwCreateFlags)
 {
-    TLogHelper Logger("IncMaxFileCount", szPlainName);
-    LPCSTR szFileData = "TestCreateArchive_IncMaxFileCount: Testing file data";
-    char szFileName[MAX_PATH];
+    TLogHelper Logger("CompactInPlaceTest", szPlainName);
+    ULONGLONG ArchiveSize1 = 0;
+    ULONGLONG ArchiveSize2 = 0;
+    ULONGLONG LastFilePos = 0;
+    ULONGLONG ByteOffset = 0;
     HANDLE hMpq = NULL;
-    DWORD dwMaxFileCount = 1;
-    DWORD dwErrCode;
+    LPBYTE pbData;
+    DWORD dwRandom = 0x24681357;
+    DWORD cbData = 0x40000;
+    DWORD dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+    char szFileName[MAX_PATH];
 
-    // Create the new MPQ
-    dwErrCode = CreateNewArchive(&Logger, szPlainName, MPQ_CREATE_ARCHIVE_V4 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, dwMaxFileCount, &hMpq);
+    // Prepare compressible data
+    if((pbData = STORM_ALLOC(BYTE, cbData)) != NULL)
+    {
+        for(DWORD i = 0; i < cbData; i++)
+        {
+            dwRandom = dwRandom * 1103515245 + 12345;
+            pbData[i] = (BYTE)('a' + ((dwRandom >> 16) & 0x0F));
+        }
+        dwErrCode = ERROR_SUCCESS;
+    }
 
-    // Now add exactly one file
+    // Create the archive with 40 files. Some of them have the key depending on the position
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CreateNewArchive(&Logger, szPlainName, dwCreateFlags | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, 0x100, &hMpq);
+    for(DWORD i = 0; i < 40 && dwErrCode == ERROR_SUCCESS; i++)
+    {
+        DWORD dwFlags = (i & 1) ? (MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED | MPQ_FILE_KEY_V2) : (MPQ_FILE_COMPRESS | MPQ_FILE_SECTOR_CRC);
+
+        sprintf(szFileName, "Data\\File%03u.bin", i);
+        dwErrCode = AddFileData(&Logger, hMpq, szFileName, pbData + i, 0x8000 + i * 0x1000, dwFlags, &ByteOffset);
+        LastFilePos = STORMLIB_MAX(LastFilePos, ByteOffset);
+    }
+
+    // Remove every third file
+    for(DWORD i = 0; i < 40 && dwErrCode == ERROR_SUCCESS; i += 3)
+    {
+        sprintf(szFileName, "Data\\File%03u.bin", i);
+        dwErrCode = RemoveMpqFile(&Logger, hMpq, szFileName, ERROR_SUCCESS);
+    }
     if(dwErrCode == ERROR_SUCCESS)
     {
-        dwErrCode = AddFileToMpq(&Logger, hMpq, "AddFile_base.txt", szFileData);
         SFileFlushArchive(hMpq);
-        SFileCloseArchive(hMpq);
+        SFileGetFileInfo(hMpq, SFileMpqArchiveSize64, &ArchiveSize1, sizeof(ULONGLONG), NULL);
     }
 
-    // Now add 10 files. Each time we cannot add the file due to archive being full,
-    // we increment the max file count
+    // Only reclaim some space. The archive keeps its size, but a new file must go to the reclaimed space
     if(dwErrCode == ERROR_SUCCESS)
     {
-        for(unsigned int i = 0; i < 10; i++)
+        Logger.PrintProgress("Compacting archive in place (partially) ...");
+        if(!SFileCompactArchiveInPlace(hMpq, NULL, 0x20000))
+            dwErrCode = Logger.PrintError("Failed to compact the archive in place");
+    }
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwErrCode = AddFileData(&Logger, hMpq, "Data\\NewFile.bin", pbData, 0x10000, MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED, &ByteOffset);
+        if(dwErrCode == ERROR_SUCCESS && ByteOffset >= LastFilePos)
         {
-            // Open the archive again
-            dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
-            if(dwErrCode != ERROR_SUCCESS)
-                break;
-
-            // Add one file
-            sprintf(szFileName, "AddFile_%04u.txt", i);
-            dwErrCode = AddFileToMpq(&Logger, hMpq, szFileName, szFileData, 0, 0, ERROR_UNDETERMINED_RESULT);
-            if(dwErrCode != ERROR_SUCCESS)
-            {
-                // Increment the max file count by one
-                dwMaxFileCount = SFileGetMaxFileCount(hMpq) + 1;
-                Logger.PrintProgress("Increasing max file count to %u ...", dwMaxFileCount);
-                SFileSetMaxFileCount(hMpq, dwMaxFileCount);
-
-                // Attempt to create the file again
-                dwErrCode = AddFileToMpq(&Logger, hMpq, szFileName, szFileData, 0, 0, ERROR_SUCCESS);
-            }
+            Logger.PrintMessage("The new file has not been stored in the reclaimed space");
+            dwErrCode = ERROR_CAN_NOT_COMPLETE;
+        }
+    }
 
-            // Compact the archive and close it
-            SFileSetCompactCallback(hMpq, CompactCallback, &Logger);
-            SFileCompactArchive(hMpq, NULL, false);
-            SFileCloseArchive(hMpq);
-            if(dwErrCode != ERROR_SUCCESS)
-                break;
+    // Compact the rest of the archive. Now it must shrink
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        Logger.PrintProgress("Compacting archive in place ...");
+        if(!SFileCompactArchiveInPlace(hMpq, NULL, 0))
+            dwErrCode = Logger.PrintError("Failed to compact the archive in place");
+    }
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        SFileGetFileInfo(hMpq, SFileMpqArchiveSize64, &ArchiveSize2, sizeof(ULONGLONG), NULL);
+        if(ArchiveSize2 >= ArchiveSize1)
+        {
+            Logger.PrintMessage("The archive has not been made smaller");
+            dwErrCode = ERROR_CAN_NOT_COMPLETE;
         }
     }
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    hMpq = NULL;
+
+    // Verify the files in the archive
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwErrCode = SearchArchive(&Logger, hMpq, SEARCH_FLAG_LOAD_FILES);
+        SFileCloseArchive(hMpq);
+    }
 
-    return dwErrCode;
+    if(pbData != NULL)
+        STORM_FREE(pbData);
+    return Logger.PrintVerdict(dwErrCode);
 }
 
-static DWORD TestCreateArchive_FileFlagTest(LPCTSTR szPlainName)
+static void WINAPI VerifyFilesCallback(void * pvUserData, PSFILE_VERIFY_INFO pVerifyInfo)
 {
-    TLogHelper Logger("TestFileFlag", szPlainName);
-    HANDLE hMpq = NULL;                 // Handle of created archive
-    TCHAR szFileName1[MAX_PATH];
-    TCHAR szFileName2[MAX_PATH];
-    TCHAR szFullPath[MAX_PATH];
-    LPCSTR szMiddleFile = "FileTest_10.exe";
-    LCID LocaleIDs[] = {0x000, 0x405, 0x406, 0x407};
-    char szArchivedName[MAX_PATH];
-    DWORD dwMaxFileCount = 0;
-    DWORD dwFileCount = 0;
-    DWORD dwErrCode;
-
-    // Create paths for local file to be added
-    CreateFullPathName(szFileName1, _countof(szFileName1), szDataFileDir, _T("new-file.exe"));
-    CreateFullPathName(szFileName2, _countof(szFileName2), szDataFileDir, _T("new-file.bin"));
-    SFileSetLocale(LANG_NEUTRAL);
+    std::vector<SFILE_VERIFY_INFO> * pReports = (std::vector<SFILE_VERIFY_INFO> *)pvUserData;
 
-    // Create an empty file that will serve as holder for the MPQ
-    dwErrCode = CreateEmptyFile(&Logger, szPlainName, 0x100000, szFullPath);
+    // The file name is only valid during the callback
+    pReports->push_back(*pVerifyInfo);
+    pReports->back().szFileName = NULL;
+}
 
-    // Create new MPQ archive over that file
-    if(dwErrCode == ERROR_SUCCESS)
-        dwErrCode = CreateNewArchive(&Logger, szPlainName, MPQ_CREATE_ARCHIVE_V1 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, 17, &hMpq);
+// Verifies all files of an archive on multiple threads, then without the listfile,
+// then damages one file and checks that only that file fails
+static DWORD TestCreateArchive_VerifyFiles(LPCTSTR szPlainName, DWORD dwThreadCount)
+{
+    std::vector<SFILE_VERIFY_INFO> Reports;
+    TFileStream * pStream;
+    TLogHelper Logger("VerifyFilesTest", szPlainName);
+    ULONGLONG DamagedOffset = 0;
+    ULONGLONG ByteOffset = 0;
+    HANDLE hMpq = NULL;
+    LPBYTE pbData;
+    DWORD dwRandom = 0x13572468;
+    DWORD cbData = 0x40000;
+    DWORD dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+    TCHAR szFullPath[MAX_PATH];
+    char szFileName[MAX_PATH];
+    BYTE DamagedByte = 0;
 
-    // Add the same file multiple times
-    if(dwErrCode == ERROR_SUCCESS)
+    // Prepare compressible data
+    if((pbData = STORM_ALLOC(BYTE, cbData)) != NULL)
     {
-        dwMaxFileCount = SFileGetMaxFileCount(hMpq);
-        for(size_t i = 0; AddFlags[i] != 0xFFFFFFFF; i++)
+        for(DWORD i = 0; i < cbData; i++)
         {
-            sprintf(szArchivedName, "FileTest_%02u.exe", (unsigned int)i);
-            dwErrCode = AddLocalFileToMpq(&Logger, hMpq, szArchivedName, szFileName1, AddFlags[i], 0);
-            if(dwErrCode != ERROR_SUCCESS)
-                break;
-
-            dwFileCount++;
+            dwRandom = dwRandom * 1103515245 + 12345;
+            pbData[i] = (BYTE)('a' + ((dwRandom >> 16) & 0x0F));
         }
+        dwErrCode = ERROR_SUCCESS;
     }
 
-    // Delete a file in the middle of the file table
+    // Create the archive with files of various flags. Remember the position of one of them
     if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CreateNewArchive(&Logger, szPlainName, MPQ_CREATE_ARCHIVE_V4 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, 0x100, &hMpq);
+    for(DWORD i = 0; i < 30 && dwErrCode == ERROR_SUCCESS; i++)
     {
-        Logger.PrintProgress("Removing file %s ...", szMiddleFile);
-        dwErrCode = RemoveMpqFile(&Logger, hMpq, szMiddleFile, ERROR_SUCCESS);
-        dwFileCount--;
+        DWORD dwFlags = (i & 1) ? (MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED) : (MPQ_FILE_COMPRESS | MPQ_FILE_SECTOR_CRC);
+
+        sprintf(szFileName, "Data\\File%03u.bin", i);
+        dwErrCode = AddFileData(&Logger, hMpq, szFileName, pbData + i, 0x8000 + i * 0x1000, dwFlags, &ByteOffset);
+        DamagedOffset = (i == 17) ? ByteOffset + 0x100 : DamagedOffset;
     }
 
-    // Add one more file
+    // Without a name, the key of this file can't be detected (no sector offset table, unknown content)
     if(dwErrCode == ERROR_SUCCESS)
-    {
-        dwErrCode = AddLocalFileToMpq(&Logger, hMpq, "FileTest_xx.exe", szFileName1);
-        dwFileCount++;
-    }
+        dwErrCode = AddFileData(&Logger, hMpq, "Data\\Secret.bin", pbData, 0x3000, MPQ_FILE_ENCRYPTED, &ByteOffset);
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    hMpq = NULL;
 
-    // Try to decrement max file count. This must succeed
+    // Verify all files. All of them must pass and all of them must have been checked
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
     if(dwErrCode == ERROR_SUCCESS)
     {
-        Logger.PrintProgress("Attempting to decrement max file count ...");
-        if(SFileSetMaxFileCount(hMpq, 5))
-            dwErrCode = Logger.PrintError("Max file count decremented, even if it should fail");
+        Logger.PrintProgress("Verifying files ...");
+        SFileSetThreadCount(dwThreadCount);
+        if(!SFileVerifyArchiveFiles(hMpq, SFILE_VERIFY_ALL, 0, VerifyFilesCallback, &Reports))
+            dwErrCode = Logger.PrintError("Failed to verify the files of the archive");
+        SFileSetThreadCount(1);
     }
-
-    // Add ZeroSize.txt several times under a different locale
     if(dwErrCode == ERROR_SUCCESS)
     {
-        for(size_t i = 0; i < _countof(LocaleIDs); i++)
-        {
-            bool bMustSucceed = ((dwFileCount + 2) < dwMaxFileCount);
+        SFILE_VERIFY_INFO & Final = Reports.back();
+        DWORD dwFilesWithChecksums = 0;
 
-            SFileSetLocale(LocaleIDs[i]);
-            dwErrCode = AddLocalFileToMpq(&Logger, hMpq, "ZeroSize_1.txt", szFileName2);
-            if(dwErrCode != ERROR_SUCCESS)
-            {
-                if(bMustSucceed == false)
-                    dwErrCode = ERROR_SUCCESS;
-                break;
-            }
+        if(Reports.size() != (Final.dwFileCount + 1) || Final.dwFilesDone != Final.dwFileCount || Final.dwFilesFailed != 0 || Final.BytesRead != Final.TotalBytes)
+            dwErrCode = Logger.PrintError("Unexpected statistics of the verification");
+        for(size_t i = 0; i < Final.dwFileCount && dwErrCode == ERROR_SUCCESS; i++)
+        {
+            DWORD dwChecksums = VERIFY_FILE_HAS_CHECKSUM | VERIFY_FILE_HAS_MD5;
 
-            dwFileCount++;
+            // All files have raw MD5, the added files also have their checksums in (attributes)
+            if((Reports[i].dwVerifyResult & VERIFY_FILE_HAS_RAW_MD5) == 0)
+                dwErrCode = Logger.PrintErrorVa("The file %u was not fully verified", Reports[i].dwFileIndex);
+            if((Reports[i].dwVerifyResult & dwChecksums) == dwChecksums)
+                dwFilesWithChecksums++;
         }
+        if(dwErrCode == ERROR_SUCCESS && dwFilesWithChecksums < 30)
+            dwErrCode = Logger.PrintError("The checksums of the files were not verified");
     }
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    hMpq = NULL;
 
-    // Add ZeroSize.txt again several times under a different locale
+    // Without the listfile, the file with the unknown key must be skipped, not failed.
+    // This time, the call is limited to two threads
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq, MPQ_OPEN_NO_LISTFILE);
     if(dwErrCode == ERROR_SUCCESS)
     {
-        for(size_t i = 0; LocaleIDs[i] != 0xFFFF; i++)
-        {
-            bool bMustSucceed = ((dwFileCount + 2) < dwMaxFileCount);
-
-            SFileSetLocale(LocaleIDs[i]);
-            dwErrCode = AddLocalFileToMpq(&Logger, hMpq, "ZeroSize_2.txt", szFileName2, 0, 0, bMustSucceed);
-            if(dwErrCode != ERROR_SUCCESS)
-            {
-                if(bMustSucceed == false)
-                    dwErrCode = ERROR_SUCCESS;
-                break;
-            }
+        Logger.PrintProgress("Verifying files without names ...");
+        Reports.clear();
+        SFileSetThreadCount(dwThreadCount);
+        if(!SFileVerifyArchiveFiles(hMpq, SFILE_VERIFY_ALL, 2, VerifyFilesCallback, &Reports))
+            dwErrCode = Logger.PrintError("Failed to verify the files without names");
+        SFileSetThreadCount(1);
+    }
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        SFILE_VERIFY_INFO & Final = Reports.back();
 
-            dwFileCount++;
+        if(Final.dwFilesDone != Final.dwFileCount || Final.dwFilesFailed != 0 || Final.dwFilesSkipped != 1)
+            dwErrCode = Logger.PrintError("Unexpected statistics of the verification");
+        for(size_t i = 0; i < Final.dwFileCount && dwErrCode == ERROR_SUCCESS; i++)
+        {
+            if((Reports[i].ByteOffset == ByteOffset) != ((Reports[i].dwVerifyResult & VERIFY_FILE_KEY_UNKNOWN) != 0))
+                dwErrCode = Logger.PrintErrorVa("Unexpected result of the file %u", Reports[i].dwFileIndex);
         }
     }
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    hMpq = NULL;
 
-    // Verify how many files did we add to the MPQ
+    // Damage one file
     if(dwErrCode == ERROR_SUCCESS)
     {
-        if(dwFileCount + 2 != dwMaxFileCount)
+        CreateFullPathName(szFullPath, _countof(szFullPath), NULL, szPlainName);
+        if((pStream = FileStream_OpenFile(szFullPath, 0)) != NULL)
         {
-            Logger.PrintErrorVa("Number of files added to MPQ was unexpected (expected %u, added %u)", dwFileCount, dwMaxFileCount - 2);
-            dwErrCode = ERROR_FILE_CORRUPT;
+            FileStream_Read(pStream, &DamagedOffset, &DamagedByte, 1);
+            DamagedByte ^= 0x55;
+            FileStream_Write(pStream, &DamagedOffset, &DamagedByte, 1);
+            FileStream_Close(pStream);
         }
     }
 
-    // Test rename function
+    // Now the verification must fail on that file only
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
     if(dwErrCode == ERROR_SUCCESS)
     {
-        Logger.PrintProgress("Testing rename files ...");
-        SFileSetLocale(LANG_NEUTRAL);
-        if(!SFileRenameFile(hMpq, "FileTest_08.exe", "FileTest_08a.exe"))
-            dwErrCode = Logger.PrintError("Failed to rename the file");
+        Logger.PrintProgress("Verifying files ...");
+        Reports.clear();
+        SFileSetThreadCount(dwThreadCount);
+        if(SFileVerifyArchiveFiles(hMpq, SFILE_VERIFY_ALL, 0, VerifyFilesCallback, &Reports) || SErrGetLastError() != ERROR_FILE_CORRUPT)
+            dwErrCode = Logger.PrintError("The damaged file has not been detected");
+        SFileSetThreadCount(1);
     }
-
     if(dwErrCode == ERROR_SUCCESS)
     {
-        if(!SFileRenameFile(hMpq, "FileTest_08a.exe", "FileTest_08.exe"))
-            dwErrCode = Logger.PrintError("Failed to rename the file");
+        SFILE_VERIFY_INFO & Final = Reports.back();
+
+        if(Final.dwFilesDone != Final.dwFileCount || Final.dwFilesFailed != 1)
+            dwErrCode = Logger.PrintError("Unexpected statistics of the verification");
+        for(size_t i = 0; i < Final.dwFileCount && dwErrCode == ERROR_SUCCESS; i++)
+        {
+            bool bDamaged = (Reports[i].ByteOffset <= DamagedOffset && DamagedOffset < (Reports[i].ByteOffset + Reports[i].dwCompSize));
+
+            if(bDamaged != ((Reports[i].dwVerifyResult & VERIFY_FILE_RAW_MD5_ERROR) != 0))
+                dwErrCode = Logger.PrintErrorVa("Unexpected result of the file %u", Reports[i].dwFileIndex);
+        }
     }
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+
+    if(pbData != NULL)
+        STORM_FREE(pbData);
+    return Logger.PrintVerdict(dwErrCode);
+}
+
+// Signs an archive bigger than the buffers for hashing the signed data, so that
+// the data are read and hashed in several parts. Then damages one byte of a file,
+// which must make the signature invalid
+static DWORD TestCreateArchive_WeakSignature(LPCTSTR szPlainName, DWORD dwFileSize)
+{
+    TFileStream * pStream;
+    TLogHelper Logger("WeakSignatureTest", szPlainName);
+    ULONGLONG DamagedOffset = 0;
+    HANDLE hMpq = NULL;
+    LPBYTE pbData;
+    DWORD dwVerifyResult;
+    DWORD dwErrCode = ERROR_SUCCESS;
+    BYTE DamagedByte = 0;
+    TCHAR szFullPath[MAX_PATH];
+
+    // The file is random, so the archive has about the same size
+    if((pbData = STORM_ALLOC(BYTE, dwFileSize)) == NULL)
+        return Logger.PrintError("Failed to allocate buffer");
+    FillTestData(pbData, dwFileSize, 0x9E3779B9);
+
+    // Create an archive with the file and sign it. The signature is written when the archive is closed
+    dwErrCode = CreateNewArchive(&Logger, szPlainName, MPQ_CREATE_ARCHIVE_V1 | MPQ_CREATE_LISTFILE, 0x10, &hMpq);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = AddFileData(&Logger, hMpq, "Data\\Signed.bin", pbData, dwFileSize, 0, &DamagedOffset);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestOpenArchive_SignArchive(Logger, hMpq, 1);
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    hMpq = NULL;
 
+    // The signature must be valid
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq, MPQ_OPEN_READ_ONLY);
     if(dwErrCode == ERROR_SUCCESS)
     {
-        if(SFileRenameFile(hMpq, "FileTest_10.exe", "FileTest_10a.exe"))
+        Logger.PrintProgress("Verifying archive signature ...");
+        if((dwVerifyResult = SFileVerifyArchive(hMpq)) != ERROR_WEAK_SIGNATURE_OK)
         {
-            Logger.PrintError("Rename test succeeded even if it shouldn't");
+            Logger.PrintErrorVa("Unexpected result of the signature verification (%u)", dwVerifyResult);
             dwErrCode = ERROR_FILE_CORRUPT;
         }
+        SFileCloseArchive(hMpq);
+        hMpq = NULL;
     }
 
+    // Damage one byte near the end of the file, far beyond the first buffer of the signed data
     if(dwErrCode == ERROR_SUCCESS)
     {
-        if(SFileRenameFile(hMpq, "FileTest_10a.exe", "FileTest_10.exe"))
+        CreateFullPathName(szFullPath, _countof(szFullPath), NULL, szPlainName);
+        if((pStream = FileStream_OpenFile(szFullPath, 0)) != NULL)
         {
-            Logger.PrintError("Rename test succeeded even if it shouldn't");
-            dwErrCode = ERROR_FILE_CORRUPT;
+            DamagedOffset += dwFileSize - 0x100;
+            FileStream_Read(pStream, &DamagedOffset, &DamagedByte, 1);
+            DamagedByte ^= 0x55;
+            FileStream_Write(pStream, &DamagedOffset, &DamagedByte, 1);
+            FileStream_Close(pStream);
+        }
+        else
+        {
+            dwErrCode = Logger.PrintError(_T("Failed to open %s"), szFullPath);
         }
     }
 
-    // Close the archive
-    if(hMpq != NULL)
+    // The signature must not match anymore
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq, MPQ_OPEN_READ_ONLY);
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        Logger.PrintProgress("Verifying the signature of the damaged archive ...");
+        if((dwVerifyResult = SFileVerifyArchive(hMpq)) != ERROR_WEAK_SIGNATURE_ERROR)
+        {
+            Logger.PrintErrorVa("Unexpected result of the signature verification (%u)", dwVerifyResult);
+            dwErrCode = ERROR_FILE_CORRUPT;
+        }
         SFileCloseArchive(hMpq);
-    hMpq = NULL;
+    }
 
-    // Try to reopen the archive
-    if(dwErrCode == ERROR_SUCCESS)
-        dwErrCode = OpenExistingArchive(&Logger, szFullPath, 0, NULL);
-    return dwErrCode;
+    STORM_FREE(pbData);
+    return Logger.PrintVerdict(dwErrCode);
 }
 
-static DWORD TestCreateArchive_WaveCompressionsTest(LPCTSTR szPlainName, LPCTSTR szWaveFile)
-{
-    TLogHelper Logger("TestCompressions", szPlainName);
-    HANDLE hMpq = NULL;                 // Handle of created archive
-    TCHAR szFileName[MAX_PATH];         // Source file to be added
-    char szArchivedName[MAX_PATH];
-    DWORD dwCmprCount = sizeof(WaveCompressions) / sizeof(DWORD);
-    DWORD dwAddedFiles = 0;
-    DWORD dwFoundFiles = 0;
-    DWORD dwErrCode;
+// Creates an incremental patch (BSD0) that changes the old data to the new data.
+// The BSDIFF40 data consist of a single control block, compressed by the patch RLE
+static LPBYTE CreateIncrementalPatch(LPBYTE pbOldData, DWORD cbOldData, LPBYTE pbNewData, DWORD cbNewData, LPDWORD pcbPatch)
+{
+    DWORD cbDiffData = 0x20 + 0x0C + cbNewData;
+    DWORD cbPatch = 0x44 + sizeof(DWORD);
+    LPBYTE pbDiffData;
+    LPBYTE pbPatch;
+    LPDWORD PatchHeader;
+    LPDWORD DiffHeader;
+
+    // Prepare the BSDIFF40 data: header, control block and the data block
+    if((pbDiffData = STORM_ALLOC(BYTE, cbDiffData)) == NULL)
+        return NULL;
+    memset(pbDiffData, 0, cbDiffData);
+    DiffHeader = (LPDWORD)pbDiffData;
+    memcpy(pbDiffData, "BSDIFF40", 8);
+    DiffHeader[2] = 0x0C;                   // Size of the control block
+    DiffHeader[4] = cbNewData;              // Size of the data block
+    DiffHeader[6] = cbNewData;              // Size of the new file
+    DiffHeader[8] = cbNewData;              // Length to add from the data block
+    for(DWORD i = 0; i < cbNewData; i++)
+        pbDiffData[0x2C + i] = (i < cbOldData) ? (BYTE)(pbNewData[i] - pbOldData[i]) : pbNewData[i];
+
+    // Allocate the patch for the worst case of the RLE
+    if((pbPatch = STORM_ALLOC(BYTE, cbPatch + cbDiffData + cbDiffData / 0x80 + 1)) != NULL)
+    {
+        // Compress the diff: runs of zeros and runs of other bytes
+        for(DWORD i = 0; i < cbDiffData; )
+        {
+            DWORD dwRunLength = 0;
 
-    // Create paths for local file to be added
-    CreateFullPathName(szFileName, _countof(szFileName), szDataFileDir, szWaveFile);
+            if(pbDiffData[i] == 0)
+            {
+                while(dwRunLength < 0x80 && (i + dwRunLength) < cbDiffData && pbDiffData[i + dwRunLength] == 0)
+                    dwRunLength++;
+                pbPatch[cbPatch++] = (BYTE)(dwRunLength - 1);
+            }
+            else
+            {
+                while(dwRunLength < 0x80 && (i + dwRunLength) < cbDiffData && pbDiffData[i + dwRunLength] != 0)
+                    dwRunLength++;
+                pbPatch[cbPatch++] = (BYTE)(0x80 | (dwRunLength - 1));
+                memcpy(pbPatch + cbPatch, pbDiffData + i, dwRunLength);
+                cbPatch += dwRunLength;
+            }
+            i += dwRunLength;
+        }
 
-    // Create new archive
-    dwErrCode = CreateNewArchive(&Logger, szPlainName, MPQ_CREATE_ARCHIVE_V1 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, 0x40, &hMpq);
+        // Fill the patch header
+        PatchHeader = (LPDWORD)pbPatch;
+        PatchHeader[0] = 0x48435450;        // 'PTCH'
+        PatchHeader[1] = 0x44 + cbDiffData;
+        PatchHeader[2] = cbOldData;
+        PatchHeader[3] = cbNewData;
+        PatchHeader[4] = 0x5f35444d;        // 'MD5_'
+        PatchHeader[5] = 0x28;
+        CalculateDataBlockHash(pbOldData, cbOldData, (LPBYTE)(PatchHeader + 6));
+        CalculateDataBlockHash(pbNewData, cbNewData, (LPBYTE)(PatchHeader + 10));
+        PatchHeader[14] = 0x4d524658;       // 'XFRM'
+        PatchHeader[15] = cbPatch - 0x44 + 0x0C;
+        PatchHeader[16] = 0x30445342;       // 'BSD0'
+        PatchHeader[17] = cbDiffData;       // Size of the decompressed data, skipped by the RLE
+        *pcbPatch = cbPatch;
+    }
+
+    STORM_FREE(pbDiffData);
+    return pbPatch;
+}
 
-    // Add the same file multiple times
-    if(dwErrCode == ERROR_SUCCESS)
-    {
-        Logger.UserTotal = dwCmprCount;
-        for(unsigned int i = 0; i < dwCmprCount; i++)
-        {
-            sprintf(szArchivedName, "WaveFile_%02u.wav", i + 1);
-            dwErrCode = AddLocalFileToMpq(&Logger, hMpq, szArchivedName, szFileName, MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED | MPQ_FILE_SECTOR_CRC, WaveCompressions[i]);
-            if(dwErrCode != ERROR_SUCCESS)
-                break;
+// Reads a patched file and compares its content
+static DWORD ReadPatchedFile(TLogHelper & Logger, HANDLE hMpq, LPCSTR szFileName, LPBYTE pbExpected, DWORD cbExpected)
+{
+    HANDLE hFile = NULL;
+    LPBYTE pbFileData;
+    DWORD dwBytesRead = 0;
+    DWORD dwErrCode = ERROR_SUCCESS;
 
-            Logger.UserCount++;
-            dwAddedFiles++;
-        }
+    if((pbFileData = STORM_ALLOC(BYTE, cbExpected + 1)) == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
 
-        SFileCloseArchive(hMpq);
+    Logger.PrintProgress("Reading patched file %s ...", szFileName);
+    if(SFileOpenFileEx(hMpq, szFileName, 0, &hFile))
+    {
+        SFileReadFile(hFile, pbFileData, cbExpected + 1, &dwBytesRead, NULL);
+        if(dwBytesRead != cbExpected || memcmp(pbFileData, pbExpected, cbExpected))
+            dwErrCode = Logger.PrintError("The patched file %s has unexpected content", szFileName);
+        SFileCloseFile(hFile);
     }
-
-    // Reopen the archive extract each WAVE file and try to play it
-    if(dwErrCode == ERROR_SUCCESS)
+    else
     {
-        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
-        if(dwErrCode == ERROR_SUCCESS)
-        {
-            SearchArchive(&Logger, hMpq, SEARCH_FLAG_LOAD_FILES | SEARCH_FLAG_PLAY_WAVES, &dwFoundFiles, NULL);
-            SFileCloseArchive(hMpq);
-        }
-
-        // Check if the number of found files is the same like the number of added files
-        // DOn;t forget that there will be (listfile) and (attributes)
-        if(dwFoundFiles != (dwAddedFiles + 2))
-        {
-            Logger.PrintError("Number of found files does not match number of added files.");
-            dwErrCode = ERROR_FILE_CORRUPT;
-        }
+        dwErrCode = Logger.PrintError("Failed to open the patched file %s", szFileName);
     }
 
+    STORM_FREE(pbFileData);
     return dwErrCode;
 }
 
-static DWORD TestCreateArchive_ListFilePos(LPCTSTR szPlainName)
+// Verifies the number of hits and misses of the patch cache
+static DWORD CheckPatchCacheStats(TLogHelper & Logger, HANDLE hMpq, ULONGLONG ExpectedHits, ULONGLONG ExpectedMisses)
 {
-    PFILE_DATA pFileData;
-    LPCSTR szReaddedFile = "AddedFile_##.txt";
-    LPCSTR szFileMask = "AddedFile_%02u.txt";
-    TLogHelper Logger("ListFilePos", szPlainName);
-    HANDLE hMpq = NULL;                 // Handle of created archive
-    char szArchivedName[MAX_PATH];
-    DWORD dwMaxFileCount = 0x0E;
-    DWORD dwFileCount = 0;
-    size_t i;
-    DWORD dwErrCode;
+    ULONGLONG CacheHits = 0;
+    ULONGLONG CacheMisses = 0;
 
-    // Create a new archive with the limit of 0x20 files
-    dwErrCode = CreateNewArchive(&Logger, szPlainName, MPQ_CREATE_ARCHIVE_V4 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, dwMaxFileCount, &hMpq);
+    SFileGetFileInfo(hMpq, SFileMpqPatchCacheHits, &CacheHits, sizeof(ULONGLONG), NULL);
+    SFileGetFileInfo(hMpq, SFileMpqPatchCacheMisses, &CacheMisses, sizeof(ULONGLONG), NULL);
+    if(CacheHits != ExpectedHits || CacheMisses != ExpectedMisses)
+        return Logger.PrintErrorVa("Unexpected patch cache statistics (hits: %u, misses: %u)", (DWORD)CacheHits, (DWORD)CacheMisses);
+    return ERROR_SUCCESS;
+}
 
-    // Add maximum files files
-    if(dwErrCode == ERROR_SUCCESS)
+// Patched files must be taken from the cache when open again, until the patch chain changes
+static DWORD TestOpenArchive_PatchCache(LPCTSTR szBaseName, LPCTSTR szPatchName1, LPCTSTR szPatchName2)
+{
+    TLogHelper Logger("PatchCacheTest", szBaseName);
+    LPCSTR szFileName = "Data\\Patched.bin";
+    LPCTSTR PatchNames[] = {szPatchName1, szPatchName2};
+    LPBYTE Versions[3] = {NULL, NULL, NULL};
+    DWORD VersionSizes[3] = {0x30000, 0x31000, 0x2F000};
+    HANDLE hMpq = NULL;
+    DWORD dwRandom = 0x13572468;
+    DWORD dwErrCode = ERROR_SUCCESS;
+    TCHAR szFullPath[MAX_PATH];
+
+    // Prepare three versions of the file. Each version changes some bytes of the previous one
+    for(DWORD v = 0; v < 3 && dwErrCode == ERROR_SUCCESS; v++)
     {
-        for(i = 0; i < dwMaxFileCount; i++)
+        if((Versions[v] = STORM_ALLOC(BYTE, VersionSizes[v])) == NULL)
         {
-            sprintf(szArchivedName, szFileMask, i);
-            dwErrCode = AddFileToMpq(&Logger, hMpq, szArchivedName, "This is a text data.", 0, 0, ERROR_SUCCESS);
-            if(dwErrCode != ERROR_SUCCESS)
-                break;
-
-            dwFileCount++;
+            dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+            break;
         }
-    }
-
-    // Delete few middle files
-    if(dwErrCode == ERROR_SUCCESS)
-    {
-        for(i = 0; i < (dwMaxFileCount / 2); i++)
+        for(DWORD i = 0; i < VersionSizes[v]; i++)
         {
-            sprintf(szArchivedName, szFileMask, i);
-            dwErrCode = RemoveMpqFile(&Logger, hMpq, szArchivedName, ERROR_SUCCESS);
-            if(dwErrCode != ERROR_SUCCESS)
-                break;
-
-            dwFileCount--;
+            dwRandom = dwRandom * 1103515245 + 12345;
+            if(v == 0 || i >= VersionSizes[v - 1] || ((dwRandom >> 16) & 0x3F) == 0)
+                Versions[v][i] = (BYTE)(dwRandom >> 24);
+            else
+                Versions[v][i] = Versions[v - 1][i];
         }
     }
 
-    // Close the archive
+    // Create the base archive and two patch archives
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CreateNewArchive(&Logger, szBaseName, MPQ_CREATE_ARCHIVE_V2 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, 0x10, &hMpq);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = AddFileData(&Logger, hMpq, szFileName, Versions[0], VersionSizes[0], MPQ_FILE_COMPRESS, NULL);
     if(hMpq != NULL)
         SFileCloseArchive(hMpq);
     hMpq = NULL;
 
-    // Reopen the archive to catch any asserts
-    if(dwErrCode == ERROR_SUCCESS)
-        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
-
-    // Check that (listfile) is at the end
-    if(dwErrCode == ERROR_SUCCESS)
+    for(DWORD v = 0; v < 2 && dwErrCode == ERROR_SUCCESS; v++)
     {
-        if(LoadMpqFile(Logger, hMpq, LISTFILE_NAME, 0, 0, &pFileData) == ERROR_SUCCESS)
-        {
-            if(pFileData->dwBlockIndex < dwFileCount)
-                Logger.PrintMessage("Unexpected file index of %s", LISTFILE_NAME);
-            STORM_FREE(pFileData);
-        }
+        LPBYTE pbPatch;
+        DWORD cbPatch = 0;
 
-        if(LoadMpqFile(Logger, hMpq, ATTRIBUTES_NAME, 0, 0, &pFileData) == ERROR_SUCCESS)
+        if((pbPatch = CreateIncrementalPatch(Versions[v], VersionSizes[v], Versions[v + 1], VersionSizes[v + 1], &cbPatch)) == NULL)
         {
-            if(pFileData->dwBlockIndex <= dwFileCount)
-                Logger.PrintMessage("Unexpected file index of %s", ATTRIBUTES_NAME);
-            STORM_FREE(pFileData);
+            dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+            break;
         }
 
-        // Add new file to the archive. It should be added to the last position
-        dwErrCode = AddFileToMpq(&Logger, hMpq, szReaddedFile, "This is a re-added file.", 0, 0, ERROR_SUCCESS);
+        dwErrCode = CreateNewArchive(&Logger, PatchNames[v], MPQ_CREATE_ARCHIVE_V2 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, 0x10, &hMpq);
         if(dwErrCode == ERROR_SUCCESS)
-        {
-            // Force update of the tables
-            SFileFlushArchive(hMpq);
+            dwErrCode = AddFileData(&Logger, hMpq, szFileName, pbPatch, cbPatch, MPQ_FILE_COMPRESS, NULL);
+        if(hMpq != NULL)
+            SFileCloseArchive(hMpq);
+        hMpq = NULL;
+        STORM_FREE(pbPatch);
+    }
 
-            // Load the file
-            if(LoadMpqFile(Logger, hMpq, szReaddedFile, 0, 0, &pFileData) == ERROR_SUCCESS)
-            {
-                if(pFileData->dwBlockIndex != dwFileCount)
-                    Logger.PrintMessage("Unexpected file index of %s", szReaddedFile);
-                STORM_FREE(pFileData);
-            }
-        }
+    // Open the base archive with the first patch and enable the cache
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szBaseName, &hMpq, MPQ_OPEN_READ_ONLY);
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        if(!SFileSetPatchCacheSize(hMpq, 0x1000000))
+            dwErrCode = Logger.PrintError("Failed to set the patch cache size");
+        CreateFullPathName(szFullPath, _countof(szFullPath), NULL, szPatchName1);
+        if(dwErrCode == ERROR_SUCCESS && !SFileOpenPatchArchive(hMpq, szFullPath, NULL, 0))
+            dwErrCode = Logger.PrintError(_T("Failed to add patch %s ..."), szFullPath);
+    }
 
-        SFileCloseArchive(hMpq);
+    // The first open patches the file, the second one takes it from the cache
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = ReadPatchedFile(Logger, hMpq, szFileName, Versions[1], VersionSizes[1]);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = ReadPatchedFile(Logger, hMpq, szFileName, Versions[1], VersionSizes[1]);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CheckPatchCacheStats(Logger, hMpq, 1, 1);
+
+    // Adding another patch must drop the cached file
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        CreateFullPathName(szFullPath, _countof(szFullPath), NULL, szPatchName2);
+        if(!SFileOpenPatchArchive(hMpq, szFullPath, NULL, 0))
+            dwErrCode = Logger.PrintError(_T("Failed to add patch %s ..."), szFullPath);
     }
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = ReadPatchedFile(Logger, hMpq, szFileName, Versions[2], VersionSizes[2]);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = ReadPatchedFile(Logger, hMpq, szFileName, Versions[2], VersionSizes[2]);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CheckPatchCacheStats(Logger, hMpq, 2, 2);
 
-    return dwErrCode;
+    // A file bigger than the cache is never cached
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        SFileSetPatchCacheSize(hMpq, 0x10000);
+        dwErrCode = ReadPatchedFile(Logger, hMpq, szFileName, Versions[2], VersionSizes[2]);
+    }
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = ReadPatchedFile(Logger, hMpq, szFileName, Versions[2], VersionSizes[2]);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CheckPatchCacheStats(Logger, hMpq, 2, 4);
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+
+    for(DWORD v = 0; v < 3; v++)
+        STORM_FREE(Versions[v]);
+    return Logger.PrintVerdict(dwErrCode);
 }
 
-static DWORD TestCreateArchive_BigArchive(LPCTSTR szPlainName)
+struct TPatchedReadTest
 {
-    TLogHelper Logger("TestBigArchive", szPlainName);
-    HANDLE hMpq = NULL;                 // Handle of created archive
-    TCHAR szLocalFileName[MAX_PATH];
-    char szArchivedName[MAX_PATH];
-    DWORD dwMaxFileCount = 0x20;
-    DWORD dwAddedCount = 0;
-    size_t i;
-    DWORD dwErrCode;
+    HANDLE hMpq;                                    // Base archive with the patch archive
+    LPCSTR szFileName;                              // Name of the patched file
+    LPBYTE pbNewData;                               // Expected content of the patched file
+    DWORD cbNewData;                                // Size of the patched file
+};
+
+// Reads the patched file a few times and measures the speed
+static DWORD CheckPatchedReadCodePath(TLogHelper & Logger, void * lpContext)
+{
+    TPatchedReadTest * pTest = (TPatchedReadTest *)lpContext;
+    DWORD dwReadCount = 4;
+    DWORD dwReadTime;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    Logger.SetStartTime();
+    for(DWORD i = 0; i < dwReadCount && dwErrCode == ERROR_SUCCESS; i++)
+        dwErrCode = ReadPatchedFile(Logger, pTest->hMpq, pTest->szFileName, pTest->pbNewData, pTest->cbNewData);
+    dwReadTime = Logger.SetEndTime();
 
-    // Create a new archive with the limit of 0x20 files
-    dwErrCode = CreateNewArchive(&Logger, szPlainName, MPQ_CREATE_ARCHIVE_V3 | MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES, dwMaxFileCount, &hMpq);
     if(dwErrCode == ERROR_SUCCESS)
     {
-        LPCSTR szFileMask = "AddedFile_%02u.txt";
+        Logger.PrintMessage("CPU features 0x%X: reading the patched file %u MB/s (%u ms)", StormCpu_GetFeatures(),
+                            (DWORD)(((ULONGLONG)dwReadCount * pTest->cbNewData * 1000 / 0x100000) / STORMLIB_MAX(dwReadTime, 1)), dwReadTime);
+    }
+    return dwErrCode;
+}
 
-        // Now add few really big files
-        CreateFullPathName(szLocalFileName, _countof(szLocalFileName), szMpqSubDir, _T("MPQ_1997_v1_Diablo1_DIABDAT.MPQ"));
-        Logger.UserTotal = (dwMaxFileCount / 2);
+// Benchmark for reading a big file with an incremental patch (BSD0). The file is read through
+// SFileReadFile, so the time includes loading and checking of both files, not only the combining
+static DWORD TestOpenArchive_PatchedReadSpeed(LPCTSTR szBaseName, LPCTSTR szPatchName, DWORD dwFileSize)
+{
+    TPatchedReadTest Test;
+    TLogHelper Logger("PatchedReadTest", szBaseName);
+    LPBYTE pbOldData = STORM_ALLOC(BYTE, dwFileSize);
+    LPBYTE pbNewData = STORM_ALLOC(BYTE, dwFileSize);
+    LPBYTE pbPatch = NULL;
+    HANDLE hMpq = NULL;
+    DWORD dwRandom = 0x2468ACE0;
+    DWORD cbPatch = 0;
+    DWORD dwErrCode = ERROR_SUCCESS;
+    TCHAR szFullPath[MAX_PATH];
 
-        for(i = 0; i < dwMaxFileCount / 2; i++)
-        {
-            sprintf(szArchivedName, szFileMask, i + 1);
-            dwErrCode = AddLocalFileToMpq(&Logger, hMpq, szArchivedName, szLocalFileName, 0, 0, true);
-            if(dwErrCode != ERROR_SUCCESS)
-                break;
+    if(pbOldData == NULL || pbNewData == NULL)
+    {
+        Logger.PrintMessage("Failed to allocate buffers");
+        dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+    }
 
-            Logger.UserCount++;
-            dwAddedCount++;
+    // The new version changes about one byte in 16, like real patches of game data
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        FillTestData(pbOldData, dwFileSize, 0x9E3779B9);
+        for(DWORD i = 0; i < dwFileSize; i++)
+        {
+            dwRandom = dwRandom * 1103515245 + 12345;
+            pbNewData[i] = ((dwRandom >> 8) & 0x0F) ? pbOldData[i] : (BYTE)(dwRandom >> 16);
         }
+
+        if((pbPatch = CreateIncrementalPatch(pbOldData, dwFileSize, pbNewData, dwFileSize, &cbPatch)) == NULL)
+            dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
     }
 
-    // Close the archive
+    // Create the base archive with the old file and the patch archive
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CreateNewArchive(&Logger, szBaseName, MPQ_CREATE_ARCHIVE_V2 | MPQ_CREATE_LISTFILE, 0x10, &hMpq);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = AddFileData(&Logger, hMpq, "Data\\Patched.bin", pbOldData, dwFileSize, MPQ_FILE_COMPRESS, NULL);
     if(hMpq != NULL)
         SFileCloseArchive(hMpq);
     hMpq = NULL;
 
-    // Reopen the archive to catch any asserts
     if(dwErrCode == ERROR_SUCCESS)
-        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szPlainName, &hMpq);
+        dwErrCode = CreateNewArchive(&Logger, szPatchName, MPQ_CREATE_ARCHIVE_V2 | MPQ_CREATE_LISTFILE, 0x10, &hMpq);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = AddFileData(&Logger, hMpq, "Data\\Patched.bin", pbPatch, cbPatch, MPQ_FILE_COMPRESS, NULL);
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    hMpq = NULL;
 
-    // Check that (listfile) is at the end
+    // Open the base archive with the patch
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = OpenExistingArchiveWithCopy(&Logger, NULL, szBaseName, &hMpq, MPQ_OPEN_READ_ONLY);
     if(dwErrCode == ERROR_SUCCESS)
     {
-        CheckIfFileIsPresent(&Logger, hMpq, LISTFILE_NAME, true);
-        CheckIfFileIsPresent(&Logger, hMpq, ATTRIBUTES_NAME, true);
+        CreateFullPathName(szFullPath, _countof(szFullPath), NULL, szPatchName);
+        if(!SFileOpenPatchArchive(hMpq, szFullPath, NULL, 0))
+            dwErrCode = Logger.PrintError(_T("Failed to add patch %s ..."), szFullPath);
+    }
 
-        SFileCloseArchive(hMpq);
+    // Read the patched file with all code paths the CPU supports
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        Test.hMpq = hMpq;
+        Test.szFileName = "Data\\Patched.bin";
+        Test.pbNewData = pbNewData;
+        Test.cbNewData = dwFileSize;
+        dwErrCode = TestCpuCodePaths(Logger, STORM_CPU_FEATURE_SSE2 | STORM_CPU_FEATURE_AVX2, CheckPatchedReadCodePath, &Test);
     }
 
-    return dwErrCode;
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    STORM_FREE(pbPatch);
+    STORM_FREE(pbNewData);
+    STORM_FREE(pbOldData);
+    return Logger.PrintVerdict(dwErrCode);
 }
 
 // Test replacing a file in an archive
@@ -4523,6 +7654,14 @@ static const TEST_INFO1 TestList_OpenMpqs[] =
 
 };
 
+static const TEST_INFO1 TestList_ParallelMpqs[] =
+{
+    {_T("MPQ_1997_v1_Diablo1_DIABDAT.MPQ"),                     NULL, "554b538541e42170ed41cb236483489e",  2910, &TwoFilesD1},  // Imploded and encrypted files
+    {_T("MPQ_1997_v1_StarDat_SC1B.mpq"),                        NULL, "0094b23f28cfff7386071ef3bd19a577",  2468},               // Starcraft BETA decompression table
+    {_T("MPQ_2010_v3_expansion-locale-frFR.MPQ"),               NULL, "0c8fc921466f07421a281a05fad08b01",    53},               // MPQ archive v 3.0
+    {_T("mpqe-file://MPQ_2011_v2_EncryptedMpq.MPQE"),           NULL, "10e4dcdbe95b7ad731c563ec6b71bc16",    82},               // Encrypted archive from Starcraft II installer
+};
+
 static const TEST_INFO1 TestList_ReopenMpqs[] =
 {
     // Test the archive compacting feature
@@ -4632,6 +7771,30 @@ static void Test_PlayingSpace()
 #define TEST_VERIFY_HASHES
 #define TEST_CREATE_MPQS
 #define TEST_MISC_MPQS
+#define TEST_CONCURRENT_READ
+#define TEST_PARALLEL_SECTORS
+#define TEST_SECTOR_CACHE
+#define TEST_LISTFILE_SPEED
+#define TEST_DATA_VIEW
+#define TEST_BATCH_OPEN
+#define TEST_EXTRACT_FILES
+#define TEST_CRYPT_KERNELS
+#define TEST_PARALLEL_COMPRESSION
+#define TEST_BULK_ADD
+#define TEST_REUSE_FREE_SPACE
+#define TEST_COMPACT_IN_PLACE
+#define TEST_COMPACT_CONTENTS
+#define TEST_VERIFY_FILES
+#define TEST_WEAK_SIGNATURE
+#define TEST_MD5_KERNELS
+#define TEST_PATCH_CACHE
+#define TEST_PATCH_KERNELS
+#define TEST_BLOCK_READ
+#define TEST_PREFETCH
+#define TEST_BLOCK4_STREAM
+#ifndef STORMLIB_WINDOWS
+#define TEST_HTTP_MIRROR                    // The loopback HTTP server uses BSD sockets
+#endif
 
 int _tmain(int argc, TCHAR * argv[])
 {
@@ -4834,6 +7997,137 @@ int _tmain(int argc, TCHAR * argv[])
         dwErrCode = TestCreateArchive_BigArchive(_T("StormLibTest_BigArchive_v4.mpq"));
 #endif  // TEST_MISC_MPQS
 
+#ifdef TEST_CONCURRENT_READ             // Read files from multiple threads using one archive handle
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestOpenArchive_ConcurrentRead(_T("MPQ_1997_v1_StarDat_SC1B.mpq"), 8);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestOpenArchive_ConcurrentRead(_T("MPQ_2013_v4_expansion1.MPQ"), 8);
+#endif  // TEST_CONCURRENT_READ
+
+#ifdef TEST_PARALLEL_SECTORS            // Decrypt and decompress file sectors on multiple threads
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        for(size_t i = 0; i < _countof(TestList_ParallelMpqs); i++)
+        {
+            dwErrCode = TestOpenArchive_ThreadCount(TestList_ParallelMpqs[i], 4);
+            if(dwErrCode != ERROR_SUCCESS)
+                break;
+        }
+    }
+#endif  // TEST_PARALLEL_SECTORS
+
+#ifdef TEST_SECTOR_CACHE                // Read files through the archive-wide sector cache
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestOpenArchive_SectorCache(_T("MPQ_1997_v1_StarDat_SC1B.mpq"), 0x4000000);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestOpenArchive_SectorCache(_T("MPQ_2013_v4_expansion1.MPQ"), 0x100000);
+#endif  // TEST_SECTOR_CACHE
+
+#ifdef TEST_LISTFILE_SPEED              // Apply a big listfile to an archive with a big hash table
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestCreateArchive_ListFileSpeed(_T("StormLibTest_ListFileSpeed.mpq"), 20000, 1500000);
+#endif  // TEST_LISTFILE_SPEED
+
+#ifdef TEST_DATA_VIEW                   // Get zero-copy views of files in a memory-mapped archive
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestOpenArchive_DataView(_T("MPQ_1997_v1_StarDat_SC1B.mpq"), _T("StormLibTest_DataView.mpq"));
+#endif  // TEST_DATA_VIEW
+
+#ifdef TEST_BATCH_OPEN                  // Open many files with a single call
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestOpenArchive_BatchOpen(_T("MPQ_2002_v1_StrongSignature.w3m"));
+#endif  // TEST_BATCH_OPEN
+
+#ifdef TEST_EXTRACT_FILES               // Extract all files of an archive on multiple threads
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestOpenArchive_ExtractFiles(_T("MPQ_1997_v1_StarDat_SC1B.mpq"), 4, 0);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestOpenArchive_ExtractFiles(_T("MPQ_1997_v1_StarDat_SC1B.mpq"), 4, 2);
+#endif  // TEST_EXTRACT_FILES
+
+#ifdef TEST_CRYPT_KERNELS               // Encrypt and decrypt MPQ data blocks with all code paths
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestCryptography_MpqBlocks(0x10000);
+#endif  // TEST_CRYPT_KERNELS
+
+#ifdef TEST_PARALLEL_COMPRESSION        // Compress sectors of added files on multiple threads
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestCreateArchive_ParallelCompression(_T("StormLibTest_SequentialCompression.mpq"), _T("StormLibTest_ParallelCompression.mpq"), 4);
+#endif  // TEST_PARALLEL_COMPRESSION
+
+#ifdef TEST_BULK_ADD                    // Add many files to an archive at once
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestCreateArchive_BulkAdd(_T("StormLibTest_OneByOneAdd.mpq"), _T("StormLibTest_BulkAdd.mpq"), 4);
+#endif  // TEST_BULK_ADD
+
+#ifdef TEST_REUSE_FREE_SPACE            // Store new files in the space of removed files
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestModifyArchive_ReuseFreeSpace(_T("StormLibTest_ReuseFreeSpace_v2.mpq"), MPQ_CREATE_ARCHIVE_V2);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestModifyArchive_ReuseFreeSpace(_T("StormLibTest_ReuseFreeSpace_v4.mpq"), MPQ_CREATE_ARCHIVE_V4);
+#endif  // TEST_REUSE_FREE_SPACE
+
+#ifdef TEST_COMPACT_IN_PLACE            // Slide the files into the holes without creating a new archive
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestModifyArchive_CompactInPlace(_T("StormLibTest_CompactInPlace_v1.mpq"), MPQ_CREATE_ARCHIVE_V1);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestModifyArchive_CompactInPlace(_T("StormLibTest_CompactInPlace_v4.mpq"), MPQ_CREATE_ARCHIVE_V4);
+#endif  // TEST_COMPACT_IN_PLACE
+
+#ifdef TEST_COMPACT_CONTENTS            // The content of the files must survive compacting
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestModifyArchive_CompactContents(_T("StormLibTest_CompactContents.mpq"), false);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestModifyArchive_CompactContents(_T("StormLibTest_CompactContentsInPlace.mpq"), true);
+#endif  // TEST_COMPACT_CONTENTS
+
+#ifdef TEST_VERIFY_FILES                // Verify all files of an archive on multiple threads
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestCreateArchive_VerifyFiles(_T("StormLibTest_VerifyFiles.mpq"), 4);
+#endif  // TEST_VERIFY_FILES
+
+#ifdef TEST_WEAK_SIGNATURE              // Sign an archive bigger than the digest buffers and damage it
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestCreateArchive_WeakSignature(_T("StormLibTest_WeakSignature.mpq"), 0x300000);
+#endif  // TEST_WEAK_SIGNATURE
+
+#ifdef TEST_MD5_KERNELS                 // Calculate MD5 of multiple chunks with all code paths
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestCryptography_Md5Chunks(0x100000);
+#endif  // TEST_MD5_KERNELS
+
+#ifdef TEST_PATCH_CACHE                 // Reopen patched files from the cache of patched files
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestOpenArchive_PatchCache(_T("StormLibTest_PatchCache.mpq"), _T("StormLibTest_PatchCache_p1.mpq"), _T("StormLibTest_PatchCache_p2.mpq"));
+#endif  // TEST_PATCH_CACHE
+
+#ifdef TEST_PATCH_KERNELS               // Verify the combining of BSD0 patch data and measure reading of patched files
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestPatchData_Combine(0x1000000);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestOpenArchive_PatchedReadSpeed(_T("StormLibTest_PatchedRead.mpq"), _T("StormLibTest_PatchedRead_p1.mpq"), 0x1000000);
+#endif  // TEST_PATCH_KERNELS
+
+#ifdef TEST_BLOCK_READ                  // Reading from block streams with various alignments
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestFileStream_BlockRead(_T("StormLibTest_BlockRead.mirror"), _T("StormLibTest_BlockRead.master"), 0x801234);
+#endif  // TEST_BLOCK_READ
+
+#ifdef TEST_PREFETCH                    // Background prefetch of a mirror and of a mirrored MPQ
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestFileStream_Prefetch(_T("StormLibTest_Prefetch.mirror"), _T("StormLibTest_Prefetch.master"), _T("StormLibTest_Prefetch.mpq"), 0x801234);
+#endif  // TEST_PREFETCH
+
+#ifdef TEST_BLOCK4_STREAM               // Vectored reads and MD5 verification of block4 streams
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestFileStream_Block4(_T("StormLibTest_Block4.MPQ.0"), 0x801234);
+#endif  // TEST_BLOCK4_STREAM
+
+#ifdef TEST_HTTP_MIRROR                 // Master-mirror streaming from a loopback HTTP server
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = TestFileStream_HttpMirror(_T("StormLibTest_HttpMirror.mirror"), 0x401234);
+#endif  // TEST_HTTP_MIRROR
+
 #ifdef _MSC_VER
     _CrtDumpMemoryLeaks();
 #endif  // _MSC_VER
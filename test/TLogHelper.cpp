@@ -556,13 +556,17 @@ class TLogHelper
     //  Time functions
     //
 
+    // Returns the time in milliseconds. The clock has a better resolution
+    // than one second, so that short operations can be measured
     ULONGLONG GetCurrentThreadTime()
     {
 #ifdef _WIN32
-        ULONGLONG TempTime = 0;
+        LARGE_INTEGER Frequency;
+        LARGE_INTEGER Counter;
 
-        GetSystemTimeAsFileTime((LPFILETIME)(&TempTime));
-        return ((TempTime) / 10 / 1000);
+        QueryPerformanceFrequency(&Frequency);
+        QueryPerformanceCounter(&Counter);
+        return (ULONGLONG)(Counter.QuadPart * 1000 / Frequency.QuadPart);
 
         //ULONGLONG KernelTime = 0;
         //ULONGLONG UserTime = 0;
@@ -571,7 +575,10 @@ class TLogHelper
         //GetThreadTimes(GetCurrentThread(), (LPFILETIME)&TempTime, (LPFILETIME)&TempTime, (LPFILETIME)&KernelTime, (LPFILETIME)&UserTime);
         //return ((KernelTime + UserTime) / 10 / 1000);
 #else
-        return time(NULL) * 1000;
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ((ULONGLONG)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
 #endif
     }
 